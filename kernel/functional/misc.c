@@ -73,6 +73,37 @@ dec_counter(arguments_t args, SkBuff b)
 }
 
 
+/* packets and bytes seen, in the per-cpu persistent slot n of the group:
+ * read them with Q_SO_GET_GROUP_PERSISTENT (Q_PERSISTENT_REDUCE_SUM) */
+
+struct meter_state
+{
+	unsigned long packets;
+	unsigned long bytes;
+};
+
+
+static Action_SkBuff
+meter(arguments_t args, SkBuff b)
+{
+        const int idx = get_arg(int,args);
+
+        struct meter_state * m;
+
+        if (idx < 0 || idx >= Q_MAX_PERSISTENT_CPU) {
+                if (printk_ratelimit())
+                        printk(KERN_INFO "[PFQ/lang] meter[%d]: bad index!\n", idx);
+                return Pass(b);
+        }
+
+        m = get_persistent_cpu(struct meter_state, b, idx);
+        m->packets++;
+        m->bytes += b.skb->len;
+
+        return Pass(b);
+}
+
+
 static Action_SkBuff
 crc16_sum(arguments_t args, SkBuff b)
 {
@@ -467,6 +498,7 @@ struct pfq_function_descr misc_functions[] = {
 
         { "inc", 	"CInt -> SkBuff -> Action SkBuff",     		inc_counter 	},
         { "dec", 	"CInt -> SkBuff -> Action SkBuff",    		dec_counter 	},
+        { "meter", 	"CInt -> SkBuff -> Action SkBuff",    		meter	 	},
  	{ "mark", 	"CULong -> SkBuff -> Action SkBuff",  		mark		},
         { "crc16", 	"SkBuff -> Action SkBuff", 			crc16_sum	},
         { "log_msg",  	"String -> SkBuff -> Action SkBuff", 		log_msg 	},
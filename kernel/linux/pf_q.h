@@ -78,6 +78,14 @@ static inline void smp_wmb() { barrier(); }
 #define Q_MPDB_QUEUE_SLOT_SIZE(x)    	ALIGN(sizeof(struct pfq_pkthdr) + x, 8)
 #define Q_SPSC_QUEUE_SLOT_SIZE(x)    	ALIGN(sizeof(struct pfq_pkthdr_tx) + x, 8)
 
+/* packed Rx layout: the queue length is expressed in 8-byte units */
+
+#define Q_PACKED_UNIT			8
+#define Q_PACKED_MAX_UNITS		0x00ffffffu
+#define Q_PACKED_RECORD_SIZE(x)		((sizeof(struct pfq_pkthdr) + (x) + Q_PACKED_UNIT - 1) & ~(size_t)(Q_PACKED_UNIT - 1))
+#define Q_PKTHDR_RECORD_SIZE(h)		Q_PACKED_RECORD_SIZE(((h)->flags & Q_PKTHDR_ZCOPY) ? \
+						sizeof(struct pfq_pkthdr_zcopy) : (h)->caplen)
+
 
 /* PFQ socket options */
 
@@ -121,6 +129,61 @@ static inline void smp_wmb() { barrier(); }
 #define Q_SO_TX_FLUSH			35
 #define Q_SO_TX_ASYNC			36
 
+#define Q_SO_SET_RX_ZCOPY		37	/* before enable: requires the zcopy_frames pool */
+#define Q_SO_GET_RX_ZCOPY		38	/* size of the zero-copy area (0 = disabled) */
+#define Q_SO_RX_ZCOPY_RETURN		39	/* give back an array of uint32_t tokens */
+
+#define Q_SO_SET_RX_PACKED		40	/* before enable: variable-length Rx records */
+#define Q_SO_GET_RX_PACKED		41
+
+#define Q_SO_SET_RX_RINGS		42	/* before enable: number of Rx sub-rings (1 = single queue) */
+#define Q_SO_GET_RX_RINGS		43
+
+#define Q_SO_GROUP_STEERING		44	/* steering mode of the group (Q_STEERING_xxx) */
+
+#define Q_SO_SET_WEIGHT			45	/* steering weight of the socket (1..Q_MAX_SOCK_WEIGHT) */
+#define Q_SO_GET_WEIGHT			46
+
+#define Q_SO_GROUP_WATERMARK		47	/* load-aware steering: Rx watermark of the group (percent, 0 = off) */
+
+#define Q_SO_GROUP_TX_QUEUE		48	/* Tx queue policy of lazy forwarding (Q_TX_QUEUE_xxx) */
+
+#define Q_SO_SET_TX_ZCOPY		49	/* before enable: Tx skbs refer to the pages of the Tx queue */
+#define Q_SO_GET_TX_ZCOPY		50
+
+#define Q_SO_TX_RATE			51	/* token bucket of a bound Tx queue (struct pfq_tx_rate) */
+
+#define Q_SO_GET_TX_QUEUES		52	/* Tx queues in the shared memory (the bound ones, before enable) */
+
+#define Q_SO_SET_TX_WEIGHT		53	/* share of the per-cpu Tx service thread (1..Q_MAX_SOCK_WEIGHT) */
+#define Q_SO_GET_TX_WEIGHT		54
+
+#define Q_SO_GET_STATS_CPUS		55	/* per-cpu blocks of the mapped statistics areas */
+
+#define Q_SO_GET_GROUP_PERSISTENT	56	/* per-cpu persistent slot of a group, reduced (struct pfq_group_persistent_read) */
+
+#define Q_SO_GROUP_TIMESERIES		57	/* period of the snapshots of a group (struct pfq_group_timeseries_period) */
+
+#define Q_SO_SET_PROFILE		58	/* Rx profile: 1 enables (and resets) it, 0 disables it */
+#define Q_SO_GET_PROFILE		59	/* struct pfq_profile */
+
+#define Q_SO_TX_POLL_QUEUE		60	/* Tx queue POLLOUT waits for (-1: any bound queue) */
+
+
+/* steering modes */
+
+#define Q_STEERING_FOLD			0	/* hash folded on the number of sockets (default) */
+#define Q_STEERING_MAGLEV		1	/* consistent hashing: about 1/N of the flows move on join/leave */
+
+#define Q_MAX_SOCK_WEIGHT		64	/* flows are steered in proportion to the socket weights */
+
+
+/* Tx queue policies of lazy forwarding */
+
+#define Q_TX_QUEUE_PACKET		0	/* the queue of the packet (default) */
+#define Q_TX_QUEUE_CPU			1	/* one queue per cpu: no contention among Rx cpus */
+#define Q_TX_QUEUE_HASH			2	/* by flow hash */
+
 
 /* general placeholders */
 
@@ -167,7 +230,46 @@ static inline void smp_wmb() { barrier(); }
 /* additional constants */
 
 #define Q_MAX_COUNTERS          	64
-#define Q_MAX_TX_QUEUES 		4
+#define Q_GROUPS_MASK_WORDS		(512 / (sizeof(unsigned long) << 3))	/* words of the mask of Q_SO_GET_GROUPS (Q_MAX_GROUP groups) */
+#define Q_MAX_TX_QUEUES 		64	/* Tx queues of a socket (one per Tx binding) */
+#define Q_MIN_TX_QUEUES 		4	/* Tx queues allocated at enable in any case (Tx binds after enable) */
+#define Q_MAX_RX_RINGS 			32
+
+#define Q_PERSISTENT_MEM 		64	/* bytes of a persistent slot */
+#define Q_MAX_PERSISTENT_CPU 		64	/* per-cpu persistent slots of a group */
+
+/* reduce of the per-cpu persistent slots, word by word (unsigned long) */
+
+#define Q_PERSISTENT_REDUCE_SUM		0
+#define Q_PERSISTENT_REDUCE_MAX		1
+#define Q_PERSISTENT_REDUCE_OR		2
+
+/* zero-copy: mmap offset of the (read-only) zero-copy area */
+
+#define Q_ZCOPY_MMAP_OFFSET		0x40000000
+
+/* statistics: mmap offsets of the (read-only) areas of the socket and of the groups */
+
+#define Q_STATS_MMAP_OFFSET		0x50000000
+#define Q_GROUP_STATS_MMAP_OFFSET(gid)	(0x60000000 + ((unsigned long)(gid) << 20))
+#define Q_GROUP_TIMESERIES_MMAP_OFFSET(gid) (Q_GROUP_STATS_MMAP_OFFSET(gid) + 0x80000)
+
+#define Q_TIMESERIES_SLOTS		512	/* snapshots in the time-series ring of a group */
+
+/* Rx profile: the stages of the Rx path, timed in cycles */
+
+#define Q_PROFILE_GC			0	/* setup of the batch collected by the GC (per batch) */
+#define Q_PROFILE_BPF			1	/* BPF filter of a group (per packet) */
+#define Q_PROFILE_VLAN			2	/* vlan filter of a group (per packet) */
+#define Q_PROFILE_RUN			3	/* computation of a group (per packet) */
+#define Q_PROFILE_ENQUEUE		4	/* copy to the queue of a socket (per socket and group) */
+#define Q_PROFILE_XMIT			5	/* lazy forwarding to devices (per batch) */
+#define Q_PROFILE_KERNEL		6	/* to kernel and release of the batch (per batch) */
+#define Q_PROFILE_NODE(n)		(7 + (n))	/* n-th functional node of a computation (per packet) */
+
+#define Q_PROFILE_MAX_NODES		16	/* the last one also accounts for the nodes beyond */
+#define Q_PROFILE_STAGES		Q_PROFILE_NODE(Q_PROFILE_MAX_NODES)
+#define Q_PROFILE_HIST_SIZE		24	/* log2 buckets of the cycles */
 
 
 /* PFQ socket queue */
@@ -177,7 +279,7 @@ struct pfq_rx_queue
 {
         unsigned int   		data;
         unsigned int            size;       /* queue length in slots */
-        unsigned int            slot_size;  /* sizeof(pfq_pkthdr) + caplen  */
+        unsigned int            slot_size;  /* sizeof(pfq_pkthdr) + caplen (0 = packed layout) */
 
 } __attribute__((aligned(64)));
 
@@ -188,6 +290,12 @@ struct pfq_tx_queue
         unsigned int            cons;
         size_t 			size;  	    /* queue length in bytes */
 
+	unsigned int		zc_busy[2]; /* zero-copy Tx: half still referenced by the driver */
+
+	uint64_t		consumed;   /* records taken from the queue by the kernel (a template counts once) */
+	uint64_t		sent;	    /* packets handed to the driver */
+	uint64_t		disc;	    /* packets discarded */
+
 	void __user * 		ptr; 	    /* reserved for user-space */
 	unsigned int __user     index; 	    /* reserved for user-space */
 
@@ -197,10 +305,22 @@ struct pfq_tx_queue
 struct pfq_shared_queue
 {
         struct pfq_rx_queue rx;
-        struct pfq_tx_queue tx[Q_MAX_TX_QUEUES];
+        struct pfq_rx_queue rx_ring[Q_MAX_RX_RINGS-1];	/* Rx sub-rings 1..N-1 */
+
+        struct pfq_tx_queue tx[];			/* one per Tx binding (Q_SO_GET_TX_QUEUES) */
 };
 
 
+/* size of the shared queue header with n Tx queues: the Rx queues follow it */
+
+#define Q_SHARED_QUEUE_HDR_SIZE(n)	(sizeof(struct pfq_shared_queue) + (n) * sizeof(struct pfq_tx_queue))
+
+
+/* Rx sub-ring r: the ring 0 is the rx queue */
+
+#define Q_SHARED_RX_RING(q, r)		((r) ? &(q)->rx_ring[(r)-1] : &(q)->rx)
+
+
 /* packet headers */
 
 
@@ -218,7 +338,8 @@ struct pfq_pkthdr
         } tstamp;
 
         int         if_index;   /* interface index */
-        int         gid;        /* group id */
+        uint16_t    gid;        /* group id */
+        uint16_t    flags;      /* Q_PKTHDR_ZCOPY */
 
         uint16_t    len;        /* length of the packet (off wire) */
         uint16_t    caplen;     /* bytes captured */
@@ -241,6 +362,21 @@ struct pfq_pkthdr
 } __attribute__((packed));
 
 
+/* pkthdr flags */
+
+#define Q_PKTHDR_ZCOPY		1	/* a pfq_pkthdr_zcopy descriptor follows the header */
+
+
+/* zero-copy descriptor: the packet is in the zero-copy area */
+
+struct pfq_pkthdr_zcopy
+{
+	uint64_t addr;		/* user address of the packet data */
+	uint32_t token;		/* to be given back with Q_SO_RX_ZCOPY_RETURN */
+	uint32_t reserved;
+};
+
+
 struct pfq_pkthdr_tx
 {
 	uint64_t len;
@@ -248,6 +384,44 @@ struct pfq_pkthdr_tx
 };
 
 
+/* Tx templates: a record flagged with Q_TX_TEMPLATE holds a pfq_tx_template,
+ * its mutators and the template packet; the kernel expands it into 'copies'
+ * packets, rewriting the mutated fields of each one */
+
+#define Q_TX_TEMPLATE			(1ULL << 63)	/* pfq_pkthdr_tx.len flag */
+#define Q_TX_RECORD_LEN(h)		((h)->len & ~Q_TX_TEMPLATE)
+
+#define Q_TX_MAX_MUTATORS		8
+
+#define Q_TX_MUTATOR_INC		0	/* min, min+1, ... max, min, ... */
+#define Q_TX_MUTATOR_RAND		1	/* random in [min, max] */
+
+#define Q_TX_TEMPLATE_CSUM		1	/* fix the IPv4/UDP checksums of each packet */
+
+struct pfq_tx_mutator
+{
+	uint16_t offset;	/* byte offset in the packet */
+	uint8_t  width;		/* 1, 2 or 4 bytes (network byte order) */
+	uint8_t  op;		/* Q_TX_MUTATOR_xxx */
+	uint32_t min;
+	uint32_t max;
+};
+
+struct pfq_tx_template
+{
+	uint32_t copies;	/* packets generated */
+	uint16_t len;		/* length of the template packet */
+	uint8_t  num_mutators;	/* up to Q_TX_MAX_MUTATORS */
+	uint8_t  flags;		/* Q_TX_TEMPLATE_xxx */
+
+	struct pfq_tx_mutator mutator[];
+
+	/* followed by the packet */
+};
+
+#define Q_TX_TEMPLATE_SIZE(n, len)	(sizeof(struct pfq_tx_template) + (n) * sizeof(struct pfq_tx_mutator) + (len))
+
+
 /*
    +------------------+---------------------+                  +---------------------+          +---------------------+
    | pfq_queue_hdr    | pfq_pkthdr | packet | ...              | pfq_pkthdr | packet |...       | pfq_pkthdr | packet | ...
@@ -255,6 +429,14 @@ struct pfq_pkthdr_tx
    +                             +                             +                            +
    | <------+ queue rx  +------> |  <----+ queue rx +------>   |  <----+ queue tx +------>  |  <----+ queue tx +------>
    +                             +                             +                            +
+
+   With the packed Rx layout each record is a pfq_pkthdr followed by caplen bytes
+   (or by a pfq_pkthdr_zcopy descriptor), padded to Q_PACKED_UNIT: the length
+   field of the rx data counts Q_PACKED_UNIT units rather than slots.
+
+   With N Rx sub-rings the two rx queues are repeated N times (ring r at offset
+   r * 2 * queue_size * slot_size), each ring with its own header, followed by
+   the tx queues. The producer running on cpu c writes to the ring c % N.
    */
 
 
@@ -307,6 +489,51 @@ struct pfq_vlan_toggle
         int toggle;
 };
 
+struct pfq_group_steering
+{
+        int gid;
+        int mode;
+};
+
+struct pfq_group_watermark
+{
+        int gid;
+        int watermark;          /* percent of the socket Rx queue, 0 = disabled */
+};
+
+struct pfq_group_tx_queue
+{
+        int gid;
+        int policy;             /* Q_TX_QUEUE_xxx */
+};
+
+struct pfq_group_timeseries_period
+{
+        int gid;
+        unsigned int period;    /* msec, 0 = stopped */
+};
+
+/* Tx rate limit of a queue: 0 stands for unlimited */
+
+struct pfq_tx_rate
+{
+	int	 queue;		/* Tx queue, in the order of Q_SO_TX_BIND */
+	uint32_t burst;		/* bucket depth, in packets */
+	uint64_t pps;		/* packets per second */
+	uint64_t bps;		/* bits per second */
+};
+
+
+/* Tx queue counters, as published in the shared queue */
+
+struct pfq_tx_queue_stats
+{
+	uint64_t consumed;	/* records taken from the queue by the kernel (a template counts once) */
+	uint64_t sent;		/* packets handed to the driver */
+	uint64_t disc;		/* packets discarded */
+};
+
+
 struct pfq_binding
 {
         union {
@@ -372,4 +599,102 @@ struct pfq_counters
         unsigned long int counter[Q_MAX_COUNTERS];
 };
 
+
+/* mapped statistics: an area holds a block per cpu (Q_SO_GET_STATS_CPUS),
+ * each cpu updates its own block, the reader sums the blocks */
+
+struct pfq_sock_stats_block
+{
+        unsigned long int recv;
+        unsigned long int lost;
+        unsigned long int drop;
+
+        unsigned long int sent;
+        unsigned long int disc;
+
+} __attribute__((aligned(64)));
+
+
+struct pfq_group_stats_block
+{
+        unsigned long int recv;
+        unsigned long int drop;
+        unsigned long int frwd;
+        unsigned long int kern;
+        unsigned long int disc;
+        unsigned long int abrt;
+
+        unsigned long int counter[Q_MAX_COUNTERS];
+
+} __attribute__((aligned(64)));
+
+
+#define Q_STATS_AREA_SIZE(cpus, block)	((size_t)(cpus) * sizeof(block))
+
+
+/* time-series of a group: a ring of snapshots of the stats and counters,
+ * taken by the kernel every period and mapped read-only in user space.
+ *
+ * The snapshot n is in slot n % Q_TIMESERIES_SLOTS: its seq is n + 1 once
+ * written (0 if never written, ~0 while being written); a reader copies the
+ * slot and checks seq before and after the copy.
+ */
+
+struct pfq_group_snapshot
+{
+        uint64_t seq;
+        uint64_t tstamp;                /* nsec, monotonic clock */
+
+        unsigned long int recv;
+        unsigned long int drop;
+        unsigned long int frwd;
+        unsigned long int kern;
+        unsigned long int disc;
+        unsigned long int abrt;
+
+        unsigned long int counter[Q_MAX_COUNTERS];
+};
+
+
+struct pfq_group_timeseries
+{
+        uint64_t head;                  /* snapshots taken so far */
+        uint32_t period;                /* msec */
+        uint32_t slots;                 /* Q_TIMESERIES_SLOTS */
+
+        struct pfq_group_snapshot snap[Q_TIMESERIES_SLOTS] __attribute__((aligned(64)));
+};
+
+
+/* per-cpu persistent state of a group, reduced across the cpus */
+
+struct pfq_group_persistent_read
+{
+        int gid;
+        int index;      /* 0..Q_MAX_PERSISTENT_CPU-1 */
+        int reduce;     /* Q_PERSISTENT_REDUCE_xxx */
+
+        unsigned long int word[Q_PERSISTENT_MEM / sizeof(unsigned long)];
+};
+
+
+/* Rx profile: the histogram of a stage, bucket n counts the runs of
+ * [2^(n-1), 2^n) cycles (the last bucket is open) */
+
+struct pfq_profile_stage
+{
+        unsigned long int count;
+        unsigned long int cycles;       /* total */
+        unsigned long int hist[Q_PROFILE_HIST_SIZE];
+};
+
+
+struct pfq_profile
+{
+        int cpu;        /* Q_ANY_CPU for the sum of all the cpus */
+        int enabled;
+
+        struct pfq_profile_stage stage[Q_PROFILE_STAGES];
+};
+
 #endif /* PF_Q_LINUX_H */
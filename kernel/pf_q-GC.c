@@ -35,6 +35,14 @@ void gc_reset(struct gc_data *gc)
 		gc_log_init(&gc->log[n]);
 	}
 	gc->pool.len = 0;
+
+	for(n = 0; n < gc->fwd.num; ++n)
+	{
+		bitmap_zero(gc->fwd.mask[n], Q_GC_POOL_QUEUE_LEN);
+	}
+	gc->fwd.num = 0;
+	gc->fwd.cnt_total = 0;
+	gc->fwd.last = 0;
 }
 
 
@@ -113,46 +121,40 @@ gc_copy_buff(struct gc_data *gc, struct gc_buff orig)
 }
 
 
-static inline void
-add_dev_to_targets(struct net_device *dev, struct lazy_fwd_targets *ts)
-{
-	size_t n = 0;
-
-	for(; n < ts->num; ++n)
-	{
-        	if (dev == ts->dev[n]) {
-        		ts->cnt[n]++;
-        		ts->cnt_total++;
-        		return;
-		}
-	}
+/* record the annotation of the packet (log) for the device */
 
-	if (n < Q_GC_LOG_QUEUE_LEN) {
-		ts->dev[n] = dev;
-		ts->cnt[n] = 1;
-		ts->cnt_total++;
-		ts->num++;
-	}
-	else
-		pr_devel("[PFQ] GC: forward pool exhausted!\n");
-}
-
-
-void
-gc_get_fwd_targets(struct gc_data *gc, struct lazy_fwd_targets *ts)
+bool
+gc_add_fwd_target(struct gc_data *gc, struct net_device *dev, struct gc_log *log)
 {
-	size_t n, i;
+	struct lazy_fwd_targets *ts = &gc->fwd;
+	size_t n = ts->last;
 
-	ts->num = 0;
-        ts->cnt_total = 0;
+	if (n >= ts->num || ts->dev[n] != dev) {
 
-	for(n = 0; n < gc->pool.len; ++n)
-	{
-		for(i = 0; i < gc->log[n].num_devs; i++)
+		for(n = 0; n < ts->num; ++n)
 		{
-         		add_dev_to_targets(gc->log[n].dev[i], ts);
+			if (dev == ts->dev[n])
+				break;
 		}
+
+		if (n == ts->num) {
+			if (n == Q_GC_LOG_QUEUE_LEN) {
+				pr_devel("[PFQ] GC: forward pool exhausted!\n");
+				return false;
+			}
+
+			ts->dev[n] = dev;
+			ts->cnt[n] = 0;
+			ts->num++;
+		}
+
+		ts->last = n;
 	}
+
+	__set_bit(log - gc->log, ts->mask[n]);
+	ts->cnt[n]++;
+	ts->cnt_total++;
+	return true;
 }
 
 
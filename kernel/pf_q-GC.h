@@ -26,6 +26,7 @@
 
 #include <linux/string.h>
 #include <linux/skbuff.h>
+#include <linux/bitmap.h>
 
 #include <pf_q-skbuff.h>
 #include <pf_q-macro.h>
@@ -67,10 +68,25 @@ struct gc_queue_buff
 };
 
 
+/* forward targets, recorded as the packets are annotated: for each
+ * device, the bitmap of the packets (pool index) to forward */
+
+struct lazy_fwd_targets
+{
+	struct net_device * dev[Q_GC_LOG_QUEUE_LEN];
+	size_t cnt [Q_GC_LOG_QUEUE_LEN];
+	DECLARE_BITMAP(mask[Q_GC_LOG_QUEUE_LEN], Q_GC_POOL_QUEUE_LEN);
+	size_t cnt_total;
+	size_t num;
+	size_t last;				/* hint: the last target used */
+};
+
+
 struct gc_data
 {
 	struct gc_log   	log[Q_GC_POOL_QUEUE_LEN];
 	struct gc_queue_buff 	pool;
+	struct lazy_fwd_targets	fwd;
 };
 
 
@@ -84,9 +100,7 @@ extern struct gc_buff pfq_make_buff(struct sk_buff *skb);
 extern struct gc_buff pfq_alloc_buff(size_t size);
 extern struct gc_buff pfq_copy_buff(struct gc_buff buff);
 
-struct lazy_fwd_targets;
-
-extern void   gc_get_fwd_targets(struct gc_data *gc, struct lazy_fwd_targets *ts);
+extern bool   gc_add_fwd_target(struct gc_data *gc, struct net_device *dev, struct gc_log *log);
 
 
 static inline size_t
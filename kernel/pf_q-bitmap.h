@@ -0,0 +1,173 @@
+/***************************************************************
+ *
+ * (C) 2011-14 Nicola Bonelli <nicola@pfq.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ ****************************************************************/
+
+#ifndef PF_Q_BITMAP_H
+#define PF_Q_BITMAP_H
+
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/string.h>
+#include <linux/compiler.h>
+
+#include <pf_q-macro.h>
+#include <pf_q-bitops.h>
+
+
+/* multi-word bitmaps for socket ids and group ids.
+ *
+ * The storage is sized to the compile-time ceiling (Q_MAX_ID/Q_MAX_GROUP),
+ * whereas operations only touch the first `nw` words, as set at load time
+ * by the max_sockets/max_groups module parameters. With the default
+ * values (64) every operation collapses into a single-word one.
+ *
+ * Writers (user context) use the atomic set/clear, readers (softirq) load
+ * each word once: consistency is guaranteed per-word only, as it was for
+ * the former single-word masks.
+ */
+
+#define Q_BITMAP_BITS		(Q_MAX_ID > Q_MAX_GROUP ? Q_MAX_ID : Q_MAX_GROUP)
+#define Q_BITMAP_WORDS		BITS_TO_LONGS(Q_BITMAP_BITS)
+
+
+typedef struct
+{
+	unsigned long word[Q_BITMAP_WORDS];
+
+} pfq_bitmap_t;
+
+
+extern size_t pfq_sock_words;		/* BITS_TO_LONGS(max_sockets) */
+extern size_t pfq_group_words;		/* BITS_TO_LONGS(max_groups)  */
+
+
+static inline
+void pfq_bitmap_zero(unsigned long *map, size_t nw)
+{
+	if (likely(nw == 1))
+		map[0] = 0;
+	else
+		memset(map, 0, nw * sizeof(unsigned long));
+}
+
+
+static inline
+void pfq_bitmap_copy(unsigned long *dst, const unsigned long *src, size_t nw)
+{
+	size_t n;
+	for(n = 0; n < nw; n++)
+		dst[n] = ACCESS_ONCE(src[n]);
+}
+
+
+static inline
+void pfq_bitmap_or(unsigned long *dst, const unsigned long *src, size_t nw)
+{
+	size_t n;
+	for(n = 0; n < nw; n++)
+		dst[n] |= ACCESS_ONCE(src[n]);
+}
+
+
+static inline
+bool pfq_bitmap_empty(const unsigned long *map, size_t nw)
+{
+	size_t n;
+	for(n = 0; n < nw; n++)
+		if (ACCESS_ONCE(map[n]))
+			return false;
+	return true;
+}
+
+
+static inline
+bool pfq_bitmap_equal(const unsigned long *a, const unsigned long *b, size_t nw)
+{
+	size_t n;
+	for(n = 0; n < nw; n++)
+		if (a[n] != b[n])
+			return false;
+	return true;
+}
+
+
+static inline
+unsigned int pfq_bitmap_weight(const unsigned long *map, size_t nw)
+{
+	unsigned int ret = 0;
+	size_t n;
+	for(n = 0; n < nw; n++)
+		ret += pfq_popcount(map[n]);
+	return ret;
+}
+
+
+static inline
+bool pfq_bitmap_test(const unsigned long *map, int bit)
+{
+	return (ACCESS_ONCE(map[BIT_WORD(bit)]) & BIT_MASK(bit)) != 0;
+}
+
+
+/* atomic versions, to be used on shared bitmaps */
+
+static inline
+void pfq_bitmap_set(unsigned long *map, int bit)
+{
+	set_bit(bit, map);
+}
+
+
+static inline
+void pfq_bitmap_clear(unsigned long *map, int bit)
+{
+	clear_bit(bit, map);
+}
+
+
+/* non-atomic versions, for bitmaps on the stack/per-cpu */
+
+static inline
+void __pfq_bitmap_set(unsigned long *map, int bit)
+{
+	map[BIT_WORD(bit)] |= BIT_MASK(bit);
+}
+
+
+/* iterate over the set bits of a bitmap: `n` is the index of the bit */
+
+#define pfq_bitmap_foreach(map, nw, n, ...) \
+{ \
+	size_t _w; \
+	for(_w = 0; _w < (nw); _w++) \
+	{ \
+		unsigned long _mask = ACCESS_ONCE((map)[_w]), _bit; \
+		for(; _bit = _mask & -_mask, _mask; _mask ^= _bit) \
+		{ \
+			n = _w * BITS_PER_LONG + pfq_ctz(_bit); \
+			__VA_ARGS__ \
+		} \
+	} \
+}
+
+
+#endif /* PF_Q_BITMAP_H */
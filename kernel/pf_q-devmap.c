@@ -25,79 +25,498 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/semaphore.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/netdevice.h>
+#include <net/net_namespace.h>
 
 #include <pf_q-devmap.h>
+#include <pf_q-global.h>
 
 
 static DEFINE_SEMAPHORE(devmap_sem);
 
-atomic_long_t   pfq_devmap [Q_MAX_DEVICE][Q_MAX_HW_QUEUE];
-atomic_t        pfq_devmap_monitor [Q_MAX_DEVICE];
+DEFINE_HASHTABLE(pfq_devmap, Q_DEVMAP_HASH_BITS);
 
+struct pfq_devmap_entry __rcu *pfq_devmap_any;
 
-void pfq_devmap_monitor_update(void)
+const pfq_bitmap_t pfq_devmap_none;
+
+
+/* a binding: the groups bound to (ifindex, queue), either can be a wildcard */
+
+struct pfq_devmap_bind
+{
+        struct list_head list;
+        int              ifindex;
+        int              queue;
+        pfq_bitmap_t     groups;
+};
+
+static LIST_HEAD(devmap_binds);
+
+
+/* a protocol hook on a bound device (holds a reference to the device) */
+
+struct pfq_devmap_hook
+{
+        struct list_head   list;
+        struct packet_type pt;
+};
+
+static LIST_HEAD(devmap_hooks);
+
+static struct packet_type  devmap_proto;        /* template of the hooks */
+static bool                devmap_proto_on;     /* hooks enabled */
+
+static struct packet_type  devmap_hook_any;     /* for bindings to any device */
+static bool                devmap_hook_any_on;
+
+
+int pfq_devmap_init(void)
+{
+    hash_init(pfq_devmap);
+    RCU_INIT_POINTER(pfq_devmap_any, NULL);
+    return 0;
+}
+
+
+static struct pfq_devmap_entry *
+devmap_entry_build(int ifindex)
+{
+    struct pfq_devmap_entry *e;
+    struct pfq_devmap_bind *b;
+    unsigned int queues = 0, q;
+    bool any = false;
+
+    /* the bindings of the device (and the wildcard ones, for a device) */
+
+    list_for_each_entry(b, &devmap_binds, list)
+    {
+        if (b->ifindex != ifindex && b->ifindex != Q_ANY_DEVICE)
+            continue;
+        if (b->queue != Q_ANY_QUEUE && (unsigned int)b->queue + 1 > queues)
+            queues = (unsigned int)b->queue + 1;
+    }
+
+    e = kzalloc(sizeof(*e) + (queues + 1) * pfq_group_words * sizeof(unsigned long), GFP_KERNEL);
+    if (!e)
+        return NULL;
+
+    e->ifindex = ifindex;
+    e->queues  = queues;
+
+    list_for_each_entry(b, &devmap_binds, list)
+    {
+        if (b->ifindex != ifindex && b->ifindex != Q_ANY_DEVICE)
+            continue;
+
+        for(q = 0; q <= queues; q++)
+        {
+            if (b->queue == Q_ANY_QUEUE || (unsigned int)b->queue == q)
+                pfq_bitmap_or(e->map + q * pfq_group_words, b->groups.word, pfq_group_words);
+        }
+
+        any |= !pfq_bitmap_empty(b->groups.word, pfq_group_words);
+    }
+
+    e->monitor = any;
+    return e;
+}
+
+
+/* one entry per device: built at the first binding of the device */
+
+static bool
+devmap_first_bind(struct pfq_devmap_bind *this)
+{
+    struct pfq_devmap_bind *b;
+
+    list_for_each_entry(b, &devmap_binds, list)
+    {
+        if (b == this)
+            return true;
+        if (b->ifindex == this->ifindex)
+            return false;
+    }
+    return true;
+}
+
+
+/* rebuild the entries from the bindings: old entries are freed after
+ * a grace period */
+
+static int
+devmap_rebuild(void)
+{
+    struct pfq_devmap_entry *e, *old;
+    struct pfq_devmap_bind *b;
+    struct hlist_node *tmp;
+    bool wildcard = false;
+    int bkt;
+
+    list_for_each_entry(b, &devmap_binds, list)
+    {
+        if (b->ifindex == Q_ANY_DEVICE) {
+            wildcard = true;
+            continue;
+        }
+
+        if (!devmap_first_bind(b))
+            continue;
+
+        e = devmap_entry_build(b->ifindex);
+        if (!e)
+            return -ENOMEM;
+
+        hash_for_each_possible(pfq_devmap, old, node, b->ifindex)
+        {
+            if (old->ifindex == b->ifindex)
+                break;
+        }
+
+        if (old) {
+            hlist_replace_rcu(&old->node, &e->node);
+            kfree_rcu(old, rcu);
+        }
+        else {
+            hash_add_rcu(pfq_devmap, &e->node, e->ifindex);
+        }
+    }
+
+    /* remove the entries of the devices left without bindings */
+
+    hash_for_each_safe(pfq_devmap, bkt, tmp, old, node)
+    {
+        bool bound = false;
+
+        list_for_each_entry(b, &devmap_binds, list)
+        {
+            if (b->ifindex == old->ifindex) {
+                bound = true;
+                break;
+            }
+        }
+
+        if (!bound) {
+            hash_del_rcu(&old->node);
+            kfree_rcu(old, rcu);
+        }
+    }
+
+    /* the wildcard entry */
+
+    e = NULL;
+    if (wildcard) {
+        e = devmap_entry_build(Q_ANY_DEVICE);
+        if (!e)
+            return -ENOMEM;
+    }
+
+    old = rcu_dereference_protected(pfq_devmap_any, 1);
+    rcu_assign_pointer(pfq_devmap_any, e);
+    if (old)
+        kfree_rcu(old, rcu);
+
+    return 0;
+}
+
+
+void pfq_devmap_free(void)
+{
+    struct pfq_devmap_bind *b, *btmp;
+    struct pfq_devmap_entry *e;
+    struct hlist_node *tmp;
+    int bkt;
+
+    down(&devmap_sem);
+
+    list_for_each_entry_safe(b, btmp, &devmap_binds, list)
+    {
+        list_del(&b->list);
+        kfree(b);
+    }
+
+    hash_for_each_safe(pfq_devmap, bkt, tmp, e, node)
+    {
+        hash_del_rcu(&e->node);
+        kfree_rcu(e, rcu);
+    }
+
+    e = rcu_dereference_protected(pfq_devmap_any, 1);
+    RCU_INIT_POINTER(pfq_devmap_any, NULL);
+    if (e)
+        kfree_rcu(e, rcu);
+
+    up(&devmap_sem);
+
+    rcu_barrier();
+}
+
+
+void pfq_devmap_monitor_reset(void)
+{
+    struct pfq_devmap_entry *e;
+    int bkt;
+
+    down(&devmap_sem);
+
+    hash_for_each(pfq_devmap, bkt, e, node)
+        ACCESS_ONCE(e->monitor) = 0;
+
+    e = rcu_dereference_protected(pfq_devmap_any, 1);
+    if (e)
+        ACCESS_ONCE(e->monitor) = 0;
+
+    up(&devmap_sem);
+}
+
+
+/* protocol hooks: called with the devmap semaphore held */
+
+static bool
+devmap_is_bound(int ifindex)
+{
+    struct pfq_devmap_bind *b;
+
+    list_for_each_entry(b, &devmap_binds, list)
+    {
+        if (b->ifindex == ifindex || b->ifindex == Q_ANY_DEVICE)
+            return true;
+    }
+    return false;
+}
+
+
+static void
+devmap_hook_del(struct pfq_devmap_hook *h)
+{
+    dev_remove_pack(&h->pt);
+    dev_put(h->pt.dev);
+    list_del(&h->list);
+    kfree(h);
+}
+
+
+static void
+devmap_hook_add(int ifindex)
+{
+    struct pfq_devmap_hook *h;
+    struct net_device *dev;
+
+    list_for_each_entry(h, &devmap_hooks, list)
+    {
+        if (h->pt.dev->ifindex == ifindex)
+            return;
+    }
+
+    dev = dev_get_by_index(&init_net, ifindex);
+    if (!dev)
+        return;
+
+    h = kzalloc(sizeof(*h), GFP_KERNEL);
+    if (!h) {
+        printk(KERN_WARNING "[PFQ] devmap: could not hook if_index=%d!\n", ifindex);
+        dev_put(dev);
+        return;
+    }
+
+    h->pt     = devmap_proto;
+    h->pt.dev = dev;
+
+    dev_add_pack(&h->pt);
+    list_add_tail(&h->list, &devmap_hooks);
+
+    pr_devel("[PFQ] devmap: hook on %s\n", dev->name);
+}
+
+
+static void
+devmap_hooks_sync(void)
+{
+    struct pfq_devmap_hook *h, *tmp;
+    struct pfq_devmap_bind *b;
+    bool any;
+
+    any = devmap_proto_on && devmap_is_bound(Q_ANY_DEVICE);
+
+    /* drop the hooks of unbound devices (all of them, if a single hook
+     * on any device is required) */
+
+    list_for_each_entry_safe(h, tmp, &devmap_hooks, list)
+    {
+        if (any || !devmap_proto_on || !devmap_is_bound(h->pt.dev->ifindex))
+            devmap_hook_del(h);
+    }
+
+    if (any != devmap_hook_any_on) {
+
+        if (any) {
+            devmap_hook_any = devmap_proto;
+            devmap_hook_any.dev = NULL;
+            dev_add_pack(&devmap_hook_any);
+        }
+        else {
+            dev_remove_pack(&devmap_hook_any);
+        }
+
+        devmap_hook_any_on = any;
+    }
+
+    if (any || !devmap_proto_on)
+        return;
+
+    list_for_each_entry(b, &devmap_binds, list)
+        devmap_hook_add(b->ifindex);
+}
+
+
+static int
+devmap_netdev_event(struct notifier_block *this, unsigned long msg, void *ptr)
 {
-    int i,j;
-    for(i=0; i < Q_MAX_DEVICE; ++i)
+    struct net_device *dev = netdev_notifier_info_to_dev(ptr);
+    struct pfq_devmap_hook *h, *tmp;
+
+    if (!net_eq(dev_net(dev), &init_net))
+        return NOTIFY_DONE;
+
+    switch(msg)
     {
-        unsigned long val = 0;
-        for(j=0; j < Q_MAX_HW_QUEUE; ++j)
+    case NETDEV_REGISTER: {
+
+        down(&devmap_sem);
+        if (devmap_proto_on && devmap_is_bound(dev->ifindex))
+            devmap_hooks_sync();
+        up(&devmap_sem);
+
+    } break;
+
+    case NETDEV_UNREGISTER: {
+
+        /* release the reference, the bindings are kept */
+
+        down(&devmap_sem);
+        list_for_each_entry_safe(h, tmp, &devmap_hooks, list)
         {
-            val |= atomic_long_read(&pfq_devmap[i][j]);
+            if (h->pt.dev == dev)
+                devmap_hook_del(h);
         }
+        up(&devmap_sem);
 
-        atomic_set(&pfq_devmap_monitor[i], val ? 1 : 0);
+    } break;
     }
+
+    return NOTIFY_DONE;
+}
+
+
+static struct notifier_block devmap_notifier = {
+    .notifier_call = devmap_netdev_event,
+};
+
+
+int pfq_devmap_hooks_enable(const struct packet_type *proto)
+{
+    int err = register_netdevice_notifier(&devmap_notifier);
+    if (err)
+        return err;
+
+    down(&devmap_sem);
+
+    devmap_proto    = *proto;
+    devmap_proto_on = true;
+    devmap_hooks_sync();
+
+    up(&devmap_sem);
+    return 0;
+}
+
+
+void pfq_devmap_hooks_disable(void)
+{
+    if (!devmap_proto_on)
+        return;
+
+    unregister_netdevice_notifier(&devmap_notifier);
+
+    down(&devmap_sem);
+
+    devmap_proto_on = false;
+    devmap_hooks_sync();
+
+    up(&devmap_sem);
 }
 
 
 int pfq_devmap_update(int action, int index, int queue, int gid)
 {
-    int n = 0, i,q;
+    struct pfq_devmap_bind *b, *tmp;
+    int n = 0, err;
 
-    if (unlikely(gid >= Q_MAX_GROUP || gid < 0)) {
+    if (unlikely(gid >= max_groups || gid < 0)) {
         pr_devel("[PF_Q] devmap_update: bad gid (%u)\n",gid);
         return 0;
     }
 
+    if (unlikely(queue < Q_ANY_QUEUE || queue >= Q_MAX_HW_QUEUE)) {
+        pr_devel("[PF_Q] devmap_update: bad queue (%d)\n",queue);
+        return -EINVAL;
+    }
+
     down(&devmap_sem);
 
-    for(i=0; i < Q_MAX_DEVICE; ++i)
-    {
-        for(q=0; q < Q_MAX_HW_QUEUE; ++q)
+    if (action == map_set) {
+
+        list_for_each_entry(b, &devmap_binds, list)
         {
-            unsigned long tmp;
+            if (b->ifindex == index && b->queue == queue)
+                break;
+        }
 
-            if (!__pfq_devmap_equal(i, q, index, queue))
-                continue;
+        if (&b->list == &devmap_binds) {
+
+            b = kzalloc(sizeof(*b), GFP_KERNEL);
+            if (!b) {
+                up(&devmap_sem);
+                return -ENOMEM;
+            }
 
-            /* map_set... */
-            if (action == map_set) {
+            b->ifindex = index;
+            b->queue   = queue;
+            list_add_tail(&b->list, &devmap_binds);
+        }
 
-                tmp = atomic_long_read(&pfq_devmap[i][q]);
-                tmp |= 1L << gid;
-                atomic_long_set(&pfq_devmap[i][q], tmp);
-                n++;
+        pfq_bitmap_set(b->groups.word, gid);
+        n++;
+    }
+    else {
+
+        /* map_reset: wildcards match any binding */
+
+        list_for_each_entry_safe(b, tmp, &devmap_binds, list)
+        {
+            if ((index != Q_ANY_DEVICE && b->ifindex != index) ||
+                (queue != Q_ANY_QUEUE  && b->queue != queue))
                 continue;
-            }
 
-            /* map_reset */
-            tmp = atomic_long_read(&pfq_devmap[i][q]);
-            if (tmp & (1L<<gid)) {
-                tmp &= ~(1L<<gid);
-                atomic_long_set(&pfq_devmap[i][q], tmp);
+            if (pfq_bitmap_test(b->groups.word, gid)) {
+                pfq_bitmap_clear(b->groups.word, gid);
                 n++;
-                continue;
+            }
+
+            if (pfq_bitmap_empty(b->groups.word, pfq_group_words)) {
+                list_del(&b->list);
+                kfree(b);
             }
         }
     }
 
-    /* update capture monitor filter... */
+    err = n ? devmap_rebuild() : 0;
 
-    pfq_devmap_monitor_update();
+    if (n && devmap_proto_on)
+        devmap_hooks_sync();
 
     up(&devmap_sem);
 
-    return n;
+    return err < 0 ? err : n;
 }
-
@@ -26,62 +26,112 @@
 #define PF_Q_DEVMAP_H
 
 #include <linux/pf_q.h>
+#include <linux/rculist.h>
+#include <linux/hashtable.h>
+#include <linux/netdevice.h>
 
 #include <pf_q-macro.h>
+#include <pf_q-bitmap.h>
 
 
-/* pfq devmap */
+/* pfq devmap
+ *
+ * The groups bound to a device are kept in a per-device entry, looked up
+ * by ifindex in a small RCU hash table: any ifindex is supported, without
+ * aliasing. An entry holds one group bitmap (pfq_group_words) per Rx queue
+ * with an explicit binding, plus a last one for all the other queues.
+ *
+ * Entries are derived from the list of bindings and rebuilt at every update
+ * (user context, under the devmap semaphore): readers (softirq) see either
+ * the old or the new entry of a device. Bindings to Q_ANY_DEVICE go to a
+ * wildcard entry, used for the devices that do not have one of their own.
+ *
+ * Bindings also drive the protocol hooks: a packet_type is registered for
+ * each bound device (.dev set), so that unbound devices do not go through
+ * PFQ at all. A binding to Q_ANY_DEVICE falls back to a single hook on all
+ * the devices.
+ */
 
 enum { map_reset, map_set };
 
-extern atomic_long_t pfq_devmap [Q_MAX_DEVICE][Q_MAX_HW_QUEUE];
-extern atomic_t      pfq_devmap_monitor [Q_MAX_DEVICE];
+#define Q_DEVMAP_HASH_BITS	6
+
+
+struct pfq_devmap_entry
+{
+	struct hlist_node	node;
+	struct rcu_head		rcu;
+
+	int			ifindex;	/* Q_ANY_DEVICE for the wildcard entry */
+	int			monitor;	/* direct capture enabled on the device */
+	unsigned int		queues;		/* Rx queues with an explicit binding (+1) */
+
+	unsigned long		map[];		/* (queues + 1) group bitmaps */
+};
+
+
+extern DECLARE_HASHTABLE(pfq_devmap, Q_DEVMAP_HASH_BITS);
+
+extern struct pfq_devmap_entry __rcu *pfq_devmap_any;
+
+extern const pfq_bitmap_t pfq_devmap_none;
 
 
 /* called from u-context
 */
 
+extern int  pfq_devmap_init(void);
+extern void pfq_devmap_free(void);
 extern int  pfq_devmap_update(int action, int index, int queue, int gid);
-extern void pfq_devmap_monitor_update(void);
+extern void pfq_devmap_monitor_reset(void);
+
+extern int  pfq_devmap_hooks_enable(const struct packet_type *proto);
+extern void pfq_devmap_hooks_disable(void);
+
+
+/* called under rcu_read_lock */
 
 static inline
-int __pfq_devmap_equal(int i1, int q1, int i2, int q2)
+struct pfq_devmap_entry * __pfq_devmap_lookup(int ifindex)
 {
-        i1 = i1 > 0 ? i1 & Q_MAX_DEVICE_MASK   : i1;
-        q1 = q1 > 0 ? q1 & Q_MAX_HW_QUEUE_MASK : q1;
+        struct pfq_devmap_entry *e;
 
-        i2 = i2 > 0 ? i2 & Q_MAX_DEVICE_MASK   : i2;
-        q2 = q2 > 0 ? q2 & Q_MAX_HW_QUEUE_MASK : q2;
+        hash_for_each_possible_rcu(pfq_devmap, e, node, ifindex)
+        {
+                if (e->ifindex == ifindex)
+                        return e;
+        }
 
-        return  (i1 == i2 && q1 == q2) ||
-                (i1 == i2 && q2 == -1) ||
-                (i2 == -1 && q1 == q2) ||
-                (i2 == -1 && q2 == -1);
+        return rcu_dereference(pfq_devmap_any);
 }
 
 
 static inline
-unsigned long __pfq_devmap_get_groups(int d, int q)
+const unsigned long * __pfq_devmap_get_groups(int ifindex, int queue)
 {
-        return atomic_long_read(&pfq_devmap[d & Q_MAX_DEVICE_MASK][q & Q_MAX_HW_QUEUE_MASK]);
-}
+        struct pfq_devmap_entry *e = __pfq_devmap_lookup(ifindex);
+        unsigned int q = (unsigned int)queue;
 
+        if (!e)
+                return pfq_devmap_none.word;
 
-static inline
-int __pfq_devmap_monitor_get(int index)
-{
-        return atomic_read(&pfq_devmap_monitor[index & Q_MAX_DEVICE_MASK]);
+        return e->map + (q < e->queues ? q : e->queues) * pfq_group_words;
 }
 
 
 static inline
-void __pfq_devmap_monitor_reset(void)
+int __pfq_devmap_monitor_get(int ifindex)
 {
-        int n;
-        for(n = 0; n < Q_MAX_DEVICE; n++)
-        {
-                atomic_set(&pfq_devmap_monitor[n],0);
-        }
+        struct pfq_devmap_entry *e;
+        int ret;
+
+        rcu_read_lock();
+        e = __pfq_devmap_lookup(ifindex);
+        ret = e ? ACCESS_ONCE(e->monitor) : 0;
+        rcu_read_unlock();
+
+        return ret;
 }
 
+
 #endif /* PF_Q_DEVMAP_H */
@@ -25,11 +25,14 @@
 #include <linux/version.h>
 #include <linux/module.h>
 #include <linux/skbuff.h>
+#include <linux/netdevice.h>
+#include <linux/rtnetlink.h>
 
 #include <pf_q-shared-queue.h>
 #include <pf_q-sparse.h>
 #include <pf_q-transmit.h>
 #include <pf_q-endpoint.h>
+#include <pf_q-global.h>
 
 
 static inline
@@ -42,7 +45,7 @@ size_t copy_to_user_skbs(struct pfq_rx_opt *ro, struct pfq_skbuff_batch *skbs, u
 
         	smp_rmb();
 
-                cpy = pfq_mpsc_enqueue_batch(ro, skbs, mask, len, gid);
+                cpy = pfq_mpsc_enqueue_batch(ro, skbs, mask, len, cpu, gid);
 
         	__sparse_add(&ro->stats.recv, cpy, cpu);
 
@@ -61,25 +64,17 @@ size_t copy_to_user_skbs(struct pfq_rx_opt *ro, struct pfq_skbuff_batch *skbs, u
 static inline
 size_t copy_to_dev_buffs(struct pfq_sock *so, struct gc_queue_buff *buffs, unsigned long long mask, int cpu, int gid)
 {
-	struct net_device *dev;
-	int sent;
-
-	if (so->egress_index) {
-
-               	dev = dev_get_by_index(&init_net, so->egress_index);
-               	if (dev == NULL) {
-			if (printk_ratelimit())
-                        	printk(KERN_INFO "[PFQ] egress endpoint not existing (%d)\n", so->egress_index);
-                        return false;
-		}
+	/* the device is pinned by the binding: called under rcu_read_lock */
 
- 		sent = pfq_batch_lazy_xmit_by_mask(buffs, mask, dev, so->egress_queue);
+	struct net_device *dev = rcu_dereference(so->egress_dev);
 
-                dev_put(dev);
-		return sent;
+	if (unlikely(dev == NULL)) {
+		if (printk_ratelimit())
+			printk(KERN_INFO "[PFQ] egress endpoint not existing (%d)\n", so->egress_index);
+		return 0;
 	}
 
-	return 0;
+	return pfq_batch_lazy_xmit_by_mask(buffs, mask, dev, so->egress_queue);
 }
 
 
@@ -97,3 +92,116 @@ size_t copy_to_endpoint_buffs(struct pfq_sock *so, struct gc_queue_buff *pool, u
 	return false;
 }
 
+
+
+/* bind and unbind are serialized with the notifier by the rtnl lock */
+
+static void
+egress_release(struct pfq_sock *so)
+{
+	struct net_device *dev = rtnl_dereference(so->egress_dev);
+
+	if (dev) {
+		RCU_INIT_POINTER(so->egress_dev, NULL);
+		synchronize_net();
+		dev_put(dev);
+	}
+}
+
+
+int
+pfq_egress_bind(struct pfq_sock *so, struct net *net, int if_index, int hw_queue)
+{
+	struct net_device *dev;
+
+	rtnl_lock();
+
+	dev = __dev_get_by_index(net, if_index);
+	if (dev == NULL) {
+		rtnl_unlock();
+		return -ENODEV;
+	}
+
+	/* the hw queue is resolved now: Q_ANY_QUEUE is left to the Tx queue selection */
+
+	if (hw_queue >= (int)dev->real_num_tx_queues) {
+		rtnl_unlock();
+		return -EINVAL;
+	}
+
+	egress_release(so);
+
+	dev_hold(dev);
+
+	so->egress_type  = pfq_endpoint_device;
+	so->egress_index = if_index;
+	so->egress_queue = hw_queue;
+
+	rcu_assign_pointer(so->egress_dev, dev);
+
+	rtnl_unlock();
+	return 0;
+}
+
+
+void
+pfq_egress_unbind(struct pfq_sock *so)
+{
+	rtnl_lock();
+
+	so->egress_type  = pfq_endpoint_socket;
+	egress_release(so);
+	so->egress_index = 0;
+	so->egress_queue = 0;
+
+	rtnl_unlock();
+}
+
+
+/* a device going away drops the references of its endpoints: the
+ * sockets remain bound to a missing device, until unbound */
+
+static int
+endpoint_netdev_event(struct notifier_block *this, unsigned long msg, void *ptr)
+{
+	struct net_device *dev = netdev_notifier_info_to_dev(ptr);
+	int id, refs = 0;
+
+	if (msg != NETDEV_UNREGISTER)
+		return NOTIFY_DONE;
+
+	for(id = 0; id < max_sockets; id++)
+	{
+		struct pfq_sock *so = pfq_get_sock_by_id(id);
+
+		if (so && rtnl_dereference(so->egress_dev) == dev) {
+			RCU_INIT_POINTER(so->egress_dev, NULL);
+			refs++;
+		}
+	}
+
+	if (refs) {
+		synchronize_net();
+		while (refs--)
+			dev_put(dev);
+	}
+
+	return NOTIFY_DONE;
+}
+
+
+static struct notifier_block endpoint_notifier = {
+	.notifier_call = endpoint_netdev_event,
+};
+
+
+int pfq_endpoint_init(void)
+{
+	return register_netdevice_notifier(&endpoint_notifier);
+}
+
+
+void pfq_endpoint_fini(void)
+{
+	unregister_netdevice_notifier(&endpoint_notifier);
+}
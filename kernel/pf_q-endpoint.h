@@ -24,6 +24,8 @@
 #ifndef PF_Q_ENDPOINT_H
 #define PF_Q_ENDPOINT_H
 
+#include <linux/netdevice.h>
+
 struct pfq_sock;
 struct pfq_skbuff_batch;
 
@@ -35,4 +37,12 @@ enum pfq_endpoint_type
 
 extern size_t copy_to_endpoint_buffs(struct pfq_sock *so, struct gc_queue_buff *pool, unsigned long long mask, int cpu, int gid);
 
+/* device endpoints: the net_device is resolved and pinned at bind time */
+
+extern int  pfq_egress_bind(struct pfq_sock *so, struct net *net, int if_index, int hw_queue);
+extern void pfq_egress_unbind(struct pfq_sock *so);
+
+extern int  pfq_endpoint_init(void);
+extern void pfq_endpoint_fini(void);
+
 #endif /* PF_Q_ENDPOINT_H */
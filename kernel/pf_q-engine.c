@@ -32,6 +32,7 @@
 #include <pf_q-module.h>
 #include <pf_q-symtable.h>
 #include <pf_q-signature.h>
+#include <pf_q-profile.h>
 #include <pf_q-engine.h>
 
 #include <functional/headers.h>
@@ -137,9 +138,13 @@ pfq_bind(SkBuff b, struct pfq_computation_tree *prg)
 
         while (node)
         {
+                cycles_t start = pfq_profile_begin();
                 fanout_t *a;
 
                 b = pfq_apply(&node->fun, b).value;
+
+                pfq_profile_end(Q_PROFILE_NODE(min_t(ptrdiff_t, node - prg->node, Q_PROFILE_MAX_NODES-1)), start);
+
                 if (b.skb == NULL)
                         return Pass(b);
 
@@ -158,32 +163,7 @@ pfq_bind(SkBuff b, struct pfq_computation_tree *prg)
 Action_SkBuff
 pfq_run(struct pfq_computation_tree *prg, SkBuff b)
 {
-#ifdef PFQ_LANG_PROFILE
-	static uint64_t nrun, total;
-	uint64_t stop, start;
-#endif
-
-#ifdef PFQ_LANG_PROFILE
-	start = get_cycles();
-
-	b =
-#else
-	return
-#endif
-
-	pfq_bind(b, prg);
-
-#ifdef PFQ_LANG_PROFILE
-
-	stop = get_cycles();
-	total += (stop-start);
-
-	if ((nrun++ % 1048576) == 0)
-		printk(KERN_INFO "[PFQ] PFQ/lang run: %llu_tsc.\n", total/nrun);
-
-	return b;
-#endif
-
+	return pfq_bind(b, prg);
 }
 
 
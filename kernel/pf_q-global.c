@@ -26,6 +26,8 @@
 #include <linux/types.h>
 
 #include <pf_q-global.h>
+#include <pf_q-bitmap.h>
+#include <pf_q-profile.h>
 
 
 struct local_data __percpu    * cpu_data;
@@ -40,12 +42,57 @@ int cap_len      	= 1514;
 int max_len      	= 1514;
 
 int batch_len 		= 1;
+int batch_adaptive	= 0;			/* adaptive Rx batching */
+int batch_latency	= 100;			/* usec, flush bound of adaptive batching */
 int vl_untag     	= 0;
 
 int skb_pool_size 	= 1024;
 int tx_max_retry 	= 1024;
+int tx_sleep_thresh	= 0;			/* usec, Tx pacing: sleep through longer gaps (0 = spin) */
+int tx_service		= 0;			/* async Tx: a shared thread per cpu (0 = a thread per queue) */
+
+int zcopy_frames	= 0;			/* zero-copy Rx pool (frames), 0 = disabled */
+
+int max_sockets		= Q_DEF_MAX_ID;		/* up to Q_MAX_ID */
+int max_groups		= Q_DEF_MAX_GROUP;	/* up to Q_MAX_GROUP */
+
+size_t pfq_sock_words	= BITS_TO_LONGS(Q_DEF_MAX_ID);
+size_t pfq_group_words	= BITS_TO_LONGS(Q_DEF_MAX_GROUP);
 
 struct pfq_global_stats global_stats;
 struct pfq_memory_stats memory_stats;
 
+static struct sparse_area global_stats_area;
+static struct sparse_area memory_stats_area;
+
+
+int pfq_global_stats_init(void)
+{
+	if (sparse_area_alloc(&global_stats_area, SPARSE_BLOCK_SIZE(SPARSE_COUNTERS(global_stats))))
+		return -ENOMEM;
+
+	if (sparse_area_alloc(&memory_stats_area, SPARSE_BLOCK_SIZE(SPARSE_COUNTERS(memory_stats)))) {
+		sparse_area_free(&global_stats_area);
+		return -ENOMEM;
+	}
+
+	if (pfq_profile_init()) {
+		sparse_area_free(&global_stats_area);
+		sparse_area_free(&memory_stats_area);
+		return -ENOMEM;
+	}
+
+	sparse_area_bind(&global_stats_area, 0, (sparse_counter_t *)&global_stats, SPARSE_COUNTERS(global_stats));
+	sparse_area_bind(&memory_stats_area, 0, (sparse_counter_t *)&memory_stats, SPARSE_COUNTERS(memory_stats));
+	return 0;
+}
+
+
+void pfq_global_stats_free(void)
+{
+	pfq_profile_free();
+	sparse_area_free(&global_stats_area);
+	sparse_area_free(&memory_stats_area);
+}
+
 
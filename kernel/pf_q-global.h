@@ -42,14 +42,26 @@ extern int cap_len;
 extern int max_len;
 
 extern int batch_len;
+extern int batch_adaptive;
+extern int batch_latency;
 
 extern int vl_untag;
 
 extern int skb_pool_size;
 extern int tx_max_retry;
+extern int tx_sleep_thresh;
+extern int tx_service;
+
+extern int zcopy_frames;
+
+extern int max_sockets;
+extern int max_groups;
 
 extern struct pfq_global_stats global_stats;
 extern struct pfq_memory_stats memory_stats;
 
+extern int  pfq_global_stats_init(void);
+extern void pfq_global_stats_free(void);
+
 
 #endif /* PF_Q_GLOBAL_H */
@@ -27,17 +27,215 @@
 #include <linux/module.h>
 #include <linux/semaphore.h>
 #include <linux/sched.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
 
 #include <pf_q-group.h>
+#include <pf_q-steering.h>
 #include <pf_q-devmap.h>
 #include <pf_q-bitops.h>
 #include <pf_q-engine.h>
+#include <pf_q-global.h>
 
 
 DEFINE_SEMAPHORE(group_sem);
 
 
-static struct pfq_group pfq_groups[Q_MAX_GROUP];
+static struct pfq_group *pfq_groups;
+
+
+/* time-series: a snapshot of the stats and counters of the group every period,
+ * taken in process context (workqueue), away from the Rx softirq */
+
+static void
+pfq_group_timeseries_work(struct work_struct *work)
+{
+	struct pfq_group *g = container_of(to_delayed_work(work), struct pfq_group, timeseries_work);
+	struct pfq_group_timeseries *ts = g->timeseries;
+	struct pfq_group_snapshot *snap;
+	unsigned long period;
+	uint64_t n = ts->head;
+	int i;
+
+	snap = &ts->snap[n % Q_TIMESERIES_SLOTS];
+
+	ACCESS_ONCE(snap->seq) = ~0ULL;
+	smp_wmb();
+
+	snap->tstamp = ktime_to_ns(ktime_get());
+
+	snap->recv = sparse_read(&g->stats.recv);
+	snap->drop = sparse_read(&g->stats.drop);
+	snap->frwd = sparse_read(&g->stats.frwd);
+	snap->kern = sparse_read(&g->stats.kern);
+	snap->disc = sparse_read(&g->stats.disc);
+	snap->abrt = sparse_read(&g->stats.abrt);
+
+	for(i = 0; i < Q_MAX_COUNTERS; i++)
+		snap->counter[i] = sparse_read(&g->context.counter[i]);
+
+	smp_wmb();
+	ACCESS_ONCE(snap->seq) = n + 1;
+	smp_wmb();
+	ACCESS_ONCE(ts->head) = n + 1;
+
+	period = ACCESS_ONCE(g->timeseries_period);
+	if (period)
+		schedule_delayed_work(&g->timeseries_work, period);
+}
+
+
+static void
+pfq_group_timeseries_stop(struct pfq_group *g)
+{
+	ACCESS_ONCE(g->timeseries_period) = 0;
+	cancel_delayed_work_sync(&g->timeseries_work);
+}
+
+
+/* mark every snapshot as unwritten: the ring itself is kept, as it may
+ * still be mapped by a former member of the group */
+
+static void
+pfq_group_timeseries_reset(struct pfq_group *g)
+{
+	struct pfq_group_timeseries *ts = g->timeseries;
+	int i;
+
+	if (!ts)
+		return;
+
+	ACCESS_ONCE(ts->head) = 0;
+	smp_wmb();
+
+	for(i = 0; i < Q_TIMESERIES_SLOTS; i++)
+		ACCESS_ONCE(ts->snap[i].seq) = 0;
+
+	ts->period = 0;
+	smp_wmb();
+}
+
+
+int pfq_groups_init(void)
+{
+	int n;
+
+	pfq_groups = vzalloc(sizeof(struct pfq_group) * max_groups);
+	if (!pfq_groups) {
+		printk(KERN_WARNING "[PFQ] groups: could not allocate %d groups!\n", max_groups);
+		return -ENOMEM;
+	}
+
+	/* stats and counters of the group, in the slots of pfq_group_stats_block */
+
+	for(n = 0; n < max_groups; n++)
+	{
+		struct pfq_group *g = &pfq_groups[n];
+
+		if (sparse_area_alloc(&g->stats_area, sizeof(struct pfq_group_stats_block))) {
+			pfq_groups_free();
+			return -ENOMEM;
+		}
+
+		sparse_area_bind(&g->stats_area, 0, (sparse_counter_t *)&g->stats, SPARSE_COUNTERS(g->stats));
+		sparse_area_bind(&g->stats_area, offsetof(struct pfq_group_stats_block, counter)/sizeof(unsigned long),
+				 g->context.counter, Q_MAX_COUNTERS);
+
+		INIT_DELAYED_WORK(&g->timeseries_work, pfq_group_timeseries_work);
+
+		g->context.percpu = __alloc_percpu(sizeof(struct pfq_persistent_cpu) * Q_MAX_PERSISTENT_CPU,
+						   __alignof__(struct pfq_persistent_cpu));
+		if (!g->context.percpu) {
+			printk(KERN_WARNING "[PFQ] groups: could not allocate the per-cpu persistent state!\n");
+			pfq_groups_free();
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+
+void pfq_groups_free(void)
+{
+	int n;
+
+	if (!pfq_groups)
+		return;
+
+	for(n = 0; n < max_groups; n++)
+	{
+		pfq_group_timeseries_stop(&pfq_groups[n]);
+		vfree(pfq_groups[n].timeseries);
+
+		sparse_area_free(&pfq_groups[n].stats_area);
+		free_percpu(pfq_groups[n].context.percpu);
+	}
+
+	vfree(pfq_groups);
+	pfq_groups = NULL;
+}
+
+
+/* reduce of the per-cpu persistent slots, a word at a time */
+
+static void
+persistent_reduce_sum(void *acc, const void *slot)
+{
+	unsigned long *a = acc; const unsigned long *s = slot; size_t n;
+	for(n = 0; n < Q_PERSISTENT_WORDS; n++)
+		a[n] += s[n];
+}
+
+static void
+persistent_reduce_max(void *acc, const void *slot)
+{
+	unsigned long *a = acc; const unsigned long *s = slot; size_t n;
+	for(n = 0; n < Q_PERSISTENT_WORDS; n++)
+		a[n] = max(a[n], s[n]);
+}
+
+static void
+persistent_reduce_or(void *acc, const void *slot)
+{
+	unsigned long *a = acc; const unsigned long *s = slot; size_t n;
+	for(n = 0; n < Q_PERSISTENT_WORDS; n++)
+		a[n] |= s[n];
+}
+
+
+pfq_persistent_reduce_t
+pfq_persistent_reducer(int op)
+{
+	switch(op)
+	{
+	case Q_PERSISTENT_REDUCE_SUM:	return persistent_reduce_sum;
+	case Q_PERSISTENT_REDUCE_MAX:	return persistent_reduce_max;
+	case Q_PERSISTENT_REDUCE_OR:	return persistent_reduce_or;
+	}
+	return NULL;
+}
+
+
+/* merge the slot index of every cpu into acc (initialized by the caller):
+ * writers are not stopped, each word is read atomically */
+
+void
+__pfq_read_group_persistent(int gid, int index, pfq_persistent_reduce_t reduce, void *acc)
+{
+	struct pfq_group *g = pfq_get_group(gid);
+	int cpu;
+
+	if (!g || index < 0 || index >= Q_MAX_PERSISTENT_CPU)
+		return;
+
+	for_each_possible_cpu(cpu)
+	{
+		reduce(acc, per_cpu_ptr(g->context.percpu, cpu)[index].memory);
+	}
+}
 
 
 bool
@@ -82,9 +280,13 @@ __pfq_group_init(int gid)
 
         for(i = 0; i < Q_CLASS_MAX; i++)
         {
-                atomic_long_set(&g->sock_mask[i], 0);
+                pfq_bitmap_zero(g->sock_mask[i].word, Q_BITMAP_WORDS);
         }
 
+        g->steering = Q_STEERING_FOLD;
+        g->watermark = 0;
+        g->tx_queue  = Q_TX_QUEUE_PACKET;
+
         atomic_long_set(&g->bp_filter,0L);
         atomic_long_set(&g->comp,     0L);
         atomic_long_set(&g->comp_ctx, 0L);
@@ -101,6 +303,11 @@ __pfq_group_init(int gid)
 		spin_lock_init(&g->context.persistent[i].lock);
 		memset(g->context.persistent[i].memory, 0, sizeof(g->context.persistent[i].memory));
 	}
+
+	for_each_possible_cpu(i)
+	{
+		memset(per_cpu_ptr(g->context.percpu, i), 0, sizeof(struct pfq_persistent_cpu) * Q_MAX_PERSISTENT_CPU);
+	}
 }
 
 
@@ -141,6 +348,17 @@ __pfq_group_free(int gid)
         	pfq_free_sk_filter(filter);
 
         g->vlan_filt = false;
+        g->steering  = Q_STEERING_FOLD;
+        g->watermark = 0;
+        g->tx_queue  = Q_TX_QUEUE_PACKET;
+
+        pfq_group_timeseries_stop(g);
+        pfq_group_timeseries_reset(g);
+
+	/* the gid may be reused: drop the steering caches and pins */
+
+	pfq_steering_invalidate();
+
         pr_devel("[PFQ] group %d destroyed.\n", gid);
 }
 
@@ -149,7 +367,6 @@ static int
 __pfq_join_group(int gid, int id, unsigned long class_mask, int policy)
 {
         struct pfq_group * g = pfq_get_group(gid);
-        unsigned long tmp = 0;
         unsigned long bit;
 
         if (!g)
@@ -168,9 +385,7 @@ __pfq_join_group(int gid, int id, unsigned long class_mask, int policy)
         pfq_bitwise_foreach(class_mask, bit,
         {
                  int class = pfq_ctz(bit);
-                 tmp = atomic_long_read(&g->sock_mask[class]);
-                 tmp |= 1L << id;
-                 atomic_long_set(&g->sock_mask[class], tmp);
+                 pfq_bitmap_set(g->sock_mask[class].word, id);
         })
 
 	if (g->owner == -1) {
@@ -189,7 +404,6 @@ static int
 __pfq_leave_group(int gid, int id)
 {
         struct pfq_group * g = pfq_get_group(gid);
-        unsigned long tmp;
         int i;
 
         if (!g)
@@ -200,9 +414,7 @@ __pfq_leave_group(int gid, int id)
 
         for(i = 0; i < Q_CLASS_MAX; ++i)
         {
-                tmp = atomic_long_read(&g->sock_mask[i]);
-                tmp &= ~(1L << id);
-                atomic_long_set(&g->sock_mask[i], tmp);
+                pfq_bitmap_clear(g->sock_mask[i].word, id);
         }
 
         if (__pfq_group_is_empty(gid))
@@ -211,21 +423,21 @@ __pfq_leave_group(int gid, int id)
         return 0;
 }
 
-unsigned long
-__pfq_get_all_groups_mask(int gid)
+void
+__pfq_get_all_groups_mask(int gid, unsigned long *mask)
 {
         struct pfq_group * g = pfq_get_group(gid);
-        unsigned long mask = 0;
         int i;
 
+        pfq_bitmap_zero(mask, pfq_sock_words);
+
         if (!g)
-                return mask;
+                return;
 
         for(i = 0; i < Q_CLASS_MAX; ++i)
         {
-                mask |= atomic_long_read(&g->sock_mask[i]);
+                pfq_bitmap_or(mask, g->sock_mask[i].word, pfq_sock_words);
         }
-        return mask;
 }
 
 
@@ -252,7 +464,7 @@ void __pfq_dismiss_function(void *f)
 {
         int n;
 
-        for(n = 0; n < Q_MAX_GROUP; n++)
+        for(n = 0; n < max_groups; n++)
         {
                 struct pfq_computation_tree *comp = (struct pfq_computation_tree *)atomic_long_read(&pfq_get_group(n)->comp);
 
@@ -318,7 +530,7 @@ pfq_join_free_group(int id, unsigned long class_mask, int policy)
         int n = 0;
 
         down(&group_sem);
-        for(; n < Q_MAX_ID; n++)
+        for(; n < max_groups; n++)
         {
                 if(!pfq_get_group(n)->pid) {
                         __pfq_join_group(n, id, class_mask, policy);
@@ -352,7 +564,7 @@ pfq_leave_all_groups(int id)
 {
         int n = 0;
         down(&group_sem);
-        for(; n < Q_MAX_ID; n++)
+        for(; n < max_groups; n++)
         {
                 __pfq_leave_group(n, id);
         }
@@ -360,27 +572,27 @@ pfq_leave_all_groups(int id)
 }
 
 
-unsigned long
-pfq_get_groups(int id)
+void
+pfq_get_groups(int id, unsigned long *groups)
 {
-        unsigned long ret = 0;
         int n = 0;
+
+        pfq_bitmap_zero(groups, pfq_group_words);
+
         down(&group_sem);
-        for(; n < Q_MAX_ID; n++)
+        for(; n < max_groups; n++)
         {
-                unsigned long mask = __pfq_get_all_groups_mask(n);
-                if(mask & (1L << id))
-                        ret |= (1UL << n);
+                if (__pfq_has_joined_group(n, id))
+                        pfq_bitmap_set(groups, n);
         }
         up(&group_sem);
-        return ret;
 }
 
 
 struct pfq_group *
 pfq_get_group(int gid)
 {
-        if (gid < 0 || gid >= Q_MAX_GROUP) {
+        if (gid < 0 || gid >= max_groups) {
                 pr_devel("[PFQ] get_group error: invalid group id %d!\n", gid);
                 return NULL;
 	}
@@ -434,10 +646,111 @@ void __pfq_set_group_vlan_filter(int gid, bool value, int vid)
 }
 
 
+bool __pfq_set_group_steering(int gid, int mode)
+{
+        struct pfq_group *g = pfq_get_group(gid);
+        if (!g)
+                return false;
+
+        /* per-cpu caches notice the new mode at the next packet */
+
+        ACCESS_ONCE(g->steering) = mode;
+        return true;
+}
+
+
+bool __pfq_set_group_watermark(int gid, int watermark)
+{
+        struct pfq_group *g = pfq_get_group(gid);
+        if (!g)
+                return false;
+
+        ACCESS_ONCE(g->watermark) = watermark;
+        return true;
+}
+
+
+int pfq_set_group_timeseries(int gid, unsigned int period)
+{
+        struct pfq_group *g = pfq_get_group(gid);
+        int ret = 0;
+
+        if (!g)
+                return -EINVAL;
+
+        down(&group_sem);
+
+        pfq_group_timeseries_stop(g);
+
+        if (period == 0)
+                goto out;
+
+        /* the ring outlives the time-series: user space may still map it */
+
+        if (!g->timeseries) {
+                g->timeseries = vmalloc_user(PAGE_ALIGN(sizeof(struct pfq_group_timeseries)));
+                if (!g->timeseries) {
+                        ret = -ENOMEM;
+                        goto out;
+                }
+                g->timeseries->slots = Q_TIMESERIES_SLOTS;
+        }
+
+        g->timeseries->period = period;
+        g->timeseries_period  = max_t(unsigned long, 1, msecs_to_jiffies(period));
+
+        schedule_delayed_work(&g->timeseries_work, 0);
+out:
+        up(&group_sem);
+        return ret;
+}
+
+
+int pfq_group_timeseries_mmap(int gid, struct vm_area_struct *vma)
+{
+        struct pfq_group *g = pfq_get_group(gid);
+        struct pfq_group_timeseries *ts = g ? ACCESS_ONCE(g->timeseries) : NULL;
+
+        if (!ts) {
+        	printk(KERN_WARNING "[PFQ] time-series mmap: not enabled (gid=%d)!\n", gid);
+        	return -EPERM;
+        }
+
+	if (vma->vm_flags & VM_WRITE) {
+		printk(KERN_WARNING "[PFQ] time-series mmap: the area is read-only!\n");
+		return -EPERM;
+	}
+
+        if (vma->vm_end - vma->vm_start > PAGE_ALIGN(sizeof(struct pfq_group_timeseries))) {
+		printk(KERN_WARNING "[PFQ] time-series mmap: area too large!\n");
+		return -EINVAL;
+        }
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	if (remap_vmalloc_range(vma, ts, 0) != 0) {
+		printk(KERN_WARNING "[PFQ] time-series mmap: remap_vmalloc_range error.\n");
+		return -EAGAIN;
+	}
+
+	return 0;
+}
+
+
+bool __pfq_set_group_tx_queue(int gid, int policy)
+{
+        struct pfq_group *g = pfq_get_group(gid);
+        if (!g)
+                return false;
+
+        ACCESS_ONCE(g->tx_queue) = policy;
+        return true;
+}
+
 
 int pfq_check_group(int id, int gid, const char *msg)
 {
-        if (gid < 0 || gid >= Q_MAX_GROUP) {
+        if (gid < 0 || gid >= max_groups) {
                 printk(KERN_INFO "[PFQ|%d] %s error: invalid group (gid=%d)!\n", id, msg, gid);
                 return -EINVAL;
         }
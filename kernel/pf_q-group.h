@@ -29,9 +29,13 @@
 #include <linux/pf_q.h>
 #include <linux/filter.h>
 #include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
+#include <linux/mm_types.h>
 #include <linux/semaphore.h>
 
 #include <pf_q-macro.h>
+#include <pf_q-bitmap.h>
 #include <pf_q-sparse.h>
 #include <pf_q-stats.h>
 #include <pf_q-bpf.h>
@@ -39,26 +43,53 @@
 
 /* persistent state */
 
+#define Q_PERSISTENT_WORDS	(Q_PERSISTENT_MEM / sizeof(long))
+
+struct pfq_persistent_cpu
+{
+	char 		memory[Q_PERSISTENT_MEM];
+
+} ____cacheline_aligned;
+
+
 struct pfq_group_persistent
 {
         sparse_counter_t counter[Q_MAX_COUNTERS];
 
+	/* shared slots: locked with get/put_persistent, or updated a word at a time */
+
 	struct _persistent {
 
 		spinlock_t 	lock;
-		char 		memory[Q_PERSISTENT_MEM];
+		union {
+			char 		memory[Q_PERSISTENT_MEM];
+			atomic_long_t	word[Q_PERSISTENT_WORDS];
+		};
 
 	} persistent [Q_MAX_PERSISTENT];
+
+	/* per-cpu slots: lock-free, reduced on read */
+
+	struct pfq_persistent_cpu __percpu *percpu;	/* Q_MAX_PERSISTENT_CPU slots */
 };
 
 
+/* merge of a per-cpu slot into the accumulator */
+
+typedef void (*pfq_persistent_reduce_t)(void *acc, const void *slot);
+
+
 struct pfq_group
 {
         int policy;                                     /* policy for the group */
         int pid;	                                /* process id for restricted/private group */
 	int owner;					/* id of the owner */
 
-        atomic_long_t sock_mask[Q_CLASS_MAX];           /* for class: Q_CLASS_DEFAULT, Q_CLASS_USER_PLANE, Q_CLASS_CONTROL_PLANE etc... */
+        pfq_bitmap_t  sock_mask[Q_CLASS_MAX];           /* for class: Q_CLASS_DEFAULT, Q_CLASS_USER_PLANE, Q_CLASS_CONTROL_PLANE etc... */
+
+        int steering;                                   /* steering mode: Q_STEERING_FOLD, Q_STEERING_MAGLEV */
+        int watermark;                                  /* load-aware steering: Rx watermark in percent (0 = off) */
+        int tx_queue;                                   /* Tx queue policy of lazy forwarding: Q_TX_QUEUE_xxx */
 
         atomic_long_t bp_filter; 			/* struct sk_filter pointer */
 
@@ -69,6 +100,11 @@ struct pfq_group
         atomic_long_t comp_ctx;                         /* void *: storage context (new functional program) */
 
 	struct pfq_group_stats stats;
+	struct sparse_area stats_area;			/* per-cpu blocks of stats and counters (mmap-able) */
+
+	struct pfq_group_timeseries *timeseries;	/* ring of snapshots (mmap-able), allocated on first use */
+	struct delayed_work timeseries_work;
+	unsigned long timeseries_period;		/* jiffies, 0 = stopped */
 
         struct pfq_group_persistent context;
 };
@@ -78,6 +114,9 @@ extern struct semaphore group_sem;
 
 struct pfq_computation_tree;
 
+extern int  pfq_groups_init(void);
+extern void pfq_groups_free(void);
+
 extern int  pfq_join_free_group(int id, unsigned long class_mask, int policy);
 extern int  pfq_join_group(int gid, int id, unsigned long class_mask, int policy);
 extern int  pfq_leave_group(int gid, int id);
@@ -87,12 +126,15 @@ extern int  pfq_set_group_prog(int gid, struct pfq_computation_tree *prog, void
 extern int pfq_check_group(int id, int gid, const char *msg);
 extern int pfq_check_group_access(int id, int gid, const char *msg);
 
-extern unsigned long pfq_get_groups(int id);
-extern unsigned long __pfq_get_all_groups_mask(int gid);
+extern void pfq_get_groups(int id, unsigned long *groups);
+extern void __pfq_get_all_groups_mask(int gid, unsigned long *mask);
 
 extern bool __pfq_group_access(int gid, int id, int policy, bool join);
 
 extern int  __pfq_get_group_context(int gid, int level, int size, void __user *context);
+
+extern pfq_persistent_reduce_t pfq_persistent_reducer(int op);
+extern void __pfq_read_group_persistent(int gid, int index, pfq_persistent_reduce_t reduce, void *acc);
 extern void __pfq_set_group_filter(int gid, struct sk_filter *filter);
 
 extern void __pfq_dismiss_function(void *f);
@@ -104,16 +146,27 @@ extern bool __pfq_check_group_vlan_filter(int gid, int vid);
 extern bool __pfq_toggle_group_vlan_filters(int gid, bool value);
 extern void __pfq_set_group_vlan_filter(int gid, bool value, int vid);
 
+extern bool __pfq_set_group_steering(int gid, int mode);
+extern bool __pfq_set_group_watermark(int gid, int watermark);
+extern bool __pfq_set_group_tx_queue(int gid, int policy);
+
+extern int  pfq_set_group_timeseries(int gid, unsigned int period);
+extern int  pfq_group_timeseries_mmap(int gid, struct vm_area_struct *vma);
+
 static inline
 bool __pfq_group_is_empty(int gid)
 {
-        return __pfq_get_all_groups_mask(gid) == 0;
+	pfq_bitmap_t mask;
+	__pfq_get_all_groups_mask(gid, mask.word);
+        return pfq_bitmap_empty(mask.word, pfq_sock_words);
 }
 
 static inline
 bool __pfq_has_joined_group(int gid, int id)
 {
-        return __pfq_get_all_groups_mask(gid) & (1L << id);
+	pfq_bitmap_t mask;
+	__pfq_get_all_groups_mask(gid, mask.word);
+        return pfq_bitmap_test(mask.word, id);
 }
 
 
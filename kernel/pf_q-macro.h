@@ -24,19 +24,22 @@
 #ifndef PF_Q_MACRO_H
 #define PF_Q_MACRO_H
 
-#define Q_MAX_ID                (sizeof(long)<<3)
-#define Q_MAX_GROUP             (sizeof(long)<<3)
+#define Q_MAX_ID                512	/* ceiling: see max_sockets */
+#define Q_MAX_GROUP             512	/* ceiling: see max_groups  */
+
+#define Q_DEF_MAX_ID            64
+#define Q_DEF_MAX_GROUP         64
+
 #define Q_SKBUFF_SHORT_BATCH	(sizeof(long)<<3)
 #define Q_SKBUFF_LONG_BATCH	128
 
+#define Q_BATCH_HIST_SIZE	7	/* log2 buckets of the Rx batch length (up to Q_SKBUFF_SHORT_BATCH) */
+#define Q_TX_DELAY_HIST_SIZE	12	/* log2 buckets (usec) of the Tx timing error */
+
 #define Q_GC_LOG_QUEUE_LEN	16
 #define Q_GC_POOL_QUEUE_LEN 	Q_SKBUFF_LONG_BATCH
 
-#define Q_MAX_DEVICE           	256
-#define Q_MAX_DEVICE_MASK       (Q_MAX_DEVICE-1)
-
-#define Q_MAX_HW_QUEUE          256
-#define Q_MAX_HW_QUEUE_MASK     (Q_MAX_HW_QUEUE-1)
+#define Q_MAX_HW_QUEUE          256	/* Rx queue index of a binding */
 
 #define Q_GRACE_PERIOD 		100 /* msec */
 
@@ -46,13 +49,15 @@
 #define Q_SLOT_ALIGN(s, n)      ((s+(n-1)) & ~(n-1))
 
 #define Q_FUN_SYMB_LEN          256
-#define Q_PERSISTENT_MEM 	64
-
-
-#define Q_MAX_CPU               256
-#define Q_MAX_CPU_MASK          (Q_MAX_CPU-1)
-
 #define Q_MAX_PERSISTENT 	1024
 #define Q_POOL_MAX_SIZE         16384
 
+#define Q_ZCOPY_MAX_SCAN        16	/* frames scanned per allocation */
+#define Q_TX_ZCOPY_HEAD         128	/* bytes copied into the linear part of a zero-copy Tx skb */
+#define Q_TX_SHAPER_SHIFT	10	/* fixed point of the Tx token bucket costs */
+
+#define Q_TX_SERVICE_QUANTUM	64	/* packets per round and unit of weight */
+#define Q_TX_SERVICE_SPIN	64	/* idle rounds spent spinning before sleeping */
+#define Q_TX_SERVICE_SLEEP	10	/* msec, longest sleep of an idle service thread */
+
 #endif /* PF_Q_MACRO_H */
@@ -25,10 +25,19 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/skbuff.h>
+#include <linux/slab.h>
+#include <linux/topology.h>
 
 #include <pf_q-memory.h>
 #include <pf_q-global.h>
 
+
+/* size classes of the recycler, in bytes of skb data (set at init, after max_len) */
+
+unsigned int pfq_skb_class_size[Q_SKB_POOL_CLASSES];
+
+static struct pfq_skb_depot *skb_depot;		/* per NUMA node */
+
 struct pfq_skb_pool_stat
 pfq_get_skb_pool_stats(void)
 {
@@ -44,6 +53,338 @@ pfq_get_skb_pool_stats(void)
 }
 
 
+static struct pfq_skb_magazine *
+skb_magazine_alloc(int node, gfp_t gfp)
+{
+	return kzalloc_node(sizeof(struct pfq_skb_magazine), gfp, node);
+}
+
+
+static size_t
+skb_magazine_purge(struct pfq_skb_magazine *mag)
+{
+	size_t n = mag->count;
+
+	while (mag->count)
+		kfree_skb(mag->skbs[--mag->count]);
+	return n;
+}
+
+
+/* depot: take a full magazine of the class (NULL if none) */
+
+static struct pfq_skb_magazine *
+skb_depot_get_full(struct pfq_skb_depot *d, int class)
+{
+	struct pfq_skb_magazine *mag = NULL;
+
+	spin_lock(&d->lock);
+	if (d->nfull[class])
+		mag = d->full[class][--d->nfull[class]];
+	spin_unlock(&d->lock);
+	return mag;
+}
+
+
+/* depot: store a full magazine and return an empty one; when the depot
+ * is full, the skbs of the magazine go back to the OS */
+
+static struct pfq_skb_magazine *
+skb_depot_exchange(struct pfq_skb_depot *d, int class, struct pfq_skb_magazine *mag, int node)
+{
+	spin_lock(&d->lock);
+	if (d->nfull[class] < d->capacity) {
+		struct pfq_skb_magazine *empty = d->nempty ? d->empty[--d->nempty]
+							   : skb_magazine_alloc(node, GFP_ATOMIC);
+		if (empty) {
+			d->full[class][d->nfull[class]++] = mag;
+			mag = empty;
+		}
+	}
+	spin_unlock(&d->lock);
+
+	skb_magazine_purge(mag);
+	return mag;
+}
+
+
+static void
+skb_depot_put_empty(struct pfq_skb_depot *d, struct pfq_skb_magazine *mag)
+{
+	spin_lock(&d->lock);
+	if (d->nempty < d->capacity * Q_SKB_POOL_CLASSES) {
+		d->empty[d->nempty++] = mag;
+		mag = NULL;
+	}
+	spin_unlock(&d->lock);
+	kfree(mag);
+}
+
+
+/* slow path of the recycler (bottom halves disabled) */
+
+struct sk_buff *
+__pfq_skb_pool_get(struct pfq_skb_pool *pool, int class)
+{
+	struct pfq_skb_magazine *full;
+
+	if (!pool->loaded[class])
+		return NULL;
+
+	/* the previous magazine holds skbs */
+
+	if (pool->prev[class]->count) {
+		swap(pool->loaded[class], pool->prev[class]);
+		return pool->loaded[class]->skbs[--pool->loaded[class]->count];
+	}
+
+	/* both empty: a full magazine from the depot of the node */
+
+	full = skb_depot_get_full(&skb_depot[pool->node], class);
+	if (!full)
+		return NULL;
+
+	skb_depot_put_empty(&skb_depot[pool->node], pool->prev[class]);
+
+	pool->prev[class]   = pool->loaded[class];
+	pool->loaded[class] = full;
+
+	return full->skbs[--full->count];
+}
+
+
+void
+__pfq_skb_pool_put(struct pfq_skb_pool *pool, struct sk_buff *skb, int class, int node)
+{
+	struct pfq_skb_magazine *mag;
+
+	if (!pool->loaded[class] || node < 0 || node >= nr_node_ids) {
+		kfree_skb(skb);
+		return;
+	}
+
+	/* skb of another node: back to its depot, a magazine at a time */
+
+	if (node != pool->node) {
+
+		size_t idx = node * Q_SKB_POOL_CLASSES + class;
+
+		mag = pool->remote[idx];
+		if (!mag) {
+			kfree_skb(skb);
+			return;
+		}
+
+		mag->skbs[mag->count++] = skb;
+		pool->remote_free++;
+
+		if (mag->count == Q_SKB_MAGAZINE_SIZE)
+			pool->remote[idx] = skb_depot_exchange(&skb_depot[node], class, mag, node);
+		return;
+	}
+
+	/* the loaded magazine is full */
+
+	if (pool->prev[class]->count < Q_SKB_MAGAZINE_SIZE)
+		swap(pool->loaded[class], pool->prev[class]);
+	else {
+		mag = pool->prev[class];
+		pool->prev[class]   = pool->loaded[class];
+		pool->loaded[class] = skb_depot_exchange(&skb_depot[pool->node], class, mag, pool->node);
+	}
+
+	mag = pool->loaded[class];
+	mag->skbs[mag->count++] = skb;
+}
+
+
+int
+pfq_skb_pool_init(void)
+{
+	size_t capacity;
+	int node, cpu, c;
+
+	for(c = 0; c < Q_SKB_POOL_CLASSES; c++)
+		pfq_skb_class_size[c] = SKB_DATA_ALIGN((max_len >> (Q_SKB_POOL_CLASSES - 1 - c)) + NET_IP_ALIGN + 2 * NET_SKB_PAD);
+
+	if (skb_pool_size <= 0)
+		return 0;
+
+	skb_depot = kcalloc(nr_node_ids, sizeof(struct pfq_skb_depot), GFP_KERNEL);
+	if (!skb_depot)
+		return -ENOMEM;
+
+	/* each depot holds up to skb_pool_size skbs per class for each cpu of the node */
+
+	capacity = DIV_ROUND_UP(skb_pool_size, Q_SKB_MAGAZINE_SIZE);
+
+	for(node = 0; node < nr_node_ids; node++)
+	{
+		struct pfq_skb_depot *d = &skb_depot[node];
+
+		spin_lock_init(&d->lock);
+		d->capacity = capacity * max_t(unsigned int, 1, nr_cpus_node(node));
+
+		for(c = 0; c < Q_SKB_POOL_CLASSES; c++) {
+			d->full[c] = kcalloc(d->capacity, sizeof(struct pfq_skb_magazine *), GFP_KERNEL);
+			if (!d->full[c])
+				return -ENOMEM;
+		}
+
+		d->empty = kcalloc(d->capacity * Q_SKB_POOL_CLASSES, sizeof(struct pfq_skb_magazine *), GFP_KERNEL);
+		if (!d->empty)
+			return -ENOMEM;
+	}
+
+	for_each_online_cpu(cpu)
+	{
+		struct pfq_skb_pool *pool = &per_cpu_ptr(cpu_data, cpu)->skb_pool;
+
+		pool->node = cpu_to_node(cpu);
+
+		pool->remote = kcalloc(nr_node_ids * Q_SKB_POOL_CLASSES, sizeof(struct pfq_skb_magazine *), GFP_KERNEL);
+		if (!pool->remote)
+			return -ENOMEM;
+
+		for(c = 0; c < Q_SKB_POOL_CLASSES; c++)
+		{
+			pool->loaded[c] = skb_magazine_alloc(pool->node, GFP_KERNEL);
+			pool->prev[c]   = skb_magazine_alloc(pool->node, GFP_KERNEL);
+			if (!pool->loaded[c] || !pool->prev[c])
+				return -ENOMEM;
+
+			for_each_online_node(node)
+			{
+				if (node == pool->node)
+					continue;
+
+				pool->remote[node * Q_SKB_POOL_CLASSES + c] = skb_magazine_alloc(node, GFP_KERNEL);
+				if (!pool->remote[node * Q_SKB_POOL_CLASSES + c])
+					return -ENOMEM;
+			}
+		}
+	}
+
+	printk(KERN_INFO "[PFQ] skb pool: %d node(s), classes %u/%u/%u bytes, %zu magazines per depot.\n",
+	       nr_node_ids, pfq_skb_class_size[0], pfq_skb_class_size[1], pfq_skb_class_size[2], capacity);
+	return 0;
+}
+
+
+size_t
+pfq_skb_pool_purge(void)
+{
+	size_t total = 0, n;
+	int node, cpu, c;
+
+	for_each_online_cpu(cpu)
+	{
+		struct pfq_skb_pool *pool = &per_cpu_ptr(cpu_data, cpu)->skb_pool;
+
+		for(c = 0; c < Q_SKB_POOL_CLASSES; c++)
+		{
+			if (pool->loaded[c])
+				total += skb_magazine_purge(pool->loaded[c]);
+			if (pool->prev[c])
+				total += skb_magazine_purge(pool->prev[c]);
+
+			kfree(pool->loaded[c]);
+			kfree(pool->prev[c]);
+			pool->loaded[c] = NULL;
+			pool->prev[c] = NULL;
+		}
+
+		if (pool->remote) {
+			for(n = 0; n < nr_node_ids * Q_SKB_POOL_CLASSES; n++)
+			{
+				if (pool->remote[n]) {
+					total += skb_magazine_purge(pool->remote[n]);
+					kfree(pool->remote[n]);
+				}
+			}
+			kfree(pool->remote);
+			pool->remote = NULL;
+		}
+	}
+
+	if (!skb_depot)
+		return total;
+
+	for(node = 0; node < nr_node_ids; node++)
+	{
+		struct pfq_skb_depot *d = &skb_depot[node];
+
+		for(c = 0; c < Q_SKB_POOL_CLASSES; c++)
+		{
+			for(n = 0; d->full[c] && n < d->nfull[c]; n++)
+			{
+				total += skb_magazine_purge(d->full[c][n]);
+				kfree(d->full[c][n]);
+			}
+			kfree(d->full[c]);
+		}
+
+		for(n = 0; d->empty && n < d->nempty; n++)
+			kfree(d->empty[n]);
+		kfree(d->empty);
+	}
+
+	kfree(skb_depot);
+	skb_depot = NULL;
+	return total;
+}
+
+
+void
+pfq_skb_pool_enable(bool value)
+{
+        int cpu;
+
+        printk(KERN_INFO "[PFQ] %s skb memory pool...\n", value ? "enabling" : "disabling");
+
+        smp_wmb();
+        for_each_online_cpu(cpu)
+        {
+                struct local_data *this_cpu = per_cpu_ptr(cpu_data, cpu);
+                atomic_set(&this_cpu->enable_skb_pool, value);
+        }
+        smp_wmb();
+}
+
+
+struct pfq_skb_pool_node_stat
+pfq_get_skb_pool_node_stats(int node)
+{
+	struct pfq_skb_pool_node_stat ret = { 0, 0, 0, 0 };
+	int cpu, c;
+	size_t n;
+
+	for_each_online_cpu(cpu)
+	{
+		struct pfq_skb_pool *pool = &per_cpu_ptr(cpu_data, cpu)->skb_pool;
+
+		if (cpu_to_node(cpu) != node)
+			continue;
+
+		ret.hit  += ACCESS_ONCE(pool->hit);
+		ret.miss += ACCESS_ONCE(pool->miss);
+		ret.remote_free += ACCESS_ONCE(pool->remote_free);
+	}
+
+	if (skb_depot && node < nr_node_ids) {
+		struct pfq_skb_depot *d = &skb_depot[node];
+
+		spin_lock_bh(&d->lock);
+		for(c = 0; c < Q_SKB_POOL_CLASSES; c++)
+			for(n = 0; n < d->nfull[c]; n++)
+				ret.cached += d->full[c][n]->count;
+		spin_unlock_bh(&d->lock);
+	}
+
+	return ret;
+}
+
+
 /* exported symbols */
 
 struct sk_buff *
@@ -53,7 +394,7 @@ __pfq_alloc_skb(unsigned int size, gfp_t priority, int fclone, int node)
         struct local_data *this_cpu = this_cpu_ptr(cpu_data);
 
         if (atomic_read(&this_cpu->enable_skb_pool))
-                return ____pfq_alloc_skb_pool(size, priority, fclone, node, &this_cpu->rx_pool);
+                return ____pfq_alloc_skb_pool(size, priority, fclone, node);
 #endif
         return __alloc_skb(size, priority, fclone, node);
 }
@@ -62,7 +403,15 @@ __pfq_alloc_skb(unsigned int size, gfp_t priority, int fclone, int node)
 struct sk_buff *
 pfq_dev_alloc_skb(unsigned int length)
 {
-        struct sk_buff *skb = pfq_alloc_skb(length + NET_SKB_PAD, GFP_ATOMIC);
+        struct sk_buff *skb;
+
+        if (atomic_read(&pfq_zcopy_pool.users)) {
+        	skb = pfq_zcopy_alloc_skb(length);
+        	if (skb)
+        		return skb;
+	}
+
+        skb = pfq_alloc_skb(length + NET_SKB_PAD, GFP_ATOMIC);
         if (likely(skb))
                 skb_reserve(skb, NET_SKB_PAD);
         return skb;
@@ -72,7 +421,19 @@ pfq_dev_alloc_skb(unsigned int length)
 struct sk_buff *
 __pfq_netdev_alloc_skb(struct net_device *dev, unsigned int length, gfp_t gfp)
 {
-        struct sk_buff *skb = __pfq_alloc_skb(length + NET_SKB_PAD, gfp, 0, NUMA_NO_NODE);
+        struct sk_buff *skb;
+
+        /* zero-copy Rx: place the packet in a frame mapped to user-space */
+
+        if (atomic_read(&pfq_zcopy_pool.users)) {
+        	skb = pfq_zcopy_alloc_skb(length);
+        	if (skb) {
+        		skb->dev = dev;
+        		return skb;
+		}
+	}
+
+        skb = __pfq_alloc_skb(length + NET_SKB_PAD, gfp, 0, NUMA_NO_NODE);
         if (likely(skb)) {
                 skb_reserve(skb, NET_SKB_PAD);
                 skb->dev = dev;
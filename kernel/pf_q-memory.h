@@ -28,6 +28,7 @@
 #include <linux/version.h>
 #include <linux/skbuff.h>
 #include <linux/hardirq.h>
+#include <linux/mm.h>
 #include <net/dst.h>
 
 #include <pf_q-skbuff-pool.h>
@@ -35,6 +36,7 @@
 #include <pf_q-percpu.h>
 #include <pf_q-sparse.h>
 #include <pf_q-global.h>
+#include <pf_q-zcopy.h>
 
 extern int skb_pool_size;
 extern struct local_data __percpu * cpu_data;
@@ -196,25 +198,40 @@ struct sk_buff * pfq_netdev_alloc_skb_ip_align(struct net_device *dev, unsigned
 
 
 static inline
-struct sk_buff * ____pfq_alloc_skb_pool(unsigned int size, gfp_t priority, int fclone, int node, struct pfq_sk_buff_pool *pool)
+struct sk_buff * ____pfq_alloc_skb_pool(unsigned int size, gfp_t priority, int fclone, int node)
 {
-
 #ifdef PFQ_USE_SKB_POOL
-        struct sk_buff *skb = pfq_sk_buff_pool_get(pool);
-        if (skb != NULL) {
-        	if (pfq_skb_is_recycleable(skb, size)) {
+	int class = fclone ? -1 : pfq_skb_alloc_class(size);
+
+	if (class >= 0 && !in_irq() && !irqs_disabled()) {
+
+		struct pfq_skb_pool *pool;
+		struct sk_buff *skb;
+
+		local_bh_disable();
+
+		pool = &this_cpu_ptr(cpu_data)->skb_pool;
+		skb = pfq_skb_pool_get(pool, class);
+		if (skb) {
+			if (pfq_skb_is_recycleable(skb, size)) {
+				pool->hit++;
+				local_bh_enable();
 #ifdef PFQ_USE_EXTENDED_PROC
-                	sparse_inc(&memory_stats.pool_alloc);
+                		sparse_inc(&memory_stats.pool_alloc);
 #endif
-			return pfq_skb_recycle(skb);
-                } else
-                	kfree_skb(skb);
-        }
+				return pfq_skb_recycle(skb);
+			}
+
+			/* still referenced (e.g. by a driver) */
+			kfree_skb(skb);
+		}
+
+		pool->miss++;
+		local_bh_enable();
 #ifdef PFQ_USE_EXTENDED_PROC
-	else {
 		sparse_inc(&memory_stats.pool_fail);
-	}
 #endif
+	}
 #endif
 
 #ifdef PFQ_USE_EXTENDED_PROC
@@ -225,65 +242,35 @@ struct sk_buff * ____pfq_alloc_skb_pool(unsigned int size, gfp_t priority, int f
 
 
 static inline
-void pfq_kfree_skb_pool(struct sk_buff *skb, struct pfq_sk_buff_pool *pool)
+void pfq_kfree_skb_pool(struct sk_buff *skb)
 {
 #ifdef PFQ_USE_SKB_POOL
-	pfq_sk_buff_pool_put(pool, skb);
-#else
-	kfree_skb(skb);
-#endif
-}
-
-
-static inline
-int pfq_skb_pool_init(void)
-{
-        int cpu;
-        for_each_online_cpu(cpu)
-        {
-                struct local_data *this_cpu = per_cpu_ptr(cpu_data, cpu);
+	int class;
 
-                if (pfq_sk_buff_pool_init(&this_cpu->tx_pool, skb_pool_size) != 0)
-                	return -ENOMEM;
-
-                if (pfq_sk_buff_pool_init(&this_cpu->rx_pool, skb_pool_size) != 0)
-                	return -ENOMEM;
-        }
-
-        return 0;
-}
-
-
-static inline
-void pfq_skb_pool_enable(bool value)
-{
-        int cpu;
-
-        printk(KERN_INFO "[PFQ] %s skb memory pool...\n", value ? "enabling" : "disabling");
-
-        smp_wmb();
-        for_each_online_cpu(cpu)
-        {
-                struct local_data *this_cpu = per_cpu_ptr(cpu_data, cpu);
-                atomic_set(&this_cpu->enable_skb_pool, value);
-        }
-        smp_wmb();
-}
+	/* zero-copy frames go back to their own pool, zero-copy Tx skbs
+	 * release the pages of the Tx queue */
 
+	if (pfq_zcopy_frame(skb) >= 0 || skb_is_nonlinear(skb) ||
+	    skb->fclone != SKB_FCLONE_UNAVAILABLE || in_irq() || irqs_disabled()) {
+		kfree_skb(skb);
+		return;
+	}
 
-static inline
-int pfq_skb_pool_purge(void)
-{
-        int cpu, total = 0;
-        for_each_online_cpu(cpu)
-        {
-                struct local_data *local = per_cpu_ptr(cpu_data, cpu);
+	class = pfq_skb_free_class(pfq_skb_end_offset(skb));
+	if (class < 0) {
+		kfree_skb(skb);
+		return;
+	}
 
-                total += pfq_sk_buff_pool_free(&local->rx_pool);
-                total += pfq_sk_buff_pool_free(&local->tx_pool);
-        }
+	/* the skb goes back to the node of its memory */
 
-        return total;
+	local_bh_disable();
+	pfq_skb_pool_put(&this_cpu_ptr(cpu_data)->skb_pool, skb, class,
+			 page_to_nid(virt_to_head_page(skb->head)));
+	local_bh_enable();
+#else
+	kfree_skb(skb);
+#endif
 }
 
 
@@ -294,7 +281,7 @@ struct sk_buff * pfq_alloc_skb(unsigned int size, gfp_t priority)
         struct local_data *this_cpu = this_cpu_ptr(cpu_data);
 
         if (atomic_read(&this_cpu->enable_skb_pool))
-                return ____pfq_alloc_skb_pool(size, priority, 0, NUMA_NO_NODE, &this_cpu->rx_pool);
+                return ____pfq_alloc_skb_pool(size, priority, 0, NUMA_NO_NODE);
 
 #ifdef PFQ_USE_EXTENDED_PROC
         sparse_inc(&memory_stats.os_alloc);
@@ -311,7 +298,7 @@ struct sk_buff * pfq_tx_alloc_skb(unsigned int size, gfp_t priority, int node)
         struct local_data *this_cpu = this_cpu_ptr(cpu_data);
 
         if (atomic_read(&this_cpu->enable_skb_pool))
-                return ____pfq_alloc_skb_pool(size, priority, 0, node, &this_cpu->tx_pool);
+                return ____pfq_alloc_skb_pool(size, priority, 0, node);
 
 #ifdef PFQ_USE_EXTENDED_PROC
         sparse_inc(&memory_stats.os_alloc);
@@ -219,7 +219,7 @@ __get_persistent(SkBuff b, int n)
 	return ctx->persistent[n].memory;
 }
 
-#define get_persistent(type, b, n) __builtin_choose_expr(sizeof(type) <= 64, __get_persistent(b, n) , (void)0)
+#define get_persistent(type, b, n) __builtin_choose_expr(sizeof(type) <= Q_PERSISTENT_MEM, __get_persistent(b, n) , (void)0)
 
 static inline
 void put_persistent(SkBuff b, int n)
@@ -228,4 +228,52 @@ void put_persistent(SkBuff b, int n)
 	spin_unlock(&ctx->persistent[n].lock);
 }
 
+
+/* shared persistent state, lock-free: atomic operations on the word w of the slot n */
+
+static inline atomic_long_t *
+__persistent_word(SkBuff b, int n, int w)
+{
+	return &PFQ_CB(b.skb)->monad->group->context.persistent[n].word[w];
+}
+
+static inline
+long persistent_add(SkBuff b, int n, int w, long value)
+{
+	return atomic_long_add_return(value, __persistent_word(b, n, w));
+}
+
+static inline
+long persistent_max(SkBuff b, int n, int w, long value)
+{
+	atomic_long_t *word = __persistent_word(b, n, w);
+	long cur = atomic_long_read(word), old;
+
+	while (cur < value) {
+		old = atomic_long_cmpxchg(word, cur, value);
+		if (old == cur)
+			return value;
+		cur = old;
+	}
+	return cur;
+}
+
+static inline
+bool persistent_cas(SkBuff b, int n, int w, long old, long value)
+{
+	return atomic_long_cmpxchg(__persistent_word(b, n, w), old, value) == old;
+}
+
+
+/* per-cpu persistent state: the slot n (< Q_MAX_PERSISTENT_CPU) of this cpu, no lock
+ * is required; readers merge the slots of all the cpus (Q_SO_GET_GROUP_PERSISTENT) */
+
+static inline void *
+__get_persistent_cpu(SkBuff b, int n)
+{
+	return this_cpu_ptr(PFQ_CB(b.skb)->monad->group->context.percpu)[n].memory;
+}
+
+#define get_persistent_cpu(type, b, n) __builtin_choose_expr(sizeof(type) <= Q_PERSISTENT_MEM, __get_persistent_cpu(b, n) , (void)0)
+
 #endif /* PF_Q_MONAD_H */
@@ -23,6 +23,7 @@
 
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/slab.h>
 #include <linux/cpumask.h>
 #include <linux/timer.h>
 #include <linux/pf_q.h>
@@ -34,6 +35,8 @@
 
 
 extern void pfq_timer (unsigned long);
+extern void pfq_flush_tasklet (unsigned long);
+extern enum hrtimer_restart pfq_flush_timer (struct hrtimer *);
 
 int pfq_percpu_init(void)
 {
@@ -47,6 +50,20 @@ int pfq_percpu_init(void)
 		return -ENOMEM;
         }
 
+	/* steering caches (too large for the per-cpu area) */
+
+	for_each_possible_cpu(cpu) {
+
+                struct local_data *local = per_cpu_ptr(cpu_data, cpu);
+
+		local->steering = pfq_steering_alloc(cpu);
+		if (!local->steering) {
+			printk(KERN_WARNING "[PFQ] steering cache: out of memory!\n");
+			pfq_percpu_free();
+			return -ENOMEM;
+		}
+	}
+
         for_each_online_cpu(cpu) {
 
                 struct local_data *local = per_cpu_ptr(cpu_data, cpu);
@@ -59,6 +76,16 @@ int pfq_percpu_init(void)
 
 		add_timer_on(&local->timer, cpu);
 
+		/* adaptive batching */
+
+		local->batch_target = 1;
+		local->batch_start  = ktime_set(0, 0);
+
+		hrtimer_init(&local->flush_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+		local->flush_timer.function = pfq_flush_timer;
+
+		tasklet_init(&local->flush_tasklet, pfq_flush_tasklet, (unsigned long)cpu);
+
 		gc_data_init(&local->gc);
 	}
 
@@ -79,6 +106,9 @@ int pfq_percpu_flush(void)
 	        struct sk_buff *skb;
 		int n = 0;
 
+		hrtimer_cancel(&local->flush_timer);
+		tasklet_kill(&local->flush_tasklet);
+
 		for_each_skbuff(SKBUFF_BATCH_ADDR(local->gc.pool), skb, n)
 		{
                  	kfree_skb(skb);
@@ -96,3 +126,19 @@ int pfq_percpu_flush(void)
 }
 
 
+void pfq_percpu_free(void)
+{
+	int cpu;
+
+	if (!cpu_data)
+		return;
+
+	for_each_possible_cpu(cpu) {
+
+                struct local_data *local = per_cpu_ptr(cpu_data, cpu);
+		kfree(local->steering);
+	}
+
+	free_percpu(cpu_data);
+	cpu_data = NULL;
+}
@@ -27,22 +27,26 @@
 #include <linux/percpu.h>
 #include <linux/ktime.h>
 #include <linux/timer.h>
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>
 
 #include <pf_q-skbuff-pool.h>
 #include <pf_q-macro.h>
 #include <pf_q-GC.h>
+#include <pf_q-bitmap.h>
+#include <pf_q-steering.h>
 
 int pfq_percpu_init(void);
 int pfq_percpu_flush(void);
+void pfq_percpu_free(void);
 
 /* per-cpu data... */
 
 struct local_data
 {
-        unsigned long           eligible_mask;
-        unsigned long           sock_mask [Q_MAX_ID];
+        struct pfq_steering_local *steering;	/* eligible sockets and steering tables */
 
-        int                     sock_cnt;
+        unsigned long long      sock_queue [Q_MAX_ID];	/* batch mask per socket id */
 
 	struct gc_data 		gc;		/* garbage collector */
 	ktime_t 		last_ts;	/* timestamp of the last packet */
@@ -51,8 +55,12 @@ struct local_data
 
 	struct timer_list 	timer;
 
-        struct pfq_sk_buff_pool tx_pool;
-        struct pfq_sk_buff_pool rx_pool;
+	int			batch_target;	/* adaptive batching: current length */
+	struct hrtimer		flush_timer;	/* adaptive batching: latency bound */
+	ktime_t			batch_start;	/* adaptive batching: arrival of the first held packet */
+	struct tasklet_struct	flush_tasklet;
+
+        struct pfq_skb_pool	skb_pool;	/* magazines of the skb recycler */
 
 } ____cacheline_aligned;
 
@@ -25,6 +25,8 @@
 #include <linux/module.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
 #include <linux/pf_q.h>
 
 #include <net/net_namespace.h>
@@ -38,6 +40,7 @@
 #include <pf_q-proc.h>
 #include <pf_q-memory.h>
 #include <pf_q-printk.h>
+#include <pf_q-profile.h>
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,10,0)
 #define PDE_DATA(a) PDE(a)->data
@@ -48,6 +51,7 @@ struct proc_dir_entry *pfq_proc_dir = NULL;
 static const char proc_computations[] = "computations";
 static const char proc_groups[]       = "groups";
 static const char proc_stats[]        = "stats";
+static const char proc_profile[]      = "profile";
 
 #ifdef PFQ_USE_EXTENDED_PROC
 static const char proc_memory[]       = "memory";
@@ -90,7 +94,7 @@ static int pfq_proc_comp(struct seq_file *m, void *v)
 
 	down(&group_sem);
 
-	for(n = 0; n < Q_MAX_GROUP; n++)
+	for(n = 0; n < max_groups; n++)
 	{
 		struct pfq_group *this_group = pfq_get_group(n);
 
@@ -108,6 +112,18 @@ static int pfq_proc_comp(struct seq_file *m, void *v)
 	return 0;
 }
 
+/* print the socket mask most significant word first */
+
+static void seq_printf_sock_mask(struct seq_file *m, pfq_bitmap_t const *mask)
+{
+	size_t w = pfq_sock_words;
+	seq_printf(m, "%08lx", ACCESS_ONCE(mask->word[--w]));
+	while (w)
+		seq_printf(m, "%016lx", ACCESS_ONCE(mask->word[--w]));
+	seq_printf(m, " ");
+}
+
+
 static int pfq_proc_groups(struct seq_file *m, void *v)
 {
 	size_t n;
@@ -116,7 +132,7 @@ static int pfq_proc_groups(struct seq_file *m, void *v)
 
 	down(&group_sem);
 
-	for(n = 0; n < Q_MAX_GROUP; n++)
+	for(n = 0; n < max_groups; n++)
 	{
 		struct pfq_group *this_group = pfq_get_group(n);
 		if (!this_group->policy)
@@ -131,10 +147,11 @@ static int pfq_proc_groups(struct seq_file *m, void *v)
 
         	seq_printf(m, "%3d %3d ", this_group->policy, this_group->pid);
 
-        	seq_printf(m, "%08lx %08lx %08lx %08lx \n", atomic_long_read(&this_group->sock_mask[pfq_ctz(Q_CLASS_DEFAULT)]),
-        				                    atomic_long_read(&this_group->sock_mask[pfq_ctz(Q_CLASS_USER_PLANE)]),
-        				                    atomic_long_read(&this_group->sock_mask[pfq_ctz(Q_CLASS_CONTROL_PLANE)]),
-        				                    atomic_long_read(&this_group->sock_mask[63]));
+        	seq_printf_sock_mask(m, &this_group->sock_mask[pfq_ctz(Q_CLASS_DEFAULT)]);
+        	seq_printf_sock_mask(m, &this_group->sock_mask[pfq_ctz(Q_CLASS_USER_PLANE)]);
+        	seq_printf_sock_mask(m, &this_group->sock_mask[pfq_ctz(Q_CLASS_CONTROL_PLANE)]);
+        	seq_printf_sock_mask(m, &this_group->sock_mask[63]);
+        	seq_printf(m, "\n");
 
 	}
 
@@ -144,6 +161,8 @@ static int pfq_proc_groups(struct seq_file *m, void *v)
 
 static int pfq_proc_stats(struct seq_file *m, void *v)
 {
+	int n;
+
 	seq_printf(m, "INPUT:\n");
 	seq_printf(m, "received  : %ld\n", sparse_read(&global_stats.recv));
 	seq_printf(m, "lost      : %ld\n", sparse_read(&global_stats.lost));
@@ -153,6 +172,15 @@ static int pfq_proc_stats(struct seq_file *m, void *v)
 	seq_printf(m, "forwarded : %ld\n", sparse_read(&global_stats.frwd));
 	seq_printf(m, "discarded : %ld\n", sparse_read(&global_stats.disc));
 	seq_printf(m, "aborted   : %ld\n", sparse_read(&global_stats.abrt));
+	seq_printf(m, "zc copied : %ld\n", sparse_read(&global_stats.zc_copy));
+	seq_printf(m, "BATCH:\n");
+	for(n = 0; n < Q_BATCH_HIST_SIZE; n++)
+		seq_printf(m, "%3d-%-3d   : %ld\n", 1 << n, (2 << n) - 1, sparse_read(&global_stats.batch[n]));
+	seq_printf(m, "TX DELAY (usec):\n");
+	seq_printf(m, "    0     : %ld\n", sparse_read(&global_stats.tx_delay[0]));
+	for(n = 1; n < Q_TX_DELAY_HIST_SIZE - 1; n++)
+		seq_printf(m, "%4d-%-4d : %ld\n", 1 << (n-1), (1 << n) - 1, sparse_read(&global_stats.tx_delay[n]));
+	seq_printf(m, "%4d+     : %ld\n", 1 << (n-1), sparse_read(&global_stats.tx_delay[n]));
 #ifdef PFQ_USE_EXTENDED_PROC
 	seq_printf(m, "SCHEDULE:\n");
 	seq_printf(m, "poll      : %ld\n", sparse_read(&global_stats.poll));
@@ -162,6 +190,92 @@ static int pfq_proc_stats(struct seq_file *m, void *v)
 }
 
 
+/* Rx profile: a line per stage, the histogram is by log2 of the cycles */
+
+static const char *profile_stage_name[] =
+{
+	[Q_PROFILE_GC]      = "gc",
+	[Q_PROFILE_BPF]     = "bpf",
+	[Q_PROFILE_VLAN]    = "vlan",
+	[Q_PROFILE_RUN]     = "run",
+	[Q_PROFILE_ENQUEUE] = "enqueue",
+	[Q_PROFILE_XMIT]    = "xmit",
+	[Q_PROFILE_KERNEL]  = "kernel",
+};
+
+
+static int pfq_proc_profile(struct seq_file *m, void *v)
+{
+	struct pfq_profile_stage *stage;
+	int s, n;
+
+	stage = kmalloc(sizeof(struct pfq_profile_stage) * Q_PROFILE_STAGES, GFP_KERNEL);
+	if (!stage)
+		return -ENOMEM;
+
+	pfq_profile_read(Q_ANY_CPU, stage);
+
+	seq_printf(m, "enabled: %d\n", pfq_profile_enabled());
+	seq_printf(m, "stage     count      cycles        avg        hist\n");
+
+	for(s = 0; s < Q_PROFILE_STAGES; s++)
+	{
+		if (s < Q_PROFILE_NODE(0))
+			seq_printf(m, "%-9s", profile_stage_name[s]);
+		else
+			seq_printf(m, "node%-5d", s - Q_PROFILE_NODE(0));
+
+		seq_printf(m, " %-10lu %-13lu %-10lu", stage[s].count, stage[s].cycles,
+			   stage[s].count ? stage[s].cycles / stage[s].count : 0);
+
+		for(n = 0; n < Q_PROFILE_HIST_SIZE; n++)
+			seq_printf(m, " %lu", stage[s].hist[n]);
+
+		seq_printf(m, "\n");
+	}
+
+	kfree(stage);
+	return 0;
+}
+
+
+static int pfq_proc_profile_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pfq_proc_profile, PDE_DATA(inode));
+}
+
+
+/* '1' enables the profile (and resets it), '0' disables it */
+
+static ssize_t
+pfq_proc_profile_write(struct file *file, const char __user *buf, size_t length, loff_t *ppos)
+{
+	char c;
+
+	if (length == 0)
+		return 0;
+
+	if (get_user(c, buf))
+		return -EFAULT;
+
+	if (c != '0' && c != '1')
+		return -EINVAL;
+
+	pfq_profile_enable(c == '1');
+	return length;
+}
+
+
+static const struct file_operations pfq_proc_profile_fops = {
+ 	.owner   = THIS_MODULE,
+ 	.open    = pfq_proc_profile_open,
+ 	.read    = seq_read,
+ 	.write   = pfq_proc_profile_write,
+ 	.llseek  = seq_lseek,
+ 	.release = single_release,
+};
+
+
 #ifdef PFQ_USE_EXTENDED_PROC
 
 static int pfq_proc_memory(struct seq_file *m, void *v)
@@ -173,6 +287,21 @@ static int pfq_proc_memory(struct seq_file *m, void *v)
 	seq_printf(m, "error shared   : %ld\n", sparse_read(&memory_stats.err_shared));
 	seq_printf(m, "error cloned   : %ld\n", sparse_read(&memory_stats.err_cloned));
 	seq_printf(m, "error memory   : %ld\n", sparse_read(&memory_stats.err_memory));
+
+#ifdef PFQ_USE_SKB_POOL
+	{
+		int node;
+		for_each_online_node(node)
+		{
+			struct pfq_skb_pool_node_stat stat = pfq_get_skb_pool_node_stats(node);
+
+			seq_printf(m, "node %-2d hit    : %lu\n", node, stat.hit);
+			seq_printf(m, "node %-2d miss   : %lu\n", node, stat.miss);
+			seq_printf(m, "node %-2d remote : %lu\n", node, stat.remote_free);
+			seq_printf(m, "node %-2d cached : %zu\n", node, stat.cached);
+		}
+	}
+#endif
 	return 0;
 }
 
@@ -262,6 +391,7 @@ int pfq_proc_init(void)
 	proc_create(proc_computations, 	0644, pfq_proc_dir, &pfq_proc_comp_fops);
 	proc_create(proc_groups,       	0644, pfq_proc_dir, &pfq_proc_groups_fops);
 	proc_create(proc_stats,		0644, pfq_proc_dir, &pfq_proc_stats_fops);
+	proc_create(proc_profile,	0644, pfq_proc_dir, &pfq_proc_profile_fops);
 #ifdef PFQ_USE_EXTENDED_PROC
 	proc_create(proc_memory,	0644, pfq_proc_dir, &pfq_proc_memory_fops);
 #endif
@@ -275,6 +405,7 @@ int pfq_proc_fini(void)
 	remove_proc_entry(proc_computations, pfq_proc_dir);
 	remove_proc_entry(proc_groups, 	     pfq_proc_dir);
 	remove_proc_entry(proc_stats, 	     pfq_proc_dir);
+	remove_proc_entry(proc_profile,	     pfq_proc_dir);
 #ifdef PFQ_USE_EXTENDED_PROC
 	remove_proc_entry(proc_memory, 	     pfq_proc_dir);
 #endif
@@ -0,0 +1,121 @@
+/***************************************************************
+ *
+ * (C) 2011-14 Nicola Bonelli <nicola@pfq.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ ****************************************************************/
+
+
+#include <linux/kernel.h>
+#include <linux/mutex.h>
+#include <linux/cpumask.h>
+
+#include <pf_q-profile.h>
+
+
+struct static_key pfq_profile_key = STATIC_KEY_INIT_FALSE;
+
+struct pfq_profile_stats profile_stats;
+
+static struct sparse_area profile_stats_area;
+
+static DEFINE_MUTEX(profile_mutex);
+
+static bool profile_enabled;
+
+
+int pfq_profile_init(void)
+{
+	if (sparse_area_alloc(&profile_stats_area, SPARSE_BLOCK_SIZE(SPARSE_COUNTERS(profile_stats))))
+		return -ENOMEM;
+
+	sparse_area_bind(&profile_stats_area, 0, (sparse_counter_t *)&profile_stats, SPARSE_COUNTERS(profile_stats));
+	return 0;
+}
+
+
+void pfq_profile_free(void)
+{
+	pfq_profile_enable(false);
+	sparse_area_free(&profile_stats_area);
+}
+
+
+/* the key is switched under the mutex, enabling the profile resets the histograms */
+
+void pfq_profile_enable(bool value)
+{
+	sparse_counter_t *sc = (sparse_counter_t *)&profile_stats;
+	size_t n;
+
+	mutex_lock(&profile_mutex);
+
+	if (value != profile_enabled) {
+
+		if (value) {
+			for(n = 0; n < SPARSE_COUNTERS(profile_stats); n++)
+				sparse_set(&sc[n], 0);
+
+			static_key_slow_inc(&pfq_profile_key);
+		}
+		else
+			static_key_slow_dec(&pfq_profile_key);
+
+		profile_enabled = value;
+	}
+
+	mutex_unlock(&profile_mutex);
+}
+
+
+bool pfq_profile_enabled(void)
+{
+	return ACCESS_ONCE(profile_enabled);
+}
+
+
+static inline unsigned long
+profile_read(sparse_counter_t *sc, int cpu)
+{
+	return cpu == Q_ANY_CPU ? sparse_read(sc) : local_read(__sparse_ptr(sc, cpu));
+}
+
+
+/* the histograms of a cpu, or their sum (Q_ANY_CPU) */
+
+int pfq_profile_read(int cpu, struct pfq_profile_stage *stage)
+{
+	int s, n;
+
+	if (cpu != Q_ANY_CPU && (cpu < 0 || cpu >= nr_cpu_ids || !cpu_possible(cpu)))
+		return -EINVAL;
+
+	for(s = 0; s < Q_PROFILE_STAGES; s++)
+	{
+		struct pfq_profile_stats_stage *this = &profile_stats.stage[s];
+
+		stage[s].count  = profile_read(&this->count, cpu);
+		stage[s].cycles = profile_read(&this->cycles, cpu);
+
+		for(n = 0; n < Q_PROFILE_HIST_SIZE; n++)
+			stage[s].hist[n] = profile_read(&this->hist[n], cpu);
+	}
+
+	return 0;
+}
@@ -0,0 +1,94 @@
+/***************************************************************
+ *
+ * (C) 2011-14 Nicola Bonelli <nicola@pfq.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ ****************************************************************/
+
+
+#ifndef PF_Q_PROFILE_H
+#define PF_Q_PROFILE_H
+
+#include <linux/kernel.h>
+#include <linux/jump_label.h>
+#include <linux/timex.h>
+#include <linux/bitops.h>
+#include <linux/pf_q.h>
+
+#include <pf_q-sparse.h>
+
+
+/*
+ * Rx profile: per-cpu histograms of the cycles spent in the stages of
+ * the Rx path. The probes are guarded by a static key, they cost a nop
+ * when the profile is disabled (the default).
+ */
+
+struct pfq_profile_stats_stage
+{
+	sparse_counter_t count;
+	sparse_counter_t cycles;
+	sparse_counter_t hist[Q_PROFILE_HIST_SIZE];
+};
+
+
+struct pfq_profile_stats
+{
+	struct pfq_profile_stats_stage stage[Q_PROFILE_STAGES];
+};
+
+
+extern struct static_key pfq_profile_key;
+extern struct pfq_profile_stats profile_stats;
+
+extern int  pfq_profile_init(void);
+extern void pfq_profile_free(void);
+
+extern void pfq_profile_enable(bool value);
+extern bool pfq_profile_enabled(void);
+extern int  pfq_profile_read(int cpu, struct pfq_profile_stage *stage);
+
+
+static inline
+cycles_t pfq_profile_begin(void)
+{
+	return static_key_false(&pfq_profile_key) ? get_cycles() : 0;
+}
+
+
+/* called in softirq context: a start of 0 means the profile was enabled
+ * in the middle of the stage */
+
+static inline
+void pfq_profile_end(int stage, cycles_t start)
+{
+	if (static_key_false(&pfq_profile_key) && start) {
+
+		struct pfq_profile_stats_stage *s = &profile_stats.stage[stage];
+		cycles_t delta = get_cycles() - start;
+		int cpu = smp_processor_id();
+
+		__sparse_inc(&s->count, cpu);
+		__sparse_add(&s->cycles, delta, cpu);
+		__sparse_inc(&s->hist[min_t(int, fls64(delta), Q_PROFILE_HIST_SIZE-1)], cpu);
+	}
+}
+
+
+#endif /* PF_Q_PROFILE_H */
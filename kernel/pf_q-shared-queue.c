@@ -40,6 +40,8 @@
 #include <pf_q-global.h>
 #include <pf_q-memory.h>
 #include <pf_q-GC.h>
+#include <pf_q-zcopy.h>
+#include <pf_q-transmit.h>
 
 
 static inline
@@ -52,9 +54,91 @@ void *pfq_skb_copy_from_linear_data(const struct sk_buff *skb, void *to, size_t
 
 
 static inline
-char *mpsc_slot_ptr(struct pfq_rx_opt *ro, struct pfq_rx_queue *qd, size_t qindex, size_t slot)
+char *mpsc_slot_ptr(struct pfq_rx_opt *ro, char *base, size_t qindex, size_t slot)
 {
-	return (char *)(ro->base_addr) + (ro->queue_size * (qindex & 1) + slot) * ro->slot_size;
+	return base + (ro->queue_size * (qindex & 1) + slot) * ro->slot_size;
+}
+
+
+static inline
+char *mpsc_packed_ptr(struct pfq_rx_opt *ro, char *base, size_t qindex, size_t units)
+{
+	return base + ro->queue_size * ro->slot_size * (qindex & 1) + units * Q_PACKED_UNIT;
+}
+
+
+static inline
+int mpsc_zcopy_frame(struct pfq_rx_opt *ro, struct sk_buff *skb, unsigned long zc_base)
+{
+	return zc_base && ro->zcopy_loan ? pfq_zcopy_frame(skb) : -1;
+}
+
+
+static inline
+size_t mpsc_packed_units(struct pfq_rx_opt *ro, struct sk_buff *skb, unsigned long zc_base)
+{
+	size_t bytes = mpsc_zcopy_frame(ro, skb, zc_base) >= 0 ? sizeof(struct pfq_pkthdr_zcopy)
+							      : min_t(size_t, skb->len, ro->caplen);
+
+	return Q_PACKED_RECORD_SIZE(bytes) / Q_PACKED_UNIT;
+}
+
+
+/* packed layout: reserve the bytes for the longest prefix of the batch that
+ * fits in the current half of the queue. Return the mask of the packets
+ * that got room, and the offset of the first record (qindex and offset
+ * are set only when the mask is not empty).
+ */
+
+static unsigned long long
+mpsc_packed_reserve(struct pfq_rx_opt *ro, struct pfq_rx_queue *rx_queue,
+		    struct pfq_skbuff_batch *skbs, unsigned long long mask,
+		    unsigned long zc_base, int *qindex, size_t *offset)
+{
+	size_t cap = pfq_mpsc_packed_capacity(ro);
+	unsigned long long fit;
+	unsigned int data, units;
+
+	do {
+		unsigned long long todo = mask;
+		struct sk_buff *skb;
+		size_t n, len;
+
+		data = atomic_read((atomic_t *)&rx_queue->data);
+		len  = Q_SHARED_QUEUE_LEN(data);
+
+		units = 0;
+		fit   = 0;
+
+		for_each_skbuff_bitmask(skbs, todo, skb, n)
+		{
+			size_t u = mpsc_packed_units(ro, skb, zc_base);
+			if (len + units + u > cap)
+				break;
+			units += u;
+			fit |= 1ULL << n;
+		}
+
+		if (!fit)
+			return 0;
+	}
+	while (atomic_cmpxchg((atomic_t *)&rx_queue->data, data, data + units) != data);
+
+	*qindex = Q_SHARED_QUEUE_INDEX(data);
+	*offset = Q_SHARED_QUEUE_LEN(data);
+	return fit;
+}
+
+
+static inline
+void mpsc_wake_up(struct pfq_rx_opt *ro)
+{
+	if (waitqueue_active(&ro->waitqueue)) {
+#ifdef PFQ_USE_EXTENDED_PROC
+		sparse_inc(&global_stats.wake);
+#endif
+		wake_up_interruptible(&ro->waitqueue);
+	}
 }
 
 
@@ -62,33 +146,68 @@ size_t pfq_mpsc_enqueue_batch(struct pfq_rx_opt *ro,
 		              struct pfq_skbuff_batch *skbs,
 		              unsigned long long mask,
 		              int burst_len,
+		              int cpu,
 		              int gid)
 {
-	struct pfq_rx_queue *rx_queue = pfq_get_rx_queue(ro);
+	unsigned int ring = pfq_mpsc_ring_index(ro, cpu);
+	struct pfq_rx_queue *rx_queue = pfq_get_rx_ring(ro, ring);
+	unsigned long zc_base;
 	int data, qlen, qindex;
 	struct sk_buff *skb;
 
 	size_t n, sent = 0;
-	char *this_slot;
+	char *base, *this_slot;
 
 	if (unlikely(rx_queue == NULL))
 		return 0;
 
-	data = atomic_read((atomic_t *)&rx_queue->data);
+	/* each cpu produces on its own sub-ring: no shared cache line with
+	 * the other producers, as long as there are enough rings */
 
-        if (Q_SHARED_QUEUE_LEN(data) > ro->queue_size)
-		return 0;
+	base = (char *)(ro->base_addr) + ring * pfq_queue_mpsc_ring_mem(ro);
+
+	/* the zero-copy area, if mapped, is read once per batch: the
+	 * size of packed records depends on it */
+
+	zc_base = ACCESS_ONCE(ro->zcopy_uaddr);
 
-	data = atomic_add_return(burst_len, (atomic_t *)&rx_queue->data);
+	if (ro->packed) {
 
-	qlen      = Q_SHARED_QUEUE_LEN(data) - burst_len;
-	qindex    = Q_SHARED_QUEUE_INDEX(data);
-        this_slot = mpsc_slot_ptr(ro, rx_queue, qindex, qlen);
+		unsigned long long fit;
+		size_t offset;
+
+		fit = mpsc_packed_reserve(ro, rx_queue, skbs, mask, zc_base, &qindex, &offset);
+		if (fit != mask)
+			mpsc_wake_up(ro);
+
+		/* nothing fits: qindex and offset are not set */
+
+		if (!fit)
+			return 0;
+
+		mask	  = fit;
+		qlen	  = (int)offset;
+		this_slot = mpsc_packed_ptr(ro, base, qindex, offset);
+	}
+	else {
+		data = atomic_read((atomic_t *)&rx_queue->data);
+
+		if (Q_SHARED_QUEUE_LEN(data) >= ro->queue_size)
+			return 0;
+
+		data = atomic_add_return(burst_len, (atomic_t *)&rx_queue->data);
+
+		qlen      = Q_SHARED_QUEUE_LEN(data) - burst_len;
+		qindex    = Q_SHARED_QUEUE_INDEX(data);
+		this_slot = mpsc_slot_ptr(ro, base, qindex, qlen);
+	}
 
 	for_each_skbuff_bitmask(skbs, mask, skb, n)
 	{
 		volatile struct pfq_pkthdr *hdr;
 		size_t bytes, slot_index;
+		unsigned long zc_addr;
+		int frame;
 		char *pkt;
 
 		bytes = min_t(size_t, skb->len, ro->caplen);
@@ -98,34 +217,50 @@ size_t pfq_mpsc_enqueue_batch(struct pfq_rx_opt *ro,
 		hdr = (struct pfq_pkthdr *)this_slot;
 		pkt = (char *)(hdr+1);
 
-		if (slot_index > ro->queue_size) {
-
-			if (waitqueue_active(&ro->waitqueue)) {
-#ifdef PFQ_USE_EXTENDED_PROC
- 				sparse_inc(&global_stats.wake);
-#endif
-				wake_up_interruptible(&ro->waitqueue);
-			}
-
+		if (!ro->packed && slot_index >= ro->queue_size) {
+			mpsc_wake_up(ro);
 			return sent;
 		}
 
-		/* copy bytes of packet */
+		/* zero-copy: lend the frame instead of copying the packet */
+
+		frame   = mpsc_zcopy_frame(ro, skb, zc_base);
+		zc_addr = frame >= 0 ? zc_base : 0;
+
+		if (zc_addr) {
+
+			struct pfq_pkthdr_zcopy *zc = (struct pfq_pkthdr_zcopy *)pkt;
+
+			pfq_zcopy_lend(ro->zcopy_loan, frame);
+
+			zc->addr  = zc_addr + (unsigned long)frame * PAGE_SIZE + (skb->data - skb->head);
+			zc->token = (uint32_t)frame;
+
+			bytes = skb->len;
+		}
+		else {
+			/* copy bytes of packet */
 
 #ifdef PFQ_USE_SKB_LINEARIZE
-		if (unlikely(skb_is_nonlinear(skb)))
+			if (unlikely(skb_is_nonlinear(skb)))
 #else
-		if (skb_is_nonlinear(skb))
+			if (skb_is_nonlinear(skb))
 #endif
-		{
-			if (skb_copy_bits(skb, 0, pkt, bytes) != 0) {
-				printk(KERN_WARNING "[PFQ] BUG! skb_copy_bits failed (bytes=%zu, skb_len=%d mac_len=%d)!\n",
-							    bytes, skb->len, skb->mac_len);
-				return 0;
+			{
+				if (skb_copy_bits(skb, 0, pkt, bytes) != 0) {
+					printk(KERN_WARNING "[PFQ] BUG! skb_copy_bits failed (bytes=%zu, skb_len=%d mac_len=%d)!\n",
+								    bytes, skb->len, skb->mac_len);
+					return 0;
+				}
+			}
+			else {
+				/* packed records are contiguous: no over-copy */
+
+				if (ro->packed)
+					memcpy(pkt, skb->data, bytes);
+				else
+					pfq_skb_copy_from_linear_data(skb, pkt, bytes);
 			}
-		}
-		else {
-			pfq_skb_copy_from_linear_data(skb, pkt, bytes);
 		}
 
                 /* copy mark from pfq_cb (annotation) */
@@ -143,6 +278,7 @@ size_t pfq_mpsc_enqueue_batch(struct pfq_rx_opt *ro,
 
 		hdr->if_index    = skb->dev->ifindex & 0xff;
 		hdr->gid         = gid;
+		hdr->flags       = zc_addr ? Q_PKTHDR_ZCOPY : 0;
 
 		hdr->len         = (uint16_t)skb->len;
 		hdr->caplen 	 = (uint16_t)bytes;
@@ -155,17 +291,15 @@ size_t pfq_mpsc_enqueue_batch(struct pfq_rx_opt *ro,
 
 		hdr->commit = (uint8_t)qindex;
 
-		if ((slot_index & 8191) == 0 &&
-				waitqueue_active(&ro->waitqueue)) {
-#ifdef PFQ_USE_EXTENDED_PROC
- 			sparse_inc(&global_stats.wake);
-#endif
-		        wake_up_interruptible(&ro->waitqueue);
-		}
+		/* packed: wake up at the first record of the queue only */
+
+		if ((ro->packed ? slot_index == 0 : (slot_index & 8191) == 0))
+			mpsc_wake_up(ro);
 
 		sent++;
 
-		this_slot += ro->slot_size;
+		this_slot += ro->packed ? Q_PACKED_RECORD_SIZE(zc_addr ? sizeof(struct pfq_pkthdr_zcopy) : bytes)
+				        : ro->slot_size;
 	}
 
 	return sent;
@@ -179,6 +313,7 @@ pfq_shared_queue_enable(struct pfq_sock *so, unsigned long user_addr)
 
 		struct pfq_shared_queue * queue;
 		size_t n;
+		unsigned int r;
 
 		/* alloc queue memory */
 
@@ -191,33 +326,66 @@ pfq_shared_queue_enable(struct pfq_sock *so, unsigned long user_addr)
 				return -ENOMEM;
 		}
 
-		/* so->mem_addr and so->mem_size are set now */
+		/* so->mem_addr and so->mem_size are set now: a Tx queue per binding
+		 * (at least Q_MIN_TX_QUEUES) */
+
+		so->tx_opt.shared_queues = max_t(size_t, so->tx_opt.num_queues, Q_MIN_TX_QUEUES);
+
+		if (so->rx_opt.zcopy_loan && so->rx_opt.caplen < sizeof(struct pfq_pkthdr_zcopy)) {
+			printk(KERN_INFO "[PFQ|%d] zero-copy: caplen must be at least %zu!\n", so->id, sizeof(struct pfq_pkthdr_zcopy));
+			pfq_shared_memory_free(&so->shmem);
+			return -EINVAL;
+		}
 
 		/* initialize queues headers */
 
 		queue = (struct pfq_shared_queue *)so->shmem.addr;
 
-		/* initialize rx queue header */
+		/* initialize rx queue headers (one per sub-ring) */
 
-		queue->rx.data      = (1L << 24);
-		queue->rx.size      = so->rx_opt.queue_size;
-		queue->rx.slot_size = so->rx_opt.slot_size;
+		for(r = 0; r < so->rx_opt.rings; r++)
+		{
+			struct pfq_rx_queue *rx = Q_SHARED_RX_RING(queue, r);
 
-		for(n = 0; n < Q_MAX_TX_QUEUES; n++)
+			rx->data      = (1L << 24);
+			rx->size      = so->rx_opt.queue_size;
+			rx->slot_size = so->rx_opt.packed ? 0 : so->rx_opt.slot_size;
+		}
+
+		for(n = 0; n < so->tx_opt.shared_queues; n++)
 		{
 			queue->tx[n].prod      = 0;
 			queue->tx[n].cons      = 0;
 			queue->tx[n].size      = pfq_queue_spsc_mem(so)/2;
+			queue->tx[n].zc_busy[0] = 0;
+			queue->tx[n].zc_busy[1] = 0;
+			queue->tx[n].consumed  = 0;
+			queue->tx[n].sent      = 0;
+			queue->tx[n].disc      = 0;
                         queue->tx[n].ptr       = NULL;
                         queue->tx[n].index     = -1;
 
-			so->tx_opt.queue[n].base_addr = so->shmem.addr + sizeof(struct pfq_shared_queue)
+			so->tx_opt.queue[n].base_addr = so->shmem.addr + Q_SHARED_QUEUE_HDR_SIZE(so->tx_opt.shared_queues)
 							+ pfq_queue_mpsc_mem(so) + pfq_queue_spsc_mem(so) * n;
 		}
 
+		/* zero-copy Tx state */
+
+		if (so->tx_opt.zcopy) {
+			for(n = 0; n < so->tx_opt.shared_queues; n++)
+			{
+				if (pfq_tx_zcopy_enable(&so->tx_opt.queue[n], &queue->tx[n], &so->tx_opt.waitqueue) < 0) {
+					while (n--)
+						pfq_tx_zcopy_disable(&so->tx_opt.queue[n]);
+					pfq_shared_memory_free(&so->shmem);
+					return -ENOMEM;
+				}
+			}
+		}
+
 		/* update the queues base_addr */
 
-		so->rx_opt.base_addr = so->shmem.addr + sizeof(struct pfq_shared_queue);
+		so->rx_opt.base_addr = so->shmem.addr + Q_SHARED_QUEUE_HDR_SIZE(so->tx_opt.shared_queues);
 
 		/* commit both the queues */
 
@@ -225,22 +393,23 @@ pfq_shared_queue_enable(struct pfq_sock *so, unsigned long user_addr)
 
 		atomic_long_set(&so->rx_opt.queue_hdr, (long)&queue->rx);
 
-		for(n = 0; n < Q_MAX_TX_QUEUES; n++)
+		for(n = 0; n < so->tx_opt.shared_queues; n++)
 		{
 			atomic_long_set(&so->tx_opt.queue[n].queue_hdr, (long)&queue->tx[n]);
 		}
 
-		pr_devel("[PFQ|%d] Rx queue: len=%zu slot_size=%zu caplen=%zu, mem=%zu bytes\n", so->id,
+		pr_devel("[PFQ|%d] Rx queue: len=%zu slot_size=%zu caplen=%zu%s, mem=%zu bytes (%u rings)\n", so->id,
 				so->rx_opt.queue_size,
 				so->rx_opt.slot_size,
 				so->rx_opt.caplen,
-				pfq_queue_mpsc_mem(so));
+				so->rx_opt.packed ? " (packed)" : "",
+				pfq_queue_mpsc_mem(so), so->rx_opt.rings);
 
-		pr_devel("[PFQ|%d] Tx queue: len=%zu slot_size=%zu maxlen=%d, mem=%zu bytes (%d queues)\n", so->id,
+		pr_devel("[PFQ|%d] Tx queue: len=%zu slot_size=%zu maxlen=%d, mem=%zu bytes (%zu queues)\n", so->id,
 				so->tx_opt.queue_size,
 				so->tx_opt.slot_size,
 				max_len,
-				pfq_queue_spsc_mem(so) * Q_MAX_TX_QUEUES, Q_MAX_TX_QUEUES);
+				pfq_queue_spsc_mem(so) * so->tx_opt.shared_queues, so->tx_opt.shared_queues);
 	}
 
 	return 0;
@@ -263,11 +432,25 @@ pfq_shared_queue_disable(struct pfq_sock *so)
 
 		msleep(Q_GRACE_PERIOD);
 
+		/* wait for the zero-copy Tx skbs still in flight */
+
+		for(n = 0; n < Q_MAX_TX_QUEUES; n++)
+		{
+			pfq_tx_zcopy_disable(&so->tx_opt.queue[n]);
+		}
+
+		/* give back the frames still lent to the user */
+
+		pfq_zcopy_release_all(&so->rx_opt);
+		pfq_zcopy_detach(&so->rx_opt);
+
 		pfq_shared_memory_free(&so->shmem);
 
 		so->shmem.addr = NULL;
 		so->shmem.size = 0;
 
+		so->tx_opt.shared_queues = 0;
+
 		pr_devel("[PFQ|%d] Tx/Rx queues disabled.\n", so->id);
 	}
 
@@ -41,12 +41,34 @@ extern size_t pfq_mpsc_enqueue_batch(struct pfq_rx_opt *ro,
 		                     struct pfq_skbuff_batch *skbs,
 		                     unsigned long long skbs_mask,
 		                     int burst_len,
+		                     int cpu,
 		                     int gid);
 
 
+/* memory of a single Rx ring (both the queues) */
+
+static inline size_t pfq_queue_mpsc_ring_mem(struct pfq_rx_opt *ro)
+{
+        return ro->queue_size * ro->slot_size * 2;
+}
+
 static inline size_t pfq_queue_mpsc_mem(struct pfq_sock *so)
 {
-        return so->rx_opt.queue_size * so->rx_opt.slot_size * 2;
+        return pfq_queue_mpsc_ring_mem(&so->rx_opt) * so->rx_opt.rings;
+}
+
+/* capacity of each half of the packed queue, in Q_PACKED_UNIT units */
+
+static inline size_t pfq_mpsc_packed_capacity(struct pfq_rx_opt *ro)
+{
+	return min_t(size_t, ro->queue_size * ro->slot_size / Q_PACKED_UNIT, Q_PACKED_MAX_UNITS);
+}
+
+/* the Rx sub-ring a cpu produces on */
+
+static inline unsigned int pfq_mpsc_ring_index(struct pfq_rx_opt *ro, int cpu)
+{
+	return ro->rings > 1 ? (unsigned int)cpu % ro->rings : 0;
 }
 
 static inline size_t pfq_queue_spsc_mem(struct pfq_sock *so)
@@ -54,14 +76,97 @@ static inline size_t pfq_queue_spsc_mem(struct pfq_sock *so)
         return so->tx_opt.queue_size * so->tx_opt.slot_size * 2;
 }
 
+/* Tx queues in the shared memory: the bound ones (at least Q_MIN_TX_QUEUES,
+ * so that a socket can still bind some Tx queues once enabled), fixed when the
+ * socket is enabled */
+
+static inline size_t pfq_tx_shared_queues(struct pfq_sock *so)
+{
+	return so->shmem.addr ? so->tx_opt.shared_queues : max_t(size_t, so->tx_opt.num_queues, Q_MIN_TX_QUEUES);
+}
+
 
 static inline
 size_t pfq_mpsc_queue_len(struct pfq_sock *p)
 {
 	struct pfq_shared_queue *q = pfq_get_shared_queue(p);
+	size_t len = 0;
+	unsigned int r;
+
 	if (!q)
 		return 0;
-        return Q_SHARED_QUEUE_LEN(q->rx.data);
+	for(r = 0; r < p->rx_opt.rings; r++)
+		len += Q_SHARED_QUEUE_LEN(Q_SHARED_RX_RING(q, r)->data);
+        return len;
+}
+
+
+/* a Tx queue can take packets: a drained half has been handed to the producer
+ * (or the producer half is still empty) and the driver no longer holds its pages.
+ * A half the producer has started is not writable: the producer waits only when
+ * its half can not take the next packet (pfq_tx_space), and only a swap changes that */
+
+static inline
+bool pfq_tx_queue_writable(struct pfq_sock *so, size_t n)
+{
+	struct pfq_tx_queue *txq = pfq_get_tx_queue(&so->tx_opt, n);
+	struct pfq_pkthdr_tx *hdr;
+	unsigned int cons;
+
+	if (!txq)
+		return false;
+
+	cons = ACCESS_ONCE(txq->cons);
+
+	if (ACCESS_ONCE(txq->zc_busy[cons & 1]))
+		return false;
+
+	if (cons != ACCESS_ONCE(txq->prod))
+		return true;
+
+	hdr = (struct pfq_pkthdr_tx *)(so->tx_opt.queue[n].base_addr + (cons & 1) * txq->size);
+	return ACCESS_ONCE(hdr->len) == 0;
+}
+
+
+/* POLLOUT: the Tx queue selected with Q_SO_TX_POLL_QUEUE is writable, or any
+ * bound queue if none is selected (the producer re-checks its own queue) */
+
+static inline
+bool pfq_tx_queues_writable(struct pfq_sock *so)
+{
+	size_t n, queues = min(so->tx_opt.num_queues, so->tx_opt.shared_queues);
+	int poll = ACCESS_ONCE(so->tx_opt.poll_queue);
+
+	if (poll >= 0)
+		return (size_t)poll < queues && pfq_tx_queue_writable(so, poll);
+
+	for(n = 0; n < queues; n++)
+	{
+		if (pfq_tx_queue_writable(so, n))
+			return true;
+	}
+
+	return false;
+}
+
+
+/* occupancy of the sub-ring a cpu produces on, in percent of its capacity
+ * (100 if the socket is not enabled) */
+
+static inline
+int pfq_mpsc_ring_usage(struct pfq_rx_opt *ro, int cpu)
+{
+	struct pfq_rx_queue *rx = pfq_get_rx_ring(ro, pfq_mpsc_ring_index(ro, cpu));
+	size_t cap, len;
+
+	if (!rx)
+		return 100;
+
+	cap = ro->packed ? pfq_mpsc_packed_capacity(ro) : ro->queue_size;
+	len = Q_SHARED_QUEUE_LEN(ACCESS_ONCE(rx->data));
+
+	return len >= cap ? 100 : (int)(len * 100 / cap);
 }
 
 
@@ -29,6 +29,39 @@
 
 #include <pf_q-shmem.h>
 #include <pf_q-shared-queue.h>
+#include <pf_q-zcopy.h>
+#include <pf_q-group.h>
+
+
+static int
+pfq_group_stats_mmap(struct pfq_sock *so, struct vm_area_struct *vma)
+{
+	unsigned long offset = (vma->vm_pgoff << PAGE_SHIFT) - Q_GROUP_STATS_MMAP_OFFSET(0);
+	int gid = (int)(offset >> 20), err;
+
+	/* the window of the group: stats first, then the time-series */
+
+	offset -= Q_GROUP_STATS_MMAP_OFFSET(gid) - Q_GROUP_STATS_MMAP_OFFSET(0);
+
+	if (offset != 0 && offset != Q_GROUP_TIMESERIES_MMAP_OFFSET(0) - Q_GROUP_STATS_MMAP_OFFSET(0)) {
+		printk(KERN_WARNING "[PFQ|%d] pfq_mmap: bad offset!\n", so->id);
+		return -EINVAL;
+	}
+
+	err = pfq_check_group(so->id, gid, "group stats mmap");
+	if (err != 0)
+		return err;
+
+	if (!__pfq_group_access(gid, so->id, Q_POLICY_GROUP_UNDEFINED, false)) {
+		printk(KERN_INFO "[PFQ|%d] group stats mmap error: permission denied (gid=%d)!\n", so->id, gid);
+		return -EACCES;
+	}
+
+	if (offset != 0)
+		return pfq_group_timeseries_mmap(gid, vma);
+
+	return sparse_area_mmap(&pfq_get_group(gid)->stats_area, vma);
+}
 
 
 static int
@@ -74,6 +107,19 @@ pfq_mmap(struct file *file, struct socket *sock, struct vm_area_struct *vma)
                 return -EINVAL;
         }
 
+        /* the zero-copy area is mapped apart, at its own offset */
+
+        if (vma->vm_pgoff == (Q_ZCOPY_MMAP_OFFSET >> PAGE_SHIFT))
+                return pfq_zcopy_mmap(so, vma);
+
+        /* so are the statistics of the socket and of the groups */
+
+        if (vma->vm_pgoff == (Q_STATS_MMAP_OFFSET >> PAGE_SHIFT))
+                return sparse_area_mmap(&so->stats_area, vma);
+
+        if (vma->vm_pgoff >= (Q_GROUP_STATS_MMAP_OFFSET(0) >> PAGE_SHIFT))
+                return pfq_group_stats_mmap(so, vma);
+
         if(size > so->shmem.size) {
                 printk(KERN_WARNING "[PFQ] pfq_mmap: area too large!\n");
                 return -EINVAL;
@@ -194,7 +240,9 @@ pfq_shared_memory_free(struct pfq_shmem_descr *shmem)
 
 size_t pfq_total_queue_mem(struct pfq_sock *so)
 {
-        return sizeof(struct pfq_shared_queue) + pfq_queue_mpsc_mem(so) + pfq_queue_spsc_mem(so) * Q_MAX_TX_QUEUES;
+	size_t tx = pfq_tx_shared_queues(so);
+
+        return Q_SHARED_QUEUE_HDR_SIZE(tx) + pfq_queue_mpsc_mem(so) + pfq_queue_spsc_mem(so) * tx;
 }
 
 
@@ -25,96 +25,125 @@
 #define PF_Q_SKBUFF_POOL_H
 
 #include <linux/skbuff.h>
+#include <linux/spinlock.h>
 
+/*
+ * magazine recycler: each cpu caches skbs in two magazines per size class
+ * (loaded and previous), and exchanges full and empty magazines with the
+ * depot of its NUMA node. Skbs freed on a cpu of another node are gathered
+ * in a per-node magazine and returned to the depot of their node.
+ */
 
-struct pfq_sk_buff_pool
+#define Q_SKB_POOL_CLASSES	3	/* size classes: max_len/4, max_len/2, max_len */
+#define Q_SKB_MAGAZINE_SIZE	64	/* skbs per magazine */
+
+
+struct pfq_skb_magazine
 {
-	struct sk_buff ** skbs;
-	size_t size;
-	size_t p_idx;
-	size_t c_idx;
+	size_t			 count;
+	struct sk_buff		*skbs[Q_SKB_MAGAZINE_SIZE];
 };
 
 
-static inline
-int pfq_sk_buff_pool_init (struct pfq_sk_buff_pool *pool, size_t size)
+struct pfq_skb_pool
 {
-	if (size > 0) {
-		pool->skbs = kzalloc(sizeof(struct sk_buff *) * size, GFP_KERNEL);
-		if (pool->skbs == NULL) {
-			printk(KERN_INFO "[PFQ] pfq_sk_buff_pool_init: out of memory!\n");
-			return -ENOMEM;
-		}
-	}
-	else {
-            	pool->skbs = NULL;
-	}
+	struct pfq_skb_magazine *loaded[Q_SKB_POOL_CLASSES];
+	struct pfq_skb_magazine *prev[Q_SKB_POOL_CLASSES];
+	struct pfq_skb_magazine **remote;	/* [node * Q_SKB_POOL_CLASSES + class] */
+	int			 node;
+
+	unsigned long		 hit;		/* allocations served by the pool */
+	unsigned long		 miss;		/* allocations left to the OS */
+	unsigned long		 remote_free;	/* skbs returned to another node */
+};
+
+
+struct pfq_skb_depot
+{
+	spinlock_t		  lock;
+	size_t			  capacity;	/* magazines, per stack */
+	size_t			  nfull[Q_SKB_POOL_CLASSES];
+	size_t			  nempty;
+	struct pfq_skb_magazine **full[Q_SKB_POOL_CLASSES];
+	struct pfq_skb_magazine **empty;
+};
+
+
+struct pfq_skb_pool_node_stat
+{
+	unsigned long		hit;
+	unsigned long		miss;
+	unsigned long		remote_free;
+	size_t			cached;		/* skbs in the depot */
+};
 
-	pool->size  = size;
-	pool->p_idx = 0;
-	pool->c_idx = 0;
-	return 0;
-}
 
+extern unsigned int pfq_skb_class_size[Q_SKB_POOL_CLASSES];
+
+extern int    pfq_skb_pool_init(void);
+extern size_t pfq_skb_pool_purge(void);
+extern void   pfq_skb_pool_enable(bool value);
+
+extern struct sk_buff *__pfq_skb_pool_get(struct pfq_skb_pool *pool, int class);
+extern void __pfq_skb_pool_put(struct pfq_skb_pool *pool, struct sk_buff *skb, int class, int node);
+
+extern struct pfq_skb_pool_node_stat pfq_get_skb_pool_node_stats(int node);
+
+
+/* smallest class for an allocation of size bytes (-1: too large) */
 
 static inline
-size_t
-pfq_sk_buff_pool_purge(struct pfq_sk_buff_pool *pool)
+int pfq_skb_alloc_class(unsigned int size)
 {
-	size_t n, total = 0;
-	for(n = 0; n < pool->size; n++)
-	{
-		if (pool->skbs[n]) {
-			total++;
-			kfree_skb(pool->skbs[n]);
-			pool->skbs[n] = NULL;
-		}
-	}
+	unsigned int need = SKB_DATA_ALIGN(size + NET_SKB_PAD);
+	int c;
 
-	pool->p_idx = 0;
-	pool->c_idx = 0;
-	return total;
+	for(c = 0; c < Q_SKB_POOL_CLASSES; c++)
+		if (need <= pfq_skb_class_size[c])
+			return c;
+	return -1;
 }
 
 
+/* largest class an skb with end bytes of data satisfies (-1: too small) */
+
 static inline
-size_t pfq_sk_buff_pool_free(struct pfq_sk_buff_pool *pool)
+int pfq_skb_free_class(unsigned int end)
 {
-	size_t total = pfq_sk_buff_pool_purge(pool);
-	kfree(pool->skbs);
-	pool->skbs = NULL;
-	pool->size = 0;
-	return total;
+	int c;
+
+	for(c = Q_SKB_POOL_CLASSES - 1; c >= 0; c--)
+		if (end >= pfq_skb_class_size[c])
+			return c;
+	return -1;
 }
 
 
+/* fast path: the magazines of the cpu (bottom halves disabled) */
+
 static inline
-struct sk_buff *pfq_sk_buff_pool_get(struct pfq_sk_buff_pool *pool)
+struct sk_buff *pfq_skb_pool_get(struct pfq_skb_pool *pool, int class)
 {
-	if (pool->skbs) {
-		struct sk_buff *skb = __atomic_exchange_n(&pool->skbs[pool->c_idx], NULL, __ATOMIC_RELAXED);
-		if (++pool->c_idx >= pool->size)
-			pool->c_idx = 0;
-		return skb;
-	}
-	return NULL;
+	struct pfq_skb_magazine *mag = pool->loaded[class];
+
+	if (likely(mag && mag->count))
+		return mag->skbs[--mag->count];
+
+	return __pfq_skb_pool_get(pool, class);
 }
 
 
 static inline
-void pfq_sk_buff_pool_put(struct pfq_sk_buff_pool *pool, struct sk_buff *nskb)
+void pfq_skb_pool_put(struct pfq_skb_pool *pool, struct sk_buff *skb, int class, int node)
 {
-	if (pool->skbs) {
-
-		/* most of the time skb is NULL */
-		struct sk_buff *skb = __atomic_exchange_n(&pool->skbs[pool->p_idx], nskb, __ATOMIC_RELAXED);
-		kfree_skb(skb);
-		if (++pool->p_idx >= pool->size)
-			pool->p_idx = 0;
+	struct pfq_skb_magazine *mag = pool->loaded[class];
 
-	} else {
-		kfree_skb(nskb);
+	if (likely(node == pool->node && mag && mag->count < Q_SKB_MAGAZINE_SIZE)) {
+		mag->skbs[mag->count++] = skb;
+		return;
 	}
+
+	__pfq_skb_pool_put(pool, skb, class, node);
 }
 
 #endif /* PF_Q_SKBUFF_POOL_H */
@@ -33,7 +33,7 @@ struct gc_log;
 struct pfq_cb
 {
 	unsigned long 	 mark;
-        unsigned long 	 group_mask;
+        const unsigned long *group_mask;	/* devmap entry: pfq_group_words */
 	struct gc_log 	 *log;
 	struct pfq_monad *monad;
 	int 		 direct;
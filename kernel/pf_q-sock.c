@@ -29,6 +29,8 @@
 
 #include <pf_q-sock.h>
 #include <pf_q-memory.h>
+#include <pf_q-global.h>
+#include <pf_q-steering.h>
 
 /* vector of pointers to pfq_sock */
 
@@ -58,7 +60,7 @@ pfq_sock_finish(void)
 int pfq_get_free_id(struct pfq_sock * so)
 {
         int n = 0;
-        for(; n < Q_MAX_ID; n++)
+        for(; n < max_sockets; n++)
         {
                 if (!atomic_long_cmpxchg(pfq_sock_vector + n, 0, (long)so)) {
 			if(atomic_inc_return(&pfq_sock_count) == 1)
@@ -80,7 +82,7 @@ struct pfq_sock *
 pfq_get_sock_by_id(int id)
 {
         struct pfq_sock *so;
-        if (unlikely(id >= Q_MAX_ID)) {
+        if (unlikely(id >= max_sockets)) {
                 pr_devel("[PFQ] pfq_get_sock_by_id: bad id=%d!\n", id);
                 return NULL;
         }
@@ -92,11 +94,15 @@ pfq_get_sock_by_id(int id)
 
 void pfq_release_sock_id(int id)
 {
-        if (unlikely(id >= Q_MAX_ID || id < 0)) {
+        if (unlikely(id >= max_sockets || id < 0)) {
                 pr_devel("[PFQ] pfq_release_sock_by_id: bad id=%d!\n", id);
                 return;
         }
 
+        /* the next owner of the id starts with the default weight */
+
+        pfq_steering_set_weight(id, 1);
+
         atomic_long_set(pfq_sock_vector + id, 0);
         if (atomic_dec_return(&pfq_sock_count) == 0)
         	pfq_sock_finish();
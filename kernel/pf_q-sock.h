@@ -26,6 +26,8 @@
 
 #include <linux/kernel.h>
 #include <linux/poll.h>
+#include <linux/mutex.h>
+#include <linux/seqlock.h>
 #include <linux/pf_q.h>
 
 #include <net/sock.h>
@@ -50,8 +52,16 @@ struct pfq_rx_opt
 	size_t 			queue_size;
 	size_t 			slot_size;
 
+	int			packed;		/* variable-length records */
+	unsigned int		rings;		/* Rx sub-rings (1 = single queue) */
+
 	wait_queue_head_t 	waitqueue;
 
+	atomic_t	       *zcopy_loan;	/* frames lent, per pool frame (zero-copy mode) */
+	unsigned long		zcopy_uaddr;	/* user address of the zero-copy area */
+	struct mm_struct       *zcopy_mm;	/* address space of the zero-copy area */
+	struct mutex		zcopy_lock;	/* frames mapped vs. frames returned */
+
         struct pfq_socket_rx_stats stats;
 
 } ____cacheline_aligned_in_smp;
@@ -65,6 +75,19 @@ pfq_get_rx_queue(struct pfq_rx_opt *that)
 }
 
 
+/* Rx sub-ring: the ring 0 is the rx queue of the shared memory */
+
+static inline
+struct pfq_rx_queue *
+pfq_get_rx_ring(struct pfq_rx_opt *that, unsigned int ring)
+{
+	struct pfq_rx_queue *rx = pfq_get_rx_queue(that);
+	if (rx == NULL || ring == 0)
+		return rx;
+	return Q_SHARED_RX_RING(container_of(rx, struct pfq_shared_queue, rx), ring);
+}
+
+
 static inline
 void pfq_rx_opt_init(struct pfq_rx_opt *that, size_t caplen)
 {
@@ -84,10 +107,26 @@ void pfq_rx_opt_init(struct pfq_rx_opt *that, size_t caplen)
         that->queue_size = 0;
         that->slot_size = 0;
 
+        /* fixed-slot layout by default */
+
+        that->packed = 0;
+
+        /* single Rx queue by default */
+
+        that->rings = 1;
+
         /* initialize waitqueue */
 
         init_waitqueue_head(&that->waitqueue);
 
+        /* zero-copy disabled by default */
+
+        that->zcopy_loan  = NULL;
+        that->zcopy_uaddr = 0;
+        that->zcopy_mm    = NULL;
+
+        mutex_init(&that->zcopy_lock);
+
         /* reset stats */
         sparse_set(&that->stats.recv, 0);
         sparse_set(&that->stats.lost, 0);
@@ -96,16 +135,80 @@ void pfq_rx_opt_init(struct pfq_rx_opt *that, size_t caplen)
 }
 
 
+/* zero-copy Tx: skbs in flight per half of a Tx queue */
+
+struct pfq_tx_zcopy
+{
+	struct ubuf_info	ubuf[2];	/* completion of the skbs, per half */
+	atomic_t		pending[2];	/* skbs (plus the xmit bias) in flight */
+	spinlock_t		lock;		/* serializes the zc_busy flags */
+	struct pfq_tx_queue    *txq;		/* NULL once the queue is disabled */
+	wait_queue_head_t      *waitqueue;	/* producers waiting for Tx space */
+};
+
+
+/* token bucket of a Tx queue: costs are in nsec << Q_TX_SHAPER_SHIFT */
+
+struct pfq_tx_shaper_conf
+{
+	u64			pkt_cost;	/* per packet (0 = unlimited) */
+	u64			byte_cost;	/* per byte (0 = unlimited) */
+	u64			burst;		/* nsec of credit the bucket holds */
+	unsigned int		gen;		/* bumped at each change */
+};
+
+
+/* the configuration is published under the seqlock (Q_SO_TX_RATE); the Tx
+ * thread takes a copy of it before each batch, and owns the rest */
+
+struct pfq_tx_shaper
+{
+	seqlock_t		lock;
+	struct pfq_tx_shaper_conf conf;		/* as set by user-space */
+
+	struct pfq_tx_shaper_conf cur;		/* in use by the Tx thread */
+	u64			next;		/* nsec (real time) of the next batch */
+	u64			frac;		/* fractional part of next */
+};
+
+
+static inline
+void pfq_tx_shaper_init(struct pfq_tx_shaper *sh)
+{
+	memset(sh, 0, sizeof(*sh));
+	seqlock_init(&sh->lock);
+}
+
+
+static inline
+void pfq_tx_shaper_set(struct pfq_tx_shaper *sh, u64 pkt_cost, u64 byte_cost, u64 burst)
+{
+	write_seqlock(&sh->lock);
+	sh->conf.pkt_cost  = pkt_cost;
+	sh->conf.byte_cost = byte_cost;
+	sh->conf.burst     = burst;
+	sh->conf.gen++;
+	write_sequnlock(&sh->lock);
+}
+
+
+struct pfq_tx_service_entry;	/* pf_q-thread.h */
+
+
 struct pfq_tx_queue_info
 {
 	atomic_long_t 		queue_hdr;
 	void 		       *base_addr;
+	struct pfq_tx_zcopy    *zcopy;
 
 	int 			if_index;
 	int 			hw_queue;
 	int 			cpu;
 
+	struct pfq_tx_shaper	shaper;
+
 	struct task_struct     *task;
+	struct pfq_tx_service_entry *service;
 };
 
 
@@ -116,6 +219,12 @@ struct pfq_tx_opt
 	size_t  		queue_size;
 	size_t  		slot_size;
         size_t 	       	 	num_queues;
+	size_t			shared_queues;	/* Tx queues in the shared memory (set at enable) */
+	int			zcopy;
+	int			weight;		/* share of the Tx service thread */
+	int			poll_queue;	/* Tx queue of POLLOUT (-1: any bound queue) */
+
+	wait_queue_head_t	waitqueue;	/* producers waiting for Tx space */
 
 	struct pfq_tx_queue_info queue[Q_MAX_TX_QUEUES];
 
@@ -143,16 +252,26 @@ void pfq_tx_opt_init(struct pfq_tx_opt *that, size_t maxlen)
         that->queue_size = 0;
         that->slot_size  = Q_SPSC_QUEUE_SLOT_SIZE(maxlen);
 	that->num_queues = 0;
+	that->shared_queues = 0;
+	that->zcopy	 = 0;
+	that->weight	 = 1;
+	that->poll_queue = -1;
+
+	init_waitqueue_head(&that->waitqueue);
 
 	for(n = 0; n < Q_MAX_TX_QUEUES; ++n)
 	{
 		atomic_long_set(&that->queue[n].queue_hdr, 0);
 
         	that->queue[n].base_addr = NULL;
+        	that->queue[n].zcopy	 = NULL;
+
+		pfq_tx_shaper_init(&that->queue[n].shaper);
 		that->queue[n].if_index  = -1;
 		that->queue[n].hw_queue  = -1;
 		that->queue[n].cpu       = -1;
 		that->queue[n].task 	 = NULL;
+		that->queue[n].service	 = NULL;
        	}
 
         sparse_set(&that->stats.sent, 0);
@@ -169,12 +288,15 @@ struct pfq_sock
 	int		    	egress_type;
         int 		    	egress_index;
         int 		    	egress_queue;
+	struct net_device __rcu *egress_dev;	/* pinned by the egress binding */
 
 	struct pfq_shmem_descr  shmem;
 
         struct pfq_rx_opt   	rx_opt;
         struct pfq_tx_opt   	tx_opt;
 
+        struct sparse_area	stats_area;	/* per-cpu blocks of the Rx/Tx stats (mmap-able) */
+
 } ____cacheline_aligned_in_smp;
 
 
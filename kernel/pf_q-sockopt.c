@@ -26,6 +26,7 @@
 #include <linux/version.h>
 
 #include <linux/kthread.h>
+#include <linux/math64.h>
 #include <linux/pf_q.h>
 
 #include <pf_q-transmit.h>
@@ -41,6 +42,9 @@
 #include <pf_q-sockopt.h>
 #include <pf_q-endpoint.h>
 #include <pf_q-shared-queue.h>
+#include <pf_q-zcopy.h>
+#include <pf_q-steering.h>
+#include <pf_q-profile.h>
 
 
 int pfq_getsockopt(struct socket *sock,
@@ -140,6 +144,16 @@ int pfq_getsockopt(struct socket *sock,
                         return -EFAULT;
         } break;
 
+        case Q_SO_GET_STATS_CPUS:
+        {
+                int cpus = nr_cpu_ids;
+
+                if (len != sizeof(cpus))
+                        return -EINVAL;
+                if (copy_to_user(optval, &cpus, sizeof(cpus)))
+                        return -EFAULT;
+        } break;
+
         case Q_SO_GET_RX_TSTAMP:
         {
                 if (len != sizeof(so->rx_opt.tstamp))
@@ -148,6 +162,71 @@ int pfq_getsockopt(struct socket *sock,
                         return -EFAULT;
         } break;
 
+        case Q_SO_GET_RX_ZCOPY:
+        {
+        	size_t size = so->rx_opt.zcopy_loan ? pfq_zcopy_mem() : 0;
+
+                if (len != sizeof(size))
+                        return -EINVAL;
+
+                if (copy_to_user(optval, &size, sizeof(size)))
+                        return -EFAULT;
+        } break;
+
+        case Q_SO_GET_RX_PACKED:
+        {
+                if (len != sizeof(so->rx_opt.packed))
+                        return -EINVAL;
+                if (copy_to_user(optval, &so->rx_opt.packed, sizeof(so->rx_opt.packed)))
+                        return -EFAULT;
+        } break;
+
+        case Q_SO_GET_RX_RINGS:
+        {
+                int value = (int)so->rx_opt.rings;
+
+                if (len != sizeof(value))
+                        return -EINVAL;
+                if (copy_to_user(optval, &value, sizeof(value)))
+                        return -EFAULT;
+        } break;
+
+        case Q_SO_GET_TX_QUEUES:
+        {
+                int value = (int)pfq_tx_shared_queues(so);
+
+                if (len != sizeof(value))
+                        return -EINVAL;
+                if (copy_to_user(optval, &value, sizeof(value)))
+                        return -EFAULT;
+        } break;
+
+        case Q_SO_GET_TX_WEIGHT:
+        {
+                if (len != sizeof(so->tx_opt.weight))
+                        return -EINVAL;
+                if (copy_to_user(optval, &so->tx_opt.weight, sizeof(so->tx_opt.weight)))
+                        return -EFAULT;
+        } break;
+
+        case Q_SO_GET_TX_ZCOPY:
+        {
+                if (len != sizeof(so->tx_opt.zcopy))
+                        return -EINVAL;
+                if (copy_to_user(optval, &so->tx_opt.zcopy, sizeof(so->tx_opt.zcopy)))
+                        return -EFAULT;
+        } break;
+
+        case Q_SO_GET_WEIGHT:
+        {
+                int value = pfq_steering_get_weight(so->id);
+
+                if (len != sizeof(value))
+                        return -EINVAL;
+                if (copy_to_user(optval, &value, sizeof(value)))
+                        return -EFAULT;
+        } break;
+
         case Q_SO_GET_SHMEM_SIZE:
         {
         	size_t size = pfq_shared_memory_size(so);
@@ -193,11 +272,18 @@ int pfq_getsockopt(struct socket *sock,
 
         case Q_SO_GET_GROUPS:
         {
-                unsigned long grps;
-                if(len != sizeof(unsigned long))
+                /* the user may request any number of words (at least one):
+                 * groups beyond the requested words are not reported */
+
+                pfq_bitmap_t grps;
+
+                BUILD_BUG_ON(sizeof(grps) != Q_GROUPS_MASK_WORDS * sizeof(unsigned long));
+
+                if (len == 0 || len % sizeof(unsigned long) || len > sizeof(grps))
                         return -EINVAL;
-                grps = pfq_get_groups(so->id);
-                if (copy_to_user(optval, &grps, sizeof(grps)))
+                memset(&grps, 0, sizeof(grps));
+                pfq_get_groups(so->id, grps.word);
+                if (copy_to_user(optval, grps.word, len))
                         return -EFAULT;
         } break;
 
@@ -285,6 +371,73 @@ int pfq_getsockopt(struct socket *sock,
                         return -EFAULT;
         } break;
 
+        case Q_SO_GET_GROUP_PERSISTENT:
+        {
+                struct pfq_group_persistent_read p;
+                pfq_persistent_reduce_t reduce;
+                int err;
+
+                if (len != sizeof(p))
+                        return -EINVAL;
+
+                if (copy_from_user(&p, optval, sizeof(p)))
+                        return -EFAULT;
+
+                err = pfq_check_group(so->id, p.gid, "group persistent");
+                if (err != 0)
+                	return err;
+
+                if (!__pfq_group_access(p.gid, so->id, Q_POLICY_GROUP_UNDEFINED, false)) {
+                        printk(KERN_INFO "[PFQ|%d] group persistent error: permission denied (gid=%d)!\n", so->id, p.gid);
+                        return -EACCES;
+                }
+
+                reduce = pfq_persistent_reducer(p.reduce);
+
+                if (p.index < 0 || p.index >= Q_MAX_PERSISTENT_CPU || !reduce) {
+                        printk(KERN_INFO "[PFQ|%d] group persistent error: bad slot %d or reduce %d!\n", so->id, p.index, p.reduce);
+                        return -EINVAL;
+                }
+
+                memset(p.word, 0, sizeof(p.word));
+
+                __pfq_read_group_persistent(p.gid, p.index, reduce, p.word);
+
+                if (copy_to_user(optval, &p, sizeof(p)))
+                        return -EFAULT;
+        } break;
+
+        case Q_SO_GET_PROFILE:
+        {
+                struct pfq_profile *p;
+                int err;
+
+                if (len != sizeof(*p))
+                        return -EINVAL;
+
+                /* too large for the stack */
+
+                p = kmalloc(sizeof(*p), GFP_KERNEL);
+                if (!p)
+                        return -ENOMEM;
+
+                err = copy_from_user(&p->cpu, optval, sizeof(p->cpu)) ? -EFAULT : 0;
+                if (!err) {
+                        p->enabled = pfq_profile_enabled();
+
+                        err = pfq_profile_read(p->cpu, p->stage);
+                        if (err)
+                                printk(KERN_INFO "[PFQ|%d] profile error: bad cpu %d!\n", so->id, p->cpu);
+                }
+
+                if (!err && copy_to_user(optval, p, sizeof(*p)))
+                        err = -EFAULT;
+
+                kfree(p);
+                if (err)
+                        return err;
+        } break;
+
         default:
                 return -EFAULT;
         }
@@ -344,6 +497,8 @@ int pfq_setsockopt(struct socket *sock,
 				kthread_stop(so->tx_opt.queue[n].task);
 				so->tx_opt.queue[n].task = NULL;
 			}
+
+			pfq_tx_service_detach(so, n);
 		}
 
                 err = pfq_shared_queue_disable(so);
@@ -377,7 +532,11 @@ int pfq_setsockopt(struct socket *sock,
                 }
                 rcu_read_unlock();
 
-                pfq_devmap_update(map_set, bind.if_index, bind.hw_queue, bind.gid);
+                err = pfq_devmap_update(map_set, bind.if_index, bind.hw_queue, bind.gid);
+                if (err < 0) {
+                        printk(KERN_INFO "[PFQ|%d] bind error: if_index=%d hw_queue=%d (%d)!\n", so->id, bind.if_index, bind.hw_queue, err);
+                        return err;
+                }
 
         } break;
 
@@ -404,7 +563,11 @@ int pfq_setsockopt(struct socket *sock,
                 }
                 rcu_read_unlock();
 
-                pfq_devmap_update(map_reset, bind.if_index, bind.hw_queue, bind.gid);
+                err = pfq_devmap_update(map_reset, bind.if_index, bind.hw_queue, bind.gid);
+                if (err < 0) {
+                        printk(KERN_INFO "[PFQ|%d] unbind error: if_index=%d hw_queue=%d (%d)!\n", so->id, bind.if_index, bind.hw_queue, err);
+                        return err;
+                }
 
         } break;
 
@@ -417,32 +580,29 @@ int pfq_setsockopt(struct socket *sock,
                 if (copy_from_user(&info, optval, optlen))
                         return -EFAULT;
 
-                rcu_read_lock();
-                if (!dev_get_by_index_rcu(sock_net(&so->sk), info.if_index)) {
-                        rcu_read_unlock();
-                        printk(KERN_INFO "[PFQ|%d] egress bind: invalid if_index=%d\n", so->id, info.if_index);
+                if (info.hw_queue < -1) {
+                        printk(KERN_INFO "[PFQ|%d] egress bind: invalid queue=%d\n", so->id, info.hw_queue);
                         return -EPERM;
                 }
-                rcu_read_unlock();
 
-                if (info.hw_queue < -1) {
+                switch(pfq_egress_bind(so, sock_net(&so->sk), info.if_index, info.hw_queue))
+                {
+                case 0: break;
+                case -EINVAL:
                         printk(KERN_INFO "[PFQ|%d] egress bind: invalid queue=%d\n", so->id, info.hw_queue);
                         return -EPERM;
+                default:
+                        printk(KERN_INFO "[PFQ|%d] egress bind: invalid if_index=%d\n", so->id, info.if_index);
+                        return -EPERM;
                 }
 
-		so->egress_type  = pfq_endpoint_device;
-                so->egress_index = info.if_index;
-                so->egress_queue = info.hw_queue;
-
                 pr_devel("[PFQ|%d] egress bind: device if_index=%d hw_queue=%d\n", so->id, so->egress_index, so->egress_queue);
 
         } break;
 
         case Q_SO_EGRESS_UNBIND:
         {
-		so->egress_type  = pfq_endpoint_socket;
-                so->egress_index = 0;
-                so->egress_queue = 0;
+                pfq_egress_unbind(so);
                 pr_devel("[PFQ|%d] egress unbind.\n", so->id);
 
         } break;
@@ -483,6 +643,148 @@ int pfq_setsockopt(struct socket *sock,
                                 so->id, so->rx_opt.caplen, so->rx_opt.slot_size);
         } break;
 
+        case Q_SO_SET_RX_ZCOPY:
+        {
+                int value, err = 0;
+
+                if (optlen != sizeof(value))
+                        return -EINVAL;
+
+                if (copy_from_user(&value, optval, optlen))
+                        return -EFAULT;
+
+                if (so->shmem.addr) {
+                        printk(KERN_INFO "[PFQ|%d] zero-copy: socket already enabled!\n", so->id);
+                        return -EPERM;
+                }
+
+                if (value) {
+                        err = pfq_zcopy_enable(&so->rx_opt);
+                        if (err < 0) {
+                                printk(KERN_INFO "[PFQ|%d] zero-copy: not available (zcopy_frames=%d)!\n", so->id, zcopy_frames);
+                                return err;
+                        }
+                }
+                else
+                        pfq_zcopy_disable(&so->rx_opt);
+
+                pr_devel("[PFQ|%d] zero-copy %s.\n", so->id, value ? "enabled" : "disabled");
+        } break;
+
+        case Q_SO_SET_RX_PACKED:
+        {
+                int value;
+
+                if (optlen != sizeof(value))
+                        return -EINVAL;
+
+                if (copy_from_user(&value, optval, optlen))
+                        return -EFAULT;
+
+                if (so->shmem.addr) {
+                        printk(KERN_INFO "[PFQ|%d] packed queue: socket already enabled!\n", so->id);
+                        return -EPERM;
+                }
+
+                so->rx_opt.packed = value ? 1 : 0;
+
+                pr_devel("[PFQ|%d] packed queue %s.\n", so->id, value ? "enabled" : "disabled");
+        } break;
+
+        case Q_SO_SET_TX_ZCOPY:
+        {
+                int value;
+
+                if (optlen != sizeof(value))
+                        return -EINVAL;
+
+                if (copy_from_user(&value, optval, optlen))
+                        return -EFAULT;
+
+                if (so->shmem.addr) {
+                        printk(KERN_INFO "[PFQ|%d] zero-copy Tx: socket already enabled!\n", so->id);
+                        return -EPERM;
+                }
+
+                so->tx_opt.zcopy = value ? 1 : 0;
+
+                pr_devel("[PFQ|%d] zero-copy Tx %s.\n", so->id, value ? "enabled" : "disabled");
+        } break;
+
+        case Q_SO_SET_RX_RINGS:
+        {
+                int value;
+
+                if (optlen != sizeof(value))
+                        return -EINVAL;
+
+                if (copy_from_user(&value, optval, optlen))
+                        return -EFAULT;
+
+                if (so->shmem.addr) {
+                        printk(KERN_INFO "[PFQ|%d] Rx rings: socket already enabled!\n", so->id);
+                        return -EPERM;
+                }
+
+                if (value < 1 || value > Q_MAX_RX_RINGS) {
+                        printk(KERN_INFO "[PFQ|%d] invalid Rx rings=%d (max %d)\n", so->id, value, Q_MAX_RX_RINGS);
+                        return -EPERM;
+                }
+
+                so->rx_opt.rings = (unsigned int)value;
+
+                pr_devel("[PFQ|%d] Rx rings=%d\n", so->id, value);
+        } break;
+
+        case Q_SO_SET_WEIGHT:
+        {
+                int value;
+
+                if (optlen != sizeof(value))
+                        return -EINVAL;
+
+                if (copy_from_user(&value, optval, optlen))
+                        return -EFAULT;
+
+                if (value < 1 || value > Q_MAX_SOCK_WEIGHT) {
+                        printk(KERN_INFO "[PFQ|%d] invalid weight=%d (max %d)\n", so->id, value, Q_MAX_SOCK_WEIGHT);
+                        return -EPERM;
+                }
+
+                pfq_steering_set_weight(so->id, value);
+
+                pr_devel("[PFQ|%d] weight=%d\n", so->id, value);
+        } break;
+
+        case Q_SO_SET_TX_WEIGHT:
+        {
+                int value;
+
+                if (optlen != sizeof(value))
+                        return -EINVAL;
+
+                if (copy_from_user(&value, optval, optlen))
+                        return -EFAULT;
+
+                if (value < 1 || value > Q_MAX_SOCK_WEIGHT) {
+                        printk(KERN_INFO "[PFQ|%d] invalid Tx weight=%d (max %d)\n", so->id, value, Q_MAX_SOCK_WEIGHT);
+                        return -EPERM;
+                }
+
+                so->tx_opt.weight = value;
+
+                pr_devel("[PFQ|%d] Tx weight=%d\n", so->id, value);
+        } break;
+
+        case Q_SO_RX_ZCOPY_RETURN:
+        {
+                if (optlen % sizeof(uint32_t))
+                        return -EINVAL;
+
+                return pfq_zcopy_return(&so->rx_opt, (const uint32_t __user *)optval, optlen / sizeof(uint32_t));
+
+        } break;
+
         case Q_SO_SET_RX_SLOTS:
         {
                 typeof(so->rx_opt.queue_size) slots;
@@ -604,6 +906,123 @@ int pfq_setsockopt(struct socket *sock,
 
         } break;
 
+        case Q_SO_GROUP_STEERING:
+        {
+                struct pfq_group_steering steer;
+                int err;
+
+                if (optlen != sizeof(steer))
+                        return -EINVAL;
+
+                if (copy_from_user(&steer, optval, optlen))
+                        return -EFAULT;
+
+                err = pfq_check_group_access(so->id, steer.gid, "group steering");
+                if (err != 0)
+                	return err;
+
+                if (steer.mode != Q_STEERING_FOLD && steer.mode != Q_STEERING_MAGLEV) {
+                        printk(KERN_INFO "[PFQ|%d] steering error: invalid mode=%d for gid=%d!\n", so->id, steer.mode, steer.gid);
+                        return -EINVAL;
+                }
+
+                __pfq_set_group_steering(steer.gid, steer.mode);
+                pr_devel("[PFQ|%d] steering mode=%d for gid=%d\n", so->id, steer.mode, steer.gid);
+
+        } break;
+
+        case Q_SO_GROUP_WATERMARK:
+        {
+                struct pfq_group_watermark wm;
+                int err;
+
+                if (optlen != sizeof(wm))
+                        return -EINVAL;
+
+                if (copy_from_user(&wm, optval, optlen))
+                        return -EFAULT;
+
+                err = pfq_check_group_access(so->id, wm.gid, "group watermark");
+                if (err != 0)
+                	return err;
+
+                if (wm.watermark < 0 || wm.watermark > 100) {
+                        printk(KERN_INFO "[PFQ|%d] watermark error: invalid value=%d for gid=%d!\n", so->id, wm.watermark, wm.gid);
+                        return -EINVAL;
+                }
+
+                __pfq_set_group_watermark(wm.gid, wm.watermark);
+                pr_devel("[PFQ|%d] steering watermark=%d%% for gid=%d\n", so->id, wm.watermark, wm.gid);
+
+        } break;
+
+        case Q_SO_GROUP_TX_QUEUE:
+        {
+                struct pfq_group_tx_queue txq;
+                int err;
+
+                if (optlen != sizeof(txq))
+                        return -EINVAL;
+
+                if (copy_from_user(&txq, optval, optlen))
+                        return -EFAULT;
+
+                err = pfq_check_group_access(so->id, txq.gid, "group Tx queue");
+                if (err != 0)
+                	return err;
+
+                if (txq.policy != Q_TX_QUEUE_PACKET &&
+                    txq.policy != Q_TX_QUEUE_CPU &&
+                    txq.policy != Q_TX_QUEUE_HASH) {
+                        printk(KERN_INFO "[PFQ|%d] Tx queue error: invalid policy=%d for gid=%d!\n", so->id, txq.policy, txq.gid);
+                        return -EINVAL;
+                }
+
+                __pfq_set_group_tx_queue(txq.gid, txq.policy);
+                pr_devel("[PFQ|%d] Tx queue policy=%d for gid=%d\n", so->id, txq.policy, txq.gid);
+
+        } break;
+
+        case Q_SO_GROUP_TIMESERIES:
+        {
+                struct pfq_group_timeseries_period ts;
+                int err;
+
+                if (optlen != sizeof(ts))
+                        return -EINVAL;
+
+                if (copy_from_user(&ts, optval, optlen))
+                        return -EFAULT;
+
+                err = pfq_check_group_access(so->id, ts.gid, "group time-series");
+                if (err != 0)
+                	return err;
+
+                err = pfq_set_group_timeseries(ts.gid, ts.period);
+                if (err != 0) {
+                        printk(KERN_INFO "[PFQ|%d] time-series error: could not start gid=%d (%d)!\n", so->id, ts.gid, err);
+                        return err;
+                }
+
+                pr_devel("[PFQ|%d] time-series period=%u msec for gid=%d\n", so->id, ts.period, ts.gid);
+
+        } break;
+
+        case Q_SO_SET_PROFILE:
+        {
+                int value;
+
+                if (optlen != sizeof(value))
+                        return -EINVAL;
+
+                if (copy_from_user(&value, optval, optlen))
+                        return -EFAULT;
+
+                pfq_profile_enable(value != 0);
+
+                pr_devel("[PFQ|%d] Rx profile %s.\n", so->id, value ? "enabled" : "disabled");
+        } break;
+
         case Q_SO_GROUP_VLAN_FILT:
         {
                 struct pfq_vlan_toggle filt;
@@ -656,6 +1075,13 @@ int pfq_setsockopt(struct socket *sock,
 			return -EPERM;
 		}
 
+		/* the Tx queues are allocated at enable, one per binding (at least Q_MIN_TX_QUEUES) */
+
+		if (so->shmem.addr && so->tx_opt.num_queues >= so->tx_opt.shared_queues) {
+                        printk(KERN_INFO "[PFQ|%d] Tx bind: socket already enabled (%zu Tx queues bound)!\n", so->id, so->tx_opt.shared_queues);
+			return -EPERM;
+		}
+
                 rcu_read_lock();
                 if (!dev_get_by_index_rcu(sock_net(&so->sk), info.if_index)) {
                         rcu_read_unlock();
@@ -687,17 +1113,70 @@ int pfq_setsockopt(struct socket *sock,
 
         } break;
 
+        case Q_SO_TX_RATE:
+        {
+                struct pfq_tx_rate rate;
+                u64 pkt_cost, byte_cost, unit;
+
+                if (optlen != sizeof(rate))
+                        return -EINVAL;
+
+                if (copy_from_user(&rate, optval, optlen))
+                        return -EFAULT;
+
+                if (rate.queue < 0 || rate.queue >= so->tx_opt.num_queues) {
+                        printk(KERN_INFO "[PFQ|%d] Tx rate: queue %d not bound!\n", so->id, rate.queue);
+                        return -EINVAL;
+                }
+
+                pkt_cost  = rate.pps ? div64_u64((u64)NSEC_PER_SEC << Q_TX_SHAPER_SHIFT, rate.pps) : 0;
+                byte_cost = rate.bps ? div64_u64((u64)NSEC_PER_SEC << (Q_TX_SHAPER_SHIFT + 3), rate.bps) : 0;
+
+                /* the depth is given in packets: the worst case of the two buckets */
+
+                unit = max_t(u64, pkt_cost, (u64)max_len * byte_cost);
+
+                if (rate.burst && unit > div64_u64(ULLONG_MAX, rate.burst)) {
+                        printk(KERN_INFO "[PFQ|%d] Tx rate: burst=%u too deep for the rate!\n", so->id, rate.burst);
+                        return -EINVAL;
+                }
+
+                /* the Tx thread picks the new configuration (and resets the bucket) before its next batch */
+
+                pfq_tx_shaper_set(&so->tx_opt.queue[rate.queue].shaper, pkt_cost, byte_cost,
+                                  (rate.burst * unit) >> Q_TX_SHAPER_SHIFT);
+
+                pr_devel("[PFQ|%d] Tx[%d] rate: pps=%llu bps=%llu burst=%u\n", so->id, rate.queue,
+                		(unsigned long long)rate.pps, (unsigned long long)rate.bps, rate.burst);
+        } break;
+
 	case Q_SO_TX_UNBIND:
         {
         	size_t n;
 
+		/* stop the Tx threads of the bound queues */
+
+		for(n = 0; n < so->tx_opt.num_queues; n++)
+		{
+			if (so->tx_opt.queue[n].task) {
+				kthread_stop(so->tx_opt.queue[n].task);
+				so->tx_opt.queue[n].task = NULL;
+			}
+
+			pfq_tx_service_detach(so, n);
+		}
+
          	for(n = 0; n < Q_MAX_TX_QUEUES; ++n)
 		{
 			so->tx_opt.queue[n].if_index = -1;
 			so->tx_opt.queue[n].hw_queue = -1;
 			so->tx_opt.queue[n].cpu      = -1;
+
+			pfq_tx_shaper_set(&so->tx_opt.queue[n].shaper, 0, 0, 0);
 		}
 
+		so->tx_opt.num_queues = 0;
+
         } break;
 
         case Q_SO_TX_FLUSH:
@@ -738,6 +1217,26 @@ int pfq_setsockopt(struct socket *sock,
 			return err;
         } break;
 
+        case Q_SO_TX_POLL_QUEUE:
+        {
+                int queue;
+
+        	if (optlen != sizeof(queue))
+        		return -EINVAL;
+
+        	if (copy_from_user(&queue, optval, optlen))
+        		return -EFAULT;
+
+		if (queue < -1 || queue >= Q_MAX_TX_QUEUES) {
+			printk(KERN_INFO "[PFQ|%d] Tx poll queue: bad queue %d!\n", so->id, queue);
+			return -EINVAL;
+		}
+
+		so->tx_opt.poll_queue = queue;
+
+		pr_devel("[PFQ|%d] Tx poll queue: %d\n", so->id, queue);
+        } break;
+
         case Q_SO_TX_ASYNC:
         {
                 int toggle, err = 0;
@@ -776,6 +1275,17 @@ int pfq_setsockopt(struct socket *sock,
 					continue;
 				}
 
+				/* shared service: the thread of the cpu serves the queue */
+
+				if (tx_service) {
+					int ret = pfq_tx_service_attach(so, n);
+					if (ret)
+						err = ret;
+					else
+						started++;
+					continue;
+				}
+
 				data = kmalloc(sizeof(struct pfq_thread_data), GFP_KERNEL);
 				if (!data) {
 					printk(KERN_INFO "[PFQ|%d] kernel_thread: could not allocate thread_data! Failed starting thread on cpu %d!\n",
@@ -827,6 +1337,8 @@ int pfq_setsockopt(struct socket *sock,
 					kthread_stop(so->tx_opt.queue[n].task);
 					so->tx_opt.queue[n].task = NULL;
 				}
+
+				pfq_tx_service_detach(so, n);
 			}
 		}
 
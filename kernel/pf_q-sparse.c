@@ -0,0 +1,98 @@
+/***************************************************************
+ *
+ * (C) 2011-14 Nicola Bonelli <nicola@pfq.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ ****************************************************************/
+
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+
+#include <pf_q-sparse.h>
+
+
+/* a block of counters per cpu id, zeroed; vmalloc_user makes the area mappable */
+
+int
+sparse_area_alloc(struct sparse_area *area, size_t block)
+{
+	area->stride = block;
+	area->size   = PAGE_ALIGN(nr_cpu_ids * block);
+	area->addr   = vmalloc_user(area->size);
+
+	if (!area->addr) {
+		printk(KERN_WARNING "[PFQ] sparse area: could not allocate %zu bytes!\n", area->size);
+		area->size = 0;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+
+void
+sparse_area_free(struct sparse_area *area)
+{
+	vfree(area->addr);
+
+	area->addr = NULL;
+	area->size = 0;
+}
+
+
+/* bind n counters to consecutive slots of the blocks, from index */
+
+void
+sparse_area_bind(struct sparse_area *area, size_t index, sparse_counter_t *sc, size_t n)
+{
+	size_t i;
+
+	BUG_ON((index + n) * sizeof(local_t) > area->stride);
+
+	for(i = 0; i < n; i++)
+	{
+		sc[i].base   = area->addr + (index + i) * sizeof(local_t);
+		sc[i].stride = area->stride;
+	}
+}
+
+
+int
+sparse_area_mmap(struct sparse_area *area, struct vm_area_struct *vma)
+{
+	if (vma->vm_flags & VM_WRITE) {
+		printk(KERN_WARNING "[PFQ] stats mmap: the area is read-only!\n");
+		return -EPERM;
+	}
+
+	if (vma->vm_end - vma->vm_start > area->size) {
+		printk(KERN_WARNING "[PFQ] stats mmap: area too large (max %zu bytes)!\n", area->size);
+		return -EINVAL;
+	}
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	if (remap_vmalloc_range(vma, area->addr, 0) != 0) {
+		printk(KERN_WARNING "[PFQ] stats mmap: remap_vmalloc_range error.\n");
+		return -EAGAIN;
+	}
+
+	return 0;
+}
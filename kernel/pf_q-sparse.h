@@ -26,39 +26,77 @@
 #define PF_Q_SPARSE_H
 
 #include <linux/smp.h>  /* get_cpu */
+#include <linux/cache.h>
+#include <linux/cpumask.h>
+#include <linux/mm_types.h>
 #include <asm/local.h>
 
 #include <pf_q-macro.h>
 
 
-typedef struct { local_t value; } ____cacheline_aligned counter_t;
+/*
+ * sparse counters: each cpu updates its own replica of the counter.
+ *
+ * The replicas live in a sparse_area, a block of counters per cpu id
+ * (nr_cpu_ids blocks): the counters of a block share the cache lines of
+ * their cpu, and the area can be mapped read-only in user space.
+ */
+
+typedef struct
+{
+	char 	*base;		/* replica of cpu 0 */
+	size_t 	 stride;	/* bytes between the replicas */
+
+} sparse_counter_t;
+
+
+struct sparse_area
+{
+	char 	*addr;
+	size_t	 size;		/* page aligned */
+	size_t	 stride;	/* size of a block */
+};
 
 
-typedef struct { counter_t ctx[Q_MAX_CPU]; } sparse_counter_t;
+#define SPARSE_BLOCK_SIZE(counters)	ALIGN((counters) * sizeof(local_t), SMP_CACHE_BYTES)
+#define SPARSE_COUNTERS(obj)		(sizeof(obj)/sizeof(sparse_counter_t))
+
+
+extern int  sparse_area_alloc(struct sparse_area *area, size_t block);
+extern void sparse_area_free(struct sparse_area *area);
+extern void sparse_area_bind(struct sparse_area *area, size_t index, sparse_counter_t *sc, size_t n);
+extern int  sparse_area_mmap(struct sparse_area *area, struct vm_area_struct *vma);
+
+
+static inline
+local_t *__sparse_ptr(sparse_counter_t *sc, int cpu)
+{
+	return (local_t *)(sc->base + cpu * sc->stride);
+}
 
 
 static inline
 void __sparse_inc(sparse_counter_t *sc, int cpu)
 {
-        local_inc(&sc->ctx[cpu & Q_MAX_CPU_MASK].value);
+        local_inc(__sparse_ptr(sc, cpu));
 }
 
 static inline
 void __sparse_dec(sparse_counter_t *sc, int cpu)
 {
-        local_dec(&sc->ctx[cpu & Q_MAX_CPU_MASK].value);
+        local_dec(__sparse_ptr(sc, cpu));
 }
 
 static inline
 void __sparse_add(sparse_counter_t *sc, long n, int cpu)
 {
-        local_add(n, &sc->ctx[cpu & Q_MAX_CPU_MASK].value);
+        local_add(n, __sparse_ptr(sc, cpu));
 }
 
 static inline
 void __sparse_sub(sparse_counter_t *sc, long n, int cpu)
 {
-        local_sub(n, &sc->ctx[cpu & Q_MAX_CPU_MASK].value);
+        local_sub(n, __sparse_ptr(sc, cpu));
 }
 
 
@@ -96,8 +134,8 @@ static inline
 void sparse_set(sparse_counter_t *sc, long n)
 {
         unsigned int i, me = get_cpu();
-        for(i = 0; i < Q_MAX_CPU; i++)
-                local_set(&sc->ctx[i].value, i == me ? n : 0);
+        for_each_possible_cpu(i)
+                local_set(__sparse_ptr(sc, i), i == me ? n : 0);
         put_cpu();
 }
 
@@ -105,8 +143,8 @@ static inline
 long sparse_read(sparse_counter_t *sc)
 {
         long ret = 0; int i;
-        for(i=0; i < Q_MAX_CPU; i++)
-                ret += local_read(&sc->ctx[i].value);
+        for_each_possible_cpu(i)
+                ret += local_read(__sparse_ptr(sc, i));
 
         return ret;
 }
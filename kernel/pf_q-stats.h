@@ -28,9 +28,11 @@
 #include <linux/pf_q.h>
 
 #include <pf_q-sparse.h>
+#include <pf_q-macro.h>
 
 
-/* sparse_counter_t stats */
+/* sparse_counter_t stats: the socket and group counters are bound to the
+ * slots of pfq_sock_stats_block and pfq_group_stats_block, in order */
 
 
 struct pfq_socket_rx_stats
@@ -78,14 +80,20 @@ struct pfq_global_stats
         sparse_counter_t kern;  	/* passed to kernel */
         sparse_counter_t disc;  	/* discarded due to driver congestion */
         sparse_counter_t abrt; 		/* aborted (e.g. memory problems) */
+        sparse_counter_t zc_copy;	/* zero-copy Tx that fell back to a copy */
 
         sparse_counter_t poll; 		/* number of poll */
         sparse_counter_t wake; 		/* number of wakeup */
+
+        sparse_counter_t batch[Q_BATCH_HIST_SIZE]; /* Rx batches, by log2 of the length */
+        sparse_counter_t tx_delay[Q_TX_DELAY_HIST_SIZE]; /* timestamped Tx, by log2 of the delay (usec) */
 };
 
 static inline
 void pfq_global_stats_reset(struct pfq_global_stats *stats)
 {
+	int n;
+
 	sparse_set(&stats->recv, 0);
 	sparse_set(&stats->lost, 0);
 	sparse_set(&stats->sent, 0);
@@ -93,9 +101,16 @@ void pfq_global_stats_reset(struct pfq_global_stats *stats)
 	sparse_set(&stats->kern, 0);
 	sparse_set(&stats->disc, 0);
 	sparse_set(&stats->abrt, 0);
+	sparse_set(&stats->zc_copy, 0);
 
 	sparse_set(&stats->poll, 0);
 	sparse_set(&stats->wake, 0);
+
+	for(n = 0; n < Q_BATCH_HIST_SIZE; n++)
+		sparse_set(&stats->batch[n], 0);
+
+	for(n = 0; n < Q_TX_DELAY_HIST_SIZE; n++)
+		sparse_set(&stats->tx_delay[n], 0);
 }
 
 
@@ -0,0 +1,262 @@
+/***************************************************************
+ *
+ * (C) 2011-14 Nicola Bonelli <nicola@pfq.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ ****************************************************************/
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/topology.h>
+#include <linux/jhash.h>
+
+#include <pf_q-steering.h>
+#include <pf_q-sock.h>
+#include <pf_q-shared-queue.h>
+
+
+#define Q_MAGLEV_EMPTY		0xffff
+
+
+atomic_t pfq_steering_gen = ATOMIC_INIT(0);
+
+static uint8_t pfq_sock_weight[Q_MAX_ID];	/* 0 stands for the default (1) */
+
+
+void
+pfq_steering_set_weight(int id, int weight)
+{
+	if (id < 0 || id >= Q_MAX_ID)
+		return;
+
+	ACCESS_ONCE(pfq_sock_weight[id]) = (uint8_t)(weight > 1 ? weight : 0);
+
+	pfq_steering_invalidate();
+}
+
+
+/* drop the per-cpu caches and pins (on the next packet) */
+
+void
+pfq_steering_invalidate(void)
+{
+	smp_wmb();
+	atomic_inc(&pfq_steering_gen);
+}
+
+
+struct pfq_steering_local *
+pfq_steering_alloc(int cpu)
+{
+	struct pfq_steering_local *sl;
+	int n;
+
+	sl = kzalloc_node(sizeof(struct pfq_steering_local), GFP_KERNEL, cpu_to_node(cpu));
+	if (!sl)
+		return NULL;
+
+	for(n = 0; n < Q_STEERING_CACHE_WAYS; n++)
+		sl->way[n].gid = -1;
+
+	return sl;
+}
+
+
+int
+pfq_steering_get_weight(int id)
+{
+	if (id < 0 || id >= Q_MAX_ID)
+		return 0;
+
+	return ACCESS_ONCE(pfq_sock_weight[id]) ? : 1;
+}
+
+
+/* the permutation of a socket only depends on its id */
+
+static void
+maglev_permutation(struct pfq_steering_local *sl, struct pfq_steering_cache *sc, int n)
+{
+	u32 id = (u32)sc->sock_id[n];
+
+	sl->offset[n] = jhash_1word(id, 0x5f3759df) % Q_STEERING_TABLE_SIZE;
+	sl->skip[n]   = jhash_1word(id, 0x9e3779b9) % (Q_STEERING_TABLE_SIZE - 1) + 1;
+	sl->next[n]   = 0;
+}
+
+
+/* sockets take turns, each one claiming the next free slots of its
+ * permutation (as many as its weight), until the table is full */
+
+static void
+maglev_populate(struct pfq_steering_local *sl, struct pfq_steering_cache *sc)
+{
+	int n, filled = 0;
+
+	for(n = 0; n < sc->sock_cnt; n++)
+		maglev_permutation(sl, sc, n);
+
+	memset(sc->table, 0xff, sizeof(sc->table));
+
+	for(;;)
+	{
+		for(n = 0; n < sc->sock_cnt; n++)
+		{
+			int w;
+
+			for(w = 0; w < sl->weight[n]; w++)
+			{
+				unsigned int c;
+
+				do {
+					c = (sl->offset[n] + (u32)sl->next[n] * sl->skip[n]) % Q_STEERING_TABLE_SIZE;
+					sl->next[n]++;
+				}
+				while (sc->table[c] != Q_MAGLEV_EMPTY);
+
+				sc->table[c] = (uint16_t)sc->sock_id[n];
+
+				if (++filled == Q_STEERING_TABLE_SIZE)
+					return;
+			}
+		}
+	}
+}
+
+
+/* fold on weights: each socket takes a range of slots of proportional size */
+
+static void
+fold_populate(struct pfq_steering_local *sl, struct pfq_steering_cache *sc)
+{
+	unsigned int total = 0, cumul = 0, c = 0, end;
+	int n;
+
+	for(n = 0; n < sc->sock_cnt; n++)
+		total += sl->weight[n];
+
+	for(n = 0; n < sc->sock_cnt; n++)
+	{
+		cumul += sl->weight[n];
+		end = cumul * Q_STEERING_TABLE_SIZE / total;
+
+		for(; c < end; c++)
+			sc->table[c] = (uint16_t)sc->sock_id[n];
+	}
+}
+
+
+/* rebuild the least recently used cache for the given group and set */
+
+struct pfq_steering_cache *
+pfq_steering_update(struct pfq_steering_local *sl, int gid, const unsigned long *mask, int mode)
+{
+	struct pfq_steering_cache *sc = &sl->way[0];
+	bool weighted = false;
+	int n, eid;
+
+	for(n = 1; n < Q_STEERING_CACHE_WAYS; n++)
+	{
+		if ((int)(sl->way[n].stamp - sc->stamp) < 0)
+			sc = &sl->way[n];
+	}
+
+	sc->gen = atomic_read(&pfq_steering_gen);
+	smp_rmb();
+
+	pfq_bitmap_copy(sc->eligible_mask.word, mask, pfq_sock_words);
+
+	sc->gid = gid;
+	sc->mode = mode;
+	sc->stamp = ++sl->clock;
+	sc->sock_cnt = 0;
+
+	pfq_bitmap_foreach(sc->eligible_mask.word, pfq_sock_words, eid,
+	{
+		sl->weight[sc->sock_cnt] = (uint8_t)pfq_steering_get_weight(eid);
+		if (sl->weight[sc->sock_cnt] != sl->weight[0])
+			weighted = true;
+
+		sc->sock_id[sc->sock_cnt++] = (uint16_t)eid;
+	})
+
+	sc->use_table = sc->sock_cnt && (mode == Q_STEERING_MAGLEV || weighted);
+
+	if (!sc->use_table)
+		return sc;
+
+	if (mode == Q_STEERING_MAGLEV)
+		maglev_populate(sl, sc);
+	else
+		fold_populate(sl, sc);
+
+	return sc;
+}
+
+
+static inline bool
+sock_above_watermark(int id, int watermark, int cpu)
+{
+	struct pfq_sock *so = pfq_get_sock_by_id(id);
+	if (!so)
+		return true;
+	return pfq_mpsc_ring_usage(&so->rx_opt, cpu) >= watermark;
+}
+
+
+/* load-aware steering: id is the socket selected by the lookup */
+
+int
+pfq_steering_overflow(struct pfq_steering_local *sl, struct pfq_steering_cache *sc,
+		      int id, uint32_t hash, int watermark, int cpu)
+{
+	struct pfq_steering_pin *pin = &sl->pin[(hash ^ (uint32_t)sc->gid * 0x9e3779b9U) & (Q_STEERING_PIN_SIZE - 1)];
+	int n, i;
+
+	/* established flow: stick to its socket, as long as it is eligible */
+
+	if (pin->hash == hash && pin->id && pin->gid == sc->gid && pin->gen == sc->gen &&
+	    pfq_bitmap_test(sc->eligible_mask.word, pin->id - 1))
+		return pin->id - 1;
+
+	/* new flow: overflow to the next eligible socket below the watermark
+	 * (if every socket is above, the selected one is kept) */
+
+	if (sock_above_watermark(id, watermark, cpu)) {
+
+		for(n = 0; n < sc->sock_cnt && sc->sock_id[n] != id; n++)
+		{ }
+
+		for(i = 1; i < sc->sock_cnt; i++)
+		{
+			int next = sc->sock_id[(n + i) % sc->sock_cnt];
+			if (!sock_above_watermark(next, watermark, cpu)) {
+				id = next;
+				break;
+			}
+		}
+	}
+
+	pin->hash = hash;
+	pin->id   = (uint16_t)(id + 1);
+	pin->gid  = (uint16_t)sc->gid;
+	pin->gen  = sc->gen;
+	return id;
+}
@@ -0,0 +1,226 @@
+/***************************************************************
+ *
+ * (C) 2011-14 Nicola Bonelli <nicola@pfq.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ ****************************************************************/
+
+#ifndef PF_Q_STEERING_H
+#define PF_Q_STEERING_H
+
+#include <linux/kernel.h>
+#include <linux/atomic.h>
+#include <linux/pf_q.h>
+
+#include <pf_q-macro.h>
+#include <pf_q-bitmap.h>
+
+
+/* steering
+ *
+ * A steered packet goes to one of the eligible sockets, chosen by hash.
+ * The set of eligible sockets is cached per-cpu, along with the lookup
+ * table: the table is rebuilt only when the set (or the steering mode of
+ * the group) changes, so that the per-packet cost is a single lookup.
+ * Each cpu keeps a few caches, keyed by group and eligible set (and
+ * replaced LRU), so that groups or class masks that take turns on the
+ * same cpu do not rebuild the table on every switch.
+ *
+ * Q_STEERING_FOLD:   the hash is folded on the number of sockets. Any change
+ *                    of the set remaps almost every flow.
+ *
+ * Q_STEERING_MAGLEV: consistent hashing (Maglev). Each socket fills the
+ *                    table following its own permutation, derived from the
+ *                    socket id: when a socket joins or leaves, about 1/N of
+ *                    the flows move.
+ *
+ * Sockets can be given a weight (1 by default): in both modes the flows are
+ * spread in proportion to the weights. With weights that are not uniform,
+ * fold mode also goes through the table, which gives each socket a range of
+ * slots of proportional size. A change of any weight (or the release of a
+ * group) bumps a generation counter, which invalidates the per-cpu caches.
+ *
+ * A group can also be given an Rx watermark (percent of the socket queue):
+ * a new flow whose socket is above the watermark overflows to the next
+ * eligible socket that is not. Flows are pinned, per-cpu, to the socket
+ * they were first steered to, so that established flows keep their
+ * affinity while the new ones are shed across the group. Pins are keyed
+ * by group and hash, and dropped with the generation.
+ */
+
+#define Q_STEERING_TABLE_SIZE		1021	/* prime, > Q_MAX_ID */
+#define Q_STEERING_PIN_SIZE		256	/* flow-pinning entries (power of 2) */
+#define Q_STEERING_CACHE_WAYS		4	/* steering caches per-cpu */
+
+
+struct pfq_steering_pin
+{
+	uint32_t	hash;
+	uint16_t	id;				/* socket id + 1, 0 = empty */
+	uint16_t	gid;
+	int		gen;				/* pfq_steering_gen at the pin */
+};
+
+
+struct pfq_steering_cache
+{
+	int		gid;				/* -1 = empty */
+	int		mode;
+	int		gen;				/* pfq_steering_gen at the build */
+	bool		use_table;
+	unsigned int	stamp;				/* last use (LRU) */
+
+	pfq_bitmap_t	eligible_mask;
+
+	int		sock_cnt;
+	uint16_t	sock_id[Q_MAX_ID];
+
+	uint16_t	table[Q_STEERING_TABLE_SIZE];	/* socket id, by hash slot */
+};
+
+
+struct pfq_steering_local
+{
+	struct pfq_steering_cache way[Q_STEERING_CACHE_WAYS];
+	unsigned int	clock;
+
+	/* flow pinning (load-aware steering), by hash */
+
+	struct pfq_steering_pin pin[Q_STEERING_PIN_SIZE];
+
+	/* Maglev permutations (scratch for the build, by socket index) */
+
+	uint16_t	offset[Q_MAX_ID];
+	uint16_t	skip[Q_MAX_ID];
+	uint16_t	next[Q_MAX_ID];
+	uint8_t		weight[Q_MAX_ID];
+};
+
+
+extern atomic_t pfq_steering_gen;
+
+extern struct pfq_steering_local *pfq_steering_alloc(int cpu);
+
+extern void pfq_steering_invalidate(void);
+
+extern struct pfq_steering_cache *
+pfq_steering_update(struct pfq_steering_local *sl, int gid, const unsigned long *mask, int mode);
+
+extern int  pfq_steering_overflow(struct pfq_steering_local *sl, struct pfq_steering_cache *sc,
+				  int id, uint32_t hash, int watermark, int cpu);
+
+extern void pfq_steering_set_weight(int id, int weight);
+extern int  pfq_steering_get_weight(int id);
+
+
+/*
+ * Find the next power of two.
+ * from "Hacker's Delight, Henry S. Warren."
+ */
+
+static inline
+unsigned int pfq_clp2(unsigned int x)
+{
+        x = x - 1;
+        x = x | (x >> 1);
+        x = x | (x >> 2);
+        x = x | (x >> 4);
+        x = x | (x >> 8);
+        x = x | (x >> 16);
+        return x + 1;
+}
+
+
+/*
+ * Optimized folding operation...
+ */
+
+static inline
+unsigned int pfq_fold(unsigned int a, unsigned int b)
+{
+	unsigned int c;
+	if (b == 1)
+		return 0;
+        c = b - 1;
+        if (likely((b & c) == 0))
+        	return a & c;
+        switch(b)
+        {
+        case 3:  return a % 3;
+        case 5:  return a % 5;
+        case 6:  return a % 6;
+        case 7:  return a % 7;
+        default: {
+                const unsigned int p = pfq_clp2(b);
+                const unsigned int r = a & (p-1);
+                return r < b ? r : a % b;
+            }
+        }
+}
+
+
+/* return the cache of the group for the given set of eligible sockets */
+
+static inline
+struct pfq_steering_cache *
+pfq_steering_get(struct pfq_steering_local *sl, int gid, const unsigned long *mask, int mode)
+{
+	int gen = atomic_read(&pfq_steering_gen);
+	int n;
+
+	for(n = 0; n < Q_STEERING_CACHE_WAYS; n++)
+	{
+		struct pfq_steering_cache *sc = &sl->way[n];
+
+		if (sc->gid == gid && sc->mode == mode && sc->gen == gen &&
+		    pfq_bitmap_equal(mask, sc->eligible_mask.word, pfq_sock_words)) {
+			sc->stamp = ++sl->clock;
+			return sc;
+		}
+	}
+
+	return pfq_steering_update(sl, gid, mask, mode);
+}
+
+
+/* return the socket id for the given hash, -1 if no socket is eligible */
+
+static inline
+int pfq_steering_lookup(struct pfq_steering_cache *sc, uint32_t hash)
+{
+	unsigned int h;
+
+	if (unlikely(sc->sock_cnt == 0))
+		return -1;
+
+	h = hash ^ (hash >> 8) ^ (hash >> 16);
+
+	if (sc->use_table) {
+
+		/* multiplicative hashing, scaled to the table size */
+
+		h *= 0x9e370001U;
+		return sc->table[((uint64_t)h * Q_STEERING_TABLE_SIZE) >> 32];
+	}
+
+	return sc->sock_id[pfq_fold(h, sc->sock_cnt)];
+}
+
+
+#endif /* PF_Q_STEERING_H */
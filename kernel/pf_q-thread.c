@@ -30,13 +30,18 @@
 #include <linux/module.h>
 #include <linux/version.h>
 #include <linux/kthread.h>
+#include <linux/slab.h>
 
 #include <pf_q-macro.h>
 #include <pf_q-thread.h>
 #include <pf_q-memory.h>
 #include <pf_q-sock.h>
+#include <pf_q-global.h>
 #include <pf_q-transmit.h>
 
+
+static struct pfq_tx_service *tx_services;
+
 int
 pfq_tx_wakeup(struct pfq_sock *so, int index)
 {
@@ -85,3 +90,296 @@ pfq_tx_thread(void *_data)
         kfree(data);
         return 0;
 }
+
+
+/*
+ * Tx service thread: round robin over the queues bound to the cpu,
+ * in proportion to the Tx weight of their sockets (deficit round robin).
+ * When all the queues are idle it spins for a few rounds, then sleeps
+ * until the doorbell rings or an exponential timeout expires.
+ *
+ * A queue never sends more than its deficit in a round, and never makes
+ * the thread wait: the packets in the future, or held back by the token
+ * bucket or by the driver, are left for the next rounds (pending). Thus
+ * a round is short, and a queue is detached at the end of the current one.
+ */
+
+static int
+tx_service_round(struct pfq_tx_service *svc, int cpu, bool *pending)
+{
+	struct pfq_tx_service_entry *e, *tmp;
+	bool detached = false;
+	int total = 0;
+
+	list_for_each_entry_safe(e, tmp, &svc->entries, list)
+	{
+		int sent;
+
+		if (ACCESS_ONCE(e->detach)) {
+			list_del(&e->list);
+			smp_wmb();
+			ACCESS_ONCE(e->detached) = true;
+			detached = true;
+			continue;
+		}
+
+		e->deficit += (long)e->so->tx_opt.weight * Q_TX_SERVICE_QUANTUM;
+
+		/* overdrawn in the previous rounds */
+
+		if (e->deficit <= 0)
+			continue;
+
+		sent = pfq_queue_xmit_poll(e->id, &e->so->tx_opt, e->dev, &e->drain, e->deficit, cpu, cpu_to_node(cpu));
+		if (sent > 0) {
+			e->deficit -= sent;
+			total += sent;
+		}
+		else {
+			/* idle queues do not bank credit */
+			e->deficit = 0;
+		}
+
+		if (e->drain.index || e->drain.swapped)
+			*pending = true;
+	}
+
+	if (detached)
+		wake_up(&svc->detached);
+
+	return total;
+}
+
+
+static int
+pfq_tx_service_thread(void *data)
+{
+	struct pfq_tx_service *svc = (struct pfq_tx_service *)data;
+	unsigned long sleep = 1;
+	int cpu, idle = 0;
+
+	cpu = smp_processor_id();
+
+	printk(KERN_INFO "[PFQ] Tx service thread started on cpu %d.\n", cpu);
+
+	__set_current_state(TASK_RUNNING);
+
+	while (!kthread_should_stop())
+	{
+		bool pending = false;
+		int busy;
+
+		/* attach holds the lock */
+
+		if (!mutex_trylock(&svc->lock)) {
+			pfq_relax();
+			continue;
+		}
+
+		busy = tx_service_round(svc, cpu, &pending);
+
+		mutex_unlock(&svc->lock);
+
+		/* a queue is waiting for its time: keep the timeout short */
+
+		if (pending)
+			sleep = 1;
+
+		if (busy || ++idle < Q_TX_SERVICE_SPIN) {
+			if (busy) {
+				idle = 0;
+				sleep = 1;
+			}
+			pfq_relax();
+			continue;
+		}
+
+		wait_event_interruptible_timeout(svc->doorbell,
+			atomic_read(&svc->ring) || kthread_should_stop(), sleep);
+
+		if (atomic_xchg(&svc->ring, 0)) {
+			idle = 0;
+			sleep = 1;
+		}
+		else
+			sleep = min_t(unsigned long, sleep * 2, msecs_to_jiffies(Q_TX_SERVICE_SLEEP));
+	}
+
+	printk(KERN_INFO "[PFQ] Tx service thread stopped on cpu %d.\n", cpu);
+	return 0;
+}
+
+
+int
+pfq_tx_service_init(void)
+{
+	int cpu;
+
+	tx_services = kcalloc(nr_cpu_ids, sizeof(struct pfq_tx_service), GFP_KERNEL);
+	if (!tx_services) {
+		printk(KERN_WARNING "[PFQ] Tx service: out of memory!\n");
+		return -ENOMEM;
+	}
+
+	for(cpu = 0; cpu < nr_cpu_ids; cpu++)
+	{
+		struct pfq_tx_service *svc = &tx_services[cpu];
+
+		mutex_init(&svc->lock);
+		INIT_LIST_HEAD(&svc->entries);
+		init_waitqueue_head(&svc->doorbell);
+		init_waitqueue_head(&svc->detached);
+		atomic_set(&svc->ring, 0);
+		svc->task = NULL;
+	}
+
+	return 0;
+}
+
+
+void
+pfq_tx_service_fini(void)
+{
+	int cpu;
+
+	if (!tx_services)
+		return;
+
+	/* sockets are released: no entries are left */
+
+	for(cpu = 0; cpu < nr_cpu_ids; cpu++)
+	{
+		if (tx_services[cpu].task)
+			kthread_stop(tx_services[cpu].task);
+	}
+
+	kfree(tx_services);
+	tx_services = NULL;
+}
+
+
+int
+pfq_tx_service_attach(struct pfq_sock *so, size_t index)
+{
+	struct pfq_tx_queue_info *info = &so->tx_opt.queue[index];
+	struct pfq_tx_service_entry *e;
+	struct pfq_tx_service *svc;
+	int err = 0;
+
+	if (info->service)
+		return 0;
+
+	if (info->cpu < 0 || info->cpu >= nr_cpu_ids || !cpu_online(info->cpu)) {
+		printk(KERN_INFO "[PFQ|%d] Tx[%zu] service: cpu %d not available!\n", so->id, index, info->cpu);
+		return -EINVAL;
+	}
+
+	e = kzalloc_node(sizeof(*e), GFP_KERNEL, cpu_to_node(info->cpu));
+	if (!e)
+		return -ENOMEM;
+
+	e->dev = dev_get_by_index(sock_net(&so->sk), info->if_index);
+	if (!e->dev) {
+		printk(KERN_INFO "[PFQ|%d] Tx[%zu] service: bad if_index:%d!\n", so->id, index, info->if_index);
+		kfree(e);
+		return -EPERM;
+	}
+
+	e->so = so;
+	e->id = index;
+
+	pfq_skbuff_batch_init(SKBUFF_BATCH_ADDR(e->drain.skbs));
+
+	svc = &tx_services[info->cpu];
+
+	mutex_lock(&svc->lock);
+
+	if (!svc->task) {
+		struct task_struct *task = kthread_create_on_node(pfq_tx_service_thread, svc, cpu_to_node(info->cpu),
+								  "pfq_tx_svc/%d", info->cpu);
+		if (IS_ERR(task)) {
+			printk(KERN_INFO "[PFQ|%d] Tx service: create failed on cpu %d!\n", so->id, info->cpu);
+			err = PTR_ERR(task);
+			goto out;
+		}
+
+		kthread_bind(task, info->cpu);
+		svc->task = task;
+		wake_up_process(task);
+	}
+
+	list_add_tail(&e->list, &svc->entries);
+	info->service = e;
+
+	pr_devel("[PFQ|%d] Tx[%zu] attached to the service thread on cpu %d\n", so->id, index, info->cpu);
+out:
+	mutex_unlock(&svc->lock);
+
+	if (err) {
+		dev_put(e->dev);
+		kfree(e);
+	}
+
+	return err;
+}
+
+
+void
+pfq_tx_service_detach(struct pfq_sock *so, size_t index)
+{
+	struct pfq_tx_queue_info *info = &so->tx_opt.queue[index];
+	struct pfq_tx_service_entry *e = info->service;
+	struct pfq_tx_service *svc;
+
+	if (!e)
+		return;
+
+	svc = &tx_services[info->cpu];
+
+	/* flag the queue, and wait for the thread to drop it at the end of
+	 * its round (the thread runs as long as it has entries) */
+
+	ACCESS_ONCE(e->detach) = true;
+
+	atomic_set(&svc->ring, 1);
+	wake_up_interruptible(&svc->doorbell);
+
+	wait_event(svc->detached, ACCESS_ONCE(e->detached));
+	smp_rmb();
+
+	info->service = NULL;
+
+	mutex_lock(&svc->lock);
+
+	if (list_empty(&svc->entries) && svc->task) {
+		kthread_stop(svc->task);
+		svc->task = NULL;
+	}
+
+	mutex_unlock(&svc->lock);
+
+	/* the half left midway, if any */
+
+	pfq_tx_drain_abort(&e->drain);
+
+	dev_put(e->dev);
+	kfree(e);
+
+	pr_devel("[PFQ|%d] Tx[%zu] detached from the service thread on cpu %d\n", so->id, index, info->cpu);
+}
+
+
+int
+pfq_tx_service_doorbell(struct pfq_sock *so, size_t index)
+{
+	struct pfq_tx_service *svc;
+
+	if (!so->tx_opt.queue[index].service)
+		return -EPERM;
+
+	svc = &tx_services[so->tx_opt.queue[index].cpu];
+
+	atomic_set(&svc->ring, 1);
+	wake_up_interruptible(&svc->doorbell);
+	return 0;
+}
@@ -29,8 +29,12 @@
 #define PF_Q_THREAD_H
 
 #include <linux/kthread.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
 
 #include <pf_q-sock.h>
+#include <pf_q-transmit.h>
 
 
 extern int pfq_tx_thread(void *data);
@@ -43,6 +47,40 @@ struct pfq_thread_data
 };
 
 
+/* Tx service: a thread per cpu, serving the async Tx queues bound to it */
+
+struct pfq_tx_service_entry
+{
+	struct list_head	 list;
+	struct pfq_sock		*so;
+	struct net_device	*dev;
+	size_t			 id;
+	long			 deficit;	/* packets, deficit round robin */
+	bool			 detach;	/* to be dropped at the end of the round */
+	bool			 detached;	/* dropped: the thread no longer uses it */
+	struct pfq_tx_drain	 drain;		/* half being drained, across rounds */
+};
+
+
+struct pfq_tx_service
+{
+	struct mutex		 lock;		/* entries and task */
+	struct list_head	 entries;
+	struct task_struct	*task;
+	wait_queue_head_t	 doorbell;
+	wait_queue_head_t	 detached;	/* detach waiting for the end of a round */
+	atomic_t		 ring;
+};
+
+
+extern int  pfq_tx_service_init(void);
+extern void pfq_tx_service_fini(void);
+
+extern int  pfq_tx_service_attach(struct pfq_sock *so, size_t index);
+extern void pfq_tx_service_detach(struct pfq_sock *so, size_t index);
+extern int  pfq_tx_service_doorbell(struct pfq_sock *so, size_t index);
+
+
 static inline
 void pfq_relax(void)
 {
@@ -30,14 +30,28 @@
 #include <linux/version.h>
 #include <linux/sched.h>
 #include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/vmalloc.h>
+#include <linux/delay.h>
+#include <linux/slab.h>
 
 #include <linux/skbuff.h>
 #include <linux/netdevice.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include <linux/random.h>
+
+#include <net/checksum.h>
+#include <asm/unaligned.h>
 
 #include <pf_q-thread.h>
 #include <pf_q-transmit.h>
 #include <pf_q-memory.h>
 #include <pf_q-sock.h>
+#include <pf_q-percpu.h>
+#include <pf_q-group.h>
+#include <pf_q-monad.h>
 #include <pf_q-macro.h>
 #include <pf_q-global.h>
 #include <pf_q-GC.h>
@@ -125,7 +139,7 @@ batch_drain(struct pfq_skbuff_batch *skbs, struct local_data *local, struct net_
 	/* free the transmitted skb... */
 
 	for_each_skbuff_upto(sent, skbs, skb, i)
-		pfq_kfree_skb_pool(skb, &local->tx_pool);
+		pfq_kfree_skb_pool(skb);
 
 	/* ... discard them from the batch */
 
@@ -157,6 +171,19 @@ bool keep_trying(int *retry, int sent, int cpu, bool aggressive)
 }
 
 
+static inline
+void tx_delay_account(ktime_t now, uint64_t ts, int cpu)
+{
+	s64 delay = ktime_to_ns(now) - (s64)ts;
+	int n = 0;
+
+	if (delay >= NSEC_PER_USEC)
+		n = min_t(int, ilog2(div_u64(delay, NSEC_PER_USEC)) + 1, Q_TX_DELAY_HIST_SIZE - 1);
+
+	__sparse_inc(&global_stats.tx_delay[n], cpu);
+}
+
+
 static inline
 bool tx_required(struct pfq_skbuff_batch *q, ktime_t now, uint64_t ts)
 {
@@ -167,7 +194,22 @@ bool tx_required(struct pfq_skbuff_batch *q, ktime_t now, uint64_t ts)
 static inline
 ktime_t wait_until(uint64_t ts, int cpu)
 {
+	s64 spin = (s64)tx_sleep_thresh * NSEC_PER_USEC;
 	ktime_t now;
+
+	/* sleep through long gaps, spin only the last tx_sleep_thresh usec */
+
+	if (spin > 0) {
+		s64 gap = (s64)ts - ktime_to_ns(ktime_get_real());
+		if (gap > spin) {
+			ktime_t t = ns_to_ktime(gap - spin);
+			set_current_state(TASK_INTERRUPTIBLE);
+			if (!giveup_tx(cpu))
+				schedule_hrtimeout(&t, HRTIMER_MODE_REL);
+			__set_current_state(TASK_RUNNING);
+		}
+	}
+
 	do
 	{
         	now = ktime_get_real();
@@ -180,38 +222,472 @@ ktime_t wait_until(uint64_t ts, int cpu)
 	return now;
 }
 
+/*
+ * Tx token bucket: a batch waits for the time its queue is allowed to send,
+ * then the cost of the packets transmitted moves that time forward. After an
+ * idle period the bucket lets up to 'burst' nsec of traffic go at once.
+ */
+
+static inline
+void tx_shaper_sync(struct pfq_tx_shaper *sh)
+{
+	struct pfq_tx_shaper_conf conf;
+	unsigned int seq;
+
+	do {
+		seq  = read_seqbegin(&sh->lock);
+		conf = sh->conf;
+	}
+	while (read_seqretry(&sh->lock, seq));
+
+	if (unlikely(conf.gen != sh->cur.gen)) {
+		sh->cur  = conf;
+		sh->next = 0;
+		sh->frac = 0;
+	}
+}
+
+
+static inline
+bool tx_shaper_on(struct pfq_tx_shaper const *sh)
+{
+	return sh->cur.pkt_cost || sh->cur.byte_cost;
+}
+
+
+/* false if the batch is not allowed yet, and the caller does not wait */
+
+static bool
+tx_shaper_wait(struct pfq_tx_shaper *sh, bool nonblock, int cpu)
+{
+	u64 now = ktime_to_ns(ktime_get_real());
+
+	if (sh->next + sh->cur.burst < now) {
+		sh->next = now - sh->cur.burst;
+		sh->frac = 0;
+	}
+
+	if (sh->next > now) {
+		if (nonblock)
+			return false;
+		wait_until(sh->next, cpu);
+	}
+
+	return true;
+}
+
+
+static void
+tx_shaper_charge(struct pfq_tx_shaper *sh, size_t pkts, size_t bytes)
+{
+	u64 cost = max_t(u64, pkts * sh->cur.pkt_cost, bytes * sh->cur.byte_cost) + sh->frac;
+
+	sh->next += cost >> Q_TX_SHAPER_SHIFT;
+	sh->frac  = cost & ((1ULL << Q_TX_SHAPER_SHIFT) - 1);
+}
+
+
+static int
+shaped_drain(struct pfq_skbuff_batch *skbs, struct local_data *local, struct net_device *dev, int hw_queue,
+	     struct pfq_tx_shaper *sh, bool nonblock, int cpu)
+{
+	struct sk_buff *skb;
+	size_t pkts, bytes = 0;
+	int sent, i;
+
+	tx_shaper_sync(sh);
+
+	if (!tx_shaper_on(sh))
+		return batch_drain(skbs, local, dev, hw_queue);
+
+	pkts = pfq_skbuff_batch_len(skbs);
+
+	for_each_skbuff(skbs, skb, i)
+		bytes += skb->len;
+
+	if (!tx_shaper_wait(sh, nonblock, cpu))
+		return 0;
+
+	sent = batch_drain(skbs, local, dev, hw_queue);
+
+	tx_shaper_charge(sh, sent, pkts ? bytes * sent / pkts : 0);
+	return sent;
+}
+
+
+/*
+ * zero-copy Tx: the payload of the skbs is left in the pages of the Tx queue.
+ * The zc_busy flag of a half stays set while the driver holds any of its
+ * pages; user-space does not write into that half until it is cleared.
+ */
+
+static void
+tx_zcopy_hold(struct pfq_tx_zcopy *zc, int half)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&zc->lock, flags);
+
+	if (atomic_inc_return(&zc->pending[half]) == 1 && zc->txq)
+		ACCESS_ONCE(zc->txq->zc_busy[half]) = 1;
+
+	spin_unlock_irqrestore(&zc->lock, flags);
+}
+
+
+static void
+tx_zcopy_put(struct pfq_tx_zcopy *zc, int half)
+{
+	unsigned long flags;
+
+	if (atomic_add_unless(&zc->pending[half], -1, 1))
+		return;
+
+	spin_lock_irqsave(&zc->lock, flags);
+
+	if (atomic_dec_and_test(&zc->pending[half]) && zc->txq) {
+		smp_wmb();
+		ACCESS_ONCE(zc->txq->zc_busy[half]) = 0;
+
+		/* the half is writable again: wake up the producers (under
+		 * the lock, the socket is still there) */
+
+		wake_up_interruptible(zc->waitqueue);
+	}
+
+	spin_unlock_irqrestore(&zc->lock, flags);
+}
+
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0))
+static void
+tx_zcopy_callback(struct ubuf_info *ubuf, bool success)
+#else
+static void
+tx_zcopy_callback(struct ubuf_info *ubuf)
+#endif
+{
+	tx_zcopy_put(ubuf->ctx, (int)ubuf->desc);
+}
+
+
+static struct sk_buff *
+tx_zcopy_alloc_skb(struct pfq_tx_zcopy *zc, int half, char *data, size_t len, int node)
+{
+	struct sk_buff *skb;
+	int nr;
+
+	skb = __alloc_skb(Q_TX_ZCOPY_HEAD, GFP_KERNEL, 0, node);
+	if (unlikely(skb == NULL))
+		return NULL;
+
+	/* the headers go into the linear part... */
+
+	memcpy(__skb_put(skb, Q_TX_ZCOPY_HEAD), data, Q_TX_ZCOPY_HEAD);
+
+	/* ... the rest is attached page by page */
+
+	data += Q_TX_ZCOPY_HEAD;
+	len  -= Q_TX_ZCOPY_HEAD;
+
+	for(nr = 0; len > 0; nr++)
+	{
+		struct page *page = vmalloc_to_page(data);
+		size_t off  = offset_in_page(data);
+		size_t size = min_t(size_t, len, PAGE_SIZE - off);
+
+		if (unlikely(page == NULL || nr == MAX_SKB_FRAGS)) {
+
+			/* the caller falls back to a copy */
+
+			sparse_inc(&global_stats.zc_copy);
+			kfree_skb(skb);
+			return NULL;
+		}
+
+		get_page(page);
+		skb_fill_page_desc(skb, nr, page, off, size);
+
+		skb->len      += size;
+		skb->data_len += size;
+		skb->truesize += size;
+
+		data += size;
+		len  -= size;
+	}
+
+	atomic_inc(&zc->pending[half]);
+
+	skb_shinfo(skb)->destructor_arg = &zc->ubuf[half];
+	skb_shinfo(skb)->tx_flags |= SKBTX_DEV_ZEROCOPY;
+	return skb;
+}
+
 
 int
-__pfq_queue_xmit(size_t idx, struct pfq_tx_opt *to, struct net_device *dev, int cpu, int node)
+pfq_tx_zcopy_enable(struct pfq_tx_queue_info *info, struct pfq_tx_queue *txq, wait_queue_head_t *waitqueue)
 {
-	struct pfq_skbuff_short_batch skbs;
+	struct pfq_tx_zcopy *zc;
+	int n;
 
-	struct pfq_tx_queue *soft_txq;
-	struct netdev_queue *txq;
+	zc = kzalloc(sizeof(struct pfq_tx_zcopy), GFP_KERNEL);
+	if (zc == NULL)
+		return -ENOMEM;
 
-	struct pfq_pkthdr_tx * hdr;
-	struct local_data *local;
-	size_t len, tot_sent = 0;
-	unsigned int n, retry, index;
-       	int last_batch_len, hw_queue;
+	spin_lock_init(&zc->lock);
 
-	char *ptr, *begin, *end;
-        ktime_t now; uint64_t last_ts;
+	for(n = 0; n < 2; n++)
+	{
+		zc->ubuf[n].callback = tx_zcopy_callback;
+		zc->ubuf[n].ctx      = zc;
+		zc->ubuf[n].desc     = n;
 
-	/* get the Tx queue */
+		atomic_set(&zc->pending[n], 0);
+		txq->zc_busy[n] = 0;
+	}
 
-	soft_txq = pfq_get_tx_queue(to, idx);
+	zc->txq = txq;
+	zc->waitqueue = waitqueue;
+	info->zcopy = zc;
+	return 0;
+}
 
-	/* get the netdev_queue for transmission */
 
-	hw_queue = to->queue[idx].hw_queue;
+void
+pfq_tx_zcopy_disable(struct pfq_tx_queue_info *info)
+{
+	struct pfq_tx_zcopy *zc = info->zcopy;
+	unsigned long flags;
+	int n;
 
-	txq = __pfq_pick_tx(dev, &hw_queue);
+	if (zc == NULL)
+		return;
+
+	info->zcopy = NULL;
+
+	/* from now on, completions do not touch the shared memory */
+
+	spin_lock_irqsave(&zc->lock, flags);
+	zc->txq = NULL;
+	spin_unlock_irqrestore(&zc->lock, flags);
+
+	/* wait for the skbs still held by drivers */
+
+	for(n = 0; n < 10 && (atomic_read(&zc->pending[0]) || atomic_read(&zc->pending[1])); n++)
+		msleep(Q_GRACE_PERIOD);
+
+	if (atomic_read(&zc->pending[0]) || atomic_read(&zc->pending[1])) {
+		printk(KERN_WARNING "[PFQ] zero-copy Tx: skbs still in flight (state leaked)!\n");
+		return;
+	}
+
+	kfree(zc);
+}
+
+/*
+ * Tx templates: the descriptor is copied out of the shared memory once per
+ * record, so that user-space can not change the mutators while they are used.
+ */
+
+struct tx_template
+{
+	unsigned int 		copies;
+	size_t			len;
+	int			num_mutators;
+	int			flags;
+	struct pfq_tx_mutator	mutator[Q_TX_MAX_MUTATORS];
+	const char	       *data;
+};
+
+
+static bool
+tx_template_load(struct tx_template *t, struct pfq_pkthdr_tx *hdr, const char *end)
+{
+	struct pfq_tx_template *tmpl = (struct pfq_tx_template *)(hdr+1);
+	int n;
+
+	/* the record must lie within the queue, before reading any of it */
+
+	if ((const char *)tmpl > end || Q_TX_RECORD_LEN(hdr) > (size_t)(end - (const char *)tmpl))
+		return false;
+
+	if (Q_TX_RECORD_LEN(hdr) < sizeof(struct pfq_tx_template))
+		return false;
+
+	t->copies	= ACCESS_ONCE(tmpl->copies);
+	t->len		= ACCESS_ONCE(tmpl->len);
+	t->num_mutators = ACCESS_ONCE(tmpl->num_mutators);
+	t->flags	= ACCESS_ONCE(tmpl->flags);
+
+	if (t->copies == 0 || t->num_mutators > Q_TX_MAX_MUTATORS ||
+	    Q_TX_RECORD_LEN(hdr) < Q_TX_TEMPLATE_SIZE(t->num_mutators, t->len))
+		return false;
+
+	t->data = (const char *)(tmpl->mutator + t->num_mutators);
+	t->len  = min_t(size_t, t->len, max_len);
+
+	memcpy(t->mutator, tmpl->mutator, t->num_mutators * sizeof(struct pfq_tx_mutator));
+
+	for(n = 0; n < t->num_mutators; n++)
+	{
+		struct pfq_tx_mutator const *m = &t->mutator[n];
+
+		if (m->width != 1 && m->width != 2 && m->width != 4)
+			return false;
+		if (m->offset + m->width > t->len || m->min > m->max)
+			return false;
+	}
+
+	return true;
+}
+
+
+/* packets a record stands for: the copies of a template (1 if not valid) */
+
+static unsigned int
+tx_record_packets(struct pfq_pkthdr_tx *hdr, const char *end)
+{
+	struct tx_template t;
+
+	if (!(hdr->len & Q_TX_TEMPLATE))
+		return 1;
+
+	return tx_template_load(&t, hdr, end) ? t.copies : 1;
+}
+
+
+static void
+tx_template_csum(struct sk_buff *skb)
+{
+	struct iphdr *ip;
+	struct udphdr *udp;
+	size_t ihl, ulen;
+
+	if (skb->len < ETH_HLEN + sizeof(struct iphdr) ||
+	    ((struct ethhdr *)skb->data)->h_proto != htons(ETH_P_IP))
+		return;
+
+	ip  = (struct iphdr *)(skb->data + ETH_HLEN);
+	ihl = ip->ihl << 2;
+
+	if (ihl < sizeof(struct iphdr) || skb->len < ETH_HLEN + ihl)
+		return;
+
+	ip->check = 0;
+	ip->check = ip_fast_csum((u8 *)ip, ip->ihl);
+
+	if (ip->protocol != IPPROTO_UDP || (ip->frag_off & htons(IP_MF|IP_OFFSET)))
+		return;
+
+	udp  = (struct udphdr *)((char *)ip + ihl);
+	ulen = skb->len - ETH_HLEN - ihl;
+
+	if (ulen < sizeof(struct udphdr) || ntohs(udp->len) < sizeof(struct udphdr) || ntohs(udp->len) > ulen)
+		return;
+
+	ulen = ntohs(udp->len);
+
+	udp->check = 0;
+	udp->check = csum_tcpudp_magic(ip->saddr, ip->daddr, ulen, IPPROTO_UDP, csum_partial(udp, ulen, 0));
+	if (udp->check == 0)
+		udp->check = CSUM_MANGLED_0;
+}
+
+
+static void
+tx_template_mutate(struct sk_buff *skb, struct tx_template const *t, unsigned int copy)
+{
+	int n;
+
+	for(n = 0; n < t->num_mutators; n++)
+	{
+		struct pfq_tx_mutator const *m = &t->mutator[n];
+		u64 range = (u64)m->max - m->min + 1;
+		u8 *p = skb->data + m->offset;
+		u32 value;
+
+		if (m->op == Q_TX_MUTATOR_RAND)
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,8,0))
+			value = m->min + (u32)(((u64)prandom_u32() * range) >> 32);
+#else
+			value = m->min + (u32)(((u64)random32() * range) >> 32);
+#endif
+		else
+			value = m->min + (u32)(copy % range);
+
+		switch(m->width)
+		{
+		case 1: *p = (u8)value; break;
+		case 2: put_unaligned_be16((u16)value, p); break;
+		case 4: put_unaligned_be32(value, p); break;
+		}
+	}
+
+	if (t->flags & Q_TX_TEMPLATE_CSUM)
+		tx_template_csum(skb);
+}
+
+
+/*
+ * counters of the Tx queue, published in the shared memory for the producer
+ */
+
+static inline
+void tx_queue_account(struct pfq_tx_queue *txq, unsigned int *consumed, int sent, unsigned int disc)
+{
+	if (*consumed) {
+		__atomic_add_fetch(&txq->consumed, *consumed, __ATOMIC_RELAXED);
+		*consumed = 0;
+	}
+	if (sent)
+		__atomic_add_fetch(&txq->sent, sent, __ATOMIC_RELAXED);
+	if (disc)
+		__atomic_add_fetch(&txq->disc, disc, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * a half of the Tx queue has been handed to the producer: wake up those waiting for space
+ */
+
+static inline
+void tx_space_wake_up(struct pfq_tx_opt *to)
+{
+	if (waitqueue_active(&to->waitqueue))
+		wake_up_interruptible(&to->waitqueue);
+}
+
+
+static int
+tx_queue_drain(size_t idx, struct pfq_tx_opt *to, struct net_device *dev, struct pfq_tx_drain *st,
+	       long budget, int cpu, int node);
+
+
+static inline
+void tx_drain_start(struct pfq_tx_drain *st, unsigned int index)
+{
+	st->index  = index;
+	st->offset = 0;
+	st->copy   = 0;
+}
+
+
+int
+__pfq_queue_xmit(size_t idx, struct pfq_tx_opt *to, struct net_device *dev, int cpu, int node)
+{
+	struct pfq_tx_queue *soft_txq;
+	struct pfq_tx_drain st;
+	unsigned int index;
+
+	/* get the Tx queue */
+
+	soft_txq = pfq_get_tx_queue(to, idx);
 
 	/* swap the soft Tx queue */
 
 	if (cpu != Q_NO_KTHREAD) {
 		index = __atomic_add_fetch(&soft_txq->cons, 1, __ATOMIC_RELAXED);
+		tx_space_wake_up(to);
 		while (index != __atomic_load_n(&soft_txq->prod, __ATOMIC_RELAXED))
 		{
 			pfq_relax();
@@ -224,7 +700,137 @@ __pfq_queue_xmit(size_t idx, struct pfq_tx_opt *to, struct net_device *dev, int
 		__atomic_store_n(&soft_txq->prod, 1, __ATOMIC_RELAXED);
 	}
 
-	index++;
+	/* drain the whole half */
+
+	st.swapped   = false;
+	st.resumable = false;
+	st.zc	     = NULL;
+
+	pfq_skbuff_batch_init(SKBUFF_BATCH_ADDR(st.skbs));
+	tx_drain_start(&st, index + 1);
+
+	return tx_queue_drain(idx, to, dev, &st, LONG_MAX, cpu, node);
+}
+
+
+/*
+ * non-blocking variant for threads serving many queues: the swap is
+ * started when the producer half holds packets, and the half is drained
+ * at a later call, once the producer has moved to the other one.
+ *
+ * A call sends up to budget packets and never waits: a half whose next
+ * packet is in the future, or whose batch is held back by the token bucket
+ * or by the driver, is left where it is, and resumed at the next call.
+ */
+
+int
+pfq_queue_xmit_poll(size_t idx, struct pfq_tx_opt *to, struct net_device *dev, struct pfq_tx_drain *st,
+		    long budget, int cpu, int node)
+{
+	struct pfq_tx_queue *soft_txq;
+	struct pfq_pkthdr_tx *hdr;
+	unsigned int index;
+
+	soft_txq = pfq_get_tx_queue(to, idx);
+	if (unlikely(soft_txq == NULL))
+		return 0;
+
+	st->resumable = true;
+
+	/* a half is being drained: resume it */
+
+	if (st->index)
+		return tx_queue_drain(idx, to, dev, st, budget, cpu, node);
+
+	index = __atomic_load_n(&soft_txq->cons, __ATOMIC_RELAXED);
+
+	if (st->swapped) {
+		if (index != __atomic_load_n(&soft_txq->prod, __ATOMIC_ACQUIRE))
+			return 0;
+
+		st->swapped = false;
+		tx_drain_start(st, index + 1);
+		return tx_queue_drain(idx, to, dev, st, budget, cpu, node);
+	}
+
+	hdr = (struct pfq_pkthdr_tx *)(to->queue[idx].base_addr + (index & 1) * soft_txq->size);
+	if (ACCESS_ONCE(hdr->len) == 0)
+		return 0;
+
+	__atomic_add_fetch(&soft_txq->cons, 1, __ATOMIC_RELAXED);
+	st->swapped = true;
+
+	tx_space_wake_up(to);
+	return 0;
+}
+
+
+/* free the skbs not taken by the driver: they hold two references (see batch_drain) */
+
+static void
+tx_batch_release(struct pfq_skbuff_batch *skbs)
+{
+	struct sk_buff *skb;
+	int i;
+
+	for_each_skbuff(skbs, skb, i)
+	{
+		kfree_skb(skb);
+		kfree_skb(skb);
+	}
+
+	pfq_skbuff_batch_init(skbs);
+}
+
+
+/* release a half left midway (the queue is detached from its thread) */
+
+void
+pfq_tx_drain_abort(struct pfq_tx_drain *st)
+{
+	tx_batch_release(SKBUFF_BATCH_ADDR(st->skbs));
+
+	if (st->zc) {
+		tx_zcopy_put(st->zc, st->index & 1);
+		st->zc = NULL;
+	}
+
+	st->index = 0;
+	st->swapped = false;
+}
+
+
+static int
+tx_queue_drain(size_t idx, struct pfq_tx_opt *to, struct net_device *dev, struct pfq_tx_drain *st,
+	       long budget, int cpu, int node)
+{
+	struct pfq_skbuff_batch *skbs = SKBUFF_BATCH_ADDR(st->skbs);
+	struct pfq_tx_shaper *sh = &to->queue[idx].shaper;
+	bool nonblock = st->resumable;
+
+	struct pfq_tx_queue *soft_txq;
+	struct pfq_tx_zcopy *zc;
+	struct netdev_queue *txq;
+	struct tx_template tmpl;
+
+	struct pfq_pkthdr_tx * hdr;
+	struct local_data *local;
+	size_t len, tot_sent = 0;
+	unsigned int n, retry, disc, copy, consumed = 0;
+       	int last_batch_len, hw_queue, half;
+
+	char *ptr, *begin, *end;
+        ktime_t now; uint64_t last_ts;
+
+	/* get the Tx queue */
+
+	soft_txq = pfq_get_tx_queue(to, idx);
+
+	/* get the netdev_queue for transmission */
+
+	hw_queue = to->queue[idx].hw_queue;
+
+	txq = __pfq_pick_tx(dev, &hw_queue);
 
 	/* get local cpu data */
 
@@ -232,16 +838,25 @@ __pfq_queue_xmit(size_t idx, struct pfq_tx_opt *to, struct net_device *dev, int
 
         /* initialize pointer to the current transmit queue */
 
-	begin = to->queue[idx].base_addr + (index & 1) * soft_txq->size;
+	half  = st->index & 1;
+	begin = to->queue[idx].base_addr + half * soft_txq->size;
         end   = to->queue[idx].base_addr + 2 * soft_txq->size;
 
-	/* initialize the batch */
+	/* zero-copy: the half is busy until the driver frees its skbs */
+
+	zc = (dev->features & NETIF_F_SG) ? to->queue[idx].zcopy : NULL;
+	if (zc && !st->zc) {
+		tx_zcopy_hold(zc, half);
+		st->zc = zc;
+	}
 
-	pfq_skbuff_batch_init(SKBUFF_BATCH_ADDR(skbs));
+	/* Tx loop (from where the last call stopped) */
 
-	/* Tx loop */
+	hdr = (struct pfq_pkthdr_tx *)(ptr = begin + st->offset);
 
-	hdr = (struct pfq_pkthdr_tx *)(ptr = begin);
+	copy = st->copy;
+	if (copy && !tx_template_load(&tmpl, hdr, end))
+		copy = 0;
 
 	retry = 0;
 
@@ -250,6 +865,7 @@ __pfq_queue_xmit(size_t idx, struct pfq_tx_opt *to, struct net_device *dev, int
 	for(n = 0; ptr < end && hdr->len != 0; n++, hdr = (struct pfq_pkthdr_tx *)ptr)
 	{
 		struct sk_buff *skb;
+		bool is_tmpl = hdr->len & Q_TX_TEMPLATE;
 
 		/* get tstamp of this packet */
 
@@ -257,95 +873,178 @@ __pfq_queue_xmit(size_t idx, struct pfq_tx_opt *to, struct net_device *dev, int
 
 		/* if the batch is full (or the packet is in the future), transmit the batch */
 
-		if (tx_required(SKBUFF_BATCH_ADDR(skbs), now, last_ts)) {
+		if (tx_required(skbs, now, last_ts)) {
 
-			int sent = batch_drain(SKBUFF_BATCH_ADDR(skbs), local, dev, hw_queue);
+			int sent = shaped_drain(skbs, local, dev, hw_queue, sh, nonblock, cpu);
 			tot_sent += sent;
 
 			__sparse_add(&to->stats.sent, sent, cpu);
 			__sparse_add(&global_stats.sent, sent, cpu);
 
+			tx_queue_account(soft_txq, &consumed, sent, 0);
+
+			/* resumable: the batch is held back (token bucket or driver) */
+
+			if (nonblock) {
+				if (pfq_skbuff_batch_len(skbs))
+					goto requeue;
+			}
+
 			/* break the loop in case of giveup event */
 
-			if (keep_trying(&retry, sent, cpu, false))
+			else if (keep_trying(&retry, sent, cpu, false))
 				continue;
 		}
 
+		/* resumable: the budget is spent, or the packet is in the future */
+
+		if (nonblock && (tot_sent + pfq_skbuff_batch_len(skbs) >= budget ||
+				 last_ts > ktime_to_ns(now)))
+			goto requeue;
+
 		/* wait until the ts */
 
 		if (last_ts > ktime_to_ns(now))
 			now = wait_until(last_ts, cpu);
 
-		/* allocate a packet */
+		/* achieved versus requested time */
+
+		if (last_ts && copy == 0)
+			tx_delay_account(now, last_ts, cpu);
+
+		/* templates: load the descriptor along the first copy */
 
-	 	skb = pfq_tx_alloc_skb(max_len, GFP_KERNEL, node);
-	 	if (unlikely(skb == NULL)) {
-	 		printk(KERN_INFO "[PFQ] Tx could not allocate an skb!\n");
-	 		break;
+		if (is_tmpl && copy == 0 && !tx_template_load(&tmpl, hdr, end)) {
+			__sparse_add(&to->stats.disc, 1, cpu);
+			__sparse_add(&global_stats.disc, 1, cpu);
+			tx_queue_account(soft_txq, &consumed, 0, 1);
+			goto next;
 		}
 
-	 	/* fill the skb */
+	 	len = is_tmpl ? tmpl.len : min_t(size_t, hdr->len, max_len);
 
-	 	len = min_t(size_t, hdr->len, max_len);
+		/* zero-copy: build the skb on the pages of the queue */
 
-	 	skb_reset_tail_pointer(skb);
-	 	skb->dev = dev;
-	 	skb->len = 0;
-	 	__skb_put(skb, len);
+		skb = zc && len > Q_TX_ZCOPY_HEAD && !is_tmpl ?
+			tx_zcopy_alloc_skb(zc, half, (char *)(hdr+1), len, node) : NULL;
+		if (skb == NULL) {
+
+			/* allocate a packet */
+
+			skb = pfq_tx_alloc_skb(max_len, GFP_KERNEL, node);
+			if (unlikely(skb == NULL)) {
+				printk(KERN_INFO "[PFQ] Tx could not allocate an skb!\n");
+				break;
+			}
+
+			/* fill the skb */
 
+			skb_reset_tail_pointer(skb);
+			skb->len = 0;
+			__skb_put(skb, len);
+
+			/* copy bytes in the socket buffer */
+
+			if (is_tmpl) {
+				skb_copy_to_linear_data(skb, tmpl.data, len);
+				tx_template_mutate(skb, &tmpl, copy);
+			}
+			else
+				skb_copy_to_linear_data(skb, hdr+1, len < 64 ? 64 : len);
+		}
+
+	 	skb->dev = dev;
 	 	skb_get(skb);
 
 		skb_set_queue_mapping(skb, hw_queue);
 
-	 	/* copy bytes in the socket buffer */
+                /* transmit packet */
 
-		skb_copy_to_linear_data(skb, hdr+1, len < 64 ? 64 : len);
+		pfq_skbuff_short_batch_push(skbs, skb);
 
-                /* transmit packet */
+		/* stay on a template until its last copy */
 
-		pfq_skbuff_short_batch_push(SKBUFF_BATCH_ADDR(skbs), skb);
+		if (is_tmpl && ++copy < tmpl.copies)
+			continue;
 
+		copy = 0;
+	next:
 	 	/* move ptr to the next packet */
 
-	 	ptr += sizeof(struct pfq_pkthdr_tx) + ALIGN(hdr->len, 8);
+	 	ptr += sizeof(struct pfq_pkthdr_tx) + ALIGN(Q_TX_RECORD_LEN(hdr), 8);
+		consumed++;
 	}
 
 	/* send the last batch */
 
 	retry = 0;
-	while ((last_batch_len=pfq_skbuff_batch_len(SKBUFF_BATCH_ADDR(skbs)))) {
+	while ((last_batch_len=pfq_skbuff_batch_len(skbs))) {
 
-		int sent = batch_drain(SKBUFF_BATCH_ADDR(skbs), local, dev, hw_queue);
+		int sent = shaped_drain(skbs, local, dev, hw_queue, sh, nonblock, cpu);
 		tot_sent += sent;
 
 		__sparse_add(&to->stats.sent, sent, cpu);
 		__sparse_add(&global_stats.sent, sent, cpu);
 
+		tx_queue_account(soft_txq, &consumed, sent, 0);
+
+		/* resumable: try again at the next call */
+
+		if (nonblock) {
+			if (pfq_skbuff_batch_len(skbs))
+				goto requeue;
+			break;
+		}
+
 		/* break the loop when giveup is needed */
 
 		if (!keep_trying(&retry, sent, cpu, true))
 		{
 			__sparse_add(&to->stats.disc, last_batch_len, cpu);
 			__sparse_add(&global_stats.disc, last_batch_len, cpu);
+			tx_queue_account(soft_txq, &consumed, 0, last_batch_len);
+			tx_batch_release(skbs);
 			break;
 		}
 	}
 
-	/* update stat for discarded packets */
+	/* update stat for discarded packets: a template counts for its copies
+	 * (those left, for a template interrupted midway) */
 
-	for(n = 0; ptr < end && hdr->len != 0; n++, hdr = (struct pfq_pkthdr_tx *)ptr)
+	for(n = 0, disc = 0; ptr < end && hdr->len != 0; n++, hdr = (struct pfq_pkthdr_tx *)ptr)
 	{
-		ptr += sizeof(struct pfq_pkthdr_tx) + ALIGN(hdr->len, 8);
+		disc += copy ? tmpl.copies - copy : tx_record_packets(hdr, end);
+		copy = 0;
+
+		ptr += sizeof(struct pfq_pkthdr_tx) + ALIGN(Q_TX_RECORD_LEN(hdr), 8);
 	}
 
-	__sparse_add(&to->stats.disc, n, cpu);
-	__sparse_add(&global_stats.disc, n, cpu);
+	__sparse_add(&to->stats.disc, disc, cpu);
+	__sparse_add(&global_stats.disc, disc, cpu);
+
+	consumed += n;
+	tx_queue_account(soft_txq, &consumed, 0, disc);
 
 	/* clear the queue */
 
 	hdr = (struct pfq_pkthdr_tx *)begin;
         hdr->len = 0;
 
+	if (st->zc) {
+		tx_zcopy_put(st->zc, half);
+		st->zc = NULL;
+	}
+
+	st->index = 0;
+	return tot_sent;
+
+requeue:
+	/* resumable: stop here, the next call goes on from this record */
+
+	st->offset = ptr - begin;
+	st->copy   = copy;
+
+	tx_queue_account(soft_txq, &consumed, 0, 0);
 	return tot_sent;
 }
 
@@ -363,6 +1062,19 @@ pfq_queue_flush(struct pfq_sock *so, int index)
 		return 0;
 	}
 
+	if (so->tx_opt.queue[index].service) {
+
+		/* the caller is the producer: complete a pending swap on its behalf */
+
+		struct pfq_tx_queue *txq = pfq_get_tx_queue(&so->tx_opt, index);
+		unsigned int cons = __atomic_load_n(&txq->cons, __ATOMIC_RELAXED);
+
+		if (cons != __atomic_load_n(&txq->prod, __ATOMIC_RELAXED))
+			__atomic_store_n(&txq->prod, cons, __ATOMIC_RELEASE);
+
+		return pfq_tx_service_doorbell(so, index);
+	}
+
 	dev = dev_get_by_index(sock_net(&so->sk), so->tx_opt.queue[index].if_index);
 	if (!dev) {
 		printk(KERN_INFO "[PFQ] pfq_queue_flush[%d]: bad if_index:%d!\n", index, so->tx_opt.queue[index].if_index);
@@ -517,8 +1229,35 @@ intr:
 }
 
 
-int
-pfq_lazy_xmit(struct gc_buff buff, struct net_device *dev, int hw_queue)
+/* Tx queue of a forwarded packet, as by the policy of its group */
+
+static inline int
+lazy_xmit_queue(struct sk_buff *skb, struct net_device *dev, int hw_queue)
+{
+	struct pfq_monad *monad = PFQ_CB(skb)->monad;
+	unsigned int n = dev->real_num_tx_queues;
+
+	if (!monad || !monad->group || n == 1)
+		return hw_queue;
+
+	switch(ACCESS_ONCE(monad->group->tx_queue))
+	{
+	case Q_TX_QUEUE_CPU:
+		return smp_processor_id() % n;
+	case Q_TX_QUEUE_HASH:
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0))
+		return (int)(((u64)skb_get_hash(skb) * n) >> 32);
+#else
+		return (int)(((u64)skb_get_rxhash(skb) * n) >> 32);
+#endif
+	}
+
+	return hw_queue;
+}
+
+
+static int
+__pfq_lazy_xmit(struct gc_buff buff, struct net_device *dev, int hw_queue)
 {
 	struct gc_log *log = PFQ_CB(buff.skb)->log;
 
@@ -528,6 +1267,9 @@ pfq_lazy_xmit(struct gc_buff buff, struct net_device *dev, int hw_queue)
 		return 0;
 	}
 
+	if (!gc_add_fwd_target(&this_cpu_ptr(cpu_data)->gc, dev, log))
+		return 0;
+
 	skb_set_queue_mapping(buff.skb, hw_queue);
 	log->dev[log->num_devs++] = dev;
 	log->xmit_todo++;
@@ -536,6 +1278,15 @@ pfq_lazy_xmit(struct gc_buff buff, struct net_device *dev, int hw_queue)
 }
 
 
+int
+pfq_lazy_xmit(struct gc_buff buff, struct net_device *dev, int hw_queue)
+{
+	return __pfq_lazy_xmit(buff, dev, lazy_xmit_queue(buff.skb, dev, hw_queue));
+}
+
+
+/* an explicit queue (>= 0) takes precedence over the policy of the group */
+
 int
 pfq_batch_lazy_xmit(struct gc_queue_buff *queue, struct net_device *dev, int hw_queue)
 {
@@ -544,7 +1295,7 @@ pfq_batch_lazy_xmit(struct gc_queue_buff *queue, struct net_device *dev, int hw_
 
 	for_each_gcbuff(queue, buff, i)
 	{
-		if (pfq_lazy_xmit(buff, dev, hw_queue))
+		if (hw_queue < 0 ? pfq_lazy_xmit(buff, dev, hw_queue) : __pfq_lazy_xmit(buff, dev, hw_queue))
 			++n;
 	}
 
@@ -560,7 +1311,7 @@ pfq_batch_lazy_xmit_by_mask(struct gc_queue_buff *queue, unsigned long long mask
 
 	for_each_gcbuff_bitmask(queue, mask, buff, i)
 	{
-		if (pfq_lazy_xmit(buff, dev, hw_queue))
+		if (hw_queue < 0 ? pfq_lazy_xmit(buff, dev, hw_queue) : __pfq_lazy_xmit(buff, dev, hw_queue))
 			++n;
 	}
 
@@ -582,17 +1333,19 @@ pfq_lazy_xmit_exec(struct gc_data *gc, struct lazy_fwd_targets const *ts)
 
 	for(n = 0; n < ts->num; n++)
 	{
-		size_t sent_dev = 0;
+		int mapping = -1;
 
 		dev = ts->dev[n];
 		txq = NULL;
 
-		/* scan the list of skbs, and forward them in batch fashion */
+		/* only the packets annotated for this dev, in a single pass: the
+		 * Tx queue lock is taken again only when the queue changes */
 
-		for(i = 0; i < gc->pool.len; i++)
+		for_each_set_bit(i, ts->mask[n], gc->pool.len)
 		{
 			struct gc_log *log;
-                        size_t j, num;
+                        size_t j, num, next;
+                        bool more;
 
 			/* select the packet */
 
@@ -600,22 +1353,27 @@ pfq_lazy_xmit_exec(struct gc_data *gc, struct lazy_fwd_targets const *ts)
                         log = &gc->log[i];
 			num = gc_count_dev_in_log(dev, log);
 
-			if (num == 0)
-				continue;
+			if (!txq || skb->queue_mapping != mapping) {
 
-			/* the first packet for this dev determines the hw queue */
+				if (txq)
+					__netif_tx_unlock_bh(txq);
 
-			if (!txq) {
-				queue = skb->queue_mapping;
+				mapping = skb->queue_mapping;
+				queue = mapping;
 				txq = pfq_pick_tx(dev, skb, &queue);
 				__netif_tx_lock_bh(txq);
 			}
 
+			/* is the next packet for this dev going to the same queue? */
+
+			next = find_next_bit(ts->mask[n], gc->pool.len, i + 1);
+			more = next < gc->pool.len && gc->pool.queue[next].skb->queue_mapping == mapping;
+
 			/* forward this skb `num` times */
 
 			for (j = 0; j < num; j++)
 			{
-				const int xmit_more = ++sent_dev != ts->cnt[n];
+				const int xmit_more = (j + 1 < num) || more;
 				const bool to_clone = log->to_kernel || log->xmit_todo-- > 1;
 
 				struct sk_buff *nskb = to_clone ? skb_clone(skb, GFP_ATOMIC) : skb_get(skb);
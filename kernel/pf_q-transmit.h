@@ -37,12 +37,20 @@
 #include <pf_q-GC.h>
 
 
-struct lazy_fwd_targets
+/* drain of a half of a Tx queue: the blocking callers drain a half at once,
+ * the service threads resume it across their rounds (resumable) */
+
+struct pfq_tx_drain
 {
-	struct net_device * dev[Q_GC_LOG_QUEUE_LEN];
-	size_t cnt [Q_GC_LOG_QUEUE_LEN];
-	size_t cnt_total;
-	size_t num;
+	unsigned int		index;		/* cons + 1 of the half being drained, 0 = none */
+	bool			swapped;	/* waiting for the producer to switch half */
+	bool			resumable;	/* never wait: return to the caller instead */
+
+	size_t			offset;		/* next record, from the start of the half */
+	unsigned int		copy;		/* next copy of the template at offset */
+	struct pfq_tx_zcopy    *zc;		/* zero-copy hold on the half (NULL = none) */
+
+	struct pfq_skbuff_short_batch skbs;	/* not yet taken by the driver */
 };
 
 
@@ -56,8 +64,15 @@ pfq_queue_xmit(size_t index, struct pfq_tx_opt *to, struct net_device *dev)
 }
 
 
+extern int  pfq_queue_xmit_poll(size_t index, struct pfq_tx_opt *to, struct net_device *dev, struct pfq_tx_drain *st,
+				long budget, int cpu, int node);
+extern void pfq_tx_drain_abort(struct pfq_tx_drain *st);
+
 extern int pfq_queue_flush(struct pfq_sock *so, int index);
 
+extern int  pfq_tx_zcopy_enable(struct pfq_tx_queue_info *info, struct pfq_tx_queue *txq, wait_queue_head_t *waitqueue);
+extern void pfq_tx_zcopy_disable(struct pfq_tx_queue_info *info);
+
 
 extern int pfq_batch_xmit(struct pfq_skbuff_batch *skbs, struct net_device *dev, int queue_index);
 extern int pfq_batch_xmit_by_mask(struct pfq_skbuff_batch *skbs, unsigned long long skbs_mask, struct net_device *dev, int queue_index);
@@ -0,0 +1,449 @@
+/***************************************************************
+ *
+ * (C) 2011-14 Nicola Bonelli <nicola@pfq.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ ****************************************************************/
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+
+#include <pf_q-zcopy.h>
+#include <pf_q-sock.h>
+
+
+struct pfq_zcopy_pool pfq_zcopy_pool;
+
+
+int pfq_zcopy_pool_init(size_t frames)
+{
+	struct pfq_zcopy_pool *pool = &pfq_zcopy_pool;
+	size_t n;
+
+	if (frames == 0)
+		return 0;
+
+	pool->frame = vzalloc(frames * sizeof(struct page *));
+	pool->busy  = vzalloc(frames * sizeof(atomic_t));
+	if (!pool->frame || !pool->busy)
+		goto err;
+
+	for(n = 0; n < frames; n++)
+	{
+		struct page *page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (!page)
+			goto err;
+
+		set_page_private(page, n);
+		pool->frame[n] = page;
+	}
+
+	atomic_set(&pool->cursor, 0);
+	atomic_set(&pool->users, 0);
+
+	pool->size = frames;
+
+	printk(KERN_INFO "[PFQ] zero-copy pool: %zu frames (%zu KB)\n", frames, (frames * PAGE_SIZE) >> 10);
+	return 0;
+err:
+	printk(KERN_WARNING "[PFQ] zero-copy pool: out of memory!\n");
+	pool->size = frames;
+	pfq_zcopy_pool_free();
+	return -ENOMEM;
+}
+
+
+void pfq_zcopy_pool_free(void)
+{
+	struct pfq_zcopy_pool *pool = &pfq_zcopy_pool;
+	size_t n;
+
+	if (pool->frame) {
+		for(n = 0; n < pool->size; n++)
+		{
+			if (pool->frame[n]) {
+				set_page_private(pool->frame[n], 0);
+				put_page(pool->frame[n]);
+			}
+		}
+	}
+
+	vfree(pool->frame);
+	vfree(pool->busy);
+
+	pool->frame = NULL;
+	pool->busy  = NULL;
+	pool->size  = 0;
+}
+
+
+/* build an skb on a free frame of the pool; the skb_shared_info lives at
+ * the end of the frame, as for any other build_skb user */
+
+struct sk_buff *
+pfq_zcopy_alloc_skb(unsigned int length)
+{
+	struct pfq_zcopy_pool *pool = &pfq_zcopy_pool;
+	size_t n;
+
+	if (SKB_DATA_ALIGN(length + NET_SKB_PAD) + SKB_DATA_ALIGN(sizeof(struct skb_shared_info)) > PAGE_SIZE)
+		return NULL;
+
+	for(n = 0; n < Q_ZCOPY_MAX_SCAN; n++)
+	{
+		size_t idx = (unsigned int)atomic_inc_return(&pool->cursor) % pool->size;
+		struct page *page = pool->frame[idx];
+		struct sk_buff *skb;
+
+		if (page_count(page) != 1)
+			continue;
+
+		/* claim the frame, then check it is still free */
+
+		if (atomic_cmpxchg(&pool->busy[idx], 0, 1) != 0)
+			continue;
+
+		if (page_count(page) != 1) {
+			atomic_set(&pool->busy[idx], 0);
+			continue;
+		}
+
+		get_page(page);
+
+		smp_mb();
+		atomic_set(&pool->busy[idx], 0);
+
+		skb = build_skb(page_address(page), PAGE_SIZE);
+		if (unlikely(!skb)) {
+			put_page(page);
+			return NULL;
+		}
+
+		skb_reserve(skb, NET_SKB_PAD);
+		return skb;
+	}
+
+	return NULL;
+}
+
+
+/* per-socket loans */
+
+int pfq_zcopy_enable(struct pfq_rx_opt *ro)
+{
+	if (!pfq_zcopy_pool.size)
+		return -EOPNOTSUPP;
+
+	if (ro->zcopy_loan)
+		return 0;
+
+	ro->zcopy_loan = vzalloc(pfq_zcopy_pool.size * sizeof(atomic_t));
+	if (!ro->zcopy_loan)
+		return -ENOMEM;
+
+	ro->zcopy_uaddr = 0;
+
+	atomic_inc(&pfq_zcopy_pool.users);
+	return 0;
+}
+
+
+/* the user mapping of the frames lent to a socket */
+
+static const struct vm_operations_struct pfq_zcopy_vm_ops;
+
+
+/* the address space of the zero-copy area, if still alive (to be put with mmput) */
+
+static struct mm_struct *
+zcopy_get_mm(struct pfq_rx_opt *ro)
+{
+	struct mm_struct *mm;
+
+	mutex_lock(&ro->zcopy_lock);
+	mm = ro->zcopy_mm;
+	if (mm && !atomic_inc_not_zero(&mm->mm_users))
+		mm = NULL;
+	mutex_unlock(&ro->zcopy_lock);
+	return mm;
+}
+
+
+/* unmap a frame from the zero-copy area of the socket: called with mmap_sem
+ * and zcopy_lock held, before the frame is put */
+
+static void
+zcopy_unmap_frame(struct pfq_rx_opt *ro, struct mm_struct *mm, size_t idx)
+{
+	unsigned long addr = ro->zcopy_uaddr + idx * PAGE_SIZE;
+	struct vm_area_struct *vma;
+
+	if (!mm || !ro->zcopy_uaddr)
+		return;
+
+	vma = find_vma(mm, addr);
+	if (vma && vma->vm_start <= addr && vma->vm_ops == &pfq_zcopy_vm_ops &&
+	    &((struct pfq_sock *)vma->vm_private_data)->rx_opt == ro)
+		zap_vma_ptes(vma, addr, PAGE_SIZE);
+}
+
+
+void pfq_zcopy_release_all(struct pfq_rx_opt *ro)
+{
+	struct mm_struct *mm;
+	size_t n;
+
+	if (!ro->zcopy_loan)
+		return;
+
+	mm = zcopy_get_mm(ro);
+	if (mm)
+		down_read(&mm->mmap_sem);
+
+	mutex_lock(&ro->zcopy_lock);
+
+	for(n = 0; n < pfq_zcopy_pool.size; n++)
+	{
+		int count = atomic_xchg(&ro->zcopy_loan[n], 0);
+		if (count > 0)
+			zcopy_unmap_frame(ro, mm, n);
+		while (count-- > 0)
+			put_page(pfq_zcopy_pool.frame[n]);
+	}
+
+	mutex_unlock(&ro->zcopy_lock);
+
+	if (mm) {
+		up_read(&mm->mmap_sem);
+		mmput(mm);
+	}
+}
+
+
+/* forget the zero-copy area (all the frames given back): no more packets
+ * are shared until a new area is mapped */
+
+void pfq_zcopy_detach(struct pfq_rx_opt *ro)
+{
+	struct mm_struct *mm;
+
+	mutex_lock(&ro->zcopy_lock);
+
+	ro->zcopy_uaddr = 0;
+
+	mm = ro->zcopy_mm;
+	ro->zcopy_mm = NULL;
+
+	mutex_unlock(&ro->zcopy_lock);
+
+	if (mm)
+		mmdrop(mm);
+}
+
+
+void pfq_zcopy_disable(struct pfq_rx_opt *ro)
+{
+	if (!ro->zcopy_loan)
+		return;
+
+	pfq_zcopy_release_all(ro);
+	pfq_zcopy_detach(ro);
+
+	mutex_lock(&ro->zcopy_lock);
+	vfree(ro->zcopy_loan);
+	ro->zcopy_loan = NULL;
+	mutex_unlock(&ro->zcopy_lock);
+
+	atomic_dec(&pfq_zcopy_pool.users);
+}
+
+
+/* give back the frames of the tokens lent to this socket; a frame is
+ * unmapped once its last loan is returned */
+
+static void
+zcopy_put_frames(struct pfq_rx_opt *ro, const uint32_t *token, size_t n)
+{
+	struct mm_struct *mm = zcopy_get_mm(ro);
+	size_t i;
+
+	if (mm)
+		down_read(&mm->mmap_sem);
+
+	mutex_lock(&ro->zcopy_lock);
+
+	for(i = 0; i < n; i++)
+	{
+		uint32_t t = token[i];
+
+		/* tokens not lent to this socket are ignored */
+
+		if (t >= pfq_zcopy_pool.size || !atomic_add_unless(&ro->zcopy_loan[t], -1, 0))
+			continue;
+
+		if (atomic_read(&ro->zcopy_loan[t]) == 0)
+			zcopy_unmap_frame(ro, mm, t);
+
+		put_page(pfq_zcopy_pool.frame[t]);
+	}
+
+	mutex_unlock(&ro->zcopy_lock);
+
+	if (mm) {
+		up_read(&mm->mmap_sem);
+		mmput(mm);
+	}
+}
+
+
+int pfq_zcopy_return(struct pfq_rx_opt *ro, const uint32_t __user *tokens, size_t n)
+{
+	uint32_t buf[64];
+
+	if (!ro->zcopy_loan)
+		return -EPERM;
+
+	while (n)
+	{
+		size_t len = min_t(size_t, n, ARRAY_SIZE(buf));
+
+		/* copy the tokens before taking mmap_sem */
+
+		if (copy_from_user(buf, tokens, len * sizeof(uint32_t)))
+			return -EFAULT;
+
+		zcopy_put_frames(ro, buf, len);
+
+		tokens += len;
+		n -= len;
+	}
+
+	return 0;
+}
+
+
+/* map a frame on the first access, only if it is lent to the socket */
+
+static int
+pfq_zcopy_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct pfq_rx_opt *ro = &((struct pfq_sock *)vma->vm_private_data)->rx_opt;
+	unsigned long addr = (unsigned long)vmf->virtual_address & PAGE_MASK;
+	size_t idx = (addr - ro->zcopy_uaddr) >> PAGE_SHIFT;
+	int ret = VM_FAULT_SIGBUS;
+
+	mutex_lock(&ro->zcopy_lock);
+
+	if (ro->zcopy_loan && addr >= ro->zcopy_uaddr && idx < pfq_zcopy_pool.size &&
+	    atomic_read(&ro->zcopy_loan[idx]) > 0) {
+
+		switch(vm_insert_pfn(vma, addr, page_to_pfn(pfq_zcopy_pool.frame[idx])))
+		{
+		case 0:
+		case -EBUSY:	ret = VM_FAULT_NOPAGE; break;
+		case -ENOMEM:	ret = VM_FAULT_OOM; break;
+		}
+	}
+
+	mutex_unlock(&ro->zcopy_lock);
+	return ret;
+}
+
+
+/* the area holds a reference to the socket, also when split */
+
+static void
+pfq_zcopy_vm_open(struct vm_area_struct *vma)
+{
+	sock_hold(&((struct pfq_sock *)vma->vm_private_data)->sk);
+}
+
+
+static void
+pfq_zcopy_vm_close(struct vm_area_struct *vma)
+{
+	sock_put(&((struct pfq_sock *)vma->vm_private_data)->sk);
+}
+
+
+static const struct vm_operations_struct pfq_zcopy_vm_ops =
+{
+	.open  = pfq_zcopy_vm_open,
+	.close = pfq_zcopy_vm_close,
+	.fault = pfq_zcopy_fault,
+};
+
+
+int pfq_zcopy_mmap(struct pfq_sock *so, struct vm_area_struct *vma)
+{
+	unsigned long size = vma->vm_end - vma->vm_start;
+	struct pfq_rx_opt *ro = &so->rx_opt;
+	int err = 0;
+
+	if (vma->vm_flags & VM_WRITE) {
+		printk(KERN_WARNING "[PFQ|%d] zero-copy mmap: the area is read-only!\n", so->id);
+		return -EPERM;
+	}
+
+	if (size != pfq_zcopy_mem()) {
+		printk(KERN_WARNING "[PFQ|%d] zero-copy mmap: size must be %zu!\n", so->id, pfq_zcopy_mem());
+		return -EINVAL;
+	}
+
+	mutex_lock(&ro->zcopy_lock);
+
+	if (!ro->zcopy_loan) {
+		printk(KERN_WARNING "[PFQ|%d] zero-copy mmap: zero-copy not enabled!\n", so->id);
+		err = -EPERM;
+		goto out;
+	}
+
+	/* a single area per socket: the frames returned are unmapped from it */
+
+	if (ro->zcopy_uaddr) {
+		printk(KERN_WARNING "[PFQ|%d] zero-copy mmap: area already mapped!\n", so->id);
+		err = -EBUSY;
+		goto out;
+	}
+
+	/* no frame is mapped here: they are inserted by pfn on fault, which
+	 * takes no reference to the pages, that only count the owners of
+	 * the frames */
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_IO | VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP | VM_DONTCOPY;
+	vma->vm_private_data = so;
+	vma->vm_ops = &pfq_zcopy_vm_ops;
+
+	pfq_zcopy_vm_open(vma);
+
+	atomic_inc(&vma->vm_mm->mm_count);
+	ro->zcopy_mm = vma->vm_mm;
+
+	smp_wmb();
+
+	ro->zcopy_uaddr = vma->vm_start;
+out:
+	mutex_unlock(&ro->zcopy_lock);
+	return err;
+}
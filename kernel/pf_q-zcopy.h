@@ -0,0 +1,120 @@
+/***************************************************************
+ *
+ * (C) 2011-14 Nicola Bonelli <nicola@pfq.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ ****************************************************************/
+
+#ifndef PF_Q_ZCOPY_H
+#define PF_Q_ZCOPY_H
+
+#include <linux/kernel.h>
+#include <linux/skbuff.h>
+#include <linux/mm.h>
+
+#include <pf_q-macro.h>
+
+
+/* zero-copy Rx
+ *
+ * The pool is a set of pages owned by PFQ (one frame per page). PFQ-aware
+ * drivers allocate Rx buffers from it (see __pfq_netdev_alloc_skb) as long
+ * as at least a socket runs in zero-copy mode. The Rx slot only carries a
+ * descriptor of the packet, whose frame is mapped read-only in the zero-copy
+ * area of the socket.
+ *
+ * The pool is shared by all the sockets, so the area maps a frame only while
+ * it is lent to the socket: the frame is mapped on the first access and
+ * unmapped when the last loan is returned, before the frame can be reused.
+ * A socket can thus read only the packets delivered to it by its groups.
+ *
+ * The owners of a frame are counted by the references to its page: the
+ * pool holds one, the skb built on the frame holds one until its data is
+ * freed (by the last clone), and each loan to a socket holds one until the
+ * user returns the token (or the socket is disabled). The user mappings
+ * are pfn based and take no reference: a frame is free when the pool holds
+ * the only reference left.
+ */
+
+struct pfq_zcopy_pool
+{
+	struct page **	frame;
+	size_t		size;		/* number of frames */
+
+	atomic_t	cursor;		/* next frame to scan */
+	atomic_t	users;		/* sockets in zero-copy mode */
+	atomic_t *	busy;		/* frame being claimed */
+};
+
+
+extern struct pfq_zcopy_pool pfq_zcopy_pool;
+
+struct pfq_rx_opt;
+struct pfq_sock;
+
+extern int  pfq_zcopy_pool_init(size_t frames);
+extern void pfq_zcopy_pool_free(void);
+
+extern struct sk_buff * pfq_zcopy_alloc_skb(unsigned int length);
+
+extern int  pfq_zcopy_enable(struct pfq_rx_opt *ro);
+extern void pfq_zcopy_disable(struct pfq_rx_opt *ro);
+extern void pfq_zcopy_release_all(struct pfq_rx_opt *ro);
+extern void pfq_zcopy_detach(struct pfq_rx_opt *ro);
+extern int  pfq_zcopy_return(struct pfq_rx_opt *ro, const uint32_t __user *tokens, size_t n);
+
+extern int  pfq_zcopy_mmap(struct pfq_sock *so, struct vm_area_struct *vma);
+
+
+static inline
+size_t pfq_zcopy_mem(void)
+{
+	return pfq_zcopy_pool.size * PAGE_SIZE;
+}
+
+
+static inline
+void pfq_zcopy_lend(atomic_t *loan, int idx)
+{
+	get_page(pfq_zcopy_pool.frame[idx]);
+	atomic_inc(&loan[idx]);
+}
+
+
+/* return the index of the frame that holds the skb data, -1 otherwise */
+
+static inline
+int pfq_zcopy_frame(const struct sk_buff *skb)
+{
+	struct page *page;
+	unsigned long idx;
+
+	if (!pfq_zcopy_pool.size || !skb->head_frag || skb_is_nonlinear(skb))
+		return -1;
+
+	page = virt_to_head_page(skb->head);
+	idx  = page_private(page);
+
+	if (idx < pfq_zcopy_pool.size && pfq_zcopy_pool.frame[idx] == page)
+		return (int)idx;
+	return -1;
+}
+
+
+#endif /* PF_Q_ZCOPY_H */
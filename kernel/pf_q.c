@@ -41,6 +41,7 @@
 #include <linux/vmalloc.h>
 #include <linux/percpu.h>
 #include <linux/bug.h>
+#include <linux/log2.h>
 
 #include <net/sock.h>
 #ifdef CONFIG_INET
@@ -56,6 +57,7 @@
 #include <pf_q-devmap.h>
 #include <pf_q-group.h>
 #include <pf_q-engine.h>
+#include <pf_q-profile.h>
 #include <pf_q-symtable.h>
 #include <pf_q-bitops.h>
 #include <pf_q-bpf.h>
@@ -71,6 +73,8 @@
 #include <pf_q-transmit.h>
 #include <pf_q-percpu.h>
 #include <pf_q-GC.h>
+#include <pf_q-zcopy.h>
+#include <pf_q-steering.h>
 
 static struct net_proto_family  pfq_family_ops;
 static struct packet_type       pfq_prot_hook;
@@ -94,10 +98,19 @@ module_param(max_len,         int, 0644);
 module_param(max_queue_slots, int, 0644);
 
 module_param(batch_len,       int, 0644);
+module_param(batch_adaptive,  int, 0644);
+module_param(batch_latency,   int, 0644);
 
 module_param(skb_pool_size,   int, 0644);
+module_param(tx_sleep_thresh, int, 0644);
+module_param(tx_service,      int, 0644);
 module_param(vl_untag,        int, 0644);
 
+module_param(zcopy_frames,    int, 0444);
+
+module_param(max_sockets,     int, 0444);
+module_param(max_groups,      int, 0444);
+
 MODULE_PARM_DESC(direct_capture," Direct capture packets: (0 default)");
 
 MODULE_PARM_DESC(capture_incoming," Capture incoming packets: (1 default)");
@@ -109,12 +122,21 @@ MODULE_PARM_DESC(max_len, " Maximum transmission length (default=1514 bytes)");
 MODULE_PARM_DESC(max_queue_slots, " Max Queue slots (default=262144)");
 
 MODULE_PARM_DESC(batch_len, 	" Batch queue length");
+MODULE_PARM_DESC(batch_adaptive," Adaptive batching, up to the max batch length (default=0)");
+MODULE_PARM_DESC(batch_latency, " Latency bound of adaptive batching, in usec (default=100)");
 MODULE_PARM_DESC(tx_max_retry,  " Transmission max retry (default=1024)");
+MODULE_PARM_DESC(tx_sleep_thresh," Timestamped Tx: sleep through gaps longer than this, in usec (default=0, spin)");
+MODULE_PARM_DESC(tx_service,    " Async Tx: serve the queues bound to a cpu with a single thread (default=0, a thread per queue)");
 
 MODULE_PARM_DESC(vl_untag, " Enable vlan untagging (default=0)");
 
+MODULE_PARM_DESC(zcopy_frames, " Zero-copy Rx pool, in frames of PAGE_SIZE (default=0, disabled)");
+
+MODULE_PARM_DESC(max_sockets, " Max number of sockets (default=64, up to 512)");
+MODULE_PARM_DESC(max_groups,  " Max number of groups (default=64, up to 512)");
+
 #ifdef PFQ_USE_SKB_POOL
-MODULE_PARM_DESC(skb_pool_size, " Socket buffer pool size (default=1024)");
+MODULE_PARM_DESC(skb_pool_size, " Socket buffers per cpu cached in the node depots (default=1024)");
 #endif
 
 #ifdef PFQ_DEBUG
@@ -130,61 +152,15 @@ static DEFINE_SEMAPHORE(sock_sem);
 /* send this packet to selected sockets */
 
 static inline
-void mask_to_sock_queue(unsigned long n, unsigned long mask, unsigned long long *sock_queue)
+void mask_to_sock_queue(unsigned long n, const unsigned long *mask, unsigned long long *sock_queue)
 {
-	unsigned long bit;
-       	pfq_bitwise_foreach(mask, bit,
+	int index;
+	pfq_bitmap_foreach(mask, pfq_sock_words, index,
 	{
-	        int index = pfq_ctz(bit);
                 sock_queue[index] |= 1UL << n;
         })
 }
 
-/*
- * Find the next power of two.
- * from "Hacker's Delight, Henry S. Warren."
- */
-
-inline
-unsigned clp2(unsigned int x)
-{
-        x = x - 1;
-        x = x | (x >> 1);
-        x = x | (x >> 2);
-        x = x | (x >> 4);
-        x = x | (x >> 8);
-        x = x | (x >> 16);
-        return x + 1;
-}
-
-
-/*
- * Optimized folding operation...
- */
-
-inline
-unsigned int pfq_fold(unsigned int a, unsigned int b)
-{
-	unsigned int c;
-	if (b == 1)
-		return 0;
-        c = b - 1;
-        if (likely((b & c) == 0))
-        	return a & c;
-        switch(b)
-        {
-        case 3:  return a % 3;
-        case 5:  return a % 5;
-        case 6:  return a % 6;
-        case 7:  return a % 7;
-        default: {
-                const unsigned int p = clp2(b);
-                const unsigned int r = a & (p-1);
-                return r < b ? r : a % b;
-            }
-        }
-}
-
 
 static inline
 void send_to_kernel(struct sk_buff *skb)
@@ -198,23 +174,20 @@ void send_to_kernel(struct sk_buff *skb)
 static int
 pfq_receive(struct napi_struct *napi, struct sk_buff * skb, int direct)
 {
- 	unsigned long long sock_queue[Q_SKBUFF_SHORT_BATCH];
-        unsigned long group_mask, socket_mask;
+ 	unsigned long long *sock_queue;
+        pfq_bitmap_t group_mask, socket_mask;
 
 	struct local_data * local;
         struct gc_data *gcollector;
 
- 	struct lazy_fwd_targets targets;
 
-        long unsigned n, bit, lb;
+        long unsigned n;
+        int gid, sid;
         struct pfq_monad monad;
 	struct gc_buff buff;
 	size_t this_batch_len;
         int cpu;
-
-#ifdef PFQ_RX_PROFILE
-	cycles_t start, stop;
-#endif
+	cycles_t start;
 
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,9,0))
 	BUILD_BUG_ON_MSG(Q_SKBUFF_SHORT_BATCH > (sizeof(sock_queue[0]) << 3), "skbuff batch overflow");
@@ -237,6 +210,8 @@ pfq_receive(struct napi_struct *napi, struct sk_buff * skb, int direct)
 
 	gcollector = &local->gc;
 
+	sock_queue = local->sock_queue;
+
 	if (likely(skb))
 	{
 		/* if required, timestamp the packet now */
@@ -279,7 +254,30 @@ pfq_receive(struct napi_struct *napi, struct sk_buff * skb, int direct)
 
 		PFQ_CB(buff.skb)->direct = direct;
 
-		if ((gc_size(gcollector) < batch_len) &&
+		if (batch_adaptive) {
+
+			/* hold the packets until the batch is full, or the
+			 * latency bound expires */
+
+			if (gc_size(gcollector) < local->batch_target) {
+
+				if (!hrtimer_active(&local->flush_timer)) {
+					local->batch_start = ktime_get();
+					hrtimer_start(&local->flush_timer,
+						      ns_to_ktime((u64)max(batch_latency, 1) * NSEC_PER_USEC),
+						      HRTIMER_MODE_REL_PINNED);
+				}
+				local_bh_enable();
+				return 0;
+			}
+
+			/* full batch: the latency bound is no longer needed, grow under load */
+
+			hrtimer_try_to_cancel(&local->flush_timer);
+
+			local->batch_target = min_t(int, local->batch_target * 2, Q_SKBUFF_SHORT_BATCH);
+		}
+		else if ((gc_size(gcollector) < batch_len) &&
 		     (ktime_to_ns(ktime_sub(skb_get_ktime(buff.skb), local->last_ts)) < 1000000) )
 		{
 			local_bh_enable();
@@ -294,6 +292,22 @@ pfq_receive(struct napi_struct *napi, struct sk_buff * skb, int direct)
                 	local_bh_enable();
                 	return 0;
 		}
+
+		/* flushed by a timer: shrink the batch only when the pending one
+		 * has really timed out; a stale tasklet or the periodic timer
+		 * leave a younger batch to its own flush timer */
+
+		if (batch_adaptive) {
+
+			if (ktime_to_ns(ktime_sub(ktime_get(), local->batch_start)) <
+			    (s64)max(batch_latency, 1) * NSEC_PER_USEC)
+			{
+				local_bh_enable();
+				return 0;
+			}
+
+			local->batch_target = max(local->batch_target / 2, 1);
+		}
 	}
 
 	/* --- process batch --- */
@@ -301,47 +315,51 @@ pfq_receive(struct napi_struct *napi, struct sk_buff * skb, int direct)
 	this_batch_len = gc_size(gcollector);
 
 	__sparse_add(&global_stats.recv, this_batch_len, cpu);
+	__sparse_inc(&global_stats.batch[min_t(int, ilog2(this_batch_len), Q_BATCH_HIST_SIZE-1)], cpu);
 
-	/* cleanup sock_queue... */
+	/* sock_queue entries are cleared as soon as they are consumed... */
 
-        memset(sock_queue, 0, sizeof(sock_queue));
+ 	pfq_bitmap_zero(group_mask.word, pfq_group_words);
 
- 	group_mask = 0;
+        /* setup all the skbs collected: the devmap entries are RCU protected */
 
-#ifdef PFQ_RX_PROFILE
-	start = get_cycles();
-#endif
+	rcu_read_lock();
 
-        /* setup all the skbs collected */
+	monad.group = NULL;
+
+	start = pfq_profile_begin();
 
 	for_each_skbuff(SKBUFF_BATCH_ADDR(gcollector->pool), skb, n)
         {
-		unsigned long local_group_mask = __pfq_devmap_get_groups(skb->dev->ifindex, skb_get_rx_queue(skb));
+		const unsigned long *local_group_mask = __pfq_devmap_get_groups(skb->dev->ifindex, skb_get_rx_queue(skb));
 
-		group_mask |= local_group_mask;
+		pfq_bitmap_or(group_mask.word, local_group_mask, pfq_group_words);
 
 		PFQ_CB(skb)->group_mask = local_group_mask;
 		PFQ_CB(skb)->monad      = &monad;
 	}
 
+	pfq_profile_end(Q_PROFILE_GC, start);
+
         /* process all groups enabled for this batch of packets */
 
-	pfq_bitwise_foreach(group_mask, bit,
+	pfq_bitmap_foreach(group_mask.word, pfq_group_words, gid,
 	{
-		int gid = pfq_ctz(bit);
-
 		struct pfq_group * this_group = pfq_get_group(gid);
 
 		bool bf_filter_enabled = atomic_long_read(&this_group->bp_filter);
 		bool vlan_filter_enabled = __pfq_vlan_filters_enabled(gid);
 		struct gc_queue_buff refs = { len:0 };
 
-		socket_mask = 0;
+		pfq_bitmap_zero(socket_mask.word, pfq_sock_words);
+
+		/* the group of the monad is also seen by the endpoints (e.g. the Tx queue policy) */
+
+		monad.group = this_group;
 
 		for_each_gcbuff(&gcollector->pool, buff, n)
 		{
 			struct pfq_computation_tree *prg;
-			unsigned long sock_mask = 0;
 
 			/* stop processing packets in GC ? */
 
@@ -350,7 +368,7 @@ pfq_receive(struct napi_struct *napi, struct sk_buff * skb, int direct)
 
 			/* skip this packet for this group ? */
 
-			if ((PFQ_CB(buff.skb)->group_mask & bit) == 0)
+			if (!pfq_bitmap_test(PFQ_CB(buff.skb)->group_mask, gid))
 				continue;
 
 			/* increment recv counter for this group */
@@ -363,13 +381,17 @@ pfq_receive(struct napi_struct *napi, struct sk_buff * skb, int direct)
 			if (bf_filter_enabled) {
 
 				struct sk_filter *bpf = (struct sk_filter *)atomic_long_read(&this_group->bp_filter);
+				bool pass;
 
+				start = pfq_profile_begin();
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(3,15,0))
-				if (bpf && !sk_run_filter(buff.skb, bpf->insns))
+				pass = !bpf || sk_run_filter(buff.skb, bpf->insns);
 #else
-				if (bpf && !SK_RUN_FILTER(bpf, buff.skb))
+				pass = !bpf || SK_RUN_FILTER(bpf, buff.skb);
 #endif
-                        	{
+				pfq_profile_end(Q_PROFILE_BPF, start);
+
+				if (!pass) {
 					__sparse_inc(&this_group->stats.drop, cpu);
 					continue;
 				}
@@ -379,7 +401,13 @@ pfq_receive(struct napi_struct *napi, struct sk_buff * skb, int direct)
 
 			if (vlan_filter_enabled) {
 
-				if (!__pfq_check_group_vlan_filter(gid, buff.skb->vlan_tci & ~VLAN_TAG_PRESENT)) {
+				bool pass;
+
+				start = pfq_profile_begin();
+				pass = __pfq_check_group_vlan_filter(gid, buff.skb->vlan_tci & ~VLAN_TAG_PRESENT);
+				pfq_profile_end(Q_PROFILE_VLAN, start);
+
+				if (!pass) {
 					__sparse_inc(&this_group->stats.drop, cpu);
 					continue;
 				}
@@ -390,7 +418,8 @@ pfq_receive(struct napi_struct *napi, struct sk_buff * skb, int direct)
 			prg = (struct pfq_computation_tree *)atomic_long_read(&this_group->comp);
 			if (prg) {
 
-				unsigned long cbit, eligible_mask = 0;
+				pfq_bitmap_t eligible_mask;
+				unsigned long cbit;
 				size_t to_kernel = PFQ_CB(buff.skb)->log->to_kernel;
 				size_t num_fwd   = PFQ_CB(buff.skb)->log->num_devs;
 
@@ -403,7 +432,9 @@ pfq_receive(struct napi_struct *napi, struct sk_buff * skb, int direct)
 
 				/* run the functional program */
 
+				start = pfq_profile_begin();
 				buff = pfq_run(prg, buff).value;
+				pfq_profile_end(Q_PROFILE_RUN, start);
 
 				/* save a reference of the current packet */
 
@@ -428,76 +459,82 @@ pfq_receive(struct napi_struct *napi, struct sk_buff * skb, int direct)
 
 				/* compute the eligible mask of sockets enabled for this packet... */
 
+				pfq_bitmap_zero(eligible_mask.word, pfq_sock_words);
+
 				pfq_bitwise_foreach(monad.fanout.class_mask, cbit,
 				{
 					int class = pfq_ctz(cbit);
-					eligible_mask |= atomic_long_read(&this_group->sock_mask[class]);
+					pfq_bitmap_or(eligible_mask.word, this_group->sock_mask[class].word, pfq_sock_words);
 				})
 
 
 				if (is_steering(monad.fanout)) {
 
-					/* cache the number of sockets in the mask */
-
-					if (eligible_mask != local->eligible_mask) {
+					/* the per-cpu cache of the group rebuilds the steering table when needed */
 
-						unsigned long ebit;
+					struct pfq_steering_cache *sc = pfq_steering_get(local->steering, gid,
+											 eligible_mask.word, this_group->steering);
 
-						local->eligible_mask = eligible_mask;
-						local->sock_cnt = 0;
+					int id = pfq_steering_lookup(sc, monad.fanout.hash);
 
-						pfq_bitwise_foreach(eligible_mask, ebit,
-						{
-							local->sock_mask[local->sock_cnt++] = ebit;
-						})
-					}
+					int watermark = ACCESS_ONCE(this_group->watermark);
 
-					if (likely(local->sock_cnt)) {
-						unsigned int h = monad.fanout.hash ^ (monad.fanout.hash >> 8) ^ (monad.fanout.hash >> 16);
-						sock_mask |= local->sock_mask[pfq_fold(h, local->sock_cnt)];
+					if (watermark && id >= 0)
+						id = pfq_steering_overflow(local->steering, sc,
+									   id, monad.fanout.hash, watermark, cpu);
+					if (likely(id >= 0)) {
+						sock_queue[id] |= 1UL << n;
+						__pfq_bitmap_set(socket_mask.word, id);
 					}
 				}
 				else {  /* clone or continue ... */
 
-					sock_mask |= eligible_mask;
+					mask_to_sock_queue(n, eligible_mask.word, sock_queue);
+					pfq_bitmap_or(socket_mask.word, eligible_mask.word, pfq_sock_words);
 				}
 			}
 			else { /* save a reference to the current packet */
 
 				refs.queue[refs.len++] = buff;
-				sock_mask |= atomic_long_read(&this_group->sock_mask[0]);
+				mask_to_sock_queue(n, this_group->sock_mask[0].word, sock_queue);
+				pfq_bitmap_or(socket_mask.word, this_group->sock_mask[0].word, pfq_sock_words);
 			}
-
-			mask_to_sock_queue(n, sock_mask, sock_queue);
-
-			socket_mask |= sock_mask;
 		}
 
 		/* copy payload of packets to endpoints... */
 
-		pfq_bitwise_foreach(socket_mask, lb,
+		pfq_bitmap_foreach(socket_mask.word, pfq_sock_words, sid,
 		{
-			int i = pfq_ctz(lb);
-			struct pfq_sock * so = pfq_get_sock_by_id(i);
+			struct pfq_sock * so = pfq_get_sock_by_id(sid);
+
+			start = pfq_profile_begin();
+			copy_to_endpoint_buffs(so, &refs, sock_queue[sid], cpu, gid);
+			pfq_profile_end(Q_PROFILE_ENQUEUE, start);
 
-			copy_to_endpoint_buffs(so, &refs, sock_queue[i], cpu, gid);
+			sock_queue[sid] = 0;
 		})
 	})
 
-	/* forward skbs to network devices */
+	/* forward skbs to network devices (the egress devices are RCU protected) */
 
-	gc_get_fwd_targets(gcollector, &targets);
-
-	if (targets.cnt_total)
+	if (gcollector->fwd.cnt_total)
 	{
-		size_t total = pfq_lazy_xmit_exec(gcollector, &targets);
+		size_t total;
+
+		start = pfq_profile_begin();
+		total = pfq_lazy_xmit_exec(gcollector, &gcollector->fwd);
+		pfq_profile_end(Q_PROFILE_XMIT, start);
 
 		__sparse_add(&global_stats.frwd, total, cpu);
-		__sparse_add(&global_stats.disc, targets.cnt_total - total, cpu);
+		__sparse_add(&global_stats.disc, gcollector->fwd.cnt_total - total, cpu);
 	}
 
+	rcu_read_unlock();
+
 	/* forward skbs to kernel or to the pool */
 
+	start = pfq_profile_begin();
+
 	for_each_skbuff(SKBUFF_BATCH_ADDR(gcollector->pool), skb, n)
 	{
 		struct pfq_cb *cb = PFQ_CB(skb);
@@ -510,7 +547,7 @@ pfq_receive(struct napi_struct *napi, struct sk_buff * skb, int direct)
 			send_to_kernel(skb);
 		}
 		else {
-			pfq_kfree_skb_pool(skb, &local->rx_pool);
+			pfq_kfree_skb_pool(skb);
 		}
 	}
 
@@ -518,14 +555,9 @@ pfq_receive(struct napi_struct *napi, struct sk_buff * skb, int direct)
 
 	gc_reset(gcollector);
 
-	local_bh_enable();
-
-#ifdef PFQ_RX_PROFILE
-	stop = get_cycles();
+	pfq_profile_end(Q_PROFILE_KERNEL, start);
 
-	if (printk_ratelimit())
-		printk(KERN_INFO "[PFQ] Rx profile: %llu_tsc.\n", (stop-start)/batch_len);
-#endif
+	local_bh_enable();
         return 0;
 }
 
@@ -586,6 +618,26 @@ pfq_timer(unsigned long cpu)
 }
 
 
+/* adaptive batching: the hrtimer fires in hard-irq context, the
+ * batch is flushed by a tasklet on the same cpu */
+
+enum hrtimer_restart
+pfq_flush_timer(struct hrtimer *timer)
+{
+	struct local_data *local = container_of(timer, struct local_data, flush_timer);
+
+	tasklet_schedule(&local->flush_tasklet);
+	return HRTIMER_NORESTART;
+}
+
+
+void
+pfq_flush_tasklet(unsigned long cpu)
+{
+	pfq_receive(NULL, NULL, 0);
+}
+
+
 
 static void pfq_sock_destruct(struct sock *sk)
 {
@@ -594,6 +646,8 @@ static void pfq_sock_destruct(struct sock *sk)
         WARN_ON(atomic_read(&sk->sk_rmem_alloc));
         WARN_ON(atomic_read(&sk->sk_wmem_alloc));
 
+        sparse_area_free(&pfq_sk(sk)->stats_area);
+
         sk_refcnt_debug_dec(sk);
 }
 
@@ -637,11 +691,23 @@ pfq_create(
 
         so = pfq_sk(sk);
 
+        /* stats of the socket, in the slots of pfq_sock_stats_block (mmap-able) */
+
+        if (sparse_area_alloc(&so->stats_area, sizeof(struct pfq_sock_stats_block))) {
+                sk_free(sk);
+                return -ENOMEM;
+        }
+
+        sparse_area_bind(&so->stats_area, 0, (sparse_counter_t *)&so->rx_opt.stats, SPARSE_COUNTERS(so->rx_opt.stats));
+        sparse_area_bind(&so->stats_area, offsetof(struct pfq_sock_stats_block, sent)/sizeof(unsigned long),
+        		 (sparse_counter_t *)&so->tx_opt.stats, SPARSE_COUNTERS(so->tx_opt.stats));
+
         /* get a unique id for this sock */
 
         so->id = pfq_get_free_id(so);
         if (so->id == -1) {
                 printk(KERN_WARNING "[PFQ] error: resource exhausted\n");
+                sparse_area_free(&so->stats_area);
                 sk_free(sk);
                 return -EBUSY;
         }
@@ -651,6 +717,7 @@ pfq_create(
 	so->egress_type  = pfq_endpoint_socket;
 	so->egress_index = 0;
 	so->egress_queue = 0;
+	RCU_INIT_POINTER(so->egress_dev, NULL);
 
         so->shmem.addr = NULL;
         so->shmem.size = 0;
@@ -703,16 +770,21 @@ pfq_release(struct socket *sock)
 			kthread_stop(so->tx_opt.queue[n].task);
 			so->tx_opt.queue[n].task = NULL;
 		}
+
+		pfq_tx_service_detach(so, n);
 	}
 
         pr_devel("[PFQ|%d] releasing socket...\n", id);
 
         pfq_leave_all_groups(so->id);
+        pfq_egress_unbind(so);
         pfq_release_sock_id(so->id);
 
         if (so->shmem.addr)
                 pfq_shared_queue_disable(so);
 
+        pfq_zcopy_disable(&so->rx_opt);
+
         down(&sock_sem);
 
         /* purge both batch and recycle queues if no socket is open */
@@ -749,6 +821,7 @@ pfq_poll(struct file *file, struct socket *sock, poll_table * wait)
 #endif
 
 	poll_wait(file, &so->rx_opt.waitqueue, wait);
+	poll_wait(file, &so->tx_opt.waitqueue, wait);
 
         if(!pfq_get_rx_queue(&so->rx_opt))
                 return mask;
@@ -756,6 +829,9 @@ pfq_poll(struct file *file, struct socket *sock, poll_table * wait)
         if (pfq_mpsc_queue_len(so) > 0)
                 mask |= POLLIN | POLLRDNORM;
 
+        if (so->tx_opt.shared_queues && pfq_tx_queues_writable(so))
+                mask |= POLLOUT | POLLWRNORM;
+
         return mask;
 }
 
@@ -849,13 +925,16 @@ void pfq_net_proto_family_init(void)
 
 
 static
-void register_device_handler(void)
+int register_device_handler(void)
 {
+        /* hooks are registered on the bound devices only (see devmap) */
+
         if (capture_incoming || capture_outgoing) {
                 pfq_prot_hook.func = pfq_packet_rcv;
                 pfq_prot_hook.type = __constant_htons(ETH_P_ALL);
-                dev_add_pack(&pfq_prot_hook);
+                return pfq_devmap_hooks_enable(&pfq_prot_hook);
         }
+        return 0;
 }
 
 
@@ -863,7 +942,7 @@ static
 void unregister_device_handler(void)
 {
         if (capture_incoming || capture_outgoing) {
-                dev_remove_pack(&pfq_prot_hook); /* Remove protocol hook */
+                pfq_devmap_hooks_disable(); /* Remove protocol hooks */
         }
 }
 
@@ -877,6 +956,11 @@ static int __init pfq_init_module(void)
         pfq_proto_ops_init();
         pfq_proto_init();
 
+        if (batch_latency <= 0) {
+                printk(KERN_INFO "[PFQ] batch_latency=%d not allowed: must be positive!\n", batch_latency);
+                return -EFAULT;
+        }
+
         if (batch_len <= 0 || batch_len > Q_SKBUFF_SHORT_BATCH) {
                 printk(KERN_INFO "[PFQ] batch_len=%d not allowed: valid range (0,%zu]!\n", batch_len, Q_SKBUFF_SHORT_BATCH);
                 return -EFAULT;
@@ -887,37 +971,109 @@ static int __init pfq_init_module(void)
 		return -EFAULT;
 	}
 
-	if (pfq_percpu_init())
-		return -EFAULT;
+        if (max_sockets <= 0 || max_sockets > Q_MAX_ID) {
+                printk(KERN_INFO "[PFQ] max_sockets=%d not allowed: valid range (0,%d]!\n", max_sockets, Q_MAX_ID);
+                return -EFAULT;
+        }
 
-	if (pfq_proc_init())
+        if (max_groups <= 0 || max_groups > Q_MAX_GROUP) {
+                printk(KERN_INFO "[PFQ] max_groups=%d not allowed: valid range (0,%d]!\n", max_groups, Q_MAX_GROUP);
+                return -EFAULT;
+        }
+
+        pfq_sock_words  = BITS_TO_LONGS(max_sockets);
+        pfq_group_words = BITS_TO_LONGS(max_groups);
+
+	if (pfq_global_stats_init())
 		return -ENOMEM;
 
-        /* register pfq sniffer protocol */
-        n = proto_register(&pfq_proto, 0);
-        if (n != 0)
-                return n;
+	n = -ENOMEM;
 
-	/* register the pfq socket */
-        sock_register(&pfq_family_ops);
+	if (pfq_groups_init())
+		goto err_groups;
 
-        /* finally register the basic device handler */
-        register_device_handler();
+	if (pfq_devmap_init())
+		goto err_devmap;
+
+	if (pfq_percpu_init())
+		goto err_percpu;
+
+	if (pfq_tx_service_init())
+		goto err_tx_service;
+
+	if (zcopy_frames < 0 || pfq_zcopy_pool_init(zcopy_frames))
+		goto err_zcopy;
+
+	if (pfq_proc_init())
+		goto err_proc;
 
 	/* register functions */
 
 	pfq_symtable_init();
 
 #ifdef PFQ_USE_SKB_POOL
-        if (pfq_skb_pool_init() != 0) {
-        	pfq_skb_pool_purge();
-        	return -ENOMEM;
-	}
+        if (pfq_skb_pool_init() != 0)
+		goto err_skb_pool;
+
         printk(KERN_INFO "[PFQ] skb pool initialized.\n");
 #endif
 
+	/* sockets can be opened from here on: register last */
+
+	n = -EFAULT;
+
+	if (pfq_endpoint_init())
+		goto err_endpoint;
+
+        /* register pfq sniffer protocol */
+        n = proto_register(&pfq_proto, 0);
+        if (n != 0)
+		goto err_proto;
+
+	/* register the pfq socket */
+        n = sock_register(&pfq_family_ops);
+        if (n != 0)
+		goto err_sock;
+
+        /* finally register the basic device handler */
+        n = register_device_handler();
+        if (n != 0)
+		goto err_handler;
+
 	printk(KERN_INFO "[PFQ] ready!\n");
         return 0;
+
+	/* unwind, in reverse order */
+
+err_handler:
+        sock_unregister(PF_Q);
+err_sock:
+        proto_unregister(&pfq_proto);
+err_proto:
+	pfq_endpoint_fini();
+err_endpoint:
+#ifdef PFQ_USE_SKB_POOL
+err_skb_pool:
+	pfq_skb_pool_purge();
+#endif
+	pfq_symtable_free();
+	pfq_proc_fini();
+err_proc:
+	pfq_zcopy_pool_free();
+err_zcopy:
+	pfq_tx_service_fini();
+err_tx_service:
+	pfq_percpu_flush();
+	pfq_percpu_free();
+err_percpu:
+	pfq_devmap_free();
+err_devmap:
+	pfq_groups_free();
+err_groups:
+	pfq_global_stats_free();
+
+        printk(KERN_WARNING "[PFQ] loading failed (%d)!\n", n);
+        return n;
 }
 
 
@@ -938,7 +1094,7 @@ static void __exit pfq_exit_module(void)
         proto_unregister(&pfq_proto);
 
         /* disable direct capture */
-        __pfq_devmap_monitor_reset();
+        pfq_devmap_monitor_reset();
 
         /* wait grace period */
         msleep(Q_GRACE_PERIOD);
@@ -952,8 +1108,11 @@ static void __exit pfq_exit_module(void)
         if (total)
                 printk(KERN_INFO "[PFQ] %d skbuff freed.\n", total);
 
+        /* stop Tx service threads */
+	pfq_tx_service_fini();
+
         /* free per-cpu data */
-	free_percpu(cpu_data);
+	pfq_percpu_free();
 
 	/* free functions */
 
@@ -961,6 +1120,13 @@ static void __exit pfq_exit_module(void)
 
 	pfq_proc_fini();
 
+	pfq_endpoint_fini();
+
+	pfq_zcopy_pool_free();
+	pfq_devmap_free();
+	pfq_groups_free();
+	pfq_global_stats_free();
+
         printk(KERN_INFO "[PFQ] unloaded.\n");
 }
 
@@ -692,6 +692,18 @@ namespace lang
 
         auto dec            = [] (int value) { return mfunction("dec", value); };
 
+        //! Count packets and bytes in the i-th per-cpu persistent slot of the current group.
+        /*
+         * The slot holds two words (packets, bytes), summed over the cpus by
+         * socket::group_persistent with Q_PERSISTENT_REDUCE_SUM.
+         *
+         * Example:
+         *
+         * meter (0)
+         */
+
+        auto meter          = [] (int value) { return mfunction("meter", value); };
+
         //! Monadic version of \c is_l3_proto predicate.
         /*!
          * Predicates are used in conditional expressions, while monadic functions
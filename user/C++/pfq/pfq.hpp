@@ -40,10 +40,12 @@
 #include <tuple>
 #include <memory>
 #include <vector>
+#include <array>
 #include <type_traits>
 #include <algorithm>
 #include <thread>
 #include <chrono>
+#include <cstring>
 
 #include <pfq/util.hpp>
 #include <pfq/queue.hpp>
@@ -80,6 +82,43 @@ namespace pfq {
         any           = Q_CLASS_ANY
     };
 
+    //! steering mode of a group.
+    /*!
+     * With steering_mode::maglev (consistent hashing) only about 1/N of the
+     * flows move when a socket joins or leaves the group.
+     */
+
+    enum class steering_mode : int
+    {
+        fold   = Q_STEERING_FOLD,
+        maglev = Q_STEERING_MAGLEV
+    };
+
+    //! Tx queue policy of a group, for packets forwarded to devices.
+    /*!
+     * With tx_queue_policy::cpu each cpu transmits on its own hw queue,
+     * with tx_queue_policy::hash the queue is selected by flow hash.
+     */
+
+    enum class tx_queue_policy : int
+    {
+        packet = Q_TX_QUEUE_PACKET,
+        cpu    = Q_TX_QUEUE_CPU,
+        hash   = Q_TX_QUEUE_HASH
+    };
+
+    //! reduce of the per-cpu persistent slots of a group.
+    /*!
+     * The slots are merged word by word (unsigned long).
+     */
+
+    enum class persistent_reduce : int
+    {
+        sum  = Q_PERSISTENT_REDUCE_SUM,
+        max  = Q_PERSISTENT_REDUCE_MAX,
+        or_  = Q_PERSISTENT_REDUCE_OR
+    };
+
     //! vlan options.
     /*!
      * Special vlan ids are untag (matches with untagged vlans) and anytag.
@@ -143,6 +182,13 @@ namespace pfq {
 
     class socket
     {
+        struct rx_pending_queue         // a sub-ring swapped and not read yet
+        {
+            char * addr;
+            size_t len;
+            size_t index;
+        };
+
         struct pfq_data
         {
             int id;
@@ -167,6 +213,31 @@ namespace pfq {
             size_t tx_num_bind;
 
             bool   tx_async;
+            bool   tx_zcopy;
+            int    tx_poll_queue;       // Tx queue POLLOUT waits for (Q_SO_TX_POLL_QUEUE)
+
+            bool   rx_packed;
+
+            unsigned int rx_rings;
+            unsigned int rx_ring_next;  // next sub-ring to drain
+            unsigned int rx_ring_last;  // sub-ring of the last read
+            unsigned int rx_pending;    // mask of the sub-rings swapped and not read yet
+            std::array<rx_pending_queue, Q_MAX_RX_RINGS> rx_pend;
+
+            bool   rx_zcopy;
+            void * zc_addr;
+            size_t zc_size;
+
+            std::vector<uint32_t> zc_tokens;
+
+            void * zc_last_addr;        // last queue read in zero-copy mode
+            size_t zc_last_len;
+            size_t zc_last_index;
+
+            int    stats_cpus;          // per-cpu blocks of the statistics areas
+            void * stats_addr;
+            std::vector<void *> grp_stats_addr; // by group id, mapped on demand
+            std::vector<void *> grp_ts_addr;    // time-series, by group id
         };
 
         int fd_;
@@ -402,6 +473,210 @@ namespace pfq {
             throw pfq_error("PFQ: socket not open");
         }
 
+        // slot size of the Rx queues (0 stands for the packed layout)
+
+        size_t
+        rx_queue_slot_size() const
+        {
+            return data_->rx_packed ? 0 : data_->rx_slot_size;
+        }
+
+        // round-robin: the first non-empty sub-ring, starting from the next
+        // one to drain (the next one itself, if they are all empty)
+
+        unsigned int
+        rx_ring_select(struct pfq_shared_queue *q) const
+        {
+            for(unsigned int n = 0; n < data_->rx_rings; n++)
+            {
+                auto ring = (data_->rx_ring_next + n) % data_->rx_rings;
+                if (Q_SHARED_QUEUE_LEN(Q_SHARED_RX_RING(q, ring)->data) != 0)
+                    return ring;
+            }
+            return data_->rx_ring_next;
+        }
+
+        // swap the buffers of a sub-ring: the filled one is returned
+
+        rx_pending_queue
+        rx_ring_swap(struct pfq_shared_queue *q, unsigned int ring) const
+        {
+            auto rx = Q_SHARED_RX_RING(q, ring);
+            unsigned int index = Q_SHARED_QUEUE_INDEX(rx->data);
+
+            // reset the next buffer...
+
+            unsigned int data = __sync_lock_test_and_set(&rx->data, (unsigned int)((index+1) << 24));
+
+            // packed layout: the length is expressed in Q_PACKED_UNIT units
+
+            rx_pending_queue nq;
+            nq.addr  = static_cast<char *>(data_->rx_queue_addr) + (ring * 2 + (index & 1)) * data_->rx_queue_size;
+            nq.index = index;
+            nq.len   = std::min(static_cast<size_t>(Q_SHARED_QUEUE_LEN(data)), data_->rx_packed ?
+                                std::min<size_t>(data_->rx_queue_size / Q_PACKED_UNIT, Q_PACKED_MAX_UNITS) : data_->rx_slots);
+            return nq;
+        }
+
+        // max number of packets in a Rx queue: the packed layout stores
+        // smaller records (at least a pfq_pkthdr_zcopy for a lent buffer)
+
+        size_t
+        rx_max_records() const
+        {
+            if (data_->rx_packed)
+                return data_->rx_slots * data_->rx_slot_size / Q_PACKED_RECORD_SIZE(sizeof(pfq_pkthdr_zcopy));
+            return data_->rx_slots;
+        }
+
+        // reserve a record of len bytes in a Tx queue (nullptr if the queue is full)
+
+        pfq_pkthdr_tx *
+        tx_slot(const_buffer buf, size_t len, int queue)
+        {
+            const int tss = [=]() -> size_t {
+                if (queue == any_queue)
+                    return fold(symmetric_hash(buf.first), data_->tx_num_bind);
+                return fold(queue, data_->tx_num_bind);
+            }();
+
+            auto tx = &static_cast<struct pfq_shared_queue *>(data_->shm_addr)->tx[tss];
+
+            auto index = __atomic_load_n(&tx->cons, __ATOMIC_RELAXED);
+            if (index != __atomic_load_n(&tx->prod, __ATOMIC_RELAXED))
+            {
+                __atomic_store_n(&tx->prod, index, __ATOMIC_RELAXED);
+            }
+
+            void * base_addr = static_cast<char *>(data_->tx_queue_addr)
+                                + data_->tx_queue_size * (2 * tss + (index & 1));
+
+            if (index != tx->index) {
+
+                    // zero-copy Tx: the driver still holds the pages of this half
+
+                    if (__atomic_load_n(&tx->zc_busy[index & 1], __ATOMIC_ACQUIRE))
+                        return nullptr;
+
+                    tx->index = index;
+                    tx->ptr = base_addr;
+            }
+
+            auto slot_size = sizeof(struct pfq_pkthdr_tx) + align<8>(len);
+
+            if ((static_cast<char *>(tx->ptr) - static_cast<char *>(base_addr)
+                 + slot_size + sizeof(struct pfq_pkthdr_tx)) >= data_->tx_queue_size)
+                return nullptr;
+
+            auto hdr = static_cast<pfq_pkthdr_tx *>(tx->ptr);
+
+            reinterpret_cast<char *&>(tx->ptr) += slot_size;
+            static_cast<pfq_pkthdr_tx *>(tx->ptr)->len = 0;
+
+            return hdr;
+        }
+
+        // a record of slot_size bytes fits in the Tx queue tss (as with tx_slot)
+
+        bool
+        tx_space(int tss, size_t slot_size) const
+        {
+            auto tx = &static_cast<struct pfq_shared_queue *>(data_->shm_addr)->tx[tss];
+            auto index = __atomic_load_n(&tx->cons, __ATOMIC_RELAXED);
+
+            // the kernel has handed a new half to the producer
+
+            if (index != tx->index)
+                return !__atomic_load_n(&tx->zc_busy[index & 1], __ATOMIC_ACQUIRE);
+
+            void * base_addr = static_cast<char *>(data_->tx_queue_addr)
+                                + data_->tx_queue_size * (2 * tss + (index & 1));
+
+            return (static_cast<char *>(tx->ptr) - static_cast<char *>(base_addr)
+                    + slot_size + sizeof(struct pfq_pkthdr_tx)) < data_->tx_queue_size;
+        }
+
+        // statistics areas and time-series: mapped read-only on demand
+
+        void *
+        stats_map(size_t size, off_t offset)
+        {
+            auto addr = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd_, offset);
+            if (addr == MAP_FAILED)
+                throw pfq_error(errno, "PFQ: stats memory map error");
+
+            return addr;
+        }
+
+        // per-cpu blocks of the statistics areas
+
+        int
+        stats_cpus()
+        {
+            if (data()->stats_cpus == 0)
+            {
+                socklen_t size = sizeof(data_->stats_cpus);
+                if (::getsockopt(fd_, PF_Q, Q_SO_GET_STATS_CPUS, &data_->stats_cpus, &size) == -1)
+                    throw pfq_error(errno, "PFQ: get stats cpus error");
+            }
+            return data_->stats_cpus;
+        }
+
+        void *&
+        group_map_slot(std::vector<void *> &addr, int gid)
+        {
+            if (gid < 0)
+                throw pfq_error("PFQ: invalid group id");
+
+            if (static_cast<size_t>(gid) >= addr.size())
+                addr.resize(static_cast<size_t>(gid) + 1, nullptr);
+
+            return addr[gid];
+        }
+
+        const pfq_group_stats_block *
+        group_stats_area(int gid)
+        {
+            auto & addr = group_map_slot(data()->grp_stats_addr, gid);
+            if (!addr)
+                addr = stats_map(Q_STATS_AREA_SIZE(stats_cpus(), pfq_group_stats_block), Q_GROUP_STATS_MMAP_OFFSET(gid));
+
+            return static_cast<const pfq_group_stats_block *>(addr);
+        }
+
+        const pfq_group_timeseries *
+        group_timeseries_area(int gid)
+        {
+            auto & addr = group_map_slot(data()->grp_ts_addr, gid);
+            if (!addr)
+                addr = stats_map(sizeof(pfq_group_timeseries), Q_GROUP_TIMESERIES_MMAP_OFFSET(gid));
+
+            return static_cast<const pfq_group_timeseries *>(addr);
+        }
+
+        void
+        stats_unmap()
+        {
+            if (data_->stats_addr)
+                ::munmap(data_->stats_addr, Q_STATS_AREA_SIZE(data_->stats_cpus, pfq_sock_stats_block));
+
+            for(auto addr : data_->grp_stats_addr)
+            {
+                if (addr)
+                    ::munmap(addr, Q_STATS_AREA_SIZE(data_->stats_cpus, pfq_group_stats_block));
+            }
+
+            for(auto addr : data_->grp_ts_addr)
+            {
+                if (addr)
+                    ::munmap(addr, sizeof(pfq_group_timeseries));
+            }
+
+            data_->stats_addr = nullptr;
+            data_->grp_stats_addr.clear();
+            data_->grp_ts_addr.clear();
+        }
+
         void
         open(size_t caplen, size_t rx_slots, size_t tx_slots)
         {
@@ -428,7 +703,26 @@ namespace pfq {
                                         0,
                                         0,
                                         0,
-                                        true
+                                        true,
+                                        false,
+                                        -1,
+                                        false,
+                                        1,
+                                        0,
+                                        0,
+                                        0,
+                                        {},
+                                        false,
+                                        nullptr,
+                                        0,
+                                        {},
+                                        nullptr,
+                                        0,
+                                        0,
+                                        0,
+                                        nullptr,
+                                        {},
+                                        {}
                                      });
 
             // get id
@@ -483,6 +777,9 @@ namespace pfq {
                 if (data_ && data_->shm_addr)
                     this->disable();
 
+                if (data_)
+                    this->stats_unmap();
+
                 data_.reset(nullptr);
 
                 if (::close(fd_) < 0)
@@ -539,11 +836,38 @@ namespace pfq {
 
             data()->shm_size = tot_mem;
 
-            data()->rx_queue_addr = static_cast<char *>(data()->shm_addr) + sizeof(pfq_shared_queue);
+            // map the zero-copy area (read-only)
+
+            if (data()->rx_zcopy)
+            {
+                size = sizeof(data()->zc_size);
+                if (::getsockopt(fd_, PF_Q, Q_SO_GET_RX_ZCOPY, &data()->zc_size, &size) == -1)
+                    throw pfq_error(errno, "PFQ: zero-copy size error");
+
+                data()->zc_addr = ::mmap(nullptr, data()->zc_size, PROT_READ, MAP_SHARED, fd_, Q_ZCOPY_MMAP_OFFSET);
+                if (data()->zc_addr == MAP_FAILED) {
+                    data()->zc_addr = nullptr;
+                    throw pfq_error(errno, "PFQ: socket enable (zero-copy memory map)");
+                }
+
+                data()->zc_tokens.resize(rx_max_records());
+                data()->zc_last_len = 0;
+            }
+
+            // the shared header holds a Tx queue descriptor per binding
+
+            int tx_queues;
+            size = sizeof(tx_queues);
+            if (::getsockopt(fd_, PF_Q, Q_SO_GET_TX_QUEUES, &tx_queues, &size) == -1)
+                throw pfq_error(errno, "PFQ: get Tx queues error");
+
+            data()->rx_queue_addr = static_cast<char *>(data()->shm_addr) + Q_SHARED_QUEUE_HDR_SIZE(tx_queues);
             data()->rx_queue_size = data()->rx_slots * data()->rx_slot_size;
 
-            data()->tx_queue_addr = static_cast<char *>(data()->shm_addr) + sizeof(pfq_shared_queue) + data()->rx_queue_size * 2;
+            data()->tx_queue_addr = static_cast<char *>(data()->shm_addr) + Q_SHARED_QUEUE_HDR_SIZE(tx_queues) + data()->rx_queue_size * 2 * data()->rx_rings;
             data()->tx_queue_size = data()->tx_slots * data()->tx_slot_size;
+
+            data()->rx_pending = 0;
         }
 
         //! Disable the socket.
@@ -569,6 +893,18 @@ namespace pfq {
             data()->shm_addr = nullptr;
             data()->shm_size = 0;
 
+            // zero-copy buffers are released by the kernel on disable
+
+            if (data()->zc_addr)
+            {
+                ::munmap(data()->zc_addr, data()->zc_size);
+
+                data()->zc_addr = nullptr;
+                data()->zc_size = 0;
+                data()->zc_tokens.clear();
+                data()->zc_last_len = 0;
+            }
+
             if(::setsockopt(fd_, PF_Q, Q_SO_DISABLE, nullptr, 0) == -1)
                 throw pfq_error(errno, "PFQ: socket disable");
         }
@@ -610,6 +946,119 @@ namespace pfq {
            return ret;
         }
 
+        //! Enable/disable the zero-copy Rx mode.
+        /*!
+         * Zero-copy must be set before the socket is enabled; it requires the pfq
+         * module loaded with zcopy_frames > 0. Packets that cannot be shared are
+         * still copied into the queue. Buffers are given back to the kernel
+         * by the next read (or by rx_zcopy_return).
+         */
+
+        void
+        rx_zcopy_enable(bool value)
+        {
+            if (enabled())
+                throw pfq_error("PFQ: enabled (zero-copy could not be set)");
+
+            int toggle = static_cast<int>(value);
+            if (::setsockopt(fd_, PF_Q, Q_SO_SET_RX_ZCOPY, &toggle, sizeof(toggle)) == -1)
+                throw pfq_error(errno, "PFQ: set zero-copy error");
+
+            data()->rx_zcopy = value;
+        }
+
+        //! Check whether the zero-copy Rx mode is enabled.
+
+        bool
+        rx_zcopy_enabled() const
+        {
+            return data()->rx_zcopy;
+        }
+
+        //! Enable/disable the packed Rx layout.
+        /*!
+         * With the packed layout each packet takes a pfq_pkthdr plus the captured
+         * bytes (8-byte aligned) instead of a full slot; the Rx memory is unchanged.
+         * It must be set before the socket is enabled. The size of the queues
+         * returned by read() is expressed in Q_PACKED_UNIT units.
+         */
+
+        void
+        rx_packed_enable(bool value)
+        {
+            if (enabled())
+                throw pfq_error("PFQ: enabled (packed layout could not be set)");
+
+            int toggle = static_cast<int>(value);
+            if (::setsockopt(fd_, PF_Q, Q_SO_SET_RX_PACKED, &toggle, sizeof(toggle)) == -1)
+                throw pfq_error(errno, "PFQ: set packed layout error");
+
+            data()->rx_packed = value;
+        }
+
+        //! Check whether the packed Rx layout is enabled.
+
+        bool
+        rx_packed_enabled() const
+        {
+            return data()->rx_packed;
+        }
+
+        //! Give back to the kernel the zero-copy buffers of the given queue.
+
+        void
+        rx_zcopy_return(queue const &q)
+        {
+            auto & tokens = data()->zc_tokens;
+            if (tokens.empty())
+                return;
+
+            size_t n = 0;
+            for(auto it = std::begin(q), it_e = std::end(q); it != it_e; ++it)
+            {
+                while (!it.ready())
+                    std::this_thread::yield();
+
+                if (it->flags & Q_PKTHDR_ZCOPY)
+                    tokens[n++] = reinterpret_cast<const pfq_pkthdr_zcopy *>(&(*it) + 1)->token;
+            }
+
+            if (n && ::setsockopt(fd_, PF_Q, Q_SO_RX_ZCOPY_RETURN, tokens.data(), n * sizeof(uint32_t)) == -1)
+                throw pfq_error(errno, "PFQ: zero-copy return error");
+        }
+
+        //! Specify the number of Rx sub-rings.
+        /*!
+         * Each sub-ring has rx_slots() slots and is fed by the cpus with id
+         * modulo the number of rings: with a ring per Rx cpu, producers don't
+         * share any cache line. It must be set before the socket is enabled.
+         * A read() that finds no pending sub-ring swaps all the non-empty ones at
+         * once; the following reads return them (one per call, with no poll),
+         * and dispatch() drains all of them in a single call.
+         */
+
+        void
+        rx_rings(int value)
+        {
+            if (enabled())
+                throw pfq_error("PFQ: enabled (Rx rings could not be set)");
+
+            if (::setsockopt(fd_, PF_Q, Q_SO_SET_RX_RINGS, &value, sizeof(value)) == -1)
+                throw pfq_error(errno, "PFQ: set Rx rings error");
+
+            data()->rx_rings = static_cast<unsigned int>(value);
+            data()->rx_ring_next = 0;
+            data()->rx_ring_last = 0;
+        }
+
+        //! Return the number of Rx sub-rings.
+
+        int
+        rx_rings() const
+        {
+            return static_cast<int>(data()->rx_rings);
+        }
+
         //! Specify the capture length of packets, in bytes.
         /*!
          * Capture length must be set before the socket is enabled to capture.
@@ -824,6 +1273,10 @@ namespace pfq {
          *  A socket can be bound up to a maximum number of queues.
          *  The core parameter specifies the CPU index where to run a
          *  kernel thread (unless no_kthread id is specified).
+         *
+         *  The Tx queues are allocated by enable(), one per binding: once the
+         *  socket is enabled, only the queues left up to Q_MIN_TX_QUEUES can be
+         *  bound. Bind before enabling the socket to use more queues.
          */
 
         void
@@ -859,18 +1312,59 @@ namespace pfq {
             data()->tx_num_bind = 0;
         }
 
+        //! Limit the rate of a Tx queue.
+        /*!
+         * The queue is the index of a Tx binding, in the order of bind_tx.
+         * The rate is given in packets and/or bits per second (0 = unlimited), and is
+         * enforced by the kernel for each batch, with a burst of up to @burst packets.
+         */
+
+        void
+        set_tx_rate(int queue, uint64_t pps, uint64_t bps = 0, unsigned int burst = 0)
+        {
+            struct pfq_tx_rate r { queue, burst, pps, bps };
+
+            if (::setsockopt(fd_, PF_Q, Q_SO_TX_RATE, &r, sizeof(r)) == -1)
+                throw pfq_error(errno, "PFQ: Tx rate error");
+        }
+
+        //! Specify the Tx weight of the socket (1 by default).
+        /*!
+         * A shared Tx thread serves the queues of the sockets in proportion to
+         * their weights, up to Q_MAX_SOCK_WEIGHT.
+         */
+
+        void
+        tx_weight(int value)
+        {
+            if (::setsockopt(fd_, PF_Q, Q_SO_SET_TX_WEIGHT, &value, sizeof(value)) == -1)
+                throw pfq_error(errno, "PFQ: set Tx weight error");
+        }
+
+        //! Return the Tx weight of the socket.
+
+        int
+        tx_weight() const
+        {
+            int ret; socklen_t size = sizeof(ret);
+            if (::getsockopt(fd_, PF_Q, Q_SO_GET_TX_WEIGHT, &ret, &size) == -1)
+                throw pfq_error(errno, "PFQ: get Tx weight error");
+            return ret;
+        }
+
 
         //! Return the mask of the joined groups.
         /*!
          * Each socket can bind to multiple groups. Each bit of the mask represents
-         * a joined group.
+         * a joined group: group n is bit (n % bits of unsigned long) of word n / bits.
          */
 
-        unsigned long
+        std::vector<unsigned long>
         groups_mask() const
         {
-            unsigned long mask; socklen_t size = sizeof(mask);
-            if (::getsockopt(fd_, PF_Q, Q_SO_GET_GROUPS, &mask, &size) == -1)
+            std::vector<unsigned long> mask(Q_GROUPS_MASK_WORDS);
+            socklen_t size = static_cast<socklen_t>(mask.size() * sizeof(unsigned long));
+            if (::getsockopt(fd_, PF_Q, Q_SO_GET_GROUPS, mask.data(), &size) == -1)
                 throw pfq_error(errno, "PFQ: get groups error");
             return mask;
         }
@@ -881,12 +1375,15 @@ namespace pfq {
         groups() const
         {
             std::vector<int> vec;
-            auto grps = this->groups_mask();
-            for(int n = 0; grps != 0; n++)
+            auto mask = this->groups_mask();
+            const int bits = sizeof(unsigned long) << 3;
+
+            for(size_t w = 0; w < mask.size(); w++)
             {
-                if (grps & (1L << n)) {
-                    vec.push_back(n);
-                    grps &= ~(1L << n);
+                for(int n = 0; n < bits; n++)
+                {
+                    if (mask[w] & (1UL << n))
+                        vec.push_back(static_cast<int>(w) * bits + n);
                 }
             }
 
@@ -1074,36 +1571,84 @@ namespace pfq {
             if (!data()->shm_addr)
                 throw pfq_error("PFQ: read: socket not enabled");
 
+            // give back the zero-copy buffers of the previous queue,
+            // before the kernel reuses its slots
+
+            if (data()->zc_last_len)
+            {
+                rx_zcopy_return(queue(data()->zc_last_addr, rx_queue_slot_size(),
+                                      data()->zc_last_len, data()->zc_last_index));
+                data()->zc_last_len = 0;
+            }
+
             auto q = static_cast<struct pfq_shared_queue *>(data()->shm_addr);
+            unsigned int ring;
+
+            // with sub-rings, swap all the non-empty rings in one pass; the
+            // following reads hand them out round-robin, without polling
 
-            size_t data = q->rx.data;
-            size_t index = Q_SHARED_QUEUE_INDEX(data);
+            if (!data_->rx_pending)
+            {
+                ring = rx_ring_select(q);
 
-            if( Q_SHARED_QUEUE_LEN(data) == 0 ) {
+                if( Q_SHARED_QUEUE_LEN(Q_SHARED_RX_RING(q, ring)->data) == 0 ) {
 #ifdef PFQ_USE_POLL
-                this->poll(microseconds);
+                    this->poll(microseconds);
+                    if (data_->rx_rings > 1)
+                        ring = rx_ring_select(q);
 #else
-                (void)microseconds;
+                    (void)microseconds;
 #endif
+                }
+
+                // the selected ring (even if empty) and all the non-empty ones
+
+                for(unsigned int n = 0; n < data_->rx_rings; n++)
+                {
+                    auto r = (ring + n) % data_->rx_rings;
+                    if (n == 0 || Q_SHARED_QUEUE_LEN(Q_SHARED_RX_RING(q, r)->data) != 0)
+                    {
+                        data_->rx_pend[r] = rx_ring_swap(q, r);
+                        data_->rx_pending |= 1U << r;
+                    }
+                }
+
+                data_->rx_ring_next = ring;
             }
 
-            // reset the next buffer...
+            for(unsigned int n = 0; n < data_->rx_rings; n++)
+            {
+                ring = (data_->rx_ring_next + n) % data_->rx_rings;
+                if (data_->rx_pending & (1U << ring))
+                    break;
+            }
 
-            data = __sync_lock_test_and_set(&q->rx.data, (unsigned int)((index+1) << 24));
+            data_->rx_pending  &= ~(1U << ring);
+            data_->rx_ring_next = (ring + 1) % data_->rx_rings;
+            data_->rx_ring_last = ring;
 
-            auto queue_len = std::min(static_cast<size_t>(Q_SHARED_QUEUE_LEN(data)), data_->rx_slots);
+            auto const &nq = data_->rx_pend[ring];
 
-            return queue(static_cast<char *>(data_->rx_queue_addr) + (index & 1) * data_->rx_queue_size,
-                         data_->rx_slot_size, queue_len, index);
+            if (data_->zc_addr)
+            {
+                data_->zc_last_addr  = nq.addr;
+                data_->zc_last_len   = nq.len;
+                data_->zc_last_index = nq.index;
+            }
+
+            return queue(nq.addr, rx_queue_slot_size(), nq.len, nq.index);
         }
 
         //! Return the current commit version (used internally by the memory mapped queue).
+        /*!
+         * With Rx sub-rings, the version refers to the sub-ring of the last read.
+         */
 
         uint8_t
         current_commit() const
         {
             auto q = static_cast<struct pfq_shared_queue *>(data_->shm_addr);
-            return Q_SHARED_QUEUE_INDEX(q->rx.data);
+            return Q_SHARED_QUEUE_INDEX(Q_SHARED_RX_RING(q, data_->rx_ring_last)->data);
         }
 
         //! Receive packets in the given mutable buffer.
@@ -1124,7 +1669,7 @@ namespace pfq {
             if (buff.second < data_->rx_slots * data_->rx_slot_size)
                 throw pfq_error("PFQ: buffer too small");
 
-            memcpy(buff.first, this_queue.data(), this_queue.slot_size() * this_queue.size());
+            memcpy(buff.first, this_queue.data(), this_queue.bytes());
             return queue(buff.first, this_queue.slot_size(), this_queue.size(), this_queue.index());
         }
 
@@ -1140,22 +1685,90 @@ namespace pfq {
         template <typename Fun>
         size_t dispatch(Fun callback, long int microseconds = -1, char *user = nullptr)
         {
-            auto many = this->read(microseconds);
-
-            auto it = std::begin(many),
-                 it_e = std::end(many);
             size_t n = 0;
-            for(; it != it_e; ++it)
+
+            // all the sub-rings swapped by the first read are drained
+
+            do
             {
-                while (!it.ready())
-                    std::this_thread::yield();
+                auto many = this->read(microseconds);
 
-                callback(user, &(*it), reinterpret_cast<const char *>(it.data()));
-                n++;
+                auto it = std::begin(many),
+                     it_e = std::end(many);
+                for(; it != it_e; ++it)
+                {
+                    while (!it.ready())
+                        std::this_thread::yield();
+
+                    callback(user, &(*it), reinterpret_cast<const char *>(it.data()));
+                    n++;
+                }
             }
+            while (data_->rx_pending);
+
             return n;
         }
 
+        //! Specify the steering mode of the given group.
+
+        void set_group_steering(int gid, steering_mode mode)
+        {
+            pfq_group_steering value { gid, static_cast<int>(mode) };
+
+            if (::setsockopt(fd_, PF_Q, Q_SO_GROUP_STEERING, &value, sizeof(value)) == -1)
+                throw pfq_error(errno, "PFQ: group steering error");
+        }
+
+        //! Specify the Rx watermark of the given group, for load-aware steering.
+        /*!
+         * The watermark is a percentage of the socket queue (0 disables it).
+         * New flows steered to a socket above the watermark overflow to the
+         * next socket of the group below it; established flows keep their socket.
+         */
+
+        void set_group_watermark(int gid, int watermark)
+        {
+            pfq_group_watermark value { gid, watermark };
+
+            if (::setsockopt(fd_, PF_Q, Q_SO_GROUP_WATERMARK, &value, sizeof(value)) == -1)
+                throw pfq_error(errno, "PFQ: group watermark error");
+        }
+
+        //! Specify the Tx queue policy of the given group, for packets forwarded to devices.
+
+        void set_group_tx_queue(int gid, tx_queue_policy policy)
+        {
+            pfq_group_tx_queue value { gid, static_cast<int>(policy) };
+
+            if (::setsockopt(fd_, PF_Q, Q_SO_GROUP_TX_QUEUE, &value, sizeof(value)) == -1)
+                throw pfq_error(errno, "PFQ: group Tx queue error");
+        }
+
+        //! Specify the steering weight of the socket (1 by default).
+        /*!
+         * Steered flows are spread across the sockets of a group in proportion
+         * to their weights, up to Q_MAX_SOCK_WEIGHT. The weight can be set before
+         * joining a group, or changed later.
+         */
+
+        void
+        weight(int value)
+        {
+            if (::setsockopt(fd_, PF_Q, Q_SO_SET_WEIGHT, &value, sizeof(value)) == -1)
+                throw pfq_error(errno, "PFQ: set weight error");
+        }
+
+        //! Return the steering weight of the socket.
+
+        int
+        weight() const
+        {
+            int ret; socklen_t size = sizeof(ret);
+            if (::getsockopt(fd_, PF_Q, Q_SO_GET_WEIGHT, &ret, &size) == -1)
+                throw pfq_error(errno, "PFQ: get weight error");
+            return ret;
+        }
+
         //! Set vlan filtering for the given group.
 
         void vlan_filters_enable(int gid, bool toggle)
@@ -1248,6 +1861,162 @@ namespace pfq {
             return std::vector<unsigned long>(std::begin(cs.counter), std::end(cs.counter));
         }
 
+        //! Take a snapshot of the stats and counters of the group every period.
+        /*!
+         * The kernel keeps the last Q_TIMESERIES_SLOTS snapshots in a ring, mapped
+         * read-only by group_snapshot. A period of 0 stops the time-series.
+         * The socket must own the group.
+         */
+
+        void
+        set_group_timeseries(int gid, std::chrono::milliseconds period)
+        {
+            pfq_group_timeseries_period value { gid, static_cast<unsigned int>(period.count()) };
+
+            if (::setsockopt(fd_, PF_Q, Q_SO_GROUP_TIMESERIES, &value, sizeof(value)) == -1)
+                throw pfq_error(errno, "PFQ: set group time-series error");
+        }
+
+        //! Read a snapshot of the time-series of the group, back steps before the last one.
+        /*!
+         * Return false when the snapshot is not available (not yet taken, or
+         * already overwritten). No system calls are made once the ring is mapped.
+         */
+
+        bool
+        group_snapshot(int gid, size_t back, pfq_group_snapshot &snap)
+        {
+            auto ts = group_timeseries_area(gid);
+
+            auto head = __atomic_load_n(&ts->head, __ATOMIC_ACQUIRE);
+            if (back >= head || back >= Q_TIMESERIES_SLOTS)
+                return false;
+
+            auto n = head - 1 - back;
+            auto s = &ts->snap[n % Q_TIMESERIES_SLOTS];
+
+            // the slot may be overwritten during the copy
+
+            if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != n + 1)
+                return false;
+
+            std::memcpy(&snap, s, sizeof(snap));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+            if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != n + 1)
+                return false;
+
+            snap.seq = n;
+            return true;
+        }
+
+        //! Return the per-cpu persistent slot of the given group, reduced across the cpus.
+
+        std::vector<unsigned long>
+        group_persistent(int gid, int index, persistent_reduce op = persistent_reduce::sum) const
+        {
+            pfq_group_persistent_read p { gid, index, static_cast<int>(op), { 0 } };
+            socklen_t size = sizeof(p);
+            if (::getsockopt(fd_, PF_Q, Q_SO_GET_GROUP_PERSISTENT, &p, &size) == -1)
+                throw pfq_error(errno, "PFQ: get group persistent error");
+
+            return std::vector<unsigned long>(std::begin(p.word), std::end(p.word));
+        }
+
+        //! Enable or disable the Rx profile (system-wide).
+        /*!
+         * The kernel times the stages of the Rx path (Q_PROFILE_xxx) in cycles,
+         * a log2 histogram per stage and per cpu. Enabling the profile resets
+         * the histograms; when disabled the probes cost a nop.
+         */
+
+        void
+        set_profile(bool value)
+        {
+            int enable = value;
+            if (::setsockopt(fd_, PF_Q, Q_SO_SET_PROFILE, &enable, sizeof(enable)) == -1)
+                throw pfq_error(errno, "PFQ: set profile error");
+        }
+
+        //! Return the Rx profile of the given cpu, or of all the cpus (Q_ANY_CPU).
+
+        pfq_profile
+        profile(int cpu = Q_ANY_CPU) const
+        {
+            pfq_profile p {};
+            socklen_t size = sizeof(p);
+
+            p.cpu = cpu;
+
+            if (::getsockopt(fd_, PF_Q, Q_SO_GET_PROFILE, &p, &size) == -1)
+                throw pfq_error(errno, "PFQ: get profile error");
+
+            return p;
+        }
+
+        //! Read the socket statistics from the mapped statistics area.
+        /*!
+         * The area is mapped read-only on the first call; the per-cpu blocks
+         * are summed in user space, without system calls.
+         */
+
+        pfq_stats
+        read_stats()
+        {
+            if (!data()->stats_addr)
+                data()->stats_addr = stats_map(Q_STATS_AREA_SIZE(stats_cpus(), pfq_sock_stats_block), Q_STATS_MMAP_OFFSET);
+
+            pfq_stats stat {};
+            auto b = static_cast<const pfq_sock_stats_block *>(data()->stats_addr);
+
+            for(int n = 0; n < data()->stats_cpus; n++, b++)
+            {
+                stat.recv += b->recv;
+                stat.lost += b->lost;
+                stat.drop += b->drop;
+                stat.sent += b->sent;
+                stat.disc += b->disc;
+            }
+
+            return stat;
+        }
+
+        //! Read the statistics of the given group from its mapped area.
+
+        pfq_stats
+        read_group_stats(int gid)
+        {
+            pfq_stats stat {};
+            auto b = group_stats_area(gid);
+
+            for(int n = 0; n < data()->stats_cpus; n++, b++)
+            {
+                stat.recv += b->recv;
+                stat.drop += b->drop;
+                stat.frwd += b->frwd;
+                stat.kern += b->kern;
+            }
+
+            return stat;
+        }
+
+        //! Read the set of counters of the given group from its mapped area.
+
+        std::vector<unsigned long>
+        read_group_counters(int gid)
+        {
+            std::vector<unsigned long> cs(Q_MAX_COUNTERS, 0);
+            auto b = group_stats_area(gid);
+
+            for(int n = 0; n < data()->stats_cpus; n++, b++)
+            {
+                for(int i = 0; i < Q_MAX_COUNTERS; i++)
+                    cs[i] += b->counter[i];
+            }
+
+            return cs;
+        }
+
         //! Return the memory size of the Rx queue.
 
         size_t
@@ -1331,52 +2100,156 @@ namespace pfq {
             if (!data_->shm_addr)
                 throw pfq_error("PFQ: inject: socket not enabled");
 
-            const int tss = [=]() -> size_t {
-                if (queue == any_queue)
-                    return fold(symmetric_hash(buf.first), data_->tx_num_bind);
-                return fold(queue, data_->tx_num_bind);
-            }();
+            auto hdr = tx_slot(buf, buf.second, queue);
+            if (!hdr)
+                return false;
 
-            auto tx = &static_cast<struct pfq_shared_queue *>(data_->shm_addr)->tx[tss];
+            hdr->len = buf.second;
+            hdr->nsec = ts;
+            memcpy(hdr+1, buf.first, buf.second);
+            return true;
+        }
 
-            auto index = __atomic_load_n(&tx->cons, __ATOMIC_RELAXED);
-            if (index != __atomic_load_n(&tx->prod, __ATOMIC_RELAXED))
-            {
-                __atomic_store_n(&tx->prod, index, __ATOMIC_RELAXED);
-            }
+        //! Schedule a packet template for transmission.
+        /*!
+         * The template is expanded by the kernel into @copies packets, transmitted as with
+         * inject. For each copy the mutators rewrite a field of the packet (an increment
+         * or a random value in [min, max]); with Q_TX_TEMPLATE_CSUM among the flags the IPv4
+         * and UDP checksums are fixed up after the mutation.
+         */
 
-	        void * base_addr = static_cast<char *>(data_->tx_queue_addr)
-	                            + data_->tx_queue_size * (2 * tss + (index & 1));
+        bool
+        inject_template(const_buffer buf, unsigned int copies, std::vector<pfq_tx_mutator> const &mut,
+                        int flags = 0, uint64_t ts = 0, int queue = any_queue)
+        {
+            if (!data_->shm_addr)
+                throw pfq_error("PFQ: inject: socket not enabled");
 
-            if (index != tx->index) {
-                    tx->index = index;
-                    tx->ptr = base_addr;
-            }
+            if (copies == 0 || buf.second > 0xffff || mut.size() > Q_TX_MAX_MUTATORS)
+                throw pfq_error("PFQ: inject: bad template");
 
-            auto len = buf.second;
-            auto slot_size = sizeof(struct pfq_pkthdr_tx) + align<8>(len);
+            auto size = Q_TX_TEMPLATE_SIZE(mut.size(), buf.second);
 
-            if ((static_cast<char *>(tx->ptr) - static_cast<char *>(base_addr)
-                 + slot_size + sizeof(struct pfq_pkthdr_tx)) < data_->tx_queue_size)
+            auto hdr = tx_slot(buf, size, queue);
+            if (!hdr)
+                return false;
+
+            auto tmpl = reinterpret_cast<pfq_tx_template *>(hdr+1);
+
+            tmpl->copies = copies;
+            tmpl->len = static_cast<uint16_t>(buf.second);
+            tmpl->num_mutators = static_cast<uint8_t>(mut.size());
+            tmpl->flags = static_cast<uint8_t>(flags);
+
+            memcpy(tmpl->mutator, mut.data(), mut.size() * sizeof(pfq_tx_mutator));
+            memcpy(tmpl->mutator + mut.size(), buf.first, buf.second);
+
+            hdr->len = size | Q_TX_TEMPLATE;
+            hdr->nsec = ts;
+            return true;
+        }
+
+        //! Wait until a packet of the given length can be injected.
+        /*!
+         * Block on the socket until the Tx queue (any_queue: all of them) has room
+         * for a packet of the given length, or the timeout expires (-1 = infinite).
+         * From then on POLLOUT on the socket refers to the last queue waited for.
+         * Return false on timeout.
+         */
+
+        bool
+        wait_tx_space(size_t bytes, long int microseconds = -1, int queue = any_queue)
+        {
+            auto slot_size = sizeof(struct pfq_pkthdr_tx) + align<8>(bytes);
+
+            if (!data_ || data_->shm_addr == nullptr || data_->shm_addr == MAP_FAILED)
+                throw pfq_error("PFQ: wait Tx space: socket not enabled");
+
+            if (data_->tx_num_bind == 0)
+                throw pfq_error("PFQ: wait Tx space: socket not bound");
+
+            if (slot_size + sizeof(struct pfq_pkthdr_tx) >= data_->tx_queue_size)
+                throw pfq_error("PFQ: wait Tx space: packet too long");
+
+            // any queue: the packet may be injected in each of them
+
+            const int first = queue == any_queue ? 0 : static_cast<int>(fold(queue, data_->tx_num_bind));
+            const int last  = queue == any_queue ? static_cast<int>(data_->tx_num_bind) : first + 1;
+
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(microseconds);
+            bool flushed = false;
+
+            for(;;)
             {
-                auto hdr = (struct pfq_pkthdr_tx *)tx->ptr;
-                hdr->len = len;
-                hdr->nsec = ts;
-                memcpy(hdr+1, buf.first, hdr->len);
+                int n = first;
+                while (n < last && tx_space(n, slot_size))
+                    n++;
+
+                if (n == last)
+                    return true;
+
+                // no kernel threads: transmit the queues now
+
+                if (!data_->tx_async && !flushed) {
+                    tx_queue_flush(queue == any_queue ? any_queue : first);
+                    flushed = true;
+                    continue;
+                }
+
+                // POLLOUT waits for the first queue without room
+
+                if (n != data_->tx_poll_queue) {
+                    if (::setsockopt(fd_, PF_Q, Q_SO_TX_POLL_QUEUE, &n, sizeof(n)) == -1)
+                        throw pfq_error(errno, "PFQ: wait Tx space: poll queue error");
+                    data_->tx_poll_queue = n;
+                }
+
+                struct timespec timeout;
+                struct pollfd fd = {fd_, POLLOUT, 0 };
 
-                reinterpret_cast<char *&>(tx->ptr) += slot_size;
-                hdr = (struct pfq_pkthdr_tx *)tx->ptr;
-                hdr->len = 0;
+                if (microseconds >= 0) {
+                    auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now()).count();
+                    if (left < 0)
+                        return false;
+
+                    timeout.tv_sec  = left / 1000000000;
+                    timeout.tv_nsec = left % 1000000000;
+                }
 
-                return true;
+                if (::ppoll(&fd, 1, microseconds < 0 ? nullptr : &timeout, nullptr) < 0 && errno != EINTR)
+                    throw pfq_error(errno, "PFQ: wait Tx space: ppoll error");
             }
+        }
 
-            return false;
+        //! Return the counters of a Tx queue.
+        /*!
+         * The counters are published by the kernel in the shared memory, per batch:
+         * records taken from the queue, packets handed to the driver and discarded.
+         */
+
+        pfq_tx_queue_stats
+        tx_queue_stats(int queue) const
+        {
+            if (!data_ || data_->shm_addr == nullptr || data_->shm_addr == MAP_FAILED)
+                throw pfq_error("PFQ: Tx queue stats: socket not enabled");
+
+            if (queue < 0 || static_cast<size_t>(queue) >= data_->tx_num_bind)
+                throw pfq_error("PFQ: Tx queue stats: bad queue");
+
+            auto tx = &static_cast<struct pfq_shared_queue *>(data_->shm_addr)->tx[queue];
+
+            pfq_tx_queue_stats stats;
+            stats.consumed = __atomic_load_n(&tx->consumed, __ATOMIC_RELAXED);
+            stats.sent     = __atomic_load_n(&tx->sent, __ATOMIC_RELAXED);
+            stats.disc     = __atomic_load_n(&tx->disc, __ATOMIC_RELAXED);
+            return stats;
         }
 
         //! Flush the Tx queue(s).
         /*!
          * Transmit the packets in the Tx queues of the socket.
+         * Queues served by a shared Tx thread (tx_service module parameter) are
+         * handed to the thread, which is woken up if sleeping.
          */
 
         void
@@ -1389,6 +2262,8 @@ namespace pfq {
         //! Start/Stop kernel threads.
         /*!
          * Start/Stop kernel threads associated with Tx queues.
+         * With the tx_service module parameter set, the queues bound to a cpu are
+         * served by a single thread, shared among sockets (see tx_weight).
          */
 
         void
@@ -1399,6 +2274,35 @@ namespace pfq {
                 throw pfq_error(errno, "PFQ: Tx async");
         }
 
+        //! Enable/disable the zero-copy Tx mode.
+        /*!
+         * Zero-copy must be set before the socket is enabled. Packets longer than
+         * 128 bytes are transmitted from the pages of the Tx queue, on devices with
+         * scatter-gather support. A half of the queue is not reused until the driver
+         * has released it: inject returns false in the meantime.
+         */
+
+        void
+        tx_zcopy_enable(bool value)
+        {
+            if (enabled())
+                throw pfq_error("PFQ: enabled (zero-copy Tx could not be set)");
+
+            int toggle = static_cast<int>(value);
+            if (::setsockopt(fd_, PF_Q, Q_SO_SET_TX_ZCOPY, &toggle, sizeof(toggle)) == -1)
+                throw pfq_error(errno, "PFQ: set zero-copy Tx error");
+
+            data()->tx_zcopy = value;
+        }
+
+        //! Check whether the zero-copy Tx mode is enabled.
+
+        bool
+        tx_zcopy_enabled() const
+        {
+            return data()->tx_zcopy;
+        }
+
     };
 
 
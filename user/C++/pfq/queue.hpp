@@ -30,9 +30,30 @@
 
 namespace pfq {
 
+    //! Return the pointer to the packet data of the given header.
+    /*!
+     * In zero-copy mode the packet can be stored in the zero-copy area,
+     * rather than in the slot of the queue.
+     */
+
+    inline void * packet_data(pfq_pkthdr *h)
+    {
+        if (h->flags & Q_PKTHDR_ZCOPY)
+            return reinterpret_cast<void *>(static_cast<uintptr_t>(reinterpret_cast<pfq_pkthdr_zcopy *>(h+1)->addr));
+        return h+1;
+    }
+
+    inline const void * packet_data(pfq_pkthdr const *h)
+    {
+        return packet_data(const_cast<pfq_pkthdr *>(h));
+    }
+
     //! This class represent a queue of packets.
     /*!
      * The memory where packets are stored is not owned by this class.
+     * A slot size of 0 stands for the packed layout: records have variable
+     * length and the queue length is expressed in Q_PACKED_UNIT units.
+     * Iterators of a packed queue can be incremented only when ready().
      */
 
     class queue
@@ -61,7 +82,7 @@ namespace pfq {
             operator++()
             {
                 hdr_ = reinterpret_cast<pfq_pkthdr *>(
-                        reinterpret_cast<char *>(hdr_) + slot_size_);
+                        reinterpret_cast<char *>(hdr_) + (slot_size_ ? slot_size_ : Q_PKTHDR_RECORD_SIZE(hdr_)));
                 return *this;
             }
 
@@ -88,7 +109,7 @@ namespace pfq {
             void *
             data() const
             {
-                return hdr_+1;
+                return packet_data(hdr_);
             }
 
             bool
@@ -139,7 +160,7 @@ namespace pfq {
             operator++()
             {
                 hdr_ = reinterpret_cast<pfq_pkthdr *>(
-                        reinterpret_cast<char *>(hdr_) + slot_size_);
+                        reinterpret_cast<char *>(hdr_) + (slot_size_ ? slot_size_ : Q_PKTHDR_RECORD_SIZE(hdr_)));
                 return *this;
             }
 
@@ -166,7 +187,7 @@ namespace pfq {
             const void *
             data() const
             {
-                return hdr_+1;
+                return packet_data(hdr_);
             }
 
             bool
@@ -216,6 +237,9 @@ namespace pfq {
 
 
         //! Return the number of packets stored in this queue.
+        /*!
+         * With the packed layout, return the length of the queue in Q_PACKED_UNIT units.
+         */
 
         size_t
         size() const
@@ -239,7 +263,7 @@ namespace pfq {
             return index_;
         }
 
-        //! Return the size of the queue slot, in bytes.
+        //! Return the size of the queue slot, in bytes (0 with the packed layout).
 
         size_t
         slot_size() const
@@ -247,6 +271,22 @@ namespace pfq {
             return slot_size_;
         }
 
+        //! Check whether the queue has the packed layout.
+
+        bool
+        packed() const
+        {
+            return slot_size_ == 0;
+        }
+
+        //! Return the size of the queue, in bytes.
+
+        size_t
+        bytes() const
+        {
+            return queue_len_ * (slot_size_ ? slot_size_ : Q_PACKED_UNIT);
+        }
+
         //! Return the pointer to the packet.
 
         const void *
@@ -283,7 +323,7 @@ namespace pfq {
         end()
         {
             return iterator(reinterpret_cast<pfq_pkthdr *>(
-                        static_cast<char *>(addr_) + queue_len_ * slot_size_), slot_size_, index_);
+                        static_cast<char *>(addr_) + bytes()), slot_size_, index_);
         }
 
         //! Return a constant iterator past to the end of the queue.
@@ -292,7 +332,7 @@ namespace pfq {
         end() const
         {
             return const_iterator(reinterpret_cast<pfq_pkthdr *>(
-                        static_cast<char *>(addr_) + queue_len_ * slot_size_), slot_size_, index_);
+                        static_cast<char *>(addr_) + bytes()), slot_size_, index_);
         }
 
         //! Return a constant iterator to the first slot of an non-empty queue.
@@ -312,7 +352,7 @@ namespace pfq {
         cend() const
         {
             return const_iterator(reinterpret_cast<pfq_pkthdr *>(
-                        static_cast<char *>(addr_) + queue_len_ * slot_size_), slot_size_, index_);
+                        static_cast<char *>(addr_) + bytes()), slot_size_, index_);
         }
 
     private:
@@ -333,7 +373,7 @@ namespace pfq {
         if (const_cast<volatile uint8_t &>(h.commit) != current_commit)
             return nullptr;
         smp_rmb();
-        return &h + 1;
+        return packet_data(&h);
     }
 
     //! Return a constant pointer to the packet.
@@ -347,7 +387,7 @@ namespace pfq {
         if (const_cast<volatile uint8_t &>(h.commit) != current_commit)
             return nullptr;
         smp_rmb();
-        return &h + 1;
+        return packet_data(&h);
     }
 
 } // namespace pfq
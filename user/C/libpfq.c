@@ -43,6 +43,7 @@
 #include <ctype.h>
 #include <sched.h>
 #include <fcntl.h>
+#include <time.h>
 
 #include <poll.h>
 
@@ -155,6 +156,26 @@ typedef struct pfq_data
 	size_t tx_num_bind;
 
 	int    tx_async;
+	int    tx_zcopy;
+	int    tx_poll_queue;		/* Tx queue POLLOUT waits for (Q_SO_TX_POLL_QUEUE) */
+
+	int    rx_packed;
+
+	unsigned int rx_rings;
+	unsigned int rx_ring_next;	/* next sub-ring to drain */
+	unsigned int rx_pending;	/* mask of the sub-rings swapped and not read yet */
+	struct pfq_net_queue rx_pend[Q_MAX_RX_RINGS];
+
+	int    rx_zcopy;
+	void * zc_addr;
+	size_t zc_size;
+	uint32_t * zc_tokens;
+
+	int    stats_cpus;		/* per-cpu blocks of the statistics areas */
+	void * stats_addr;
+	void ** grp_stats_addr;		/* by group id, mapped on demand */
+	void ** grp_ts_addr;		/* time-series, by group id */
+	int    grp_len;
 
 	const char * error;
 
@@ -165,6 +186,7 @@ typedef struct pfq_data
 	int gid;
 
 	struct pfq_net_queue netq;
+	struct pfq_net_queue zc_last;	/* last queue read in zero-copy mode */
 } pfq_t;
 
 /* return the string error */
@@ -239,6 +261,7 @@ pfq_open_group(unsigned long class_mask, int group_policy, size_t caplen, size_t
 	q->id 	    = -1;
 	q->gid 	    = -1;
         q->tx_async =  1;
+	q->tx_poll_queue = -1;
 
         memset(&q->netq, 0, sizeof(q->netq));
 
@@ -254,6 +277,7 @@ pfq_open_group(unsigned long class_mask, int group_policy, size_t caplen, size_t
 	}
 
 	q->rx_slots = rx_slots;
+	q->rx_rings = 1;
 
 	/* set caplen */
 	if (setsockopt(fd, PF_Q, Q_SO_SET_RX_CAPLEN, &caplen, sizeof(caplen)) == -1) {
@@ -291,6 +315,32 @@ pfq_open_group(unsigned long class_mask, int group_policy, size_t caplen, size_t
 }
 
 
+static void
+pfq_stats_unmap(pfq_t *q)
+{
+	int n;
+
+	if (q->stats_addr)
+		munmap(q->stats_addr, Q_STATS_AREA_SIZE(q->stats_cpus, struct pfq_sock_stats_block));
+
+	for(n = 0; n < q->grp_len; n++)
+	{
+		if (q->grp_stats_addr[n])
+			munmap(q->grp_stats_addr[n], Q_STATS_AREA_SIZE(q->stats_cpus, struct pfq_group_stats_block));
+		if (q->grp_ts_addr[n])
+			munmap(q->grp_ts_addr[n], sizeof(struct pfq_group_timeseries));
+	}
+
+	free(q->grp_stats_addr);
+	free(q->grp_ts_addr);
+
+	q->stats_addr     = NULL;
+	q->grp_stats_addr = NULL;
+	q->grp_ts_addr    = NULL;
+	q->grp_len        = 0;
+}
+
+
 int pfq_close(pfq_t *q)
 {
 	if (q->fd != -1)
@@ -298,6 +348,8 @@ int pfq_close(pfq_t *q)
 		if (q->shm_addr)
 			pfq_disable(q);
 
+		pfq_stats_unmap(q);
+
 		if (close(q->fd) < 0)
 			return Q_ERROR(q, "PFQ: close error");
 
@@ -313,11 +365,24 @@ int pfq_close(pfq_t *q)
 }
 
 
+/* max number of packets in a Rx queue: the packed layout stores
+ * smaller records (at least a pfq_pkthdr_zcopy for a lent buffer) */
+
+static size_t
+pfq_rx_max_records(pfq_t const *q)
+{
+	if (q->rx_packed)
+		return q->rx_slots * q->rx_slot_size / Q_PACKED_RECORD_SIZE(sizeof(struct pfq_pkthdr_zcopy));
+	return q->rx_slots;
+}
+
+
 int
 pfq_enable(pfq_t *q)
 {
 	size_t tot_mem; socklen_t size = sizeof(tot_mem);
 	char filename[64];
+	int tx_queues;
 
 	if (q->shm_addr != MAP_FAILED &&
 	    q->shm_addr != NULL) {
@@ -356,12 +421,44 @@ pfq_enable(pfq_t *q)
 
 	q->shm_size = tot_mem;
 
-       	q->rx_queue_addr = (char *)(q->shm_addr) + sizeof(struct pfq_shared_queue);
+	/* map the zero-copy area (read-only) */
+
+	if (q->rx_zcopy) {
+
+		size = sizeof(q->zc_size);
+		if (getsockopt(q->fd, PF_Q, Q_SO_GET_RX_ZCOPY, &q->zc_size, &size) == -1) {
+			return Q_ERROR(q, "PFQ: zero-copy size error");
+		}
+
+		q->zc_addr = mmap(NULL, q->zc_size, PROT_READ, MAP_SHARED, q->fd, Q_ZCOPY_MMAP_OFFSET);
+		if (q->zc_addr == MAP_FAILED) {
+			q->zc_addr = NULL;
+			return Q_ERROR(q, "PFQ: socket enable (zero-copy memory map)");
+		}
+
+		q->zc_tokens = (uint32_t *)malloc(pfq_rx_max_records(q) * sizeof(uint32_t));
+		if (q->zc_tokens == NULL) {
+			return Q_ERROR(q, "PFQ: out of memory");
+		}
+
+		memset(&q->zc_last, 0, sizeof(q->zc_last));
+	}
+
+	/* the shared header holds a Tx queue descriptor per binding */
+
+	size = sizeof(tx_queues);
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_TX_QUEUES, &tx_queues, &size) == -1) {
+		return Q_ERROR(q, "PFQ: get Tx queues error");
+	}
+
+       	q->rx_queue_addr = (char *)(q->shm_addr) + Q_SHARED_QUEUE_HDR_SIZE(tx_queues);
         q->rx_queue_size = q->rx_slots * q->rx_slot_size;
 
-        q->tx_queue_addr = (char *)(q->shm_addr) + sizeof(struct pfq_shared_queue) + q->rx_queue_size * 2;
+        q->tx_queue_addr = (char *)(q->shm_addr) + Q_SHARED_QUEUE_HDR_SIZE(tx_queues) + q->rx_queue_size * 2 * q->rx_rings;
         q->tx_queue_size = q->tx_slots * q->tx_slot_size;
 
+	q->rx_pending = 0;
+
         return Q_OK(q);
 }
 
@@ -388,6 +485,17 @@ pfq_disable(pfq_t *q)
 	q->shm_addr = NULL;
 	q->shm_size = 0;
 
+	/* zero-copy buffers are released by the kernel on disable */
+
+	if (q->zc_addr) {
+		munmap(q->zc_addr, q->zc_size);
+		free(q->zc_tokens);
+
+		q->zc_addr   = NULL;
+		q->zc_size   = 0;
+		q->zc_tokens = NULL;
+	}
+
 	if(setsockopt(q->fd, PF_Q, Q_SO_DISABLE, NULL, 0) == -1) {
 		return Q_ERROR(q, "PFQ: socket disable");
 	}
@@ -471,6 +579,111 @@ pfq_set_promisc(pfq_t const *q, const char *dev, int value)
 }
 
 
+int
+pfq_rx_zcopy_enable(pfq_t *q, int value)
+{
+	int enabled = pfq_is_enabled(q);
+	if (enabled == 1) {
+		return Q_ERROR(q, "PFQ: enabled (zero-copy could not be set)");
+	}
+
+	if (setsockopt(q->fd, PF_Q, Q_SO_SET_RX_ZCOPY, &value, sizeof(value)) == -1) {
+		return Q_ERROR(q, "PFQ: set zero-copy error");
+	}
+
+	q->rx_zcopy = value ? 1 : 0;
+	return Q_OK(q);
+}
+
+
+int
+pfq_is_rx_zcopy_enabled(pfq_t const *q)
+{
+	return Q_VALUE(q, q->rx_zcopy);
+}
+
+
+int
+pfq_rx_zcopy_return(pfq_t *q, struct pfq_net_queue const *nq)
+{
+	pfq_iterator_t it, it_end;
+	size_t n = 0;
+
+	if (q->zc_tokens == NULL)
+		return Q_OK(q);
+
+	it = pfq_net_queue_begin(nq);
+	it_end = pfq_net_queue_end(nq);
+
+	for(; it != it_end; it = pfq_net_queue_next(nq, it))
+	{
+		const struct pfq_pkthdr *h;
+
+		while (!pfq_iterator_ready(nq, it))
+			pfq_yield();
+
+		h = pfq_iterator_header(it);
+		if (h->flags & Q_PKTHDR_ZCOPY)
+			q->zc_tokens[n++] = ((const struct pfq_pkthdr_zcopy *)(h+1))->token;
+	}
+
+	if (n && setsockopt(q->fd, PF_Q, Q_SO_RX_ZCOPY_RETURN, q->zc_tokens, n * sizeof(uint32_t)) == -1) {
+		return Q_ERROR(q, "PFQ: zero-copy return error");
+	}
+
+	return Q_OK(q);
+}
+
+
+int
+pfq_rx_packed_enable(pfq_t *q, int value)
+{
+	int enabled = pfq_is_enabled(q);
+	if (enabled == 1) {
+		return Q_ERROR(q, "PFQ: enabled (packed layout could not be set)");
+	}
+
+	if (setsockopt(q->fd, PF_Q, Q_SO_SET_RX_PACKED, &value, sizeof(value)) == -1) {
+		return Q_ERROR(q, "PFQ: set packed layout error");
+	}
+
+	q->rx_packed = value ? 1 : 0;
+	return Q_OK(q);
+}
+
+
+int
+pfq_is_rx_packed_enabled(pfq_t const *q)
+{
+	return Q_VALUE(q, q->rx_packed);
+}
+
+
+int
+pfq_set_rx_rings(pfq_t *q, int value)
+{
+	int enabled = pfq_is_enabled(q);
+	if (enabled == 1) {
+		return Q_ERROR(q, "PFQ: enabled (Rx rings could not be set)");
+	}
+
+	if (setsockopt(q->fd, PF_Q, Q_SO_SET_RX_RINGS, &value, sizeof(value)) == -1) {
+		return Q_ERROR(q, "PFQ: set Rx rings error");
+	}
+
+	q->rx_rings = (unsigned int)value;
+	q->rx_ring_next = 0;
+	return Q_OK(q);
+}
+
+
+int
+pfq_get_rx_rings(pfq_t const *q)
+{
+	return Q_VALUE(q, (int)q->rx_rings);
+}
+
+
 int
 pfq_set_caplen(pfq_t *q, size_t value)
 {
@@ -677,14 +890,26 @@ pfq_unbind(pfq_t *q, const char *dev, int queue)
 
 
 int
-pfq_groups_mask(pfq_t const *q, unsigned long *_mask)
+pfq_groups_mask(pfq_t const *q, unsigned long *mask, size_t words)
 {
-	unsigned long mask; socklen_t size = sizeof(mask);
+	socklen_t size;
+
+	if (words == 0) {
+		return Q_ERROR(q, "PFQ: get groups error (empty mask)");
+	}
+
+	/* the words beyond Q_GROUPS_MASK_WORDS are always zero */
+
+	if (words > Q_GROUPS_MASK_WORDS) {
+		memset(mask + Q_GROUPS_MASK_WORDS, 0, (words - Q_GROUPS_MASK_WORDS) * sizeof(unsigned long));
+		words = Q_GROUPS_MASK_WORDS;
+	}
 
-	if (getsockopt(q->fd, PF_Q, Q_SO_GET_GROUPS, &mask, &size) == -1) {
+	size = words * sizeof(unsigned long);
+
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_GROUPS, mask, &size) == -1) {
 		return Q_ERROR(q, "PFQ: get groups error");
 	}
-	*_mask = mask;
 	return Q_OK(q);
 }
 
@@ -869,6 +1094,319 @@ pfq_get_group_counters(pfq_t const *q, int gid, struct pfq_counters *cs)
 }
 
 
+int
+pfq_get_group_persistent(pfq_t const *q, int gid, int index, int reduce, unsigned long *word)
+{
+	struct pfq_group_persistent_read p = { gid, index, reduce, { 0 } };
+	socklen_t size = sizeof(p);
+
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_GROUP_PERSISTENT, &p, &size) == -1) {
+		return Q_ERROR(q, "PFQ: get group persistent error");
+	}
+
+	memcpy(word, p.word, sizeof(p.word));
+	return Q_OK(q);
+}
+
+
+/* statistics areas and time-series: mapped read-only on demand */
+
+static void *
+pfq_stats_map(pfq_t *q, size_t size, off_t offset)
+{
+	void *addr = mmap(NULL, size, PROT_READ, MAP_SHARED, q->fd, offset);
+	if (addr == MAP_FAILED) {
+		q->error = "PFQ: stats memory map error";
+		return NULL;
+	}
+
+	return addr;
+}
+
+
+/* per-cpu blocks of the statistics areas */
+
+static int
+pfq_stats_cpus(pfq_t *q)
+{
+	socklen_t size = sizeof(q->stats_cpus);
+
+	if (q->stats_cpus == 0 &&
+	    getsockopt(q->fd, PF_Q, Q_SO_GET_STATS_CPUS, &q->stats_cpus, &size) == -1) {
+		q->error = "PFQ: get stats cpus error";
+		return -1;
+	}
+
+	return q->stats_cpus;
+}
+
+
+static int
+pfq_group_map_reserve(pfq_t *q, int gid)
+{
+	void ** stats, ** ts;
+
+	if (gid < 0) {
+		q->error = "PFQ: invalid group id";
+		return -1;
+	}
+
+	if (gid < q->grp_len)
+		return 0;
+
+	stats = (void **)realloc(q->grp_stats_addr, (size_t)(gid + 1) * sizeof(void *));
+	if (stats != NULL)
+		q->grp_stats_addr = stats;
+
+	ts = (void **)realloc(q->grp_ts_addr, (size_t)(gid + 1) * sizeof(void *));
+	if (ts != NULL)
+		q->grp_ts_addr = ts;
+
+	if (stats == NULL || ts == NULL) {
+		q->error = "PFQ: out of memory";
+		return -1;
+	}
+
+	memset(stats + q->grp_len, 0, (size_t)(gid + 1 - q->grp_len) * sizeof(void *));
+	memset(ts + q->grp_len, 0, (size_t)(gid + 1 - q->grp_len) * sizeof(void *));
+
+	q->grp_len = gid + 1;
+	return 0;
+}
+
+
+static const struct pfq_group_stats_block *
+pfq_group_stats_area(pfq_t *q, int gid)
+{
+	if (pfq_group_map_reserve(q, gid) < 0 || pfq_stats_cpus(q) < 0)
+		return NULL;
+
+	if (q->grp_stats_addr[gid] == NULL)
+		q->grp_stats_addr[gid] = pfq_stats_map(q, Q_STATS_AREA_SIZE(q->stats_cpus, struct pfq_group_stats_block),
+						       Q_GROUP_STATS_MMAP_OFFSET(gid));
+
+	return (const struct pfq_group_stats_block *)q->grp_stats_addr[gid];
+}
+
+
+static const struct pfq_group_timeseries *
+pfq_group_timeseries_area(pfq_t *q, int gid)
+{
+	if (pfq_group_map_reserve(q, gid) < 0)
+		return NULL;
+
+	if (q->grp_ts_addr[gid] == NULL)
+		q->grp_ts_addr[gid] = pfq_stats_map(q, sizeof(struct pfq_group_timeseries), Q_GROUP_TIMESERIES_MMAP_OFFSET(gid));
+
+	return (const struct pfq_group_timeseries *)q->grp_ts_addr[gid];
+}
+
+
+int
+pfq_read_stats(pfq_t *q, struct pfq_stats *stats)
+{
+	const struct pfq_sock_stats_block *b;
+	int n;
+
+	if (q->stats_addr == NULL) {
+		if (pfq_stats_cpus(q) < 0)
+			return Q_ERROR(q, q->error);
+
+		q->stats_addr = pfq_stats_map(q, Q_STATS_AREA_SIZE(q->stats_cpus, struct pfq_sock_stats_block), Q_STATS_MMAP_OFFSET);
+		if (q->stats_addr == NULL)
+			return Q_ERROR(q, q->error);
+	}
+
+	memset(stats, 0, sizeof(*stats));
+
+	for(n = 0, b = (const struct pfq_sock_stats_block *)q->stats_addr; n < q->stats_cpus; n++, b++)
+	{
+		stats->recv += b->recv;
+		stats->lost += b->lost;
+		stats->drop += b->drop;
+		stats->sent += b->sent;
+		stats->disc += b->disc;
+	}
+
+	return Q_OK(q);
+}
+
+
+int
+pfq_read_group_stats(pfq_t *q, int gid, struct pfq_stats *stats)
+{
+	const struct pfq_group_stats_block *b = pfq_group_stats_area(q, gid);
+	int n;
+
+	if (b == NULL)
+		return Q_ERROR(q, q->error);
+
+	memset(stats, 0, sizeof(*stats));
+
+	for(n = 0; n < q->stats_cpus; n++, b++)
+	{
+		stats->recv += b->recv;
+		stats->drop += b->drop;
+		stats->frwd += b->frwd;
+		stats->kern += b->kern;
+	}
+
+	return Q_OK(q);
+}
+
+
+int
+pfq_read_group_counters(pfq_t *q, int gid, struct pfq_counters *cs)
+{
+	const struct pfq_group_stats_block *b = pfq_group_stats_area(q, gid);
+	int n, i;
+
+	if (b == NULL)
+		return Q_ERROR(q, q->error);
+
+	memset(cs, 0, sizeof(*cs));
+
+	for(n = 0; n < q->stats_cpus; n++, b++)
+	{
+		for(i = 0; i < Q_MAX_COUNTERS; i++)
+			cs->counter[i] += b->counter[i];
+	}
+
+	return Q_OK(q);
+}
+
+
+int
+pfq_set_group_timeseries(pfq_t *q, int gid, unsigned int period)
+{
+        struct pfq_group_timeseries_period value = { gid, period };
+
+        if (setsockopt(q->fd, PF_Q, Q_SO_GROUP_TIMESERIES, &value, sizeof(value)) == -1) {
+		return Q_ERROR(q, "PFQ: set group time-series error");
+        }
+        return Q_OK(q);
+}
+
+
+int
+pfq_read_group_snapshot(pfq_t *q, int gid, size_t back, struct pfq_group_snapshot *snap)
+{
+	const struct pfq_group_timeseries *ts = pfq_group_timeseries_area(q, gid);
+	const struct pfq_group_snapshot *s;
+	uint64_t head, n;
+
+	if (ts == NULL)
+		return Q_ERROR(q, q->error);
+
+	head = __atomic_load_n(&ts->head, __ATOMIC_ACQUIRE);
+	if (back >= head || back >= Q_TIMESERIES_SLOTS)
+		return Q_VALUE(q, 0);
+
+	n = head - 1 - back;
+	s = &ts->snap[n % Q_TIMESERIES_SLOTS];
+
+	/* the slot may be overwritten during the copy */
+
+	if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != n + 1)
+		return Q_VALUE(q, 0);
+
+	memcpy(snap, s, sizeof(*snap));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != n + 1)
+		return Q_VALUE(q, 0);
+
+	snap->seq = n;
+	return Q_VALUE(q, 1);
+}
+
+
+int
+pfq_set_profile(pfq_t *q, int enable)
+{
+	if (setsockopt(q->fd, PF_Q, Q_SO_SET_PROFILE, &enable, sizeof(enable)) == -1) {
+		return Q_ERROR(q, "PFQ: set profile error");
+	}
+	return Q_OK(q);
+}
+
+
+int
+pfq_get_profile(pfq_t const *q, int cpu, struct pfq_profile *p)
+{
+	socklen_t size = sizeof(*p);
+
+	p->cpu = cpu;
+
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_PROFILE, p, &size) == -1) {
+		return Q_ERROR(q, "PFQ: get profile error");
+	}
+	return Q_OK(q);
+}
+
+
+int
+pfq_set_group_steering(pfq_t *q, int gid, int mode)
+{
+        struct pfq_group_steering value = { gid, mode };
+
+        if (setsockopt(q->fd, PF_Q, Q_SO_GROUP_STEERING, &value, sizeof(value)) == -1) {
+	        return Q_ERROR(q, "PFQ: group steering error");
+        }
+
+        return Q_OK(q);
+}
+
+
+int
+pfq_set_group_watermark(pfq_t *q, int gid, int watermark)
+{
+        struct pfq_group_watermark value = { gid, watermark };
+
+        if (setsockopt(q->fd, PF_Q, Q_SO_GROUP_WATERMARK, &value, sizeof(value)) == -1) {
+	        return Q_ERROR(q, "PFQ: group watermark error");
+        }
+
+        return Q_OK(q);
+}
+
+
+int
+pfq_set_group_tx_queue(pfq_t *q, int gid, int policy)
+{
+        struct pfq_group_tx_queue value = { gid, policy };
+
+        if (setsockopt(q->fd, PF_Q, Q_SO_GROUP_TX_QUEUE, &value, sizeof(value)) == -1) {
+	        return Q_ERROR(q, "PFQ: group Tx queue error");
+        }
+
+        return Q_OK(q);
+}
+
+
+int
+pfq_set_weight(pfq_t *q, int weight)
+{
+        if (setsockopt(q->fd, PF_Q, Q_SO_SET_WEIGHT, &weight, sizeof(weight)) == -1) {
+	        return Q_ERROR(q, "PFQ: set weight error");
+        }
+
+        return Q_OK(q);
+}
+
+
+int
+pfq_get_weight(pfq_t const *q)
+{
+	int ret; socklen_t size = sizeof(ret);
+
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_WEIGHT, &ret, &size) == -1) {
+		return Q_ERROR(q, "PFQ: get weight error");
+	}
+	return Q_VALUE(q, ret);
+}
+
+
 int
 pfq_vlan_filters_enable(pfq_t *q, int gid, int toggle)
 {
@@ -905,42 +1443,131 @@ int pfq_vlan_reset_filter(pfq_t *q, int gid, int vid)
 }
 
 
+/* round-robin: the first non-empty sub-ring, starting from the next one
+ * to drain (the next one itself, if they are all empty) */
+
+static unsigned int
+pfq_rx_ring_select(pfq_t *q, struct pfq_shared_queue *qd)
+{
+	unsigned int n, ring;
+
+	for(n = 0; n < q->rx_rings; n++)
+	{
+		ring = (q->rx_ring_next + n) % q->rx_rings;
+		if (Q_SHARED_QUEUE_LEN(Q_SHARED_RX_RING(qd, ring)->data) != 0)
+			return ring;
+	}
+
+	return q->rx_ring_next;
+}
+
+
+/* swap the buffers of a sub-ring: the filled one is returned in nq */
+
+static void
+pfq_rx_ring_swap(pfq_t *q, struct pfq_shared_queue *qd, unsigned int ring, struct pfq_net_queue *nq)
+{
+	struct pfq_rx_queue * rx = Q_SHARED_RX_RING(qd, ring);
+	unsigned int index, data;
+
+	index = Q_SHARED_QUEUE_INDEX(rx->data);
+
+	/* reset the next buffer... */
+
+	data = __sync_lock_test_and_set(&rx->data, ((index+1) << 24));
+
+	/* packed layout: the length is expressed in Q_PACKED_UNIT units */
+
+	nq->queue = (char *)(q->rx_queue_addr) + (ring * 2 + (index & 1)) * q->rx_queue_size;
+	nq->index = index;
+	nq->len   = min(Q_SHARED_QUEUE_LEN(data), q->rx_packed ?
+			min(q->rx_queue_size / Q_PACKED_UNIT, Q_PACKED_MAX_UNITS) : q->rx_slots);
+        nq->slot_size = q->rx_packed ? 0 : q->rx_slot_size;
+}
+
+
+/* With sub-rings, a read that finds no ring swapped yet swaps all the
+ * non-empty rings in one pass (after polling, if they are all empty),
+ * then the following reads hand out the swapped rings round-robin
+ * without touching the shared headers. A ring is swapped again only
+ * after its queue has been handed out, so the buffer being read is never
+ * the one the kernel fills. */
+
 int
 pfq_read(pfq_t *q, struct pfq_net_queue *nq, long int microseconds)
 {
 	struct pfq_shared_queue * qd;
-	unsigned int index, data;
+	unsigned int n, ring;
 
         if (q->shm_addr == NULL) {
          	return Q_ERROR(q, "PFQ: read: socket not enabled");
 	}
 
-	qd    = (struct pfq_shared_queue *)(q->shm_addr);
-	data  = qd->rx.data;
-	index = Q_SHARED_QUEUE_INDEX(data);
+	/* give back the zero-copy buffers of the previous queue, before the
+	 * kernel reuses its slots */
+
+	if (q->zc_tokens && q->zc_last.len) {
+		if (pfq_rx_zcopy_return(q, &q->zc_last) < 0)
+			return -1;
+		q->zc_last.len = 0;
+	}
+
+	qd = (struct pfq_shared_queue *)(q->shm_addr);
+
+	if (!q->rx_pending) {
 
-	if(Q_SHARED_QUEUE_LEN(data) == 0 ) {
+		ring = pfq_rx_ring_select(q, qd);
+
+		if(Q_SHARED_QUEUE_LEN(Q_SHARED_RX_RING(qd, ring)->data) == 0 ) {
 #ifdef PFQ_USE_POLL
-		if (pfq_poll(q, microseconds) < 0) {
-        		return Q_ERROR(q, "PFQ: poll error");
-		}
+			if (pfq_poll(q, microseconds) < 0) {
+				return Q_ERROR(q, "PFQ: poll error");
+			}
+			if (q->rx_rings > 1)
+				ring = pfq_rx_ring_select(q, qd);
 #else
-		(void)microseconds;
+			(void)microseconds;
 #endif
+		}
+
+		/* the selected ring (even if empty) and all the non-empty ones */
+
+		for(n = 0; n < q->rx_rings; n++)
+		{
+			unsigned int r = (ring + n) % q->rx_rings;
+
+			if (n == 0 || Q_SHARED_QUEUE_LEN(Q_SHARED_RX_RING(qd, r)->data) != 0) {
+				pfq_rx_ring_swap(q, qd, r, &q->rx_pend[r]);
+				q->rx_pending |= 1U << r;
+			}
+		}
+
+		q->rx_ring_next = ring;
 	}
 
-	/* reset the next buffer... */
+	/* the next pending ring, round-robin */
 
-	data = __sync_lock_test_and_set(&qd->rx.data, ((index+1) << 24));
+	for(n = 0; n < q->rx_rings; n++)
+	{
+		ring = (q->rx_ring_next + n) % q->rx_rings;
+		if (q->rx_pending & (1U << ring))
+			break;
+	}
+
+	if (n == q->rx_rings) {
+		q->rx_pending = 0;
+		return Q_ERROR(q, "PFQ: read: no pending ring");
+	}
 
-	size_t queue_len = min(Q_SHARED_QUEUE_LEN(data), q->rx_slots);
+	q->rx_pending  &= ~(1U << ring);
+	q->rx_ring_next = (ring + 1) % q->rx_rings;
 
-	nq->queue = (char *)(q->rx_queue_addr) + (index & 1) * q->rx_queue_size;
-	nq->index = index;
-	nq->len   = queue_len;
-        nq->slot_size = q->rx_slot_size;
+	*nq = q->rx_pend[ring];
 
-	return Q_VALUE(q, (int)queue_len);
+	if (q->zc_tokens)
+		q->zc_last = *nq;
+
+	return Q_VALUE(q, (int)nq->len);
 }
 
 
@@ -954,7 +1581,7 @@ pfq_recv(pfq_t *q, void *buf, size_t buflen, struct pfq_net_queue *nq, long int
 		return Q_ERROR(q, "PFQ: buffer too small");
 	}
 
-	memcpy(buf, nq->queue, q->rx_slot_size * nq->len);
+	memcpy(buf, nq->queue, (size_t)(pfq_net_queue_end(nq) - pfq_net_queue_begin(nq)));
 	return Q_OK(q);
 }
 
@@ -965,20 +1592,26 @@ pfq_dispatch(pfq_t *q, pfq_handler_t cb, long int microseconds, char *user)
 	pfq_iterator_t it, it_end;
 	int n = 0;
 
-	if (pfq_read(q, &q->netq, microseconds) < 0)
-		return -1;
+	/* all the sub-rings swapped by the first read are drained */
 
-	it = pfq_net_queue_begin(&q->netq);
-	it_end = pfq_net_queue_end(&q->netq);
+	do {
+		if (pfq_read(q, &q->netq, microseconds) < 0)
+			return -1;
 
-	for(; it != it_end; it = pfq_net_queue_next(&q->netq, it))
-	{
-		while (!pfq_iterator_ready(&q->netq, it))
-			pfq_yield();
+		it = pfq_net_queue_begin(&q->netq);
+		it_end = pfq_net_queue_end(&q->netq);
+
+		for(; it != it_end; it = pfq_net_queue_next(&q->netq, it))
+		{
+			while (!pfq_iterator_ready(&q->netq, it))
+				pfq_yield();
 
-		cb(user, pfq_iterator_header(it), pfq_iterator_data(it));
-		n++;
+			cb(user, pfq_iterator_header(it), pfq_iterator_data(it));
+			n++;
+		}
 	}
+	while (q->rx_pending);
+
         return Q_VALUE(q, n);
 }
 
@@ -1022,19 +1655,58 @@ pfq_unbind_tx(pfq_t *q)
 	return Q_OK(q);
 }
 
+
 int
-pfq_inject(pfq_t *q, const void *buf, size_t len, uint64_t nsec, int queue)
+pfq_set_tx_rate(pfq_t *q, int queue, uint64_t pps, uint64_t bps, unsigned int burst)
+{
+	struct pfq_tx_rate r;
+
+	r.queue = queue;
+	r.burst = burst;
+	r.pps   = pps;
+	r.bps   = bps;
+
+        if (setsockopt(q->fd, PF_Q, Q_SO_TX_RATE, &r, sizeof(r)) == -1)
+		return Q_ERROR(q, "PFQ: Tx rate error");
+
+	return Q_OK(q);
+}
+
+
+int
+pfq_set_tx_weight(pfq_t *q, int weight)
+{
+        if (setsockopt(q->fd, PF_Q, Q_SO_SET_TX_WEIGHT, &weight, sizeof(weight)) == -1) {
+	        return Q_ERROR(q, "PFQ: set Tx weight error");
+        }
+
+        return Q_OK(q);
+}
+
+
+int
+pfq_get_tx_weight(pfq_t const *q)
+{
+	int ret; socklen_t size = sizeof(ret);
+
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_TX_WEIGHT, &ret, &size) == -1) {
+		return Q_ERROR(q, "PFQ: get Tx weight error");
+	}
+	return Q_VALUE(q, ret);
+}
+
+
+static struct pfq_pkthdr_tx *
+pfq_tx_slot(pfq_t *q, const void *buf, size_t len, int queue)
 {
         struct pfq_shared_queue *sh_queue = (struct pfq_shared_queue *)(q->shm_addr);
         struct pfq_tx_queue *tx;
+        struct pfq_pkthdr_tx *hdr;
         unsigned int index;
         size_t slot_size;
         int tss;
         void *base_addr;
 
-	if (q->shm_addr == NULL)
-         	return Q_ERROR(q, "PFQ: inject: socket not enabled");
-
 	if (queue == Q_ANY_QUEUE) {
 		tss = pfq_fold(pfq_symmetric_hash(buf), q->tx_num_bind);
 	}
@@ -1053,29 +1725,199 @@ pfq_inject(pfq_t *q, const void *buf, size_t len, uint64_t nsec, int queue)
 	base_addr = q->tx_queue_addr + q->tx_queue_size * (2 * tss + (index & 1));
 
 	if (index != tx->index) {
+
+		/* zero-copy Tx: the driver still holds the pages of this half */
+
+		if (__atomic_load_n(&tx->zc_busy[index & 1], __ATOMIC_ACQUIRE))
+			return NULL;
+
         	tx->index = index;
         	tx->ptr = base_addr;
 	}
 
 	slot_size = sizeof(struct pfq_pkthdr_tx) + ALIGN(len, 8);
 
-	if ((tx->ptr - base_addr + slot_size + sizeof(struct pfq_pkthdr_tx)) < q->tx_queue_size)
+	if ((tx->ptr - base_addr + slot_size + sizeof(struct pfq_pkthdr_tx)) >= q->tx_queue_size)
+		return NULL;
+
+	hdr = (struct pfq_pkthdr_tx *)tx->ptr;
+
+	tx->ptr += slot_size;
+	((struct pfq_pkthdr_tx *)tx->ptr)->len = 0;
+
+	return hdr;
+}
+
+
+int
+pfq_inject(pfq_t *q, const void *buf, size_t len, uint64_t nsec, int queue)
+{
+	struct pfq_pkthdr_tx *hdr;
+
+	if (q->shm_addr == NULL)
+         	return Q_ERROR(q, "PFQ: inject: socket not enabled");
+
+	hdr = pfq_tx_slot(q, buf, len, queue);
+	if (hdr == NULL)
+		return Q_VALUE(q, -1);
+
+	hdr->len = len;
+	hdr->nsec = nsec;
+	memcpy(hdr+1, buf, len);
+
+	return Q_VALUE(q, len);
+}
+
+
+int
+pfq_inject_template(pfq_t *q, const void *buf, size_t len, unsigned int copies,
+		    const struct pfq_tx_mutator *mut, size_t num_mutators, int flags, uint64_t nsec, int queue)
+{
+	struct pfq_tx_template *tmpl;
+	struct pfq_pkthdr_tx *hdr;
+	size_t size;
+
+	if (q->shm_addr == NULL)
+         	return Q_ERROR(q, "PFQ: inject: socket not enabled");
+
+	if (copies == 0 || len > 0xffff || num_mutators > Q_TX_MAX_MUTATORS)
+         	return Q_ERROR(q, "PFQ: inject: bad template");
+
+	size = Q_TX_TEMPLATE_SIZE(num_mutators, len);
+
+	hdr = pfq_tx_slot(q, buf, size, queue);
+	if (hdr == NULL)
+		return Q_VALUE(q, -1);
+
+	tmpl = (struct pfq_tx_template *)(hdr+1);
+	tmpl->copies = copies;
+	tmpl->len = (uint16_t)len;
+	tmpl->num_mutators = (uint8_t)num_mutators;
+	tmpl->flags = (uint8_t)flags;
+
+	memcpy(tmpl->mutator, mut, num_mutators * sizeof(struct pfq_tx_mutator));
+	memcpy(tmpl->mutator + num_mutators, buf, len);
+
+	hdr->len = size | Q_TX_TEMPLATE;
+	hdr->nsec = nsec;
+
+	return Q_VALUE(q, len);
+}
+
+
+/* a record of slot_size bytes fits in the Tx queue tss (as with pfq_tx_slot) */
+
+static int
+pfq_tx_space(pfq_t *q, int tss, size_t slot_size)
+{
+        struct pfq_shared_queue *sh_queue = (struct pfq_shared_queue *)(q->shm_addr);
+        struct pfq_tx_queue *tx = (struct pfq_tx_queue *)&sh_queue->tx[tss];
+        unsigned int index = __atomic_load_n(&tx->cons, __ATOMIC_RELAXED);
+        void *base_addr;
+
+	/* the kernel has handed a new half to the producer */
+
+	if (index != tx->index)
+		return !__atomic_load_n(&tx->zc_busy[index & 1], __ATOMIC_ACQUIRE);
+
+	base_addr = q->tx_queue_addr + q->tx_queue_size * (2 * tss + (index & 1));
+
+	return (tx->ptr - base_addr + slot_size + sizeof(struct pfq_pkthdr_tx)) < q->tx_queue_size;
+}
+
+
+int
+pfq_wait_tx_space(pfq_t *q, size_t bytes, long int microseconds, int queue)
+{
+	size_t slot_size = sizeof(struct pfq_pkthdr_tx) + ALIGN(bytes, 8);
+	struct pollfd fd = {q->fd, POLLOUT, 0 };
+	struct timespec now, deadline, timeout;
+	int first, last, n, flushed = 0;
+
+	if (q->shm_addr == NULL || q->shm_addr == MAP_FAILED)
+         	return Q_ERROR(q, "PFQ: wait Tx space: socket not enabled");
+
+	if (q->tx_num_bind == 0)
+         	return Q_ERROR(q, "PFQ: wait Tx space: socket not bound");
+
+	if (slot_size + sizeof(struct pfq_pkthdr_tx) >= q->tx_queue_size)
+         	return Q_ERROR(q, "PFQ: wait Tx space: packet too long");
+
+	/* any queue: the packet may be injected in each of them */
+
+	first = queue == Q_ANY_QUEUE ? 0 : pfq_fold(queue, q->tx_num_bind);
+	last  = queue == Q_ANY_QUEUE ? (int)q->tx_num_bind : first + 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec  += microseconds/1000000;
+	deadline.tv_nsec += (microseconds%1000000) * 1000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	for(;;)
 	{
-       		struct pfq_pkthdr_tx *hdr;
+		for(n = first; n < last && pfq_tx_space(q, n, slot_size); n++)
+		{ }
+
+		if (n == last)
+			return Q_VALUE(q, 1);
 
-        	hdr = (struct pfq_pkthdr_tx *)tx->ptr;
-		hdr->len = len;
-		hdr->nsec = nsec;
-		memcpy(hdr+1, buf, hdr->len);
+		/* no kernel threads: transmit the queues now */
 
-                tx->ptr += slot_size;
-        	hdr = (struct pfq_pkthdr_tx *)tx->ptr;
-                hdr->len = 0;
+		if (!q->tx_async && !flushed) {
+			if (pfq_tx_queue_flush(q, queue == Q_ANY_QUEUE ? Q_ANY_QUEUE : first) < 0)
+				return -1;
+			flushed = 1;
+			continue;
+		}
+
+		/* POLLOUT waits for the first queue without room */
+
+		if (n != q->tx_poll_queue) {
+			if (setsockopt(q->fd, PF_Q, Q_SO_TX_POLL_QUEUE, &n, sizeof(n)) == -1)
+				return Q_ERROR(q, "PFQ: wait Tx space: poll queue error");
+			q->tx_poll_queue = n;
+		}
+
+		if (microseconds >= 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			timeout.tv_sec  = deadline.tv_sec - now.tv_sec;
+			timeout.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+			if (timeout.tv_nsec < 0) {
+				timeout.tv_sec--;
+				timeout.tv_nsec += 1000000000;
+			}
+			if (timeout.tv_sec < 0)
+				return Q_VALUE(q, 0);
+		}
 
-                return Q_VALUE(q, len);
+		if (ppoll(&fd, 1, microseconds < 0 ? NULL : &timeout, NULL) < 0 && errno != EINTR)
+			return Q_ERROR(q, "PFQ: wait Tx space: ppoll error");
 	}
+}
+
+
+int
+pfq_get_tx_queue_stats(pfq_t const *q, int queue, struct pfq_tx_queue_stats *stats)
+{
+        struct pfq_shared_queue *sh_queue = (struct pfq_shared_queue *)(q->shm_addr);
+        struct pfq_tx_queue *tx;
+
+	if (q->shm_addr == NULL || q->shm_addr == MAP_FAILED)
+         	return Q_ERROR(q, "PFQ: Tx queue stats: socket not enabled");
 
-	return Q_VALUE(q, -1);
+	if (queue < 0 || (size_t)queue >= q->tx_num_bind)
+         	return Q_ERROR(q, "PFQ: Tx queue stats: bad queue");
+
+	tx = (struct pfq_tx_queue *)&sh_queue->tx[queue];
+
+	stats->consumed = __atomic_load_n(&tx->consumed, __ATOMIC_RELAXED);
+	stats->sent     = __atomic_load_n(&tx->sent, __ATOMIC_RELAXED);
+	stats->disc     = __atomic_load_n(&tx->disc, __ATOMIC_RELAXED);
+
+	return Q_OK(q);
 }
 
 
@@ -1099,6 +1941,30 @@ pfq_tx_async(pfq_t *q, int toggle)
 }
 
 
+int
+pfq_tx_zcopy_enable(pfq_t *q, int value)
+{
+	int enabled = pfq_is_enabled(q);
+	if (enabled == 1) {
+		return Q_ERROR(q, "PFQ: enabled (zero-copy Tx could not be set)");
+	}
+
+	if (setsockopt(q->fd, PF_Q, Q_SO_SET_TX_ZCOPY, &value, sizeof(value)) == -1) {
+		return Q_ERROR(q, "PFQ: set zero-copy Tx error");
+	}
+
+	q->tx_zcopy = value ? 1 : 0;
+	return Q_OK(q);
+}
+
+
+int
+pfq_is_tx_zcopy_enabled(pfq_t const *q)
+{
+	return Q_VALUE(q, q->tx_zcopy);
+}
+
+
 int
 pfq_send(pfq_t *q, const void *ptr, size_t len)
 {
@@ -51,8 +51,8 @@ typedef char * pfq_iterator_t;
 struct pfq_net_queue
 {
         pfq_iterator_t queue; 	  		/* net queue */
-        size_t         len;       		/* number of packets in the queue */
-        size_t         slot_size;
+        size_t         len;       		/* number of packets in the queue (Q_PACKED_UNIT units if packed) */
+        size_t         slot_size;		/* 0 = packed layout */
         unsigned int   index; 	  		/* current queue index */
 };
 
@@ -72,19 +72,26 @@ static inline
 pfq_iterator_t
 pfq_net_queue_end(struct pfq_net_queue const *nq)
 {
-        return nq->queue + nq->len * nq->slot_size;
+        return nq->queue + nq->len * (nq->slot_size ? nq->slot_size : Q_PACKED_UNIT);
 }
 
 /*! Return an iterator to the next slot. */
+/*!
+ * With the packed layout the length of the record is read from its header:
+ * the current packet must be ready.
+ */
 
 static inline
 pfq_iterator_t
 pfq_net_queue_next(struct pfq_net_queue const *nq, pfq_iterator_t iter)
 {
+        if (nq->slot_size == 0)
+                return iter + Q_PKTHDR_RECORD_SIZE((const struct pfq_pkthdr *)iter);
+
         return iter + nq->slot_size;
 }
 
-/*! Return an iterator to the previous slot. */
+/*! Return an iterator to the previous slot (fixed-slot layout only). */
 
 static inline
 pfq_iterator_t
@@ -108,7 +115,14 @@ static inline
 const char *
 pfq_iterator_data(pfq_iterator_t iter)
 {
-        return (const char *)(iter + sizeof(struct pfq_pkthdr));
+        const struct pfq_pkthdr *h = pfq_iterator_header(iter);
+
+        /* zero-copy: the packet is in the zero-copy area */
+
+        if (h->flags & Q_PKTHDR_ZCOPY)
+                return (const char *)(uintptr_t)((const struct pfq_pkthdr_zcopy *)(h+1))->addr;
+
+        return (const char *)(h+1);
 }
 
 /*! Given an iterator, return 1 if the packet is available. */
@@ -313,6 +327,61 @@ extern int pfq_timestamp_enable(pfq_t *q, int value);
 extern int pfq_is_timestamp_enabled(pfq_t const *q);
 
 
+/*! Enable/disable the zero-copy Rx mode. */
+/*!
+ * Zero-copy must be set before the socket is enabled; it requires the pfq
+ * module loaded with zcopy_frames > 0. Packets that cannot be shared are
+ * still copied into the queue. Buffers are given back to the kernel
+ * by the next read (or with pfq_rx_zcopy_return).
+ */
+
+extern int pfq_rx_zcopy_enable(pfq_t *q, int value);
+
+
+/*! Check whether the zero-copy Rx mode is enabled. */
+
+extern int pfq_is_rx_zcopy_enabled(pfq_t const *q);
+
+
+/*! Give back to the kernel the zero-copy buffers of the given queue. */
+
+extern int pfq_rx_zcopy_return(pfq_t *q, struct pfq_net_queue const *nq);
+
+
+/*! Enable/disable the packed Rx layout. */
+/*!
+ * With the packed layout each packet takes a pfq_pkthdr plus the captured
+ * bytes (8-byte aligned) instead of a full slot; the Rx memory is unchanged.
+ * It must be set before the socket is enabled. The len field of the queue
+ * returned by pfq_read counts Q_PACKED_UNIT units rather than packets.
+ */
+
+extern int pfq_rx_packed_enable(pfq_t *q, int value);
+
+
+/*! Check whether the packed Rx layout is enabled. */
+
+extern int pfq_is_rx_packed_enabled(pfq_t const *q);
+
+
+/*! Specify the number of Rx sub-rings. */
+/*!
+ * Each sub-ring has the given number of Rx slots and is fed by the cpus
+ * with id modulo the number of rings: with a ring per Rx cpu, producers
+ * don't share any cache line. It must be set before the socket is enabled.
+ * A pfq_read that finds no pending sub-ring swaps all the non-empty ones
+ * at once; they are returned by the following reads (one per call, with no
+ * poll), and pfq_dispatch drains all of them in a single call.
+ */
+
+extern int pfq_set_rx_rings(pfq_t *q, int value);
+
+
+/*! Return the number of Rx sub-rings. */
+
+extern int pfq_get_rx_rings(pfq_t const *q);
+
+
 /*! Specify the capture length of packets, in bytes. */
 /*!
  * Capture length must be set before the socket is enabled.
@@ -410,6 +479,10 @@ extern int pfq_egress_unbind(pfq_t *q);
  *  A socket can be bound up to a maximum number of queues.
  *  The core parameter specifies the CPU index where to run a
  *  kernel thread (unless no_kthread id is specified).
+ *
+ *  The Tx queues are allocated by pfq_enable, one per binding: once the
+ *  socket is enabled, only the queues left up to Q_MIN_TX_QUEUES can be
+ *  bound. Bind before enabling the socket to use more queues.
  */
 
 extern int pfq_bind_tx(pfq_t *q, const char *dev, int queue, int core);
@@ -423,13 +496,39 @@ extern int pfq_bind_tx(pfq_t *q, const char *dev, int queue, int core);
 extern int pfq_unbind_tx(pfq_t *q);
 
 
+/*! Limit the rate of a Tx queue. */
+/*!
+ * The queue is the index of a Tx binding, in the order of pfq_bind_tx.
+ * The rate is given in packets and/or bits per second (0 = unlimited), and is
+ * enforced by the kernel for each batch, with a burst of up to @burst packets.
+ */
+
+extern int pfq_set_tx_rate(pfq_t *q, int queue, uint64_t pps, uint64_t bps, unsigned int burst);
+
+
+/*! Specify the Tx weight of the socket (1 by default). */
+/*!
+ * A shared Tx thread serves the queues of the sockets in proportion to
+ * their weights, up to Q_MAX_SOCK_WEIGHT.
+ */
+
+extern int pfq_set_tx_weight(pfq_t *q, int weight);
+
+
+/*! Return the Tx weight of the socket. */
+
+extern int pfq_get_tx_weight(pfq_t const *q);
+
+
 /*! Return the mask of the joined groups. */
 /*!
  * Each socket can bind to multiple groups. Each bit of the mask represents
- * a joined group.
+ * a joined group: group n is bit (n % bits of unsigned long) of mask[n / bits].
+ * The mask has the given number of words, Q_GROUPS_MASK_WORDS cover all the
+ * groups; groups beyond the given words are not reported.
  */
 
-extern int pfq_groups_mask(pfq_t const *q, unsigned long *_mask);
+extern int pfq_groups_mask(pfq_t const *q, unsigned long *mask, size_t words);
 
 
 /*! Specify a functional computation for the given group. */
@@ -463,6 +562,54 @@ extern int pfq_group_fprog(pfq_t *q, int gid, struct sock_fprog *);
 extern int pfq_group_fprog_reset(pfq_t *q, int gid);
 
 
+/*! Specify the steering mode of the given group. */
+/*!
+ * Q_STEERING_FOLD (default) spreads flows by folding the hash on the number
+ * of sockets: any change of the sockets remaps almost every flow.
+ * With Q_STEERING_MAGLEV (consistent hashing) only about 1/N of the flows
+ * move when a socket joins or leaves the group.
+ */
+
+extern int pfq_set_group_steering(pfq_t *q, int gid, int mode);
+
+
+/*! Specify the Rx watermark of the given group, for load-aware steering. */
+/*!
+ * The watermark is a percentage of the socket queue (0 disables it).
+ * A new flow steered to a socket whose queue is above the watermark
+ * overflows to the next socket of the group that is below it.
+ * Established flows keep their socket.
+ */
+
+extern int pfq_set_group_watermark(pfq_t *q, int gid, int watermark);
+
+
+/*! Specify the Tx queue policy of the given group, for packets forwarded to devices. */
+/*!
+ * Q_TX_QUEUE_PACKET (default) uses the queue of the packet.
+ * Q_TX_QUEUE_CPU maps each cpu to a Tx queue, so that Rx cpus forwarding
+ * to the same device do not contend for the same queue lock.
+ * Q_TX_QUEUE_HASH selects the queue by flow hash.
+ */
+
+extern int pfq_set_group_tx_queue(pfq_t *q, int gid, int policy);
+
+
+/*! Specify the steering weight of the socket (1 by default). */
+/*!
+ * Steered flows are spread across the sockets of a group in proportion
+ * to their weights, up to Q_MAX_SOCK_WEIGHT. The weight can be set before
+ * joining a group, or changed later.
+ */
+
+extern int pfq_set_weight(pfq_t *q, int weight);
+
+
+/*! Return the steering weight of the socket. */
+
+extern int pfq_get_weight(pfq_t const *q);
+
+
 /*! Set vlan filtering for the given group. */
 
 extern int pfq_vlan_filters_enable(pfq_t *q, int gid, int toggle);
@@ -500,7 +647,8 @@ extern int pfq_poll(pfq_t *q, long int microseconds /* = -1 -> infinite */);
 
 /*! Read packets in place. */
 /*!
- * Wait for packets and return the number of packets available in the queue.
+ * Wait for packets and return the number of packets available in the queue
+ * (with the packed layout, the length of the queue in Q_PACKED_UNIT units).
  * Packets are stored in the memory mapped queue of the socket.
  * The timeout is specified in microseconds.
  */
@@ -558,9 +706,74 @@ extern int pfq_get_group_stats(pfq_t const *q, int gid, struct pfq_stats *stats)
 extern int pfq_get_group_counters(pfq_t const *q, int gid, struct pfq_counters *cs);
 
 
+/*! Return the per-cpu persistent slot of the given group, reduced across the cpus. */
+/*!
+ * The reduce (Q_PERSISTENT_REDUCE_SUM, _MAX or _OR) merges the slots word by word;
+ * word must hold Q_PERSISTENT_MEM bytes.
+ */
+
+extern int pfq_get_group_persistent(pfq_t const *q, int gid, int index, int reduce, unsigned long *word);
+
+
+/*! Read the socket statistics from the mapped statistics area. */
+/*!
+ * The area is mapped read-only on the first call; the per-cpu blocks
+ * are summed in user space, without system calls.
+ */
+
+extern int pfq_read_stats(pfq_t *q, struct pfq_stats *stats);
+
+
+/*! Read the statistics of the given group from its mapped area. */
+
+extern int pfq_read_group_stats(pfq_t *q, int gid, struct pfq_stats *stats);
+
+
+/*! Read the set of counters of the given group from its mapped area. */
+
+extern int pfq_read_group_counters(pfq_t *q, int gid, struct pfq_counters *cs);
+
+
+/*! Take a snapshot of the stats and counters of the group every period (msec). */
+/*!
+ * The kernel keeps the last Q_TIMESERIES_SLOTS snapshots in a ring, mapped
+ * read-only by pfq_read_group_snapshot. A period of 0 stops the time-series.
+ * The socket must own the group.
+ */
+
+extern int pfq_set_group_timeseries(pfq_t *q, int gid, unsigned int period);
+
+
+/*! Read a snapshot of the time-series of the group, back steps before the last one. */
+/*!
+ * Return 1 when the snapshot is copied, 0 when it is not available (not
+ * yet taken, or already overwritten) and -1 on error. No system calls are
+ * made once the ring is mapped.
+ */
+
+extern int pfq_read_group_snapshot(pfq_t *q, int gid, size_t back, struct pfq_group_snapshot *snap);
+
+
+/*! Enable or disable the Rx profile (system-wide). */
+/*!
+ * The kernel times the stages of the Rx path (Q_PROFILE_xxx) in cycles,
+ * a log2 histogram per stage and per cpu. Enabling the profile resets
+ * the histograms; when disabled the probes cost a nop.
+ */
+
+extern int pfq_set_profile(pfq_t *q, int enable);
+
+
+/*! Read the Rx profile of the given cpu, or of all the cpus (Q_ANY_CPU). */
+
+extern int pfq_get_profile(pfq_t const *q, int cpu, struct pfq_profile *p);
+
+
 /*! Flush the Tx queue(s). */
 /*!
  * Transmit the packets in the Tx queues of the socket.
+ * Queues served by a shared Tx thread (tx_service module parameter) are
+ * handed to the thread, which is woken up if sleeping.
  */
 
 extern int pfq_tx_queue_flush(pfq_t *q, int queue);
@@ -569,11 +782,29 @@ extern int pfq_tx_queue_flush(pfq_t *q, int queue);
 /*! Start/Stop kernel threads. */
 /*!
  * Start/Stop kernel threads associated with Tx queues.
+ * With the tx_service module parameter set, the queues bound to a cpu are
+ * served by a single thread, shared among sockets (see pfq_set_tx_weight).
  */
 
 extern int pfq_tx_async(pfq_t *q, int toggle);
 
 
+/*! Enable/disable the zero-copy Tx mode. */
+/*!
+ * Zero-copy must be set before the socket is enabled. Packets longer than
+ * 128 bytes are transmitted from the pages of the Tx queue, on devices with
+ * scatter-gather support. A half of the queue is not reused until the driver
+ * has released it: pfq_inject fails in the meantime.
+ */
+
+extern int pfq_tx_zcopy_enable(pfq_t *q, int value);
+
+
+/*! Check whether the zero-copy Tx mode is enabled. */
+
+extern int pfq_is_tx_zcopy_enabled(pfq_t const *q);
+
+
 /*! Schedule the packet for transmission. */
 /*!
  * The packet is copied into a Tx queue (using a TSS symmetric hash if any_queue is specified)
@@ -584,6 +815,38 @@ extern int pfq_tx_async(pfq_t *q, int toggle);
 extern int pfq_inject(pfq_t *q, const void *ptr, size_t len, uint64_t nsec, int queue);
 
 
+/*! Schedule a packet template for transmission. */
+/*!
+ * The template is expanded by the kernel into @copies packets, transmitted as with
+ * pfq_inject. For each copy the mutators rewrite a field of the packet (an increment
+ * or a random value in [min, max]); with Q_TX_TEMPLATE_CSUM among the @flags the IPv4
+ * and UDP checksums are fixed up after the mutation.
+ */
+
+extern int pfq_inject_template(pfq_t *q, const void *ptr, size_t len, unsigned int copies,
+			       const struct pfq_tx_mutator *mut, size_t num_mutators, int flags, uint64_t nsec, int queue);
+
+
+/*! Wait until a packet of @bytes can be injected. */
+/*!
+ * Block on the socket until the Tx queue (any queue: all of them) has room
+ * for a packet of the given length, or the timeout expires (-1 = infinite).
+ * From then on POLLOUT on the socket refers to the last queue waited for.
+ * Return 1 if there is room, 0 on timeout, -1 on error.
+ */
+
+extern int pfq_wait_tx_space(pfq_t *q, size_t bytes, long int microseconds, int queue);
+
+
+/*! Return the counters of a Tx queue. */
+/*!
+ * The counters are published by the kernel in the shared memory, per batch:
+ * records taken from the queue, packets handed to the driver and discarded.
+ */
+
+extern int pfq_get_tx_queue_stats(pfq_t const *q, int queue, struct pfq_tx_queue_stats *stats);
+
+
 /*! Store the packet and transmit the packets in the queue. */
 /*!
  * The queue is flushed (if required) and the transmission takes place.
@@ -193,6 +193,7 @@ module Network.PFq.Default
         unit       ,
         inc        ,
         dec        ,
+        meter      ,
         mark       ,
 
     ) where
@@ -619,6 +620,13 @@ inc n = MFunction "inc" n () () () () () () ()
 dec :: CInt -> NetFunction
 dec n = MFunction "dec" n () () () () () () ()
 
+-- | Count packets and bytes in the i-th per-cpu persistent slot of the current group
+-- (two words, summed over the cpus when read).
+--
+-- > meter 0
+meter :: CInt -> NetFunction
+meter n = MFunction "meter" n () () () () () () ()
+
 -- | Mark the packet with the given value.
 --
 -- > mark 42
@@ -34,6 +34,7 @@ main()
     // computations:
 
     check_computation(q, ip >> udp >> inc(2) );
+    check_computation(q, ip >> udp >> meter(2) );
     check_computation(q, when   (has_vid(1), ip >> steer_ip) );
     check_computation(q, unless (is_ip, ip >> steer_ip) );
     check_computation(q, conditional (is_ip, steer_ip, drop  ) );
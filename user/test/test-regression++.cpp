@@ -180,6 +180,49 @@ Context(PFQ)
         Assert(x.rx_slot_size(), is_equal_to(size));
     }
 
+    Test(rx_packed)
+    {
+        pfq::socket x;
+        AssertThrow(x.rx_packed_enable(true));
+
+        x.open(pfq::group_policy::undefined, 64);
+
+        Assert(x.rx_packed_enabled(), is_false());
+        x.rx_packed_enable(true);
+        Assert(x.rx_packed_enabled(), is_true());
+
+        x.enable();
+        AssertThrow(x.rx_packed_enable(false));
+
+        auto q = x.read(10);
+        Assert(q.packed(), is_true());
+        Assert(q.begin() == q.end(), is_true());
+
+        x.disable();
+    }
+
+    Test(rx_rings)
+    {
+        pfq::socket x;
+        AssertThrow(x.rx_rings(2));
+
+        x.open(pfq::group_policy::undefined, 64);
+
+        Assert(x.rx_rings(), is_equal_to(1));
+        AssertThrow(x.rx_rings(0));
+        AssertThrow(x.rx_rings(Q_MAX_RX_RINGS + 1));
+        x.rx_rings(4);
+        Assert(x.rx_rings(), is_equal_to(4));
+
+        x.enable();
+        AssertThrow(x.rx_rings(2));
+
+        Assert(x.read(10).empty(), is_true());
+        Assert(x.read(10).empty(), is_true());
+
+        x.disable();
+    }
+
     Test(tx_slots)
     {
         pfq::socket x;
@@ -208,6 +251,9 @@ Context(PFQ)
 
         AssertThrow(x.bind("unknown"));
         x.bind(DEV.c_str());
+        x.bind(DEV.c_str(), 1);
+
+        AssertThrow(x.bind(DEV.c_str(), 256));
 
         AssertThrow(x.bind_group(11, DEV.c_str()));
     }
@@ -280,6 +326,86 @@ Context(PFQ)
     }
 
 
+    Test(read_stats)
+    {
+        pfq::socket x;
+        AssertThrow(x.read_stats());
+
+        x.open(pfq::group_policy::undefined, 64);
+
+        auto m = x.read_stats();
+        auto s = x.stats();
+        Assert(m.recv, is_equal_to(s.recv));
+        Assert(m.lost, is_equal_to(s.lost));
+        Assert(m.drop, is_equal_to(s.drop));
+        Assert(m.sent, is_equal_to(s.sent));
+
+        AssertThrow(x.read_group_stats(-1));
+
+        x.join_group(12);
+
+        auto g = x.read_group_stats(12);
+        Assert(g.recv, is_equal_to(x.group_stats(12).recv));
+        Assert(x.read_group_counters(12).size(), is_equal_to(static_cast<size_t>(Q_MAX_COUNTERS)));
+    }
+
+
+    Test(group_persistent)
+    {
+        pfq::socket x;
+
+        x.open(pfq::group_policy::undefined, 64);
+        x.join_group(13);
+
+        auto p = x.group_persistent(13, 0);
+        Assert(p.size(), is_equal_to(Q_PERSISTENT_MEM / sizeof(unsigned long)));
+        Assert(p[0], is_equal_to(0UL));
+
+        AssertNoThrow(x.group_persistent(13, Q_MAX_PERSISTENT_CPU - 1, pfq::persistent_reduce::max));
+        AssertThrow(x.group_persistent(13, Q_MAX_PERSISTENT_CPU));
+    }
+
+
+    Test(group_timeseries)
+    {
+        pfq::socket x;
+
+        x.open(pfq::group_policy::undefined, 64);
+        x.join_group(14, pfq::group_policy::restricted);
+
+        x.set_group_timeseries(14, std::chrono::milliseconds(10));
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        pfq_group_snapshot last, prev;
+
+        Assert(x.group_snapshot(14, 0, last), is_equal_to(true));
+        Assert(x.group_snapshot(14, 1, prev), is_equal_to(true));
+        Assert(last.seq, is_equal_to(prev.seq + 1));
+        Assert(last.tstamp >= prev.tstamp, is_equal_to(true));
+
+        Assert(x.group_snapshot(14, Q_TIMESERIES_SLOTS, last), is_equal_to(false));
+
+        AssertNoThrow(x.set_group_timeseries(14, std::chrono::milliseconds(0)));
+    }
+
+
+    Test(profile)
+    {
+        pfq::socket x;
+
+        x.open(pfq::group_policy::undefined, 64);
+
+        x.set_profile(true);
+        Assert(x.profile().enabled, is_equal_to(1));
+
+        AssertNoThrow(x.profile(0));
+        AssertThrow(x.profile(-1));
+
+        x.set_profile(false);
+        Assert(x.profile().enabled, is_equal_to(0));
+    }
+
+
     Test(my_group_stats_priv)
     {
         pfq::socket x;
@@ -328,6 +454,105 @@ Context(PFQ)
         Assert(s.drop, is_equal_to(0UL));
     }
 
+    Test(group_steering)
+    {
+        pfq::socket x;
+        AssertThrow(x.set_group_steering(0, pfq::steering_mode::maglev));
+
+        x.open(pfq::group_policy::priv, 64);
+
+        auto gid = x.group_id();
+
+        x.set_group_steering(gid, pfq::steering_mode::maglev);
+        x.set_group_steering(gid, pfq::steering_mode::fold);
+
+        AssertThrow(x.set_group_steering(gid, static_cast<pfq::steering_mode>(42)));
+        AssertThrow(x.set_group_steering(22, pfq::steering_mode::maglev));
+    }
+
+    Test(group_watermark)
+    {
+        pfq::socket x;
+        AssertThrow(x.set_group_watermark(0, 80));
+
+        x.open(pfq::group_policy::priv, 64);
+
+        auto gid = x.group_id();
+
+        x.set_group_watermark(gid, 80);
+        x.set_group_watermark(gid, 0);
+
+        AssertThrow(x.set_group_watermark(gid, 101));
+        AssertThrow(x.set_group_watermark(gid, -1));
+        AssertThrow(x.set_group_watermark(22, 80));
+    }
+
+    Test(group_tx_queue)
+    {
+        pfq::socket x;
+        AssertThrow(x.set_group_tx_queue(0, pfq::tx_queue_policy::cpu));
+
+        x.open(pfq::group_policy::priv, 64);
+
+        auto gid = x.group_id();
+
+        x.set_group_tx_queue(gid, pfq::tx_queue_policy::cpu);
+        x.set_group_tx_queue(gid, pfq::tx_queue_policy::hash);
+        x.set_group_tx_queue(gid, pfq::tx_queue_policy::packet);
+
+        AssertThrow(x.set_group_tx_queue(gid, static_cast<pfq::tx_queue_policy>(42)));
+        AssertThrow(x.set_group_tx_queue(22, pfq::tx_queue_policy::cpu));
+    }
+
+    Test(tx_zcopy)
+    {
+        pfq::socket x;
+        AssertThrow(x.tx_zcopy_enable(true));
+
+        x.open(pfq::group_policy::undefined, 64);
+
+        Assert(x.tx_zcopy_enabled(), is_false());
+        x.tx_zcopy_enable(true);
+        Assert(x.tx_zcopy_enabled(), is_true());
+
+        x.enable();
+        AssertThrow(x.tx_zcopy_enable(false));
+        x.disable();
+    }
+
+    Test(inject_template)
+    {
+        pfq::socket x;
+        x.open(pfq::group_policy::undefined, 64);
+
+        char pkt[64] = { 0 };
+        std::vector<pfq_tx_mutator> mut(1);
+
+        AssertThrow(x.inject_template(pfq::const_buffer(pkt, sizeof(pkt)), 10, mut));
+
+        x.enable();
+
+        AssertThrow(x.inject_template(pfq::const_buffer(pkt, sizeof(pkt)), 0, mut));
+        AssertThrow(x.inject_template(pfq::const_buffer(pkt, sizeof(pkt)), 10, std::vector<pfq_tx_mutator>(Q_TX_MAX_MUTATORS + 1)));
+
+        x.disable();
+    }
+
+    Test(weight)
+    {
+        pfq::socket x;
+        AssertThrow(x.weight(2));
+        AssertThrow(x.weight());
+
+        x.open(pfq::group_policy::undefined, 64);
+
+        Assert(x.weight(), is_equal_to(1));
+        AssertThrow(x.weight(0));
+        AssertThrow(x.weight(Q_MAX_SOCK_WEIGHT + 1));
+        x.weight(4);
+        Assert(x.weight(), is_equal_to(4));
+    }
+
     Test(groups_mask)
     {
         pfq::socket x;
@@ -335,7 +560,9 @@ Context(PFQ)
 
         x.open(pfq::group_policy::undefined, 64);
 
-        Assert(x.groups_mask(), is_equal_to(0UL));
+        auto mask = x.groups_mask();
+        Assert(mask.size(), is_equal_to(Q_GROUPS_MASK_WORDS));
+        Assert(std::all_of(mask.begin(), mask.end(), [](unsigned long w) { return w == 0; }), is_true());
 
         auto v = x.groups();
         Assert(v.empty(), is_true());
@@ -534,6 +761,54 @@ Context(PFQ)
     }
 
 
+    Test(tx_rate)
+    {
+        pfq::socket q(64);
+        AssertThrow(q.set_tx_rate(0, 1000000));
+
+        q.bind_tx("lo", -1);
+
+        AssertNoThrow(q.set_tx_rate(0, 1000000));
+        AssertNoThrow(q.set_tx_rate(0, 0, 1000000000, 32));
+        AssertNoThrow(q.set_tx_rate(0, 0));
+        AssertThrow(q.set_tx_rate(1, 1000000));
+    }
+
+
+    Test(tx_weight)
+    {
+        pfq::socket q(64);
+
+        Assert(q.tx_weight(), is_equal_to(1));
+        AssertThrow(q.tx_weight(0));
+        AssertThrow(q.tx_weight(Q_MAX_SOCK_WEIGHT + 1));
+        q.tx_weight(8);
+        Assert(q.tx_weight(), is_equal_to(8));
+    }
+
+
+    Test(tx_queues)
+    {
+        pfq::socket q(64);
+
+        for(int n = 0; n < 8; n++)
+            AssertNoThrow(q.bind_tx("lo", -1));
+
+        q.enable();
+        AssertThrow(q.bind_tx("lo", -1));
+
+        // binding after enable: up to Q_MIN_TX_QUEUES
+
+        pfq::socket p(64);
+        p.enable();
+
+        for(int n = 0; n < Q_MIN_TX_QUEUES; n++)
+            AssertNoThrow(p.bind_tx("lo", -1));
+
+        AssertThrow(p.bind_tx("lo", -1));
+    }
+
+
     Test(tx_thread)
     {
         pfq::socket q(64);
@@ -556,6 +831,31 @@ Context(PFQ)
         AssertNoThrow(q.tx_queue_flush());
     }
 
+    Test(tx_queue_stats)
+    {
+        pfq::socket q(64);
+        AssertThrow(q.wait_tx_space(64, 0));
+        AssertThrow(q.tx_queue_stats(0));
+
+        q.bind_tx("lo", -1);
+
+        q.enable();
+
+        AssertThrow(q.tx_queue_stats(1));
+        Assert(q.tx_queue_stats(0).consumed, is_equal_to(0UL));
+
+        Assert(q.wait_tx_space(64, 0), is_equal_to(true));
+        AssertThrow(q.wait_tx_space(1 << 20, 0));
+
+        char pkt[64] = { 0 };
+        Assert(q.inject(pfq::const_buffer(pkt, sizeof(pkt)), 0, 0), is_equal_to(true));
+        q.tx_queue_flush(0);
+
+        auto s = q.tx_queue_stats(0);
+        Assert(s.consumed, is_equal_to(1UL));
+        Assert(s.sent + s.disc, is_equal_to(1UL));
+    }
+
     Test(egress_bind)
     {
         pfq::socket q(64);
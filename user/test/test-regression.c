@@ -3,10 +3,225 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <sched.h>
 #include <pfq.h>
 
 #include <pthread.h>
+#include <unistd.h>
+
+
+/* loopback traffic: UDP packets sent on lo by a Tx socket, marked with
+ * "PFQT" after the headers; the flow f has source 10.0.f/256.f%256 and
+ * source port f, so that flows hash apart */
+
+#define LO_PKT_LEN	64
+#define LO_MARK_OFF	42
+
+static void
+lo_packet(char *pkt, int flow)
+{
+	memset(pkt, 0, LO_PKT_LEN);
+
+	pkt[12] = 0x08;				/* IPv4 */
+	pkt[14] = 0x45;				/* version, ihl */
+	pkt[17] = LO_PKT_LEN - 14;		/* total length */
+	pkt[22] = 64;				/* ttl */
+	pkt[23] = 17;				/* UDP */
+	pkt[26] = 10;				/* 10.0.f/256.f%256 */
+	pkt[28] = (char)(flow >> 8);
+	pkt[29] = (char)flow;
+	pkt[30] = 10;				/* 10.0.0.1 */
+	pkt[33] = 1;
+	pkt[34] = (char)(flow >> 8);		/* source port */
+	pkt[35] = (char)flow;
+	pkt[37] = 9;				/* discard */
+
+	memcpy(pkt + LO_MARK_OFF, "PFQT", 4);
+}
+
+
+static int
+lo_marked(const struct pfq_pkthdr *h, const char *data)
+{
+	return h->caplen >= LO_MARK_OFF + 4 && memcmp(data + LO_MARK_OFF, "PFQT", 4) == 0;
+}
+
+
+/* send n packets on lo, over the given number of flows */
+
+static void
+lo_inject(int n, int flows)
+{
+	pfq_t * tx = pfq_open(64, 1024);
+	char pkt[LO_PKT_LEN];
+	int i;
+
+	assert(tx);
+	assert(pfq_bind_tx(tx, "lo", Q_ANY_QUEUE, Q_NO_KTHREAD) == 0);
+	assert(pfq_enable(tx) == 0);
+
+	for(i = 0; i < n; i++)
+	{
+		lo_packet(pkt, i % flows);
+		while (pfq_inject(tx, pkt, sizeof(pkt), 0, 0) <= 0)
+			assert(pfq_tx_queue_flush(tx, 0) == 0);
+	}
+
+	assert(pfq_tx_queue_flush(tx, 0) == 0);
+	pfq_close(tx);
+
+	/* lo delivers from the backlog of the cpu */
+
+	usleep(100000);
+}
+
+
+/* read up to n marked packets (1 sec at most), return the number read */
+
+static int
+lo_count(pfq_t *q, int n)
+{
+	int i, count = 0;
+
+	for(i = 0; i < 100 && count < n; i++)
+	{
+		struct pfq_net_queue nq;
+		pfq_iterator_t it;
+
+		assert(pfq_read(q, &nq, 10000) >= 0);
+
+		for(it = pfq_net_queue_begin(&nq); it != pfq_net_queue_end(&nq); it = pfq_net_queue_next(&nq, it))
+		{
+			while (!pfq_iterator_ready(&nq, it))
+				pfq_yield();
+
+			if (lo_marked(pfq_iterator_header(it), pfq_iterator_data(it)))
+				count++;
+		}
+	}
+
+	return count;
+}
+
+
+/* read n marked packets from the sockets of a group (1 sec at most), record
+ * the socket each flow was steered to; return the number read */
+
+#define LO_FLOWS	256
+
+static int
+lo_steered(pfq_t **q, int socks, int *owner, int n)
+{
+	int i, s, count = 0;
+
+	for(i = 0; i < 100 && count < n; i++)
+	{
+		for(s = 0; s < socks; s++)
+		{
+			struct pfq_net_queue nq;
+			pfq_iterator_t it;
+
+			assert(pfq_read(q[s], &nq, 10000 / socks) >= 0);
+
+			for(it = pfq_net_queue_begin(&nq); it != pfq_net_queue_end(&nq); it = pfq_net_queue_next(&nq, it))
+			{
+				const unsigned char *data;
+
+				while (!pfq_iterator_ready(&nq, it))
+					pfq_yield();
+
+				if (!lo_marked(pfq_iterator_header(it), pfq_iterator_data(it)))
+					continue;
+
+				data = (const unsigned char *)pfq_iterator_data(it);
+				owner[((data[34] << 8) | data[35]) % LO_FLOWS] = s;
+				count++;
+			}
+		}
+	}
+
+	return count;
+}
+
+
+/* open n sockets in a shared group bound to lo, steered by IP */
+
+static int
+lo_group(pfq_t **q, int n, int mode)
+{
+	int s, gid;
+
+	q[0] = pfq_open_group(Q_CLASS_DEFAULT, Q_POLICY_GROUP_SHARED, 64, 1024, 1024);
+	assert(q[0]);
+
+	gid = pfq_group_id(q[0]);
+
+	for(s = 1; s < n; s++)
+	{
+		q[s] = pfq_open_group(Q_CLASS_DEFAULT, Q_POLICY_GROUP_UNDEFINED, 64, 1024, 1024);
+		assert(q[s]);
+		assert(pfq_join_group(q[s], gid, Q_CLASS_DEFAULT, Q_POLICY_GROUP_SHARED) == gid);
+	}
+
+	assert(pfq_set_group_steering(q[0], gid, mode) == 0);
+	assert(pfq_set_group_computation_from_string(q[0], gid, "steer_ip") == 0);
+	assert(pfq_bind(q[0], "lo", Q_ANY_QUEUE) == 0);
+
+	for(s = 0; s < n; s++)
+		assert(pfq_enable(q[s]) == 0);
+
+	return gid;
+}
+
+
+/* set a computation of a single function, with an optional argument
+ * (size 0: a string) */
+
+static int
+lang_function(pfq_t *q, int gid, const char *symbol, const void *arg, size_t size)
+{
+	struct pfq_computation_descr *prog = calloc(1, sizeof(*prog) + sizeof(struct pfq_functional_descr));
+	int ret;
+
+	assert(prog);
+
+	prog->size = 1;
+	prog->entry_point = 0;
+	prog->fun[0].symbol = symbol;
+	prog->fun[0].next = 1;
+
+	if (arg) {
+		prog->fun[0].arg[0].addr  = arg;
+		prog->fun[0].arg[0].size  = size;
+		prog->fun[0].arg[0].nelem = (size_t)-1;
+	}
+
+	ret = pfq_set_group_computation(q, gid, prog);
+	free(prog);
+	return ret;
+}
+
+
+/* packets sent by a device, from sysfs */
+
+static unsigned long
+dev_tx_packets(const char *dev)
+{
+	unsigned long packets = 0;
+	char path[128];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/tx_packets", dev);
+
+	f = fopen(path, "r");
+	assert(f);
+	if (fscanf(f, "%lu", &packets) != 1)
+		packets = 0;
+	fclose(f);
+	return packets;
+}
 
 
 void test_enable_disable()
@@ -139,6 +354,166 @@ void test_rx_slot_size()
 }
 
 
+/* packed layout: short packets take a record of their own length, not a
+ * caplen-sized slot */
+
+void test_rx_packed()
+{
+	pfq_t * q = pfq_open(1514, 1024);
+        assert(q);
+
+	struct pfq_net_queue nq;
+	pfq_iterator_t it;
+	int count = 0;
+
+	assert(pfq_rx_packed_enable(q, 1) == 0);
+	assert(pfq_bind(q, "lo", Q_ANY_QUEUE) == 0);
+	assert(pfq_enable(q) == 0);
+
+	lo_inject(64, 1);
+
+        assert(pfq_read(q, &nq, 10000) >= 0);
+	assert(nq.slot_size == 0);
+
+	for(it = pfq_net_queue_begin(&nq); it != pfq_net_queue_end(&nq); it = pfq_net_queue_next(&nq, it))
+	{
+		while (!pfq_iterator_ready(&nq, it))
+			pfq_yield();
+
+		if (lo_marked(pfq_iterator_header(it), pfq_iterator_data(it))) {
+			assert(pfq_iterator_header(it)->caplen == LO_PKT_LEN);
+			assert(pfq_net_queue_next(&nq, it) - it == Q_PACKED_RECORD_SIZE(LO_PKT_LEN));
+			count++;
+		}
+	}
+
+	assert(count == 64);
+	assert(Q_PACKED_RECORD_SIZE(LO_PKT_LEN) < pfq_get_rx_slot_size(q));
+
+	assert(pfq_disable(q) == 0);
+
+	pfq_close(q);
+}
+
+
+/* zero-copy Rx: frames come from PFQ-aware drivers only, the device is
+ * given by PFQ_ZCOPY_DEV (and the module loaded with zcopy_frames > 0) */
+
+static long zcopy_frames()
+{
+	long frames = 0;
+	FILE *f = fopen("/sys/module/pfq/parameters/zcopy_frames", "r");
+	if (f) {
+		if (fscanf(f, "%ld", &frames) != 1)
+			frames = 0;
+		fclose(f);
+	}
+	return frames;
+}
+
+
+void test_rx_zcopy()
+{
+	const char *dev = getenv("PFQ_ZCOPY_DEV");
+	long frames = zcopy_frames(), zc = 0;
+	int n;
+
+	if (!dev || frames == 0) {
+		printf("    skipped: PFQ_ZCOPY_DEV unset or zcopy_frames = 0\n");
+		return;
+	}
+
+	pfq_t * q = pfq_open(64, 1024);
+        assert(q);
+
+	assert(pfq_rx_zcopy_enable(q, 1) == 0);
+	assert(pfq_is_rx_zcopy_enabled(q) == 1);
+	assert(pfq_bind(q, dev, Q_ANY_QUEUE) == 0);
+	assert(pfq_enable(q) == 0);
+
+	/* each read gives the frames of the previous one back: more zero-copy
+	 * packets than frames means the frames are recycled while mapped */
+
+	for(n = 0; n < 5000 && zc <= frames; n++)
+	{
+		struct pfq_net_queue nq;
+		pfq_iterator_t it;
+
+		assert(pfq_read(q, &nq, 1000) >= 0);
+
+		for(it = pfq_net_queue_begin(&nq); it != pfq_net_queue_end(&nq); it = pfq_net_queue_next(&nq, it))
+		{
+			while (!pfq_iterator_ready(&nq, it))
+				pfq_yield();
+
+			if (pfq_iterator_header(it)->flags & Q_PKTHDR_ZCOPY) {
+				assert(pfq_iterator_data(it) != NULL);
+				zc++;
+			}
+		}
+	}
+
+	assert(zc > frames);
+
+	pfq_close(q);
+}
+
+
+/* Rx sub-rings: traffic injected from several cpus lands on several rings,
+ * a single dispatch drains all of them */
+
+static void *
+rx_rings_injector(void *arg)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET((int)(long)arg, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+	lo_inject(64, 1);
+	return NULL;
+}
+
+
+static void
+rx_rings_count(char *user, const struct pfq_pkthdr *h, const char *data)
+{
+	if (lo_marked(h, data))
+		(*(int *)user)++;
+}
+
+
+void test_rx_rings()
+{
+	pfq_t * q = pfq_open(64, 1024);
+        assert(q);
+
+	long cpu, cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t t[4];
+	int count = 0;
+
+	if (cpus > 4)
+		cpus = 4;
+
+	assert(pfq_set_rx_rings(q, 4) == 0);
+	assert(pfq_bind(q, "lo", Q_ANY_QUEUE) == 0);
+	assert(pfq_enable(q) == 0);
+
+	for(cpu = 0; cpu < cpus; cpu++)
+		assert(pthread_create(&t[cpu], NULL, rx_rings_injector, (void *)cpu) == 0);
+	for(cpu = 0; cpu < cpus; cpu++)
+		pthread_join(t[cpu], NULL);
+
+	assert(pfq_dispatch(q, rx_rings_count, 10000, (char *)&count) >= 0);
+	assert(count == 64 * cpus);
+
+	assert(pfq_disable(q) == 0);
+
+	pfq_close(q);
+}
+
+
 void test_bind_device()
 {
 	pfq_t * q = pfq_open(64, 1024);
@@ -146,6 +521,8 @@ void test_bind_device()
 
        	assert(pfq_bind(q, "unknown", Q_ANY_QUEUE) == -1);
        	assert(pfq_bind(q, "eth0", Q_ANY_QUEUE) == 0);
+       	assert(pfq_bind(q, "eth0", 1) == 0);
+       	assert(pfq_bind(q, "eth0", 256) == -1);
 	assert(pfq_bind_group(q, 11, "eth0", Q_ANY_QUEUE) == -1);
 
 	pfq_close(q);
@@ -168,6 +545,35 @@ void test_unbind_device()
 	pfq_close(q);
 }
 
+/* protocol hooks per device: a socket gets the traffic of the devices it is
+ * bound to only, and nothing once unbound */
+
+void test_device_hooks()
+{
+	pfq_t * q = pfq_open(64, 1024);
+	pfq_t * y = pfq_open(64, 1024);
+
+	assert(q && y);
+
+	assert(pfq_bind(q, "lo", Q_ANY_QUEUE) == 0);
+	assert(pfq_bind(y, "eth0", Q_ANY_QUEUE) == 0);
+	assert(pfq_enable(q) == 0);
+	assert(pfq_enable(y) == 0);
+
+	lo_inject(64, 1);
+	assert(lo_count(q, 64) == 64);
+	assert(lo_count(y, 64) == 0);
+
+	assert(pfq_unbind(q, "lo", Q_ANY_QUEUE) == 0);
+
+	lo_inject(64, 1);
+	assert(lo_count(q, 64) == 0);
+
+	pfq_close(q);
+	pfq_close(y);
+}
+
+
 void test_poll()
 {
 	pfq_t * q = pfq_open(64, 1024);
@@ -231,6 +637,160 @@ void test_group_stats()
 }
 
 
+void test_read_stats()
+{
+	pfq_t * q = pfq_open(64, 1024);
+        assert(q);
+
+	struct pfq_stats s, m;
+	struct pfq_counters cs;
+
+	assert(pfq_read_stats(q, &m) == 0);
+	assert(pfq_get_stats(q, &s) == 0);
+
+	assert(m.recv == s.recv);
+	assert(m.lost == s.lost);
+	assert(m.drop == s.drop);
+	assert(m.sent == s.sent);
+	assert(m.disc == s.disc);
+
+	assert(pfq_read_group_stats(q, -1, &m) == -1);
+
+	assert(pfq_join_group(q, 12, Q_CLASS_DEFAULT, Q_POLICY_GROUP_RESTRICTED) == 12);
+
+	assert(pfq_read_group_stats(q, 12, &m) == 0);
+	assert(pfq_get_group_stats(q, 12, &s) == 0);
+
+	assert(m.recv == s.recv);
+	assert(m.drop == s.drop);
+	assert(m.frwd == s.frwd);
+	assert(m.kern == s.kern);
+
+	assert(pfq_read_group_counters(q, 12, &cs) == 0);
+	assert(cs.counter[0] == 0);
+
+	pfq_close(q);
+}
+
+
+void test_group_persistent()
+{
+	pfq_t * q = pfq_open(64, 1024);
+        assert(q);
+
+	unsigned long word[Q_PERSISTENT_MEM / sizeof(unsigned long)];
+	int gid = pfq_group_id(q), slot = 3;
+
+	/* meter: packets and bytes in a per-cpu slot, summed on read */
+
+	assert(lang_function(q, gid, "meter", &slot, sizeof(slot)) == 0);
+	assert(pfq_bind(q, "lo", Q_ANY_QUEUE) == 0);
+	assert(pfq_enable(q) == 0);
+
+	assert(pfq_get_group_persistent(q, gid, slot, Q_PERSISTENT_REDUCE_SUM, word) == 0);
+	assert(word[0] == 0);
+
+	lo_inject(64, 4);
+
+	/* lo may carry other traffic as well */
+
+	assert(pfq_get_group_persistent(q, gid, slot, Q_PERSISTENT_REDUCE_SUM, word) == 0);
+	assert(word[0] >= 64);
+	assert(word[1] >= 64 * LO_PKT_LEN);
+
+	assert(pfq_get_group_persistent(q, gid, 0, Q_PERSISTENT_REDUCE_SUM, word) == 0);
+	assert(word[0] == 0);
+
+	pfq_close(q);
+}
+
+
+/* time-series: the snapshots follow the stats and the counters of the group */
+
+void test_group_timeseries()
+{
+	pfq_t * q = pfq_open(64, 1024);
+        assert(q);
+
+	struct pfq_group_snapshot last, prev;
+	int gid = pfq_group_id(q), ctr = 5;
+
+	assert(lang_function(q, gid, "inc", &ctr, sizeof(ctr)) == 0);
+	assert(pfq_bind(q, "lo", Q_ANY_QUEUE) == 0);
+	assert(pfq_enable(q) == 0);
+
+	assert(pfq_set_group_timeseries(q, gid, 10) == 0);
+	usleep(50000);
+
+	assert(pfq_read_group_snapshot(q, gid, 0, &prev) == 1);
+
+	lo_inject(64, 4);
+	usleep(50000);
+
+	/* lo may carry other traffic as well */
+
+	assert(pfq_read_group_snapshot(q, gid, 0, &last) == 1);
+	assert(last.seq > prev.seq);
+	assert(last.tstamp > prev.tstamp);
+	assert(last.recv - prev.recv >= 64);
+	assert(last.counter[ctr] - prev.counter[ctr] >= 64);
+	assert(last.counter[0] == 0);
+
+	assert(pfq_set_group_timeseries(q, gid, 0) == 0);
+
+	pfq_close(q);
+}
+
+
+/* Rx profile: the stages run by lo traffic are counted and timed, and
+ * nothing is counted once disabled */
+
+void test_profile()
+{
+	pfq_t * q = pfq_open(64, 1024);
+        assert(q);
+
+	struct pfq_profile p, d;
+	unsigned long hist = 0;
+	int gid = pfq_group_id(q), slot = 0, i;
+
+	assert(lang_function(q, gid, "meter", &slot, sizeof(slot)) == 0);
+	assert(pfq_bind(q, "lo", Q_ANY_QUEUE) == 0);
+	assert(pfq_enable(q) == 0);
+
+	assert(pfq_set_profile(q, 1) == 0);
+
+	lo_inject(64, 4);
+	assert(lo_count(q, 64) == 64);
+
+	/* lo may carry other traffic as well */
+
+	assert(pfq_get_profile(q, Q_ANY_CPU, &p) == 0);
+	assert(p.stage[Q_PROFILE_RUN].count >= 64);
+	assert(p.stage[Q_PROFILE_NODE(0)].count >= 64);
+	assert(p.stage[Q_PROFILE_NODE(1)].count == 0);
+	assert(p.stage[Q_PROFILE_ENQUEUE].count > 0);
+	assert(p.stage[Q_PROFILE_GC].count > 0);
+	assert(p.stage[Q_PROFILE_RUN].cycles > 0);
+
+	for(i = 0; i < Q_PROFILE_HIST_SIZE; i++)
+		hist += p.stage[Q_PROFILE_RUN].hist[i];
+	assert(hist >= 64);
+
+	assert(pfq_set_profile(q, 0) == 0);
+	assert(pfq_get_profile(q, Q_ANY_CPU, &p) == 0);
+
+	lo_inject(64, 4);
+	assert(lo_count(q, 64) == 64);
+
+	assert(pfq_get_profile(q, Q_ANY_CPU, &d) == 0);
+	assert(d.enabled == 0);
+	assert(d.stage[Q_PROFILE_RUN].count == p.stage[Q_PROFILE_RUN].count);
+
+	pfq_close(q);
+}
+
+
 void test_my_group_stats_priv()
 {
 	pfq_t * q = pfq_open_group(Q_CLASS_DEFAULT, Q_POLICY_GROUP_PRIVATE, 64, 1024, 1024);
@@ -288,15 +848,211 @@ void test_my_group_stats_shared()
 }
 
 
+/* consistent hashing: when a socket joins, the flows move to it only, not
+ * among the sockets already in the group (up to the Maglev disruption) */
+
+void test_group_steering()
+{
+	pfq_t * q[3];
+	int before[LO_FLOWS], after[LO_FLOWS];
+	int f, s, gid, moved = 0, stolen = 0;
+
+	gid = lo_group(q, 2, Q_STEERING_MAGLEV);
+
+	lo_inject(LO_FLOWS, LO_FLOWS);
+	assert(lo_steered(q, 2, before, LO_FLOWS) == LO_FLOWS);
+
+	q[2] = pfq_open_group(Q_CLASS_DEFAULT, Q_POLICY_GROUP_UNDEFINED, 64, 1024, 1024);
+	assert(q[2]);
+	assert(pfq_join_group(q[2], gid, Q_CLASS_DEFAULT, Q_POLICY_GROUP_SHARED) == gid);
+	assert(pfq_enable(q[2]) == 0);
+
+	lo_inject(LO_FLOWS, LO_FLOWS);
+	assert(lo_steered(q, 3, after, LO_FLOWS) == LO_FLOWS);
+
+	for(f = 0; f < LO_FLOWS; f++)
+	{
+		if (after[f] == 2)
+			stolen++;
+		else if (after[f] != before[f])
+			moved++;
+	}
+
+	assert(stolen > 0);
+	assert(moved <= LO_FLOWS / 16);
+
+	for(s = 0; s < 3; s++)
+		pfq_close(q[s]);
+}
+
+
+/* load-aware steering: with the queue of a socket above the watermark, new
+ * flows go to the other socket of the group */
+
+void test_group_watermark()
+{
+	pfq_t * q[2];
+	int gid, drained;
+
+	gid = lo_group(q, 2, Q_STEERING_FOLD);
+
+	/* about half of the flows are left in the queue of the first socket */
+
+	lo_inject(LO_FLOWS, LO_FLOWS);
+	drained = lo_count(q[1], LO_FLOWS);
+	assert(drained > 0 && drained < LO_FLOWS);
+
+	assert(pfq_set_group_watermark(q[0], gid, 5) == 0);
+
+	lo_inject(32, 32);
+	assert(lo_count(q[1], 32) == 32);
+	assert(lo_count(q[0], LO_FLOWS) == LO_FLOWS - drained);
+
+	pfq_close(q[0]);
+	pfq_close(q[1]);
+}
+
+
+/* Tx queue policies of lazy forwarding: whatever the hardware queue picked,
+ * every forwarded packet leaves the device */
+
+void test_group_tx_queue()
+{
+	pfq_t * q = pfq_open(64, 1024);
+        assert(q);
+
+	int policy[] = { Q_TX_QUEUE_CPU, Q_TX_QUEUE_HASH, Q_TX_QUEUE_PACKET };
+	int gid = pfq_group_id(q);
+	unsigned long sent;
+	size_t n;
+
+	assert(lang_function(q, gid, "forward", "eth0", 0) == 0);
+	assert(pfq_bind(q, "lo", Q_ANY_QUEUE) == 0);
+	assert(pfq_enable(q) == 0);
+
+	for(n = 0; n < sizeof(policy)/sizeof(policy[0]); n++)
+	{
+		assert(pfq_set_group_tx_queue(q, gid, policy[n]) == 0);
+
+		sent = dev_tx_packets("eth0");
+
+		lo_inject(64, 16);
+		assert(lo_count(q, 64) == 64);
+		assert(dev_tx_packets("eth0") - sent >= 64);
+	}
+
+	pfq_close(q);
+}
+
+
+/* lazy forwarding: the lo traffic of a group is forwarded to eth0, and
+ * still delivered to the socket */
+
+void test_lazy_forward()
+{
+	pfq_t * q = pfq_open(64, 1024);
+        assert(q);
+
+	int gid = pfq_group_id(q);
+	unsigned long sent = dev_tx_packets("eth0");
+	struct pfq_stats s;
+
+	assert(lang_function(q, gid, "forward", "eth0", 0) == 0);
+	assert(pfq_bind(q, "lo", Q_ANY_QUEUE) == 0);
+	assert(pfq_enable(q) == 0);
+
+	lo_inject(64, 4);
+	assert(lo_count(q, 64) == 64);
+
+	/* lo may carry other traffic as well */
+
+	assert(pfq_get_group_stats(q, gid, &s) == 0);
+	assert(s.frwd >= 64);
+	assert(dev_tx_packets("eth0") - sent >= 64);
+
+	pfq_close(q);
+}
+
+
+void test_tx_zcopy()
+{
+	pfq_t * q = pfq_open(64, 1024);
+        assert(q);
+
+	assert(pfq_is_tx_zcopy_enabled(q) == 0);
+	assert(pfq_tx_zcopy_enable(q, 1) == 0);
+	assert(pfq_is_tx_zcopy_enabled(q) == 1);
+
+	assert(pfq_enable(q) == 0);
+	assert(pfq_tx_zcopy_enable(q, 0) == -1);
+	assert(pfq_disable(q) == 0);
+
+	pfq_close(q);
+}
+
+
+void test_inject_template()
+{
+	pfq_t * q = pfq_open(64, 1024);
+        assert(q);
+
+	char pkt[64] = { 0 };
+	struct pfq_tx_mutator mut[Q_TX_MAX_MUTATORS + 1] = { { 0 } };
+
+	assert(pfq_inject_template(q, pkt, sizeof(pkt), 10, mut, 1, 0, 0, Q_ANY_QUEUE) == -1);
+
+	assert(pfq_enable(q) == 0);
+
+	assert(pfq_inject_template(q, pkt, sizeof(pkt), 0, mut, 1, 0, 0, Q_ANY_QUEUE) == -1);
+	assert(pfq_inject_template(q, pkt, sizeof(pkt), 10, mut, Q_TX_MAX_MUTATORS + 1, 0, 0, Q_ANY_QUEUE) == -1);
+
+	assert(pfq_disable(q) == 0);
+	pfq_close(q);
+}
+
+
+/* weighted steering: a socket of weight 3 takes about 3/4 of the flows */
+
+void test_weight()
+{
+	pfq_t * q[2];
+	int owner[LO_FLOWS];
+	int f, heavy = 0;
+
+	lo_group(q, 2, Q_STEERING_FOLD);
+	assert(pfq_set_weight(q[1], 3) == 0);
+
+	lo_inject(LO_FLOWS, LO_FLOWS);
+	assert(lo_steered(q, 2, owner, LO_FLOWS) == LO_FLOWS);
+
+	for(f = 0; f < LO_FLOWS; f++)
+		heavy += owner[f] == 1;
+
+	assert(heavy > LO_FLOWS * 5 / 8 && heavy < LO_FLOWS * 7 / 8);
+
+	pfq_close(q[0]);
+	pfq_close(q[1]);
+}
+
+
 void test_groups_mask()
 {
 	pfq_t * q = pfq_open(64, 1024);
         assert(q);
 
-	unsigned long groups;
-	assert(pfq_groups_mask(q, &groups) == 0);
+	unsigned long groups[Q_GROUPS_MASK_WORDS];
+	assert(pfq_groups_mask(q, groups, Q_GROUPS_MASK_WORDS) == 0);
+
+	assert(groups[0] > 0);
+	assert(pfq_groups_mask(q, groups, 0) == -1);
+
+	/* groups beyond the first word (max_groups > 70) */
 
-	assert(groups > 0);
+	if (pfq_join_group(q, 70, Q_CLASS_DEFAULT, Q_POLICY_GROUP_SHARED) == 70) {
+		const int bits = sizeof(unsigned long) << 3;
+		assert(pfq_groups_mask(q, groups, Q_GROUPS_MASK_WORDS) == 0);
+		assert(groups[70 / bits] & (1UL << (70 % bits)));
+	}
 
 	pfq_close(q);
 }
@@ -412,7 +1168,7 @@ void test_join_deferred()
 
 	unsigned long mask;
 
-	assert(pfq_groups_mask(q, &mask) == 0);
+	assert(pfq_groups_mask(q, &mask, 1) == 0);
 
 	assert(mask != 0);
 	assert(mask == (1<<13));
@@ -489,7 +1245,7 @@ void test_join_group()
 	assert(gid == 1);
 
 	unsigned long mask;
-	assert(pfq_groups_mask(q, &mask) == 0);
+	assert(pfq_groups_mask(q, &mask, 1) == 0);
 
 	assert(mask == 3);
 	pfq_close(q);
@@ -511,7 +1267,7 @@ void test_leave_group()
 	assert(pfq_group_id(q) == -1);
 
 	unsigned long mask;
-	assert(pfq_groups_mask(q, &mask) == 0);
+	assert(pfq_groups_mask(q, &mask, 1) == 0);
 	assert(mask == 0);
 
 	pfq_close(q);
@@ -574,6 +1330,63 @@ void test_bind_tx()
 }
 
 
+void test_tx_rate()
+{
+        pfq_t * q = pfq_open(64, 1024);
+
+        assert(pfq_set_tx_rate(q, 0, 1000000, 0, 0) == -1);
+        assert(pfq_bind_tx(q, "lo", Q_ANY_QUEUE, Q_NO_KTHREAD) == 0);
+
+        assert(pfq_set_tx_rate(q, 0, 1000000, 0, 0) == 0);
+        assert(pfq_set_tx_rate(q, 0, 0, 1000000000, 32) == 0);
+        assert(pfq_set_tx_rate(q, 0, 0, 0, 0) == 0);
+        assert(pfq_set_tx_rate(q, 1, 1000000, 0, 0) == -1);
+
+        pfq_close(q);
+}
+
+
+void test_tx_weight()
+{
+        pfq_t * q = pfq_open(64, 1024);
+
+        assert(pfq_get_tx_weight(q) == 1);
+        assert(pfq_set_tx_weight(q, 0) == -1);
+        assert(pfq_set_tx_weight(q, Q_MAX_SOCK_WEIGHT + 1) == -1);
+        assert(pfq_set_tx_weight(q, 8) == 0);
+        assert(pfq_get_tx_weight(q) == 8);
+
+        pfq_close(q);
+}
+
+
+void test_tx_queues()
+{
+        pfq_t * q = pfq_open(64, 1024);
+        int n;
+
+        for(n = 0; n < 8; n++)
+                assert(pfq_bind_tx(q, "lo", Q_ANY_QUEUE, Q_NO_KTHREAD) == 0);
+
+        assert(pfq_enable(q) == 0);
+        assert(pfq_bind_tx(q, "lo", Q_ANY_QUEUE, Q_NO_KTHREAD) == -1);
+
+        pfq_close(q);
+
+        /* binding after enable: up to Q_MIN_TX_QUEUES */
+
+        q = pfq_open(64, 1024);
+        assert(pfq_enable(q) == 0);
+
+        for(n = 0; n < Q_MIN_TX_QUEUES; n++)
+                assert(pfq_bind_tx(q, "lo", Q_ANY_QUEUE, Q_NO_KTHREAD) == 0);
+
+        assert(pfq_bind_tx(q, "lo", Q_ANY_QUEUE, Q_NO_KTHREAD) == -1);
+
+        pfq_close(q);
+}
+
+
 void test_tx_thread()
 {
         pfq_t * q = pfq_open(64, 1024);
@@ -598,12 +1411,43 @@ void test_tx_queue_flush()
         pfq_close(q);
 }
 
+void test_tx_queue_stats()
+{
+        pfq_t * q = pfq_open(64, 1024);
+        struct pfq_tx_queue_stats s;
+        char pkt[64] = { 0 };
+
+        assert(pfq_wait_tx_space(q, sizeof(pkt), 0, Q_ANY_QUEUE) == -1);
+        assert(pfq_get_tx_queue_stats(q, 0, &s) == -1);
+
+        assert(pfq_bind_tx(q, "lo", Q_ANY_QUEUE, Q_NO_KTHREAD) == 0);
+        assert(pfq_enable(q) == 0);
+
+        assert(pfq_get_tx_queue_stats(q, 1, &s) == -1);
+        assert(pfq_get_tx_queue_stats(q, 0, &s) == 0);
+        assert(s.consumed == 0 && s.sent == 0 && s.disc == 0);
+
+        assert(pfq_wait_tx_space(q, sizeof(pkt), 0, Q_ANY_QUEUE) == 1);
+        assert(pfq_wait_tx_space(q, 1 << 20, 0, Q_ANY_QUEUE) == -1);
+
+        assert(pfq_inject(q, pkt, sizeof(pkt), 0, 0) > 0);
+        assert(pfq_tx_queue_flush(q, 0) == 0);
+
+        assert(pfq_get_tx_queue_stats(q, 0, &s) == 0);
+        assert(s.consumed == 1);
+        assert(s.sent + s.disc == 1);
+
+        pfq_close(q);
+}
+
+
 void test_egress_bind()
 {
         pfq_t * q = pfq_open(64, 1024);
 
         assert(pfq_egress_bind(q, "lo", -1) == 0);
         assert(pfq_egress_bind(q, "unknown", -1) == -1);
+        assert(pfq_egress_bind(q, "lo", 1024) == -1);
 
         pfq_close(q);
 }
@@ -632,10 +1476,14 @@ main(int argc __attribute__((unused)), char *argv[]__attribute__((unused)))
 	TEST(test_maxlen);
 	TEST(test_rx_slots);
 	TEST(test_rx_slot_size);
+	TEST(test_rx_packed);
+	TEST(test_rx_zcopy);
+	TEST(test_rx_rings);
 	TEST(test_tx_slots);
 
 	TEST(test_bind_device);
 	TEST(test_unbind_device);
+	TEST(test_device_hooks);
 
 	TEST(test_poll);
 
@@ -643,12 +1491,23 @@ main(int argc __attribute__((unused)), char *argv[]__attribute__((unused)))
 
 	TEST(test_stats);
 	TEST(test_group_stats);
+	TEST(test_read_stats);
+	TEST(test_group_persistent);
+	TEST(test_group_timeseries);
+	TEST(test_profile);
 
         TEST(test_my_group_stats_priv);
 	TEST(test_my_group_stats_restricted);
 	TEST(test_my_group_stats_shared);
 
 	TEST(test_groups_mask);
+	TEST(test_group_steering);
+	TEST(test_group_watermark);
+	TEST(test_group_tx_queue);
+	TEST(test_lazy_forward);
+	TEST(test_tx_zcopy);
+	TEST(test_inject_template);
+	TEST(test_weight);
 
 	TEST(test_join_private_);
 	TEST(test_join_restricted_);
@@ -667,10 +1526,14 @@ main(int argc __attribute__((unused)), char *argv[]__attribute__((unused)))
         TEST(test_group_context);
 
         TEST(test_bind_tx);
+        TEST(test_tx_rate);
+        TEST(test_tx_weight);
+        TEST(test_tx_queues);
 
         TEST(test_tx_thread);
 
         TEST(test_tx_queue_flush);
+        TEST(test_tx_queue_stats);
 
         TEST(test_egress_bind);
         TEST(test_egress_unbind);
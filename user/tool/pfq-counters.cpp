@@ -43,6 +43,7 @@ namespace opt
     size_t seconds = std::numeric_limits<size_t>::max();
     size_t caplen  = 64;
     size_t slots   = 131072;
+    int    rings   = 1;
     bool flow      = false;
 }
 
@@ -101,6 +102,9 @@ namespace thread
 
             m_pfq.timestamp_enable(false);
 
+            if (opt::rings > 1)
+                m_pfq.rx_rings(opt::rings);
+
             m_pfq.enable();
         }
 
@@ -204,6 +208,7 @@ void usage(std::string name)
         " -c --caplen INT               Set caplen\n"
         " -w --flow                     Enable flow counter\n"
         " -s --slot INT                 Set slots\n"
+        " -r --rings INT                Set Rx sub-rings (per-cpu producers)\n"
         "    --seconds INT              Terminate after INT seconds\n"
         " -f --function FUNCTION\n"
         " -t --thread BINDING\n\n"
@@ -264,6 +269,15 @@ try
             continue;
         }
 
+        if (any_strcmp(argv[i], "-r", "--rings"))
+        {
+            if (++i == argc)
+                throw std::runtime_error("rings missing");
+
+            opt::rings = std::atoi(argv[i]);
+            continue;
+        }
+
         if (any_strcmp(argv[i], "--seconds"))
         {
             if (++i == argc)
@@ -296,6 +310,7 @@ try
 
     std::cout << "caplen: " << opt::caplen << std::endl;
     std::cout << "slots : " << opt::slots << std::endl;
+    std::cout << "rings : " << opt::rings << std::endl;
 
     if (opt::slots < 1024)
     {
@@ -82,11 +82,13 @@ namespace opt
     size_t len     = 1514;
     size_t slots   = 4096;
     size_t npackets = std::numeric_limits<size_t>::max();
+    size_t copies  = 0;
 
     std::atomic_int nthreads;
 
     bool   rand_ip = false;
     bool   active_ts = false;
+    bool   shape   = false;
     double rate    = 0;
 
     std::vector< std::vector<int> > kcore;
@@ -111,6 +113,7 @@ namespace thread
         , m_fail(std::unique_ptr<std::atomic_ullong>(new std::atomic_ullong(0)))
         , m_gen()
         , m_packet(std::unique_ptr<char[]>(make_packet(opt::len)))
+        , m_async(false)
         {
             if (m_bind.dev.empty())
                 throw std::runtime_error("context: device unspecified");
@@ -132,11 +135,18 @@ namespace thread
                 q.bind_tx (m_bind.dev.at(0).c_str(), m_bind.queue[n], kcpu[n]);
             }
 
+            if (opt::shape && opt::rate != 0.0)
+            {
+                for(unsigned int n = 0; n < m_bind.queue.size(); n++)
+                    q.set_tx_rate(static_cast<int>(n), static_cast<uint64_t>(opt::rate * 1000000 / m_bind.queue.size()));
+            }
+
             q.enable();
 
             if (std::any_of(std::begin(kcpu), std::end(kcpu), [](int cpu) { return cpu != -1; }))
             {
                     q.tx_async(true);
+                    m_async = true;
             }
 
             m_pfq = std::move(q);
@@ -153,6 +163,8 @@ namespace thread
             if (opt::file.empty()) {
                 if (opt::active_ts)
                     active_generator();
+                else if (opt::copies)
+                    template_generator();
                 else
                     generator();
             }
@@ -191,10 +203,10 @@ namespace thread
             for(size_t n = 0; n < opt::npackets;)
             {
                 //
-                // poor-man rate control...
+                // poor-man rate control (unless shaped in kernel)...
                 //
 
-                if ((n & 8191) == 0)
+                if (!opt::shape && (n & 8191) == 0)
                 {
                     while (std::chrono::system_clock::now() < (now + delta*8192))
                     {}
@@ -204,6 +216,7 @@ namespace thread
                 if (!m_pfq.send_async(pfq::const_buffer(reinterpret_cast<const char *>(m_packet.get()), len), opt::flush))
                 {
                     m_fail->fetch_add(1, std::memory_order_relaxed);
+                    m_pfq.wait_tx_space(len, 1000);
                     continue;
                 }
 
@@ -220,6 +233,55 @@ namespace thread
             }
         }
 
+        void template_generator()
+        {
+            std::vector<pfq_tx_mutator> mut;
+
+            if (opt::rand_ip)
+            {
+                mut.push_back(pfq_tx_mutator{14 + 12, 4, Q_TX_MUTATOR_RAND, 0, 0xffffffff});
+                mut.push_back(pfq_tx_mutator{14 + 16, 4, Q_TX_MUTATOR_RAND, 0, 0xffffffff});
+            }
+
+            auto delta = std::chrono::nanoseconds(static_cast<uint64_t>(1000/opt::rate));
+
+            auto now = std::chrono::system_clock::now();
+
+            auto len = opt::len;
+
+            for(size_t n = 0; n < opt::npackets;)
+            {
+                auto copies = static_cast<unsigned int>(std::min(opt::copies, opt::npackets - n));
+
+                //
+                // poor-man rate control, one template at a time (unless shaped in kernel)...
+                //
+
+                if (!opt::shape)
+                {
+                    while (std::chrono::system_clock::now() < (now + delta*copies))
+                    {}
+                    now = std::chrono::system_clock::now();
+                }
+
+                if (!m_pfq.inject_template(pfq::const_buffer(reinterpret_cast<const char *>(m_packet.get()), len),
+                                           copies, mut, opt::rand_ip ? Q_TX_TEMPLATE_CSUM : 0))
+                {
+                    m_fail->fetch_add(1, std::memory_order_relaxed);
+                    m_pfq.wait_tx_space(Q_TX_TEMPLATE_SIZE(mut.size(), len), 1000);
+                    continue;
+                }
+
+                if (!m_async)
+                    m_pfq.tx_queue_flush();
+
+                m_sent->fetch_add(copies, std::memory_order_relaxed);
+                m_band->fetch_add(len * copies, std::memory_order_relaxed);
+
+                n += copies;
+            }
+        }
+
         void active_generator()
         {
             auto ip = reinterpret_cast<iphdr *>(m_packet.get() + 14);
@@ -324,6 +386,8 @@ namespace thread
         std::mt19937 m_gen;
 
         std::unique_ptr<char[]> m_packet;
+
+        bool m_async;
     };
 
 }
@@ -398,7 +462,9 @@ void usage(std::string name)
         " -r --read FILE                Read pcap trace file to send\n"
 #endif
         " -R --rand-ip                  Randomize IP addresses\n"
+        " -T --template INT             Send templates of INT packets, expanded in kernel\n"
         "    --rate DOUBLE              Packet rate in Mpps\n"
+        "    --shape                    Enforce the rate with the kernel Tx token bucket\n"
         " -a --active-tstamp            Use active timestamp as rate control\n"
         " -f --flush INT                Set flush length, used in sync Tx\n"
         " -t --thread BINDING\n\n"
@@ -493,12 +559,29 @@ try
             continue;
         }
 
+        if ( any_strcmp(argv[i], "-T", "--template") )
+        {
+            if (++i == argc)
+            {
+                throw std::runtime_error("copies missing");
+            }
+
+            opt::copies = static_cast<size_t>(std::atoi(argv[i]));
+            continue;
+        }
+
         if ( any_strcmp(argv[i], "-R", "--rand-ip") )
         {
             opt::rand_ip = true;
             continue;
         }
 
+        if ( any_strcmp(argv[i], "--shape") )
+        {
+            opt::shape = true;
+            continue;
+        }
+
         if ( any_strcmp(argv[i], "-a", "--active-tstamp") )
         {
             opt::active_ts = true;
@@ -537,8 +620,11 @@ try
     std::cout << "len        : "  << opt::len << std::endl;
     std::cout << "flush-hint : "  << opt::flush << std::endl;
 
+    if (opt::copies)
+        std::cout << "template   : "  << opt::copies << " packets" << std::endl;
+
     if (opt::rate != 0.0)
-        std::cout << "rate       : "  << opt::rate << " Mpps" << std::endl;
+        std::cout << "rate       : "  << opt::rate << " Mpps" << (opt::shape ? " (kernel shaper)" : "") << std::endl;
 
     if (opt::slots == 0)
         throw std::runtime_error("tx_slots set to 0!");